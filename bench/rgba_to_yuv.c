@@ -0,0 +1,141 @@
+// benchmark of the CPU RGBA to YUV converter against swscale, for every
+// supported source and destination format
+//
+// usage: rgba_to_yuv [iterations] (100 by default), on 4K frames
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/frame.h>
+#include <libavutil/pixdesc.h>
+#include <libswscale/swscale.h>
+#include <log.h>
+
+#include "sve2/log/logging.h"
+#include "sve2/media/rgba_to_yuv.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+// f32 to f16 bit pattern, truncating (only used for test patterns, which are
+// normalized and non-negative)
+static u16 f32_to_f16(f32 f) {
+  u32 bits;
+  memcpy(&bits, &f, sizeof bits);
+  i32 exp = (i32)((bits >> 23) & 0xff) - 127 + 15;
+  if (exp <= 0) {
+    return 0;
+  }
+  return (u16)((exp << 10) | ((bits >> 13) & 0x3ff));
+}
+
+// a gradient, so the frames are not trivially compressible by the caches
+static void fill_source(AVFrame *frame) {
+  for (i32 y = 0; y < frame->height; ++y) {
+    u8 *row = frame->data[0] + y * frame->linesize[0];
+    for (i32 x = 0; x < frame->width; ++x) {
+      f32 rgb[3] = {(f32)x / (f32)frame->width, (f32)y / (f32)frame->height,
+                    (f32)((x + y) % 256) / 255.0f};
+      for (i32 c = 0; c < 4; ++c) {
+        f32 v = c < 3 ? rgb[c] : 1.0f;
+        if (frame->format == AV_PIX_FMT_RGBA) {
+          row[x * 4 + c] = (u8)lrintf(v * 255.0f);
+        } else {
+          ((u16 *)row)[x * 4 + c] = f32_to_f16(v);
+        }
+      }
+    }
+  }
+}
+
+static AVFrame *alloc_frame(enum AVPixelFormat format, i32 width, i32 height) {
+  AVFrame *frame;
+  nassert(frame = av_frame_alloc());
+  frame->format = format;
+  frame->width = width;
+  frame->height = height;
+  nassert_ffmpeg(av_frame_get_buffer(frame, 0));
+  return frame;
+}
+
+// average time of a conversion, in milliseconds
+static f64 time_convert(const rgba_to_yuv_t *cv, thread_pool_t *pool,
+                        const AVFrame *src, AVFrame *dst,
+                        i32 num_iterations) {
+  // warm up the caches (and select the kernels)
+  rgba_to_yuv_convert(cv, pool, src->data[0], src->linesize[0], dst);
+  i64 start = threads_timer_now();
+  for (i32 i = 0; i < num_iterations; ++i) {
+    rgba_to_yuv_convert(cv, pool, src->data[0], src->linesize[0], dst);
+  }
+  return (f64)(threads_timer_now() - start) / num_iterations / 1e6;
+}
+
+static f64 time_swscale(struct SwsContext *sws, const AVFrame *src,
+                        AVFrame *dst, i32 num_iterations) {
+  sws_scale(sws, (const u8 *const *)src->data, src->linesize, 0, src->height,
+            dst->data, dst->linesize);
+  i64 start = threads_timer_now();
+  for (i32 i = 0; i < num_iterations; ++i) {
+    sws_scale(sws, (const u8 *const *)src->data, src->linesize, 0,
+              src->height, dst->data, dst->linesize);
+  }
+  return (f64)(threads_timer_now() - start) / num_iterations / 1e6;
+}
+
+static void benchmark(i32 width, i32 height, i32 num_iterations) {
+  const enum AVPixelFormat src_fmts[] = {AV_PIX_FMT_RGBA, AV_PIX_FMT_RGBAF16};
+  const enum AVPixelFormat dst_fmts[] = {AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P,
+                                         AV_PIX_FMT_P010};
+  thread_pool_t pool;
+  thread_pool_init(&pool, 0);
+  log_info("benchmarking RGBA to YUV conversion at %dx%d (%d iterations, %d "
+           "threads)",
+           width, height, num_iterations, pool.num_threads + 1);
+
+  for (size_t i = 0; i < sizeof src_fmts / sizeof src_fmts[0]; ++i) {
+    AVFrame *src = alloc_frame(src_fmts[i], width, height);
+    fill_source(src);
+    for (size_t j = 0; j < sizeof dst_fmts / sizeof dst_fmts[0]; ++j) {
+      AVFrame *dst = alloc_frame(dst_fmts[j], width, height);
+      const char *src_name = av_get_pix_fmt_name(src_fmts[i]);
+      const char *dst_name = av_get_pix_fmt_name(dst_fmts[j]);
+
+      rgba_to_yuv_t cv;
+      rgba_to_yuv_init(&cv, src_fmts[i], dst_fmts[j], width, height,
+                       AVCOL_SPC_BT709, AVCOL_RANGE_MPEG);
+      f64 single = time_convert(&cv, NULL, src, dst, num_iterations);
+      f64 threaded = time_convert(&cv, &pool, src, dst, num_iterations);
+      log_info("%s -> %s: %.2f ms/frame, %.2f ms/frame threaded", src_name,
+               dst_name, single, threaded);
+
+      // swscale with its fastest (unscaled) path, for reference
+      struct SwsContext *sws =
+          sws_getContext(width, height, src_fmts[i], width, height,
+                         dst_fmts[j], SWS_POINT, NULL, NULL, NULL);
+      if (sws) {
+        const int *coefs = sws_getCoefficients(SWS_CS_ITU709);
+        sws_setColorspaceDetails(sws, coefs, 1, coefs, 0, 0, 1 << 16,
+                                 1 << 16);
+        log_info("%s -> %s: %.2f ms/frame with swscale", src_name, dst_name,
+                 time_swscale(sws, src, dst, num_iterations));
+        sws_freeContext(sws);
+      } else {
+        log_warn("swscale does not support %s -> %s", src_name, dst_name);
+      }
+      av_frame_free(&dst);
+    }
+    av_frame_free(&src);
+  }
+
+  thread_pool_free(&pool);
+}
+
+int main(int argc, char *argv[]) {
+  i32 num_iterations = argc > 1 ? atoi(argv[1]) : 100;
+  init_logging();
+  init_threads_timer();
+  benchmark(3840, 2160, num_iterations);
+  done_logging();
+  return 0;
+}
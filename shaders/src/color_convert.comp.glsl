@@ -0,0 +1,123 @@
+#include "common.glsl"
+
+// RGB to YUV conversion (see sve2/gl/color_convert.h)
+// every invocation converts one pixel, the chroma of a workgroup is downsampled
+// through shared memory, so the dimensions must be multiples of the chroma
+// subsampling factors
+#define TILE_SIZE 16
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+// maximum number of bilinear taps per axis when the frame is scaled down
+#define MAX_TAPS 4
+
+// any color format, e.g. RGBA8, RGBA16F or RGBA32F. If its size is not the
+// output size, the frame is scaled, so it must be bound with a linear sampler.
+layout(binding = 0) uniform sampler2D rgba_output;
+// the format of the planes is given by the bound images
+layout(binding = 1) writeonly uniform image2D y_plane;
+layout(binding = 2) writeonly uniform image2D u_plane;
+layout(binding = 3) writeonly uniform image2D v_plane;
+
+layout(location = 0) uniform bool flip_vertical;
+// log2 of the horizontal and vertical chroma subsampling factors
+layout(location = 1) uniform ivec2 chroma_shift;
+// 0: U and V in their own planes
+// 1: interleaved UV in u_plane, one two-channel texel per sample
+// 2: interleaved UV in u_plane, two single-channel texels per sample
+layout(location = 2) uniform int chroma_layout;
+// RGB to YUV matrix, with the range offsets in the last column
+layout(location = 3) uniform mat4 rgb_to_yuv;
+// offsets of the planes in their images
+layout(location = 4) uniform ivec2 plane_offsets[3];
+// (levels, scale): samples are rounded to one of levels + 1 values, then
+// multiplied by scale, e.g. (1023, 64 / 65535) for P010, which stores 10 bits
+// in the high bits of 16-bit texels. (0, 0) if the texels hold the samples as
+// is.
+layout(location = 7) uniform vec2 quantization;
+// size of the converted frame
+layout(location = 8) uniform ivec2 output_size;
+
+shared vec2 chroma[TILE_SIZE][TILE_SIZE];
+
+float quantize(float value) {
+  value = clamp(value, 0.0, 1.0);
+  if(quantization.x > 0.0) {
+    return round(value * quantization.x) * quantization.y;
+  }
+  return value;
+}
+
+// average of the source texels covered by an output pixel, approximated by a
+// grid of bilinear taps at most about a texel apart
+vec3 sample_scaled(ivec2 pos, ivec2 size) {
+  vec2 pixel = 1.0 / vec2(output_size);
+  vec2 center = (vec2(pos) + 0.5) * pixel;
+  if(flip_vertical) {
+    center.y = 1.0 - center.y;
+  }
+  ivec2 taps =
+      clamp(ivec2(ceil(vec2(size) * pixel)), ivec2(1), ivec2(MAX_TAPS));
+  vec3 sum = vec3(0.0);
+  for(int y = 0; y < taps.y; ++y) {
+    for(int x = 0; x < taps.x; ++x) {
+      vec2 offset = (vec2(x, y) + 0.5) / vec2(taps) - 0.5;
+      sum += textureLod(rgba_output, center + offset * pixel, 0.0).rgb;
+    }
+  }
+  return sum / float(taps.x * taps.y);
+}
+
+void main() {
+  ivec2 size = textureSize(rgba_output, 0);
+  ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+  ivec2 local_pos = ivec2(gl_LocalInvocationID.xy);
+
+  // invocations outside the frame still convert the closest pixel, so they
+  // do not bias the chroma of edge blocks
+  ivec2 dst_pos = min(pos, output_size - 1);
+  vec4 rgb = vec4(1.0);
+  if(size == output_size) {
+    ivec2 src_pos = dst_pos;
+    if(flip_vertical) {
+      src_pos.y = size.y - 1 - src_pos.y;
+    }
+    rgb.rgb = texelFetch(rgba_output, src_pos, 0).rgb;
+  } else {
+    rgb.rgb = sample_scaled(dst_pos, size);
+  }
+  vec3 yuv = (rgb_to_yuv * rgb).xyz;
+
+  bool inside = all(lessThan(pos, output_size));
+  if(inside) {
+    imageStore(y_plane, plane_offsets[0] + pos, vec4(quantize(yuv.x)));
+  }
+
+  chroma[local_pos.y][local_pos.x] = yuv.yz;
+  barrier();
+
+  // the top-left invocation of every chroma block averages it
+  ivec2 mask = (ivec2(1) << chroma_shift) - 1;
+  if(!inside || any(notEqual(local_pos & mask, ivec2(0)))) {
+    return;
+  }
+  vec2 uv = vec2(0.0);
+  for(int y = 0; y <= mask.y; ++y) {
+    for(int x = 0; x <= mask.x; ++x) {
+      uv += chroma[local_pos.y + y][local_pos.x + x];
+    }
+  }
+  uv /= float((mask.x + 1) * (mask.y + 1));
+  uv = vec2(quantize(uv.x), quantize(uv.y));
+
+  ivec2 chroma_pos = pos >> chroma_shift;
+  if(chroma_layout == 0) {
+    imageStore(u_plane, plane_offsets[1] + chroma_pos, vec4(uv.x));
+    imageStore(v_plane, plane_offsets[2] + chroma_pos, vec4(uv.y));
+  } else if(chroma_layout == 1) {
+    imageStore(u_plane, plane_offsets[1] + chroma_pos, vec4(uv, 0.0, 0.0));
+  } else {
+    ivec2 texel_pos = plane_offsets[1] + chroma_pos * ivec2(2, 1);
+    imageStore(u_plane, texel_pos, vec4(uv.x));
+    imageStore(u_plane, texel_pos + ivec2(1, 0), vec4(uv.y));
+  }
+}
@@ -0,0 +1,57 @@
+#include "common.glsl"
+
+// change detection between consecutive frames (see sve2/gl/frame_diff.h)
+// every workgroup hashes a tile of the frame, and compares the hash with the
+// one the tile had in the previous frame
+#define TILE_SIZE 16
+layout(local_size_x = TILE_SIZE, local_size_y = TILE_SIZE) in;
+
+// any color format, the bits of the texels are hashed
+layout(binding = 0) uniform sampler2D frame;
+
+layout(std430, binding = 0) buffer frame_hashes {
+  // set if any tile changed, cleared before every dispatch
+  uint changed;
+  uint tile_hashes[];
+};
+
+shared uint tile_hash;
+
+// integer hash with good avalanche (lowbias32 by Chris Wellons)
+uint mix_bits(uint x) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+void main() {
+  if(gl_LocalInvocationIndex == 0u) {
+    tile_hash = 0u;
+  }
+  barrier();
+
+  ivec2 pos = ivec2(gl_GlobalInvocationID.xy);
+  if(all(lessThan(pos, textureSize(frame, 0)))) {
+    uvec4 bits = floatBitsToUint(texelFetch(frame, pos, 0));
+    // seeded by the position in the tile, so moving texels around changes the
+    // sum
+    uint h = mix_bits(gl_LocalInvocationIndex + 1u);
+    h = mix_bits(h ^ bits.r);
+    h = mix_bits(h ^ bits.g);
+    h = mix_bits(h ^ bits.b);
+    h = mix_bits(h ^ bits.a);
+    atomicAdd(tile_hash, h);
+  }
+  barrier();
+
+  if(gl_LocalInvocationIndex == 0u) {
+    uint tile = gl_WorkGroupID.y * gl_NumWorkGroups.x + gl_WorkGroupID.x;
+    if(tile_hashes[tile] != tile_hash) {
+      tile_hashes[tile] = tile_hash;
+      changed = 1u;
+    }
+  }
+}
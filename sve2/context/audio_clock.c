@@ -0,0 +1,55 @@
+#include "audio_clock.h"
+
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/threads.h"
+
+void audio_clock_init(audio_clock_t *clk) {
+  atomic_init(&clk->seq, 0);
+  atomic_init(&clk->num_samples, 0);
+  atomic_init(&clk->timestamp, 0);
+}
+
+void audio_clock_advance(audio_clock_t *clk, i64 num_samples, i64 timestamp) {
+  // single writer: our own fields can be read without synchronization
+  u32 seq = atomic_load_explicit(&clk->seq, memory_order_relaxed);
+  i64 total = atomic_load_explicit(&clk->num_samples, memory_order_relaxed);
+
+  // odd sequence number: write in progress
+  atomic_store_explicit(&clk->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+  atomic_store_explicit(&clk->num_samples, total + num_samples,
+                        memory_order_relaxed);
+  atomic_store_explicit(&clk->timestamp, timestamp, memory_order_relaxed);
+  // even sequence number: write done, release the fields above
+  atomic_store_explicit(&clk->seq, seq + 2, memory_order_release);
+}
+
+void audio_clock_read(audio_clock_t *clk, i64 num_samples[static 1],
+                      i64 timestamp[static 1]) {
+  u32 seq_begin, seq_end;
+  do {
+    seq_begin = atomic_load_explicit(&clk->seq, memory_order_acquire);
+    *num_samples =
+        atomic_load_explicit(&clk->num_samples, memory_order_relaxed);
+    *timestamp = atomic_load_explicit(&clk->timestamp, memory_order_relaxed);
+    atomic_thread_fence(memory_order_acquire);
+    seq_end = atomic_load_explicit(&clk->seq, memory_order_relaxed);
+  } while ((seq_begin & 1) || seq_begin != seq_end);
+}
+
+i64 audio_clock_get_position(audio_clock_t *clk, i64 now, i32 sample_rate,
+                             i64 latency, i64 max_extrapolation) {
+  i64 num_samples, timestamp;
+  audio_clock_read(clk, &num_samples, &timestamp);
+  if (timestamp == 0) {
+    // the device has not started yet
+    return 0;
+  }
+
+  // samples consumed at `timestamp` are heard `latency` samples later, and
+  // the device keeps playing at a constant rate in between two updates
+  i64 elapsed =
+      sve2_max_i64(now - timestamp, 0) * sample_rate / SVE2_NS_PER_SEC;
+  elapsed = sve2_min_i64(elapsed, max_extrapolation);
+  return sve2_max_i64(num_samples - latency + elapsed, 0);
+}
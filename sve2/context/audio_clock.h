@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdatomic.h>
+
+#include "sve2/utils/types.h"
+
+/**
+ * @brief Playback position published by the audio device callback, and read
+ * lock-free by the render thread.
+ *
+ * The (samples played, timestamp) pair is protected by a sequence lock: the
+ * writer (the real-time audio thread) never waits, and the reader simply
+ * retries in the (rare) case it raced with a write. The sequence counter is odd
+ * while a write is in progress.
+ */
+typedef struct {
+  _Atomic(u32) seq;
+  /**
+   * @brief Total number of samples consumed by the audio device
+   */
+  _Atomic(i64) num_samples;
+  /**
+   * @brief Time (threads_timer_now()) when num_samples was last updated
+   */
+  _Atomic(i64) timestamp;
+} audio_clock_t;
+
+void audio_clock_init(audio_clock_t *clk);
+
+/**
+ * @brief Advance the clock by num_samples samples consumed at time timestamp.
+ * This must only be called by a single writer thread.
+ *
+ * @param clk The audio clock
+ * @param num_samples Number of samples consumed since the last update
+ * @param timestamp Time of the update, measured by threads_timer_now()
+ */
+void audio_clock_advance(audio_clock_t *clk, i64 num_samples, i64 timestamp);
+
+/**
+ * @brief Read a consistent snapshot of the clock. This never blocks, and can be
+ * called from any number of threads.
+ *
+ * @param clk The audio clock
+ * @param num_samples Pointer to return the total number of consumed samples
+ * @param timestamp Pointer to return the time of the last update (0 if the
+ * clock has never been updated)
+ */
+void audio_clock_read(audio_clock_t *clk, i64 num_samples[static 1],
+                      i64 timestamp[static 1]);
+
+/**
+ * @brief Estimate the number of samples that have actually been heard at time
+ * now. This extrapolates from the last update, compensating for the latency of
+ * the device.
+ *
+ * @param clk The audio clock
+ * @param now Current time, measured by threads_timer_now()
+ * @param sample_rate Sample rate of the device
+ * @param latency Number of samples buffered inside the device (consumed
+ * samples that have not been heard yet)
+ * @param max_extrapolation Maximum number of samples the clock is allowed to
+ * advance since the last update. This is usually the period size, so that a
+ * late callback does not make the clock run ahead.
+ * @return Number of samples heard, never negative
+ */
+i64 audio_clock_get_position(audio_clock_t *clk, i64 now, i32 sample_rate,
+                             i64 latency, i64 max_extrapolation);
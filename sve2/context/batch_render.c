@@ -0,0 +1,275 @@
+#include "batch_render.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+#include <libavutil/mathematics.h>
+
+#include "sve2/log/logging.h"
+#include "sve2/utils/asprintf.h"
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+// intermediate files are NUT, which takes any codec and keeps the time base of
+// the encoder, so timestamps survive the round trip exactly
+static char *get_segment_path(const char *output_path,
+                              const batch_segment_t *segment) {
+  if (segment->index < 0) {
+    return sve2_asprintf("%s.audio.nut", output_path);
+  }
+  return sve2_asprintf("%s.segment%04" PRIi32 ".nut", output_path,
+                       segment->index);
+}
+
+static void render_segment(const batch_render_info_t *info,
+                           const context_init_t *base_info,
+                           const batch_segment_t *segment) {
+  char *path = get_segment_path(info->info->output_path, segment);
+  context_init_t segment_info = *base_info;
+  segment_info.output_path = path;
+  segment_info.num_frames = segment->num_frames;
+  segment_info.skip_video = segment->index < 0;
+  segment_info.skip_audio = segment->index >= 0;
+
+  context_t *c = context_init(&segment_info);
+  context_set_audio_timer(c, segment->start_time);
+  info->render(c, segment, info->userdata);
+  context_free(c);
+  free(path);
+}
+
+static pid_t spawn_worker(const batch_render_info_t *info,
+                          const context_init_t *base_info,
+                          const batch_segment_t *segment) {
+  // otherwise buffered output would be written by both processes
+  fflush(NULL);
+  pid_t pid = fork();
+  nassert(pid >= 0);
+  if (pid == 0) {
+    render_segment(info, base_info, segment);
+    // the exit handlers belong to the parent
+    _exit(EXIT_SUCCESS);
+  }
+  return pid;
+}
+
+// an input of the concatenation: single-stream segment files, read one after
+// another
+typedef struct {
+  const batch_segment_t *segments;
+  i32 num_segments, segment;
+  AVFormatContext *fmt_ctx;
+  AVPacket *packet;
+  i32 out_index;
+} concat_input_t;
+
+static void open_segment(concat_input_t *in, const char *output_path) {
+  char *path = get_segment_path(output_path, &in->segments[in->segment]);
+  in->fmt_ctx = NULL;
+  nassert_ffmpeg(avformat_open_input(&in->fmt_ctx, path, NULL, NULL));
+  nassert_ffmpeg(avformat_find_stream_info(in->fmt_ctx, NULL));
+  nassert(in->fmt_ctx->nb_streams == 1);
+  free(path);
+}
+
+// read the next packet of the input, with timestamps relative to the start of
+// the timeline. Returns false after the last packet of the last segment.
+static bool read_packet(concat_input_t *in, const context_init_t *info) {
+  while (true) {
+    int err = av_read_frame(in->fmt_ctx, in->packet);
+    if (err != AVERROR_EOF) {
+      nassert_ffmpeg(err);
+      AVRational time_base = in->fmt_ctx->streams[0]->time_base;
+      i64 offset = av_rescale_q(in->segments[in->segment].start_frame,
+                                (AVRational){1, info->fps}, time_base);
+      if (in->packet->pts != AV_NOPTS_VALUE) {
+        in->packet->pts += offset;
+      }
+      if (in->packet->dts != AV_NOPTS_VALUE) {
+        in->packet->dts += offset;
+      }
+      return true;
+    }
+
+    avformat_close_input(&in->fmt_ctx);
+    if (++in->segment == in->num_segments) {
+      return false;
+    }
+    open_segment(in, info->output_path);
+  }
+}
+
+static void concat_segments(const context_init_t *info,
+                            const batch_segment_t *video_segments,
+                            i32 num_video_segments,
+                            const batch_segment_t *audio_segment) {
+  AVFormatContext *out = NULL;
+  nassert_ffmpeg(
+      avformat_alloc_output_context2(&out, NULL, NULL, info->output_path));
+
+  concat_input_t video = {.segments = video_segments,
+                          .num_segments = num_video_segments};
+  concat_input_t audio = {.segments = audio_segment, .num_segments = 1};
+  concat_input_t *inputs[] = {&video, &audio};
+  for (i32 i = 0; i < sve2_arrlen(inputs); ++i) {
+    concat_input_t *in = inputs[i];
+    open_segment(in, info->output_path);
+    nassert(in->packet = av_packet_alloc());
+
+    AVStream *in_stream = in->fmt_ctx->streams[0], *stream;
+    nassert(stream = avformat_new_stream(out, NULL));
+    nassert_ffmpeg(
+        avcodec_parameters_copy(stream->codecpar, in_stream->codecpar));
+    // the tag is specific to the container of the segments
+    stream->codecpar->codec_tag = 0;
+    stream->time_base = in_stream->time_base;
+    stream->avg_frame_rate = in_stream->avg_frame_rate;
+    in->out_index = stream->index;
+  }
+
+  if (!(out->oformat->flags & AVFMT_NOFILE)) {
+    nassert(avio_open(&out->pb, info->output_path, AVIO_FLAG_WRITE) >= 0);
+  }
+  nassert_ffmpeg(avformat_write_header(out, NULL));
+
+  // merge the two inputs by decoding timestamp
+  bool has_video = read_packet(&video, info);
+  bool has_audio = read_packet(&audio, info);
+  while (has_video || has_audio) {
+    concat_input_t *in = &audio;
+    if (has_video &&
+        (!has_audio ||
+         av_compare_ts(video.packet->dts, video.fmt_ctx->streams[0]->time_base,
+                       audio.packet->dts,
+                       audio.fmt_ctx->streams[0]->time_base) <= 0)) {
+      in = &video;
+    }
+
+    av_packet_rescale_ts(in->packet, in->fmt_ctx->streams[0]->time_base,
+                         out->streams[in->out_index]->time_base);
+    in->packet->stream_index = in->out_index;
+    in->packet->pos = -1;
+    // this takes the packet reference
+    nassert_ffmpeg(av_interleaved_write_frame(out, in->packet));
+
+    if (in == &video) {
+      has_video = read_packet(&video, info);
+    } else {
+      has_audio = read_packet(&audio, info);
+    }
+  }
+
+  nassert_ffmpeg(av_write_trailer(out));
+  if (!(out->oformat->flags & AVFMT_NOFILE)) {
+    avio_closep(&out->pb);
+  }
+  avformat_free_context(out);
+  for (i32 i = 0; i < sve2_arrlen(inputs); ++i) {
+    av_packet_free(&inputs[i]->packet);
+  }
+}
+
+// remove the intermediate files of the jobs (those which were not started
+// have none)
+static void remove_segments(const context_init_t *info,
+                            const batch_segment_t *jobs, i32 num_jobs) {
+  for (i32 i = 0; i < num_jobs; ++i) {
+    char *path = get_segment_path(info->output_path, &jobs[i]);
+    remove(path);
+    free(path);
+  }
+}
+
+void batch_render(const batch_render_info_t *info) {
+  const context_init_t *ctx_info = info->info;
+  i32 gop_size = ctx_info->gop_size > 0 ? ctx_info->gop_size : ctx_info->fps;
+  i32 num_workers =
+      info->num_workers > 0 ? info->num_workers : sve2_get_num_cpus();
+
+  // segments are made of whole GOPs, and as long as possible while still
+  // keeping every worker busy. The audio pass takes one of the workers, so
+  // the segments are spread over the others, and none waits for a free worker
+  // (unless there is only one).
+  i32 num_video_workers = sve2_max_i32(num_workers - 1, 1);
+  i32 num_gops = (info->num_frames + gop_size - 1) / gop_size;
+  i32 segment_frames =
+      sve2_max_i32((num_gops + num_video_workers - 1) / num_video_workers, 1) *
+      gop_size;
+  i32 num_segments = (info->num_frames + segment_frames - 1) / segment_frames;
+  nassert(num_segments > 0 && "nothing to render");
+
+  // the audio pass goes first, since it spans the whole timeline
+  i32 num_jobs = num_segments + 1;
+  batch_segment_t *jobs = sve2_calloc(num_jobs, sizeof *jobs);
+  jobs[0] = (batch_segment_t){
+      .index = -1, .start_frame = 0, .num_frames = info->num_frames};
+  batch_segment_t *segments = jobs + 1;
+  for (i32 i = 0; i < num_segments; ++i) {
+    i32 start = i * segment_frames;
+    segments[i] = (batch_segment_t){
+        .index = i,
+        .start_frame = start,
+        .num_frames = sve2_min_i32(segment_frames, info->num_frames - start),
+        .start_time = start * SVE2_NS_PER_SEC / ctx_info->fps,
+    };
+  }
+  log_info("batch rendering %" PRIi32 " frames in %" PRIi32
+           " segments of %" PRIi32 " frames, with %" PRIi32 " workers",
+           info->num_frames, num_segments, segment_frames, num_workers);
+
+  context_init_t base_info = *ctx_info;
+  base_info.mode = CONTEXT_MODE_RENDER;
+  base_info.gop_size = gop_size;
+  // segments are concatenated into the main output only
+  if (base_info.num_renditions > 0) {
+    log_warn("renditions are not supported by batch renders, only %s is "
+             "rendered",
+             ctx_info->output_path);
+    base_info.num_renditions = 0;
+  }
+
+  pid_t *pids = sve2_calloc(num_jobs, sizeof *pids);
+  i32 num_started = 0, num_running = 0;
+  bool failed = false;
+  while ((num_started < num_jobs && !failed) || num_running > 0) {
+    if (num_started < num_jobs && !failed && num_running < num_workers) {
+      pids[num_started] = spawn_worker(info, &base_info, &jobs[num_started]);
+      ++num_started;
+      ++num_running;
+      continue;
+    }
+
+    int status;
+    pid_t pid;
+    nassert((pid = wait(&status)) > 0);
+    i32 job = 0;
+    while (job < num_started && pids[job] != pid) {
+      ++job;
+    }
+    if (job == num_started) {
+      // a child process which is not one of our workers
+      continue;
+    }
+    --num_running;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+      // let the running workers finish, but start no new ones
+      log_error("batch render worker of segment %" PRIi32 " failed",
+                jobs[job].index);
+      failed = true;
+    }
+  }
+  if (failed) {
+    remove_segments(ctx_info, jobs, num_jobs);
+    panic();
+  }
+
+  concat_segments(ctx_info, segments, num_segments, &jobs[0]);
+  remove_segments(ctx_info, jobs, num_jobs);
+
+  free(pids);
+  free(jobs);
+}
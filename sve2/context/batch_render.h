@@ -0,0 +1,84 @@
+#pragma once
+
+#include "sve2/context/context.h"
+#include "sve2/utils/types.h"
+
+/**
+ * @brief A part of the timeline rendered by a worker process
+ */
+typedef struct {
+  /**
+   * @brief Index of the video segment, or -1 for the audio pass (which renders
+   * the audio of the whole timeline, without video)
+   */
+  i32 index;
+  /**
+   * @brief First frame of the segment, and the number of frames in it
+   */
+  i32 start_frame, num_frames;
+  /**
+   * @brief Timestamp of the first frame, in nanoseconds
+   */
+  i64 start_time;
+} batch_segment_t;
+
+/**
+ * @brief Render callback, called in a worker process with a fresh render-mode
+ * context. The audio timer of the context is already set to
+ * segment->start_time, so the callback only has to seek its sources there,
+ * then render frames until context_get_should_close() returns true (after
+ * segment->num_frames frames).
+ *
+ * Audio must be submitted in video segments too (it is not encoded, but it
+ * drives the audio timer), though silence does as well as the real mix, so the
+ * audio sources need not be opened there. Likewise, the audio pass still goes
+ * through frames like a normal render, but nothing is encoded from them, so it
+ * should not decode or draw any video. Use c->info.skip_video and
+ * skip_audio to tell the two apart.
+ */
+typedef void (*batch_render_callback_t)(context_t *c,
+                                        const batch_segment_t *segment,
+                                        void *userdata);
+
+typedef struct {
+  /**
+   * @brief Context parameters of the render. output_path is the path of the
+   * final output. mode, num_frames, skip_video and skip_audio are overridden
+   * for every segment. Renditions are not supported (they are ignored).
+   */
+  const context_init_t *info;
+  /**
+   * @brief Total number of frames to render
+   */
+  i32 num_frames;
+  /**
+   * @brief Maximum number of worker processes running at once. 0 means the
+   * number of CPUs.
+   */
+  i32 num_workers;
+  /**
+   * @brief Render callback and its user pointer
+   */
+  batch_render_callback_t render;
+  void *userdata;
+} batch_render_info_t;
+
+/**
+ * @brief Render a timeline with several worker processes.
+ *
+ * The timeline is split into segments whose lengths are multiples of the GOP
+ * size (info->gop_size, or one second if unset), so the keyframe interval is
+ * the same across segment boundaries. Every segment is rendered (video only)
+ * in its own worker process, with its own context. The audio is rendered once,
+ * by an extra worker. The segments and the audio are then concatenated into
+ * info->output_path with stream copy (no re-encoding), and the intermediate
+ * files are removed.
+ *
+ * Workers are forked from the calling process, so this must be called before
+ * any context is created in it. Since every segment starts a new encoder, the
+ * encoder options must not make the codec parameters (e.g. extradata) vary
+ * between segments.
+ *
+ * @param info Batch render parameters
+ */
+void batch_render(const batch_render_info_t *info);
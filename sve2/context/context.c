@@ -1,24 +1,30 @@
 #include "context.h"
 
+#include <dlfcn.h>
 #include <stdlib.h>
+#include <string.h>
 #include <threads.h>
 
 #include <GLFW/glfw3.h>
 #include <glad/egl.h>
 #include <libavcodec/codec.h>
 #include <libavcodec/packet.h>
-#include <libavutil/audio_fifo.h>
 #include <libavutil/buffer.h>
 #include <libavutil/frame.h>
 #include <libavutil/hwcontext_drm.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/mathematics.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/samplefmt.h>
 #include <libdrm/drm.h>
 #include <libdrm/drm_fourcc.h>
 #include <log.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "sve2/gl/shader.h"
 #include "sve2/log/logging.h"
+#include "sve2/media/audio_kernels.h"
 #include "sve2/media/output_ctx.h"
 #include "sve2/utils/minmax.h"
 #include "sve2/utils/runtime.h"
@@ -122,19 +128,178 @@ static void glfw_content_scale_callback(GLFWwindow *w, float xscale,
   c->yscale = yscale;
 }
 
-enum {
-  OUT_VIDEO_SI = 0,
-  OUT_AUDIO_SI = 1,
+// create the window (and its OpenGL context) of preview mode
+static void init_window(context_t *c) {
+  nassert(
+      !glfwSetErrorCallback(glfw_error_callback) &&
+      "Existing GLFW error callback is overriden. Consider setting the GLFW "
+      "error callback after context initialization.");
+  nassert(glfwInit() && "GLFW initialization failed");
+
+  glfwDefaultWindowHints();
+  // we require EGL + OpenGL ES for VAAPI integration extensions
+  glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+  glfwWindowHint(GLFW_CONTEXT_DEBUG, GLFW_TRUE);
+  nassert((c->window = glfwCreateWindow(c->info.width, c->info.height,
+                                        "sve2 window", NULL, NULL)));
+  glfwMakeContextCurrent(c->window);
+  glfwSetWindowUserPointer(c->window, c);
+  // presenting blocks until a vertical blank, see frame_scheduler_wait()
+  glfwSwapInterval(1);
+
+  // GLAD function loading
+  nassert(gladLoadGL(glfwGetProcAddress));
+  nassert(gladLoadEGL(glfwGetEGLDisplay(), glfwGetProcAddress));
+
+  // get framebuffer size
+  // the window size might be different to the size specified in
+  // glfwCreateWindow (e.g. if one is using a tiling WM (me))
+  int width, height;
+  glfwGetFramebufferSize(c->window, &width, &height);
+  c->info.width = width;
+  c->info.height = height;
+
+  // GLFW callback
+  glfwSetFramebufferSizeCallback(c->window, glfw_framebuffer_callback);
+  glfwSetWindowContentScaleCallback(c->window, glfw_content_scale_callback);
+}
+
+// eglGetProcAddress() of libEGL, every other EGL and OpenGL function is loaded
+// through it (EGL 1.5 returns core functions too)
+static GLADapiproc (*egl_get_proc_address)(const char *name);
+
+static GLADapiproc egl_load(const char *name) {
+  return egl_get_proc_address(name);
+}
+
+// create the OpenGL context of render mode, without a window: rendering only
+// targets framebuffer objects, so the context is created on Mesa's surfaceless
+// platform (or on the first EGL device), which needs neither X nor Wayland
+static void init_headless_gl(context_t *c) {
+  // libEGL stays loaded until the process exits
+  void *libegl;
+  if (!(libegl = dlopen("libEGL.so.1", RTLD_NOW | RTLD_GLOBAL))) {
+    log_error("unable to load libEGL: %s", dlerror());
+    panic();
+  }
+  nassert(egl_get_proc_address =
+              (GLADapiproc(*)(const char *))dlsym(libegl, "eglGetProcAddress"));
+  // client extensions first, they tell which platforms are available
+  nassert(gladLoadEGL(EGL_NO_DISPLAY, egl_load));
+
+  EGLDisplay display = EGL_NO_DISPLAY;
+  const char *platform = NULL;
+  if (GLAD_EGL_MESA_platform_surfaceless) {
+    platform = "surfaceless";
+    display = eglGetPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+                                    EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (display == EGL_NO_DISPLAY && GLAD_EGL_EXT_device_enumeration &&
+      GLAD_EGL_EXT_platform_device) {
+    EGLDeviceEXT device;
+    EGLint num_devices;
+    if (eglQueryDevicesEXT(1, &device, &num_devices) && num_devices > 0) {
+      platform = "device";
+      display = eglGetPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, device, NULL);
+    }
+  }
+  if (display == EGL_NO_DISPLAY) {
+    log_error("no headless EGL platform is available (requires "
+              "EGL_MESA_platform_surfaceless or EGL_EXT_platform_device)");
+    panic();
+  }
+  nassert(eglInitialize(display, NULL, NULL));
+  // then the display extensions
+  nassert(gladLoadEGL(display, egl_load));
+  nassert(eglBindAPI(EGL_OPENGL_API));
+
+  // without surfaceless contexts, a dummy pbuffer is made current instead
+  bool surfaceless = GLAD_EGL_KHR_surfaceless_context;
+  const EGLint config_attribs[] = {
+      EGL_SURFACE_TYPE,
+      surfaceless ? 0 : EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE,
+      EGL_OPENGL_BIT,
+      EGL_NONE,
+  };
+  EGLConfig config;
+  EGLint num_configs;
+  nassert(eglChooseConfig(display, config_attribs, &config, 1,
+                          &num_configs) &&
+          num_configs > 0);
+  // a compatibility profile, like the GLFW context of preview mode: some
+  // draws are made without a vertex array bound
+  const EGLint context_attribs[] = {
+      EGL_CONTEXT_MAJOR_VERSION,
+      4,
+      EGL_CONTEXT_MINOR_VERSION,
+      5,
+      EGL_CONTEXT_OPENGL_PROFILE_MASK,
+      EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+      EGL_CONTEXT_OPENGL_DEBUG,
+      EGL_TRUE,
+      EGL_NONE,
+  };
+  nassert((c->egl_context = eglCreateContext(display, config, EGL_NO_CONTEXT,
+                                             context_attribs)) !=
+          EGL_NO_CONTEXT);
+  c->egl_display = display;
+  c->egl_surface = EGL_NO_SURFACE;
+  if (!surfaceless) {
+    const EGLint pbuffer_attribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    nassert((c->egl_surface = eglCreatePbufferSurface(
+                 display, config, pbuffer_attribs)) != EGL_NO_SURFACE);
+  }
+  nassert(eglMakeCurrent(display, c->egl_surface, c->egl_surface,
+                         c->egl_context));
+  nassert(gladLoadGL(egl_load));
+  log_info("created a headless OpenGL context on the %s EGL platform%s",
+           platform, surfaceless ? "" : " (with a pbuffer)");
+}
+
+static void free_headless_gl(context_t *c) {
+  eglMakeCurrent(c->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  if (c->egl_surface != EGL_NO_SURFACE) {
+    eglDestroySurface(c->egl_display, c->egl_surface);
+  }
+  eglDestroyContext(c->egl_display, c->egl_context);
+  eglTerminate(c->egl_display);
+}
+
+static const char *const video_encoder_names[] = {
+    [CONTEXT_VIDEO_ENCODER_HEVC_VAAPI] = "hevc_vaapi",
+    [CONTEXT_VIDEO_ENCODER_LIBX264] = "libx264",
+    [CONTEXT_VIDEO_ENCODER_LIBX265] = "libx265",
+    [CONTEXT_VIDEO_ENCODER_LIBSVTAV1] = "libsvtav1",
+    [CONTEXT_VIDEO_ENCODER_FFV1] = "ffv1",
+    [CONTEXT_VIDEO_ENCODER_RAWVIDEO] = "rawvideo",
 };
 
+static const GLenum framebuffer_formats[] = {
+    [CONTEXT_FRAMEBUFFER_RGBA32F] = GL_RGBA32F,
+    [CONTEXT_FRAMEBUFFER_RGBA16F] = GL_RGBA16F,
+    [CONTEXT_FRAMEBUFFER_RGBA8] = GL_RGBA8,
+};
+
+// alignment of the frames read back for software encoders, enough for any
+// SIMD code in the encoders
+#define READBACK_FRAME_ALIGN 64
+#define DEFAULT_READBACK_DEPTH 3
+
 void ma_data_callback(ma_device *device, void *output, const void *input,
                       u32 nb_frames) {
   (void)input;
   preview_context_t *c = &((context_t *)device->pUserData)->pctx;
-  sve2_mtx_lock(&c->audio_fifo_mutex);
-  i32 num_read = sve2_min_i32(nb_frames, av_audio_fifo_size(c->audio_fifo));
-  nassert_ffmpeg(av_audio_fifo_read(c->audio_fifo, &output, num_read));
-  sve2_mtx_unlock(&c->audio_fifo_mutex);
+  spsc_ring_t *ring = &c->audio_ring;
+  i32 num_read = spsc_ring_read(ring, output, (i32)nb_frames);
+  // on underrun, fill the rest with silence instead of letting the device play
+  // whatever garbage is in the output buffer
+  ma_silence_pcm_frames((u8 *)output + num_read * ring->elem_size,
+                        nb_frames - num_read, device->playback.format,
+                        device->playback.channels);
+  // silence is not counted, so the audio timer stops during underruns
+  audio_clock_advance(&c->audio_clock, num_read, threads_timer_now());
 }
 
 static ma_format get_ma_sample_format(enum AVSampleFormat format) {
@@ -200,25 +365,38 @@ static nv12_output_frame_offsets_t calc_out_frame_offsets(i32 width,
   return offsets;
 }
 
-static void remap_drm_prime(render_context_t *r, EGLImage *image, i32 width,
-                            i32 height) {
+// create the texture of a surface of a hardware encoder, and export it via DRM
+// PRIME (once, the surface is mapped to a VAAPI frame for every frame)
+static void init_hw_surface(render_output_t *o, hw_surface_t *s) {
+  i32 width = o->info.width, height = o->info.height;
   nv12_output_frame_offsets_t offsets = calc_out_frame_offsets(width, height);
-  nassert((*image = eglCreateImage(eglGetCurrentDisplay(),
-                                   eglGetCurrentContext(), EGL_GL_TEXTURE_2D,
-                                   (EGLClientBuffer)(size_t)r->output_texture,
-                                   NULL)));
+  glCreateTextures(GL_TEXTURE_2D, 1, &s->texture);
+  glTextureStorage2D(s->texture, 1, GL_R8, offsets.tex_width,
+                     offsets.tex_height);
+  nassert((s->image = eglCreateImage(eglGetCurrentDisplay(),
+                                     eglGetCurrentContext(), EGL_GL_TEXTURE_2D,
+                                     (EGLClientBuffer)(size_t)s->texture,
+                                     NULL)));
 
   EGLint num_planes;
   EGLuint64KHR mods;
-  eglExportDMABUFImageQueryMESA(eglGetCurrentDisplay(), *image, NULL,
+  eglExportDMABUFImageQueryMESA(eglGetCurrentDisplay(), s->image, NULL,
                                 &num_planes, &mods);
   assert(num_planes == 1);
 
   EGLint fd, stride, offset;
-  eglExportDMABUFImageMESA(eglGetCurrentDisplay(), *image, &fd, &stride,
+  eglExportDMABUFImageMESA(eglGetCurrentDisplay(), s->image, &fd, &stride,
                            &offset);
 
-  AVFrame *prime_frame = r->output_video_texture_prime;
+  nassert(s->hw_frame = av_frame_alloc());
+  nassert(s->prime_frame = av_frame_alloc());
+  AVFrame *prime_frame = s->prime_frame;
+  prime_frame->width = width;
+  prime_frame->height = height;
+  prime_frame->format = AV_PIX_FMT_DRM_PRIME;
+  nassert(prime_frame->buf[0] =
+              av_buffer_allocz(sizeof(AVDRMFrameDescriptor)));
+  prime_frame->data[0] = prime_frame->buf[0]->data;
   AVDRMFrameDescriptor *prime =
       (AVDRMFrameDescriptor *)prime_frame->buf[0]->data;
   // DRM PRIME with one object:
@@ -258,6 +436,538 @@ static void remap_drm_prime(render_context_t *r, EGLImage *image, i32 width,
   };
 }
 
+static void free_hw_surface(hw_surface_t *s) {
+  av_frame_free(&s->hw_frame);
+  close(((AVDRMFrameDescriptor *)s->prime_frame->data[0])->objects[0].fd);
+  av_frame_free(&s->prime_frame);
+  eglDestroyImage(eglGetCurrentDisplay(), s->image);
+  glDeleteTextures(1, &s->texture);
+}
+
+// submit the last frame submitted to the encoder of an output again, at pts
+// (the buffers are shared, encoders do not write to their input)
+static void submit_last_frame(context_t *c, render_output_t *o, i64 pts) {
+  AVFrame *frame = c->temp_frames[0];
+  const AVFrame *last = o->hw_encode
+                            ? o->hw_surfaces[o->hw_last_surface].hw_frame
+                            : o->last_frame;
+  nassert_ffmpeg(av_frame_ref(frame, last));
+  frame->pts = pts;
+  output_ctx_submit_frame(&o->output_ctx, frame, c->rctx.video_si);
+  av_frame_unref(frame);
+}
+
+// map the surface a frame was converted into to a VAAPI frame, and submit it
+// to the hardware encoder of an output
+static void submit_hw_frame(context_t *c, render_output_t *o,
+                            const readback_slot_t *slot) {
+  hw_surface_t *s = &o->hw_surfaces[slot->surface];
+  if (o->hw_last_surface >= 0) {
+    o->hw_surfaces[o->hw_last_surface].in_use = false;
+  }
+  o->hw_last_surface = slot->surface;
+
+  AVFrame *hw_frame = c->temp_frames[0];
+  output_ctx_init_hwframe(&o->output_ctx, hw_frame, c->rctx.video_si);
+  nassert_ffmpeg(av_hwframe_map(hw_frame, s->prime_frame,
+                                AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_DIRECT));
+  // kept to know when the encoder is done with the surface
+  av_frame_unref(s->hw_frame);
+  nassert_ffmpeg(av_frame_ref(s->hw_frame, hw_frame));
+  hw_frame->pts = slot->pts;
+  output_ctx_submit_frame(&o->output_ctx, hw_frame, c->rctx.video_si);
+  av_frame_unref(hw_frame);
+}
+
+// queue the current frame in the next readback slot of an output: start
+// reading its converted planes (or the framebuffer, if it is converted on the
+// CPU) back, tightly packed one after another, or keep the surface it was
+// converted into for a hardware encoder. Frames that are not converted take a
+// slot too (so frames stay in order), but nothing is read back.
+static void readback_start(render_output_t *o, i64 pts, bool converted) {
+  assert(o->num_pending_readbacks < o->readback_depth);
+  readback_slot_t *slot =
+      &o->readback_slots[(o->readback_head + o->num_pending_readbacks) %
+                         o->readback_depth];
+  slot->pts = pts;
+  slot->converted = converted;
+  slot->decided = false;
+  ++o->num_pending_readbacks;
+  if (!converted) {
+    return;
+  }
+  if (o->hw_encode) {
+    slot->surface = o->hw_surface_index;
+    return;
+  }
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, slot->pbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  i32 offset = 0;
+  for (i32 i = 0; i < o->num_readback_planes; ++i) {
+    const color_convert_plane_t *p = &o->readback_planes[i];
+    glGetTextureSubImage(p->texture, 0, p->x, p->y, 0, p->width, p->height, 1,
+                         p->format, p->type, o->readback_size - offset,
+                         (void *)(size_t)offset);
+    offset += p->width * p->texel_size * p->height;
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  slot->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // make sure the fence reaches the GPU, otherwise it never signals when
+  // polled by readback_ready()
+  glFlush();
+}
+
+// whether the oldest pending readback of an output is decided and done
+static bool readback_ready(render_output_t *o) {
+  readback_slot_t *slot = &o->readback_slots[o->readback_head];
+  if (!slot->decided) {
+    return false;
+  }
+  if (o->hw_encode || !slot->converted || slot->repeat) {
+    return true;
+  }
+  GLint status;
+  glGetSynciv(slot->fence, GL_SYNC_STATUS, 1, NULL, &status);
+  return status == GL_SIGNALED;
+}
+
+// wait for the oldest pending readback of an output, which must be decided,
+// and submit it to its encoder: in a frame from the pool for software
+// encoders, or as a VAAPI frame for hardware encoders. Repeated frames submit
+// the previous frame again, and dropped frames are not submitted at all.
+static void readback_finish(context_t *c, render_output_t *o) {
+  render_context_t *r = &c->rctx;
+  assert(o->num_pending_readbacks > 0);
+  readback_slot_t *slot = &o->readback_slots[o->readback_head];
+  assert(slot->decided);
+  o->readback_head = (o->readback_head + 1) % o->readback_depth;
+  --o->num_pending_readbacks;
+  if (slot->converted && slot->repeat) {
+    // converted for nothing, the frame turned out unchanged
+    if (o->hw_encode) {
+      o->hw_surfaces[slot->surface].in_use = false;
+    } else {
+      glDeleteSync(slot->fence);
+      slot->fence = NULL;
+    }
+  }
+  if (slot->drop) {
+    return;
+  }
+  if (slot->repeat) {
+    submit_last_frame(c, o, slot->pts);
+    return;
+  }
+  if (o->hw_encode) {
+    submit_hw_frame(c, o, slot);
+    return;
+  }
+
+  nassert(glClientWaitSync(slot->fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                           GL_TIMEOUT_IGNORED) != GL_WAIT_FAILED);
+  glDeleteSync(slot->fence);
+  slot->fence = NULL;
+
+  AVFrame *frame = c->temp_frames[0];
+  frame->format = o->output_ctx.cdc_ctx[r->video_si]->sw_pix_fmt;
+  frame->width = o->info.width;
+  frame->height = o->info.height;
+  frame->pts = slot->pts;
+  nassert(frame->buf[0] = av_buffer_pool_get(o->frame_pool));
+  nassert_ffmpeg(av_image_fill_arrays(frame->data, frame->linesize,
+                                      frame->buf[0]->data, frame->format,
+                                      frame->width, frame->height,
+                                      READBACK_FRAME_ALIGN));
+
+  const u8 *src;
+  nassert(src = glMapNamedBufferRange(slot->pbo, 0, o->readback_size,
+                                      GL_MAP_READ_BIT));
+  if (o->cpu_color_convert) {
+    // the framebuffer is upside down, so it is converted from its last row
+    const color_convert_plane_t *p = &o->readback_planes[0];
+    i64 row_size = p->width * p->texel_size;
+    rgba_to_yuv_convert(&o->cpu_convert, &r->convert_pool,
+                        src + row_size * (p->height - 1), -row_size, frame);
+  } else {
+    for (i32 i = 0; i < o->num_readback_planes; ++i) {
+      const color_convert_plane_t *p = &o->readback_planes[i];
+      i32 row_size = p->width * p->texel_size;
+      av_image_copy_plane(frame->data[i], frame->linesize[i], src, row_size,
+                          row_size, p->height);
+      src += row_size * p->height;
+    }
+  }
+  glUnmapNamedBuffer(slot->pbo);
+  av_frame_unref(o->last_frame);
+  nassert_ffmpeg(av_frame_ref(o->last_frame, frame));
+
+  output_ctx_submit_frame(&o->output_ctx, frame, r->video_si);
+  av_frame_unref(frame);
+}
+
+// set up the conversion of the rendered frames for the video encoder of an
+// output
+static void init_video_output(context_t *c, render_output_t *o) {
+  render_context_t *r = &c->rctx;
+  const AVCodec *codec = o->output_ctx.cdc_ctx[r->video_si]->codec;
+  i32 width = o->info.width, height = o->info.height;
+  color_convert_init_t cc_info = {
+      .pix_fmt = o->output_ctx.cdc_ctx[r->video_si]->sw_pix_fmt,
+      .width = width,
+      .height = height,
+      .color_space = c->info.color_space,
+      .color_range = c->info.color_range,
+  };
+  // the chroma of a block is computed from the pixels of the block
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(cc_info.pix_fmt);
+  if (width % (1 << desc->log2_chroma_w) != 0 ||
+      height % (1 << desc->log2_chroma_h) != 0) {
+    log_error("video size %" PRIi32 "x%" PRIi32 " of %s is not a multiple of "
+              "the chroma subsampling of %s",
+              width, height, o->info.output_path, desc->name);
+    panic();
+  }
+  bool scaled = width != c->info.width || height != c->info.height;
+  o->hw_encode = output_ctx_is_hw_encoder(codec);
+  bool cpu_convert_supported = rgba_to_yuv_supports(cc_info.pix_fmt);
+  if ((o->hw_encode || scaled) && c->info.cpu_color_convert) {
+    log_warn("CPU color conversion is not supported with hardware encoders or "
+             "scaled outputs, converting %s on the GPU",
+             o->info.output_path);
+  } else if (!cpu_convert_supported && c->info.cpu_color_convert) {
+    log_warn("CPU color conversion does not support %s, converting %s on the "
+             "GPU",
+             desc->name, o->info.output_path);
+  }
+  o->readback_depth = c->info.readback_depth > 0 ? c->info.readback_depth
+                                                 : DEFAULT_READBACK_DEPTH;
+  o->readback_slots = sve2_calloc(o->readback_depth, sizeof *o->readback_slots);
+  if (o->hw_encode) {
+    // frames are converted straight into textures exported as VAAPI surfaces,
+    // so they must be laid out like one. The pending frames hold a surface
+    // each, and the last submitted one too.
+    o->num_hw_surfaces = o->readback_depth + 1;
+    o->hw_surfaces = sve2_calloc(o->num_hw_surfaces, sizeof *o->hw_surfaces);
+    for (i32 i = 0; i < o->num_hw_surfaces; ++i) {
+      init_hw_surface(o, &o->hw_surfaces[i]);
+    }
+    o->hw_surface_index = 0;
+    o->hw_last_surface = -1;
+    nv12_output_frame_offsets_t offsets = calc_out_frame_offsets(width, height);
+    cc_info.surface = o->hw_surfaces[0].texture;
+    cc_info.surface_chroma_y = offsets.offset_uv.y;
+    color_convert_init(c, &o->color_convert, &cc_info);
+    return;
+  }
+
+  o->cpu_color_convert =
+      c->info.cpu_color_convert && !scaled && cpu_convert_supported;
+  if (o->cpu_color_convert) {
+    // the framebuffer is read back as is, in the smallest format that keeps
+    // its precision
+    bool rgba8 = context_framebuffer_format(c) == GL_RGBA8;
+    rgba_to_yuv_init(&o->cpu_convert,
+                     rgba8 ? AV_PIX_FMT_RGBA : AV_PIX_FMT_RGBAF16,
+                     cc_info.pix_fmt, width, height, cc_info.color_space,
+                     cc_info.color_range);
+    if (!r->has_convert_pool) {
+      thread_pool_init(&r->convert_pool, 0);
+      r->has_convert_pool = true;
+    }
+    o->readback_planes[0] = (color_convert_plane_t){
+        .texture = r->fbo_color_attachment,
+        .width = width,
+        .height = height,
+        .format = GL_RGBA,
+        .type = rgba8 ? GL_UNSIGNED_BYTE : GL_HALF_FLOAT,
+        .texel_size = rgba8 ? 4 : 8,
+    };
+    o->num_readback_planes = 1;
+  } else {
+    color_convert_init(c, &o->color_convert, &cc_info);
+    memcpy(o->readback_planes, o->color_convert.planes,
+           sizeof o->readback_planes);
+    o->num_readback_planes = o->color_convert.num_planes;
+  }
+  o->readback_size = 0;
+  for (i32 i = 0; i < o->num_readback_planes; ++i) {
+    const color_convert_plane_t *p = &o->readback_planes[i];
+    o->readback_size += p->width * p->texel_size * p->height;
+  }
+
+  nassert(o->last_frame = av_frame_alloc());
+  // frames stay referenced by the encoder for a while (lookahead, B-frames
+  // etc.), so they are taken from a pool instead of being reused
+  i32 size = av_image_get_buffer_size(cc_info.pix_fmt, width, height,
+                                      READBACK_FRAME_ALIGN);
+  nassert_ffmpeg(size);
+  nassert(o->frame_pool = av_buffer_pool_init(size, NULL));
+
+  for (i32 i = 0; i < o->readback_depth; ++i) {
+    glCreateBuffers(1, &o->readback_slots[i].pbo);
+    // only the CPU reads from these buffers
+    glNamedBufferStorage(o->readback_slots[i].pbo, o->readback_size, NULL,
+                         GL_MAP_READ_BIT | GL_CLIENT_STORAGE_BIT);
+  }
+}
+
+static void free_video_output(render_output_t *o) {
+  for (i32 i = 0; i < o->num_hw_surfaces; ++i) {
+    free_hw_surface(&o->hw_surfaces[i]);
+  }
+  free(o->hw_surfaces);
+  // the pool is only freed once every frame is returned, i.e. after the
+  // encoders are closed
+  av_buffer_pool_uninit(&o->frame_pool);
+  for (i32 i = 0; i < o->readback_depth; ++i) {
+    glDeleteBuffers(1, &o->readback_slots[i].pbo);
+  }
+  free(o->readback_slots);
+  av_frame_free(&o->last_frame);
+  if (!o->cpu_color_convert) {
+    color_convert_free(&o->color_convert);
+  }
+}
+
+// move the color conversion of an output to the next hardware surface not in
+// use. If the encoder still uses it (i.e. every surface is in flight), wait
+// for the encode thread to catch up first.
+static void next_hw_surface(render_output_t *o) {
+  // there is always one: at most readback_depth - 1 frames are pending, plus
+  // the last submitted one
+  do {
+    o->hw_surface_index = (o->hw_surface_index + 1) % o->num_hw_surfaces;
+  } while (o->hw_surfaces[o->hw_surface_index].in_use);
+  hw_surface_t *s = &o->hw_surfaces[o->hw_surface_index];
+  if (s->hw_frame->buf[0] && av_buffer_get_ref_count(s->hw_frame->buf[0]) > 1) {
+    output_ctx_wait(&o->output_ctx);
+  }
+  av_frame_unref(s->hw_frame);
+  s->in_use = true;
+  color_convert_set_surface(&o->color_convert, s->texture);
+}
+
+// decide how the oldest undecided frame of every output is encoded, knowing
+// whether it changed: submitted, submitted again as the previous frame, or left
+// out of the video. Frames that were not converted are unchanged anyway.
+static void decide_frame(context_t *c, bool changed) {
+  render_context_t *r = &c->rctx;
+  assert(r->num_undecided_frames > 0);
+  bool unchanged = false;
+  i64 pts = 0;
+  for (i32 i = 0; i < r->num_outputs; ++i) {
+    render_output_t *o = &r->outputs[i];
+    readback_slot_t *slot =
+        &o->readback_slots[(o->readback_head + o->num_pending_readbacks -
+                            r->num_undecided_frames) %
+                           o->readback_depth];
+    unchanged = !slot->converted || !changed;
+    pts = slot->pts;
+    slot->decided = true;
+    slot->repeat = unchanged;
+    slot->drop = unchanged && c->info.drop_unchanged_frames;
+  }
+  --r->num_undecided_frames;
+  r->num_unchanged_frames += unchanged;
+  r->dropped_pts = unchanged && c->info.drop_unchanged_frames ? pts : -1;
+}
+
+// convert the current frame and queue it in every output, unless it was
+// declared unchanged. Frames are decided right away, or once their comparison
+// with the previous frame is read back if unchanged frames are detected.
+static void submit_video_frame(context_t *c, i64 pts, bool unchanged) {
+  render_context_t *r = &c->rctx;
+  // the first frame has nothing to repeat
+  unchanged = unchanged && r->has_previous_frame;
+  frame_diff_t *d = &r->frame_diff;
+  // decide the frames whose comparison is done (without blocking), and wait
+  // for the oldest one only if every slot is in use
+  while (r->num_undecided_frames > 0 &&
+         (d->num_pending == d->depth || frame_diff_ready(d))) {
+    decide_frame(c, frame_diff_finish(d));
+  }
+  for (i32 i = 0; i < r->num_outputs; ++i) {
+    render_output_t *o = &r->outputs[i];
+    if (o->num_pending_readbacks == o->readback_depth) {
+      readback_finish(c, o);
+    }
+  }
+
+  // do color-conversion (and scaling) via compute shader, unless the frame is
+  // converted once read back. Every conversion is dispatched before reading
+  // any frame back, so they run back to back on the GPU.
+  for (i32 i = 0; i < r->num_outputs && !unchanged; ++i) {
+    render_output_t *o = &r->outputs[i];
+    if (o->hw_encode) {
+      next_hw_surface(o);
+    }
+    if (!o->cpu_color_convert) {
+      color_convert_run(&o->color_convert, r->fbo_color_attachment, true);
+    }
+  }
+  for (i32 i = 0; i < r->num_outputs; ++i) {
+    readback_start(&r->outputs[i], pts, !unchanged);
+  }
+  ++r->num_undecided_frames;
+  if (c->info.detect_unchanged_frames) {
+    // the hashes are updated even if the application knows, so they stay in
+    // sync with the frames. Started after the readbacks, so they are done
+    // once the comparison is.
+    frame_diff_start(d, r->fbo_color_attachment);
+  } else {
+    decide_frame(c, !unchanged);
+  }
+  r->has_previous_frame = true;
+
+  // submit the frames that are decided and read back (without blocking)
+  for (i32 i = 0; i < r->num_outputs; ++i) {
+    render_output_t *o = &r->outputs[i];
+    while (o->num_pending_readbacks > 0 && readback_ready(o)) {
+      readback_finish(c, o);
+    }
+  }
+}
+
+// set up the outputs of a render: the main output, then the renditions
+static void init_outputs(context_t *c) {
+  render_context_t *r = &c->rctx;
+  r->num_outputs = 1 + c->info.num_renditions;
+  r->outputs = sve2_calloc(r->num_outputs, sizeof *r->outputs);
+  r->outputs[0].info = (context_rendition_t){
+      .output_path = c->info.output_path,
+      .width = c->info.width,
+      .height = c->info.height,
+      .video_encoder = c->info.video_encoder,
+      .video_encoder_options = c->info.video_encoder_options,
+      .video_pix_fmt = c->info.video_pix_fmt,
+  };
+  for (i32 i = 1; i < r->num_outputs; ++i) {
+    context_rendition_t *info = &r->outputs[i].info;
+    *info = c->info.renditions[i - 1];
+    if (info->width <= 0) {
+      info->width = c->info.width;
+    }
+    if (info->height <= 0) {
+      info->height = c->info.height;
+    }
+  }
+}
+
+// open the outputs of a render (with the encoders)
+static void open_render_output(context_t *c) {
+  // output streams, video first
+  render_context_t *r = &c->rctx;
+  i32 num_streams = 0;
+  r->video_si = r->audio_si = -1;
+  if (!c->info.skip_video) {
+    r->video_si = num_streams++;
+  }
+  if (!c->info.skip_audio) {
+    r->audio_si = num_streams++;
+  }
+  nassert(num_streams > 0 && "both video and audio are skipped");
+
+  for (i32 i = 0; i < r->num_outputs; ++i) {
+    render_output_t *o = &r->outputs[i];
+    const AVCodec *codecs[2];
+    const char *options[2] = {0};
+    if (r->video_si >= 0) {
+      const char *name = video_encoder_names[o->info.video_encoder];
+      if (!(codecs[r->video_si] = avcodec_find_encoder_by_name(name))) {
+        log_error("video encoder %s is not available", name);
+        panic();
+      }
+      options[r->video_si] = o->info.video_encoder_options;
+    }
+    if (r->audio_si >= 0) {
+      nassert(codecs[r->audio_si] =
+                  avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE));
+    }
+    output_ctx_video_info_t video = {
+        .width = o->info.width,
+        .height = o->info.height,
+        .pix_fmt = o->info.video_pix_fmt,
+    };
+    output_ctx_open(c, &o->output_ctx, o->info.output_path, &video,
+                    num_streams, codecs, options);
+  }
+  r->output_open = true;
+  r->dropped_pts = -1;
+}
+
+void context_finish_render(context_t *c) {
+  assert(c->info.mode == CONTEXT_MODE_RENDER);
+  render_context_t *r = &c->rctx;
+  if (!r->output_open) {
+    return;
+  }
+  while (r->num_undecided_frames > 0) {
+    decide_frame(c, frame_diff_finish(&r->frame_diff));
+  }
+  if (c->info.detect_unchanged_frames) {
+    // the first frame of the next render has nothing to be compared with
+    r->frame_diff.has_previous = false;
+  }
+  for (i32 i = 0; i < r->num_outputs; ++i) {
+    render_output_t *o = &r->outputs[i];
+    while (o->num_pending_readbacks > 0) {
+      readback_finish(c, o);
+    }
+    // the last frame must be in the stream, or the video ends early
+    if (r->dropped_pts >= 0) {
+      submit_last_frame(c, o, r->dropped_pts);
+    }
+    output_ctx_close(&o->output_ctx);
+    if (o->last_frame) {
+      av_frame_unref(o->last_frame);
+    }
+    // the mapped frames belong to the frames context of the closed encoder
+    for (i32 j = 0; j < o->num_hw_surfaces; ++j) {
+      av_frame_unref(o->hw_surfaces[j].hw_frame);
+      o->hw_surfaces[j].in_use = false;
+    }
+    o->hw_last_surface = -1;
+  }
+  r->output_open = false;
+  if (r->num_unchanged_frames > 0) {
+    log_info("%" PRIi32 " of %" PRIi32 " frames were unchanged, and %s",
+             r->num_unchanged_frames, c->frame_num,
+             c->info.drop_unchanged_frames ? "left out of the video"
+                                           : "encoded as the previous frame");
+  }
+  r->has_previous_frame = false;
+  r->num_unchanged_frames = 0;
+}
+
+void context_set_frame_unchanged(context_t *c) {
+  if (c->info.mode == CONTEXT_MODE_RENDER) {
+    c->rctx.frame_unchanged = true;
+  }
+}
+
+void context_restart_render(context_t *c, const char *output_path,
+                            i32 num_frames) {
+  context_finish_render(c);
+  c->info.output_path = output_path;
+  c->info.num_frames = num_frames;
+  c->rctx.outputs[0].info.output_path = output_path;
+  // the encoding parameters are the same, so the capture objects (the
+  // framebuffer, the color converter and the readback buffers) are kept
+  open_render_output(c);
+
+  c->frame_num = 0;
+  c->should_close = false;
+  c->audio_timer_offset = 0;
+  c->num_samples_from_last_seek = 0;
+  c->num_total_samples = 0;
+  c->num_frame_samples = 0;
+  // as if the context was new, so renders stay reproducible
+  audio_dither_init(&c->audio_dither, 0x5eed);
+}
+
 context_t *context_init(const context_init_t *info) {
   // initialize core libraries
   init_logging();
@@ -268,47 +978,20 @@ context_t *context_init(const context_init_t *info) {
   c->xscale = 1.0;
   c->yscale = 1.0;
 
-  // GLFW initialization
-  nassert(
-      !glfwSetErrorCallback(glfw_error_callback) &&
-      "Existing GLFW error callback is overriden. Consider setting the GLFW "
-      "error callback after context initialization.");
-  nassert(glfwInit() && "GLFW initialization failed");
-
-  glfwDefaultWindowHints();
-  // off-screen rendering if not in preview mode
-  glfwWindowHint(GLFW_VISIBLE, info->mode == CONTEXT_MODE_PREVIEW);
-  // we require EGL + OpenGL ES for VAAPI integration extensions
-  glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
-  glfwWindowHint(GLFW_CONTEXT_DEBUG, GLFW_TRUE);
-  nassert((c->window = glfwCreateWindow(info->width, info->height,
-                                        "sve2 window", NULL, NULL)));
-  glfwMakeContextCurrent(c->window);
-  glfwSetWindowUserPointer(c->window, c);
-
-  // GLAD function loading
-  nassert(gladLoadGL(glfwGetProcAddress));
-  nassert(gladLoadEGL(glfwGetEGLDisplay(), glfwGetProcAddress));
+  // OpenGL context: a window in preview mode, off-screen rendering otherwise
+  if (info->mode == CONTEXT_MODE_PREVIEW) {
+    init_window(c);
+  } else {
+    init_headless_gl(c);
+  }
 
   // enable debug output
-  // comment these lines (and set GLFW_CONTEXT_DEBUG to GLFW_FALSE above to
-  // disable this)
+  // comment these lines (and set GLFW_CONTEXT_DEBUG/EGL_CONTEXT_OPENGL_DEBUG
+  // to false above to disable this)
   glEnable(GL_DEBUG_OUTPUT);
   glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
   glDebugMessageCallback(gl_debug_callback, NULL);
 
-  // get framebuffer size
-  // the window size might be different to the size specified in
-  // glfwCreateWindow (e.g. if one is using a tiling WM (me))
-  int width, height;
-  glfwGetFramebufferSize(c->window, &width, &height);
-  c->info.width = width;
-  c->info.height = height;
-
-  // GLFW callback
-  glfwSetFramebufferSizeCallback(c->window, glfw_framebuffer_callback);
-  glfwSetWindowContentScaleCallback(c->window, glfw_content_scale_callback);
-
   shader_manager_init(&c->sman, "shaders/out");
 
   for (i32 i = 0; i < sve2_arrlen(c->temp_frames); ++i) {
@@ -316,33 +999,30 @@ context_t *context_init(const context_init_t *info) {
   }
   nassert(c->temp_packet = av_packet_alloc());
 
+  // the audio bus holds as many samples as the playback buffer (or a frame in
+  // render mode). Dithering uses a fixed seed, so renders are reproducible.
+  i32 nb_channels = c->info.ch_layout->nb_channels;
+  nassert(nb_channels <= SVE2_MAX_AUDIO_CHANNELS);
+  c->audio_bus_size = c->info.sample_rate *
+                      sve2_max_i32(c->info.num_buffered_audio_frames, 1) /
+                      c->info.fps;
+  for (i32 i = 0; i < nb_channels; ++i) {
+    c->audio_bus[i] = sve2_malloc(c->audio_bus_size * sve2_sizeof(f32));
+  }
+  audio_dither_init(&c->audio_dither, 0x5eed);
+
   // mode-specific initialization
   if (c->info.mode == CONTEXT_MODE_RENDER) {
     nassert(c->rctx.audio_mapping_frame = av_frame_alloc());
-
-    const AVCodec *video_codec, *audio_codec;
-    nassert(video_codec = avcodec_find_encoder_by_name("hevc_vaapi"));
-    nassert(audio_codec = avcodec_find_encoder(AV_CODEC_ID_PCM_S16LE));
-    output_ctx_open(c, &c->rctx.output_ctx, c->info.output_path, 2,
-                    (const AVCodec *[]){video_codec, audio_codec});
-
-    nassert(c->rctx.output_video_texture_prime = av_frame_alloc());
-    AVFrame *prime_frame = c->rctx.output_video_texture_prime;
-    prime_frame->width = width;
-    prime_frame->height = height;
-    prime_frame->format = AV_PIX_FMT_DRM_PRIME;
-    prime_frame->buf[0] = av_buffer_alloc(sizeof(AVDRMFrameDescriptor));
-    prime_frame->data[0] = prime_frame->buf[0]->data;
-    // TODO: this only supports RGB -> NV12 conversion
-    nassert(c->rctx.color_convert_shader =
-                shader_new_c(c, "encode_nv12.comp.glsl"));
+    init_outputs(c);
+    open_render_output(c);
 
     // create OpenGL capturing objects
     i32 width = c->info.width, height = c->info.height;
     glCreateFramebuffers(1, &c->rctx.fbo);
     glCreateTextures(GL_TEXTURE_2D, 1, &c->rctx.fbo_color_attachment);
-    glTextureStorage2D(c->rctx.fbo_color_attachment, 1, GL_RGBA32F, width,
-                       height);
+    glTextureStorage2D(c->rctx.fbo_color_attachment, 1,
+                       context_framebuffer_format(c), width, height);
     glTextureParameteri(c->rctx.fbo_color_attachment, GL_TEXTURE_MIN_FILTER,
                         GL_LINEAR);
     glTextureParameteri(c->rctx.fbo_color_attachment, GL_TEXTURE_MAG_FILTER,
@@ -351,25 +1031,27 @@ context_t *context_init(const context_init_t *info) {
                               c->rctx.fbo_color_attachment, 0);
     nassert(glCheckNamedFramebufferStatus(c->rctx.fbo, GL_FRAMEBUFFER) ==
             GL_FRAMEBUFFER_COMPLETE);
-    glCreateTextures(GL_TEXTURE_2D, 1, &c->rctx.output_texture);
-    nv12_output_frame_offsets_t offsets = calc_out_frame_offsets(width, height);
-    glTextureStorage2D(c->rctx.output_texture, 1, GL_R8, offsets.tex_width,
-                       offsets.tex_height);
-    c->rctx.offset_uv_y = offsets.offset_uv.y;
+    if (c->rctx.video_si >= 0) {
+      for (i32 i = 0; i < c->rctx.num_outputs; ++i) {
+        init_video_output(c, &c->rctx.outputs[i]);
+      }
+      if (c->info.detect_unchanged_frames) {
+        frame_diff_init(c, &c->rctx.frame_diff, width, height,
+                        c->info.readback_depth > 0 ? c->info.readback_depth
+                                                   : DEFAULT_READBACK_DEPTH);
+      }
+    }
   } else {
-    // allocate audio playback buffer and other things
+    // allocate audio playback buffer
     i32 num_samples =
         c->info.sample_rate * c->info.num_buffered_audio_frames / c->info.fps;
-    nassert(
-        c->pctx.audio_fifo = av_audio_fifo_alloc(
-            c->info.sample_fmt, c->info.ch_layout->nb_channels, num_samples));
     // throughout this, we assumed that audio samples are interleaved (to
     // advance the pointer), therefore we require the sample format to be
     // non-planar
-    c->pctx.audio_staging_buffer =
-        sve2_malloc(num_samples * c->info.ch_layout->nb_channels *
-                    av_get_bytes_per_sample(c->info.sample_fmt));
-    sve2_mtx_init(&c->pctx.audio_fifo_mutex, mtx_plain);
+    spsc_ring_init(&c->pctx.audio_ring,
+                   c->info.ch_layout->nb_channels *
+                       av_get_bytes_per_sample(c->info.sample_fmt),
+                   num_samples);
 
     ma_device_config config = ma_device_config_init(ma_device_type_playback);
     if ((config.playback.format = get_ma_sample_format(c->info.sample_fmt)) ==
@@ -384,8 +1066,25 @@ context_t *context_init(const context_init_t *info) {
     config.pUserData = c;
     // the period size is 1 frame
     config.periodSizeInFrames = c->info.sample_rate / c->info.fps;
+    audio_clock_init(&c->pctx.audio_clock);
     nassert(ma_device_init(NULL, &config, &c->pctx.audio_device) == MA_SUCCESS);
+
+    // samples handed to the device are buffered internally (in the device's
+    // own sample rate) before being heard
+    ma_device *d = &c->pctx.audio_device;
+    c->pctx.audio_latency = (i64)d->playback.internalPeriodSizeInFrames *
+                            d->playback.internalPeriods * c->info.sample_rate /
+                            d->playback.internalSampleRate;
+    c->pctx.audio_period = config.periodSizeInFrames;
+    log_info("audio device latency: %" PRIi64 " samples",
+             c->pctx.audio_latency);
     nassert(ma_device_start(&c->pctx.audio_device) == MA_SUCCESS);
+
+    frame_scheduler_init(&c->pctx.scheduler, c->info.fps);
+    c->pctx.has_proxies = info->proxy_height > 0;
+    if (c->pctx.has_proxies) {
+      proxy_manager_init(&c->pctx.proxies, info->proxy_height, 0);
+    }
   }
 
   return c;
@@ -393,40 +1092,70 @@ context_t *context_init(const context_init_t *info) {
 
 void context_free(context_t *c) {
   if (c->info.mode == CONTEXT_MODE_RENDER) {
-    output_ctx_close(&c->rctx.output_ctx);
-    eglDestroyImage(eglGetCurrentDisplay(), c->rctx.output_texture_image);
-    av_frame_free(&c->rctx.output_video_texture_prime);
-    glDeleteTextures(1, &c->rctx.output_texture);
+    context_finish_render(c);
+    if (c->rctx.video_si >= 0) {
+      for (i32 i = 0; i < c->rctx.num_outputs; ++i) {
+        free_video_output(&c->rctx.outputs[i]);
+      }
+      if (c->info.detect_unchanged_frames) {
+        frame_diff_free(&c->rctx.frame_diff);
+      }
+    }
+    free(c->rctx.outputs);
+    if (c->rctx.has_convert_pool) {
+      thread_pool_free(&c->rctx.convert_pool);
+    }
     glDeleteTextures(1, &c->rctx.fbo_color_attachment);
     glDeleteFramebuffers(1, &c->rctx.fbo);
     av_frame_free(&c->rctx.audio_mapping_frame);
   } else {
     ma_device_uninit(&c->pctx.audio_device);
-    mtx_destroy(&c->pctx.audio_fifo_mutex);
-    av_audio_fifo_free(c->pctx.audio_fifo);
-    sve2_freep(&c->pctx.audio_staging_buffer);
+    log_info("audio playback finished with %" PRIi64 " underruns and %" PRIi64
+             " overruns",
+             spsc_ring_num_underruns(&c->pctx.audio_ring),
+             spsc_ring_num_overruns(&c->pctx.audio_ring));
+    spsc_ring_free(&c->pctx.audio_ring);
+    const frame_scheduler_t *sched = &c->pctx.scheduler;
+    log_info("preview finished with %" PRIi64 " missed deadlines and %" PRIi64
+             " skipped frames in %" PRIi64 " frames",
+             sched->num_missed_deadlines, sched->num_skipped_frames,
+             sched->num_frames);
+    if (c->pctx.has_proxies) {
+      proxy_manager_free(&c->pctx.proxies);
+    }
   }
 
   av_packet_free(&c->temp_packet);
   for (i32 i = 0; i < sve2_arrlen(c->temp_frames); ++i) {
     av_frame_free(&c->temp_frames[i]);
   }
+  for (i32 i = 0; i < c->info.ch_layout->nb_channels; ++i) {
+    free(c->audio_bus[i]);
+  }
 
   shader_manager_free(&c->sman);
+  // free all windowing + OpenGL stuff, no need to manually free every resource
+  if (c->info.mode == CONTEXT_MODE_PREVIEW) {
+    glfwTerminate();
+  } else {
+    free_headless_gl(c);
+  }
   free(c);
-  glfwTerminate(); // free all windowing + OpenGL stuff,
-                   // no need to manually free every resource
 
   done_logging();
 }
 
-// this is baked-in to GLFW, so nice
+// this is baked-in to GLFW, so nice (there is no window in render mode though)
 void context_set_should_close(context_t *c, bool should_close) {
-  glfwSetWindowShouldClose(c->window, should_close);
+  if (c->window) {
+    glfwSetWindowShouldClose(c->window, should_close);
+  } else {
+    c->should_close = should_close;
+  }
 }
 
 bool context_get_should_close(context_t *c) {
-  return glfwWindowShouldClose(c->window);
+  return c->window ? glfwWindowShouldClose(c->window) : c->should_close;
 }
 
 void context_get_framebuffer_info(context_t *c, i32 *w, i32 *h, f32 *xscale,
@@ -440,7 +1169,10 @@ void context_get_framebuffer_info(context_t *c, i32 *w, i32 *h, f32 *xscale,
 }
 
 void context_begin_frame(context_t *c) {
-  glfwPollEvents();
+  if (c->info.mode == CONTEXT_MODE_PREVIEW) {
+    glfwPollEvents();
+    frame_scheduler_begin_frame(&c->pctx.scheduler, threads_timer_now());
+  }
   log_trace("frame %" PRIi32 " started", c->frame_num);
   shader_manager_update(&c->sman);
 
@@ -456,41 +1188,43 @@ void context_begin_frame(context_t *c) {
 }
 
 void context_end_frame(context_t *c) {
-  if (c->info.mode == CONTEXT_MODE_RENDER) {
-    // do color-conversion via compute shader
-    i32 width = c->info.width, height = c->info.height;
-    nassert(shader_use(c->rctx.color_convert_shader) >= 0);
-    glUniform1i(0, c->rctx.offset_uv_y);
-    glUniform1i(1, true);
-    glBindImageTexture(0, c->rctx.fbo_color_attachment, 0, GL_FALSE, 0,
-                       GL_READ_ONLY, GL_RGBA32F);
-    glBindImageTexture(1, c->rctx.output_texture, 0, GL_FALSE, 0, GL_WRITE_ONLY,
-                       GL_R8);
-    glDispatchCompute(width / 2, height / 2, 1);
-    glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
-
-    // submit frame to hardware-accelerated video encoder
-    AVFrame *hw_frame = c->temp_frames[0];
-    output_ctx_init_hwframe(&c->rctx.output_ctx, hw_frame, OUT_VIDEO_SI);
-    hw_frame->pts = c->frame_num;
-    EGLImage image;
-    remap_drm_prime(&c->rctx, &image, width, height);
-    nassert_ffmpeg(av_hwframe_map(hw_frame, c->rctx.output_video_texture_prime,
-                                  AV_HWFRAME_MAP_READ | AV_HWFRAME_MAP_DIRECT));
-    output_ctx_submit_frame(&c->rctx.output_ctx, hw_frame, OUT_VIDEO_SI);
-    eglDestroyImage(eglGetCurrentDisplay(), image);
-
-    av_frame_unref(hw_frame);
-  } else {
+  if (c->info.mode == CONTEXT_MODE_RENDER && c->rctx.video_si >= 0) {
+    render_context_t *r = &c->rctx;
+    submit_video_frame(c, c->frame_num, r->frame_unchanged);
+    r->frame_unchanged = false;
+  } else if (c->info.mode == CONTEXT_MODE_PREVIEW) {
+    frame_scheduler_wait(&c->pctx.scheduler);
     glfwSwapBuffers(c->window);
+    frame_scheduler_end_frame(&c->pctx.scheduler, threads_timer_now());
   }
   ++c->frame_num;
+
+  if (c->info.num_frames > 0 && c->frame_num >= c->info.num_frames) {
+    context_set_should_close(c, true);
+  }
 }
 
 GLuint context_default_framebuffer(context_t *c) {
   return c->info.mode == CONTEXT_MODE_RENDER ? c->rctx.fbo : 0;
 }
 
+GLenum context_framebuffer_format(context_t *c) {
+  return c->info.mode == CONTEXT_MODE_RENDER
+             ? framebuffer_formats[c->info.framebuffer_format]
+             : GL_RGBA8;
+}
+
+void context_enable_blending(context_t *c) {
+  glEnable(GL_BLEND);
+  glBlendFuncSeparate(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA, GL_ONE,
+                      GL_ONE_MINUS_SRC_ALPHA);
+  if (context_framebuffer_format(c) == GL_RGBA8) {
+    glEnable(GL_DITHER);
+  } else {
+    glDisable(GL_DITHER);
+  }
+}
+
 void context_set_audio_timer(context_t *c, i64 time) {
   // this should make sense from seeing the implementation of
   // context_get_audio_timer()
@@ -499,80 +1233,119 @@ void context_set_audio_timer(context_t *c, i64 time) {
 }
 
 i64 context_get_audio_timer(context_t *c) {
-  i32 audio_fifo_size = 0;
+  i64 num_unheard_samples = 0;
   // in preview mode, there is a little difference:
-  // samples submitted to the context might not have been played
-  // the number of such samples can be found by getting the size of the audio
-  // fifo buffer
+  // samples submitted to the context might not have been heard yet (they are
+  // either in the ring buffer or buffered inside the audio device)
+  // the number of heard samples is published by the audio callback, and
+  // extrapolated to the current time
   if (c->info.mode == CONTEXT_MODE_PREVIEW) {
-    sve2_mtx_lock(&c->pctx.audio_fifo_mutex);
-    audio_fifo_size = av_audio_fifo_size(c->pctx.audio_fifo);
-    sve2_mtx_unlock(&c->pctx.audio_fifo_mutex);
+    i64 num_heard_samples = audio_clock_get_position(
+        &c->pctx.audio_clock, threads_timer_now(), c->info.sample_rate,
+        c->pctx.audio_latency, c->pctx.audio_period);
+    num_unheard_samples =
+        sve2_max_i64(c->num_total_samples - num_heard_samples, 0);
   }
-  //                             _______________ < this is `audio_fifo_size`
-  //                             samples
+  //                             _______________ < this is
+  //                             samples           `num_unheard_samples`
   //      we need to count this v        |
   // ____________________________        v
   // XXXXXXXXXXXXXXXXXXXXXXXXXXXXOOOOOOOOOOOOOOO: c->num_samples_from_last_seek
   // samples in total
-  //                            | --- samples submitted that has not been played
-  i32 time = c->num_samples_from_last_seek - audio_fifo_size;
+  //                            | --- samples submitted that has not been heard
+  i64 time = c->num_samples_from_last_seek - num_unheard_samples;
   // we add with the seek offset, and convert `time` (in samples unit) to
-  // nanoseconds
-  return c->audio_timer_offset + time * SVE2_NS_PER_SEC / c->info.sample_rate;
+  // nanoseconds (rescaled without overflowing the intermediate product)
+  return c->audio_timer_offset +
+         av_rescale(time, SVE2_NS_PER_SEC, c->info.sample_rate);
 }
 
-bool context_map_audio(context_t *c, u8 *staging_buffer[static 1],
+i64 context_get_target_time(context_t *c) {
+  i64 time = context_get_audio_timer(c);
+  if (c->info.mode == CONTEXT_MODE_PREVIEW) {
+    time += sve2_max_i64(c->pctx.scheduler.deadline - threads_timer_now(), 0);
+  }
+  return time;
+}
+
+f32 context_get_preview_quality(context_t *c) {
+  return c->info.mode == CONTEXT_MODE_PREVIEW
+             ? frame_scheduler_get_quality(&c->pctx.scheduler)
+             : 1.0f;
+}
+
+bool context_map_audio(context_t *c, f32 **planes[static 1],
                        i32 nb_samples[static 1]) {
   switch (c->info.mode) {
   case CONTEXT_MODE_PREVIEW:
-    // in preview mode, we use the staging buffer directly
-    // the number of samples is the remaining space in the audio fifo to not let
-    // the fifo get too big
-    sve2_mtx_lock(&c->pctx.audio_fifo_mutex);
-    *nb_samples = av_audio_fifo_space(c->pctx.audio_fifo);
-    *staging_buffer = c->pctx.audio_staging_buffer;
-    sve2_mtx_unlock(&c->pctx.audio_fifo_mutex);
+    // the number of samples is bounded by the free space of the ring (to not
+    // let the buffered audio get too big), so the whole bus fits on unmap
+    *nb_samples = spsc_ring_space(&c->pctx.audio_ring);
     break;
   case CONTEXT_MODE_RENDER:
-    AVFrame *frame = c->rctx.audio_mapping_frame;
-    // allocate memory for samples
-    av_channel_layout_copy(&frame->ch_layout, c->info.ch_layout);
-    frame->sample_rate = c->info.sample_rate;
-    frame->nb_samples = frame->sample_rate / c->info.fps - c->num_frame_samples;
-    frame->format = c->info.sample_fmt;
-    if (frame->nb_samples <= 0) {
-      return false;
-    }
-    nassert_ffmpeg(av_frame_get_buffer(frame, 0));
-
-    *nb_samples = frame->nb_samples;
-    *staging_buffer = frame->data[0];
+    *nb_samples = c->info.sample_rate / c->info.fps - c->num_frame_samples;
     break;
   }
 
+  *nb_samples = sve2_min_i32(*nb_samples, c->audio_bus_size);
+  *planes = c->audio_bus;
   // we only map samples if the number of writable samples is positive
   return *nb_samples > 0;
 }
 
 void context_unmap_audio(context_t *c, i32 nb_samples) {
+  enum AVSampleFormat fmt = c->info.sample_fmt;
+  i32 nb_channels = c->info.ch_layout->nb_channels;
   switch (c->info.mode) {
-  case CONTEXT_MODE_PREVIEW:
-    // write from staging buffer to audio fifo
-    sve2_mtx_lock(&c->pctx.audio_fifo_mutex);
-    av_audio_fifo_write(c->pctx.audio_fifo,
-                        (void *[]){c->pctx.audio_staging_buffer}, nb_samples);
-    sve2_mtx_unlock(&c->pctx.audio_fifo_mutex);
+  case CONTEXT_MODE_PREVIEW: {
+    // convert the bus straight into the ring buffer, in two parts if the
+    // written region wraps around
+    spsc_ring_t *ring = &c->pctx.audio_ring;
+    for (i32 num_done = 0; num_done < nb_samples;) {
+      u8 *dst;
+      i32 count =
+          sve2_min_i32(spsc_ring_write_map(ring, nb_samples - num_done, &dst),
+                       nb_samples - num_done);
+      assert(count > 0 && "more samples unmapped than mapped");
+      f32 *src[SVE2_MAX_AUDIO_CHANNELS];
+      audio_planes_offset(c->audio_bus, nb_channels, num_done, src);
+      audio_kernel_interleaved_from_planar(fmt, (const f32 *const *)src,
+                                           nb_channels, count,
+                                           &c->audio_dither, dst);
+      spsc_ring_write_commit(ring, count);
+      num_done += count;
+    }
     break;
-  case CONTEXT_MODE_RENDER:
+  }
+  case CONTEXT_MODE_RENDER: {
+    // samples are still counted without an audio stream, so the audio timer
+    // keeps working
+    if (nb_samples == 0 || c->rctx.audio_si < 0) {
+      break;
+    }
+
     AVFrame *frame = c->rctx.audio_mapping_frame;
+    av_channel_layout_copy(&frame->ch_layout, c->info.ch_layout);
+    frame->sample_rate = c->info.sample_rate;
     frame->nb_samples = nb_samples;
+    frame->format = fmt;
+    nassert_ffmpeg(av_frame_get_buffer(frame, 0));
+    audio_kernel_interleaved_from_planar(
+        fmt, (const f32 *const *)c->audio_bus, nb_channels, nb_samples,
+        &c->audio_dither, frame->data[0]);
     frame->pts = c->num_total_samples;
-    // submit allocated frame to output context directly
-    output_ctx_submit_frame(&c->rctx.output_ctx, frame, OUT_AUDIO_SI);
+    // submit the converted frame to the output contexts directly, every output
+    // takes its own reference of the samples
+    for (i32 i = 0; i < c->rctx.num_outputs; ++i) {
+      AVFrame *output_frame = c->temp_frames[1];
+      nassert_ffmpeg(av_frame_ref(output_frame, frame));
+      output_ctx_submit_frame(&c->rctx.outputs[i].output_ctx, output_frame,
+                              c->rctx.audio_si);
+    }
     av_frame_unref(frame);
     break;
   }
+  }
 
   // update sample counters
   c->num_total_samples += nb_samples;
@@ -580,6 +1353,19 @@ void context_unmap_audio(context_t *c, i32 nb_samples) {
   c->num_samples_from_last_seek += nb_samples;
 }
 
+void context_get_audio_stats(context_t *c, i64 *num_underruns,
+                             i64 *num_overruns) {
+  i64 underruns = 0, overruns = 0;
+  if (c->info.mode == CONTEXT_MODE_PREVIEW) {
+    underruns = spsc_ring_num_underruns(&c->pctx.audio_ring);
+    overruns = spsc_ring_num_overruns(&c->pctx.audio_ring);
+  }
+  // clang-format off
+  if(num_underruns) *num_underruns = underruns;
+  if(num_overruns) *num_overruns = overruns;
+  // clang-format on
+}
+
 void context_set_user_pointer(context_t *c, void *u) { c->user_ptr = u; }
 
 void *context_get_user_pointer(GLFWwindow *window) {
@@ -592,6 +1378,15 @@ context_t *context_get_from_window(GLFWwindow *window) {
 
 shader_manager_t *context_get_shader_manager(context_t *c) { return &c->sman; }
 
+proxy_manager_t *context_get_proxy_manager(context_t *c) {
+  if (c->info.mode == CONTEXT_MODE_PREVIEW && c->pctx.has_proxies) {
+    return &c->pctx.proxies;
+  }
+  return NULL;
+}
+
 void context_set_key_callback(context_t *c, GLFWkeyfun key) {
-  glfwSetKeyCallback(c->window, key);
+  if (c->window) {
+    glfwSetKeyCallback(c->window, key);
+  }
 }
@@ -4,11 +4,18 @@
 
 #include <glad/gl.h>
 #include <glad/egl.h>
-#include <libavutil/audio_fifo.h>
 #include <miniaudio/miniaudio.h>
 
+#include "sve2/context/audio_clock.h"
+#include "sve2/context/frame_scheduler.h"
+#include "sve2/gl/color_convert.h"
+#include "sve2/gl/frame_diff.h"
 #include "sve2/gl/shader.h"
+#include "sve2/media/audio_kernels.h"
 #include "sve2/media/output_ctx.h"
+#include "sve2/media/proxy.h"
+#include "sve2/media/rgba_to_yuv.h"
+#include "sve2/utils/spsc_ring.h"
 #include "sve2/utils/types.h"
 
 #define GLFW_INCLUDE_NONE
@@ -18,9 +25,59 @@
 // e.g. when in preview mode, a GLFW window will be created, and audio will be
 // played by miniaudio, but in render mode, both video and audio will be "piped"
 // to a muxer. An OpenGL context is still provided for hardware-accelerated
-// rendering.
+// rendering, created headless with EGL (no window, so no display server is
+// needed).
 typedef enum { CONTEXT_MODE_PREVIEW, CONTEXT_MODE_RENDER } context_mode_t;
 
+// video encoders for render mode. hevc_vaapi encodes straight from GPU memory,
+// the others are software encoders fed with frames read back from the GPU, so
+// they work without a VAAPI device (e.g. on CPU-only machines with Mesa's
+// software rasterizer)
+typedef enum {
+  CONTEXT_VIDEO_ENCODER_HEVC_VAAPI,
+  CONTEXT_VIDEO_ENCODER_LIBX264,
+  CONTEXT_VIDEO_ENCODER_LIBX265,
+  CONTEXT_VIDEO_ENCODER_LIBSVTAV1,
+  CONTEXT_VIDEO_ENCODER_FFV1,
+  CONTEXT_VIDEO_ENCODER_RAWVIDEO,
+} context_video_encoder_t;
+
+// color formats of the framebuffer rendered to in render mode (see
+// context_default_framebuffer()). 32-bit float is the most precise, but the
+// converter reads 16 bytes per pixel. 16-bit float is plenty for grading
+// pipelines, and 8-bit normalized is enough for SDR projects, at a quarter of
+// the memory and bandwidth.
+typedef enum {
+  CONTEXT_FRAMEBUFFER_RGBA32F,
+  CONTEXT_FRAMEBUFFER_RGBA16F,
+  CONTEXT_FRAMEBUFFER_RGBA8,
+} context_framebuffer_format_t;
+
+/**
+ * @brief An additional output of a render (see context_init_t::renditions),
+ * e.g. a lower resolution or bitrate version of the main output
+ */
+typedef struct {
+  /**
+   * @brief Path of the output
+   */
+  const char *output_path;
+  /**
+   * @brief Size of the video, 0 meaning the size of the context. Rendered
+   * frames are scaled to this size on the GPU, while they are converted to YUV.
+   * It must be a multiple of the chroma subsampling factors of the pixel
+   * format.
+   */
+  i32 width, height;
+  /**
+   * @brief Video encoder, its options (e.g. "b=2M", for a bitrate ladder) and
+   * pixel format, as the ones of the main output in context_init_t
+   */
+  context_video_encoder_t video_encoder;
+  const char *video_encoder_options;
+  enum AVPixelFormat video_pix_fmt;
+} context_rendition_t;
+
 typedef struct {
   /**
    * @brief Context mode, see the docs of context_mode_t for more details.
@@ -42,7 +99,9 @@ typedef struct {
    */
   const AVChannelLayout *ch_layout;
   /**
-   * @brief Audio sample format. Must be a non-planar format.
+   * @brief Output audio sample format (of the audio device or the encoder).
+   * Must be a non-planar format. Audio is mixed in planar float (see
+   * context_map_audio()), and only converted to this format on output.
    */
   enum AVSampleFormat sample_fmt;
   /**
@@ -50,6 +109,97 @@ typedef struct {
    * mode.
    */
   const char *output_path;
+  /**
+   * @brief Video encoder used in render mode (hevc_vaapi by default). Ignored
+   * in preview mode.
+   */
+  context_video_encoder_t video_encoder;
+  /**
+   * @brief Options of the video encoder, in the form "key=value:key=value"
+   * (e.g. "crf=18:preset=slow" for libx264). May be NULL.
+   */
+  const char *video_encoder_options;
+  /**
+   * @brief Pixel format of the frames fed to a software video encoder (see
+   * color_convert_supports() for the supported formats). It must be supported
+   * by the encoder. 0 (AV_PIX_FMT_YUV420P) by default. Hardware encoders
+   * always take NV12.
+   */
+  enum AVPixelFormat video_pix_fmt;
+  /**
+   * @brief YUV matrix and range of the encoded video, also written to the
+   * output stream. Unspecified means BT.601 and limited range, respectively.
+   */
+  enum AVColorSpace color_space;
+  enum AVColorRange color_range;
+  /**
+   * @brief Color format of the framebuffer in render mode (RGBA32F by
+   * default). Ignored in preview mode, where the window framebuffer is used.
+   */
+  context_framebuffer_format_t framebuffer_format;
+  /**
+   * @brief Convert frames to YUV on the CPU (see sve2/media/rgba_to_yuv.h)
+   * instead of with a compute shader, e.g. when the GPU is a software
+   * rasterizer. The framebuffer is read back as RGBA8 (or half floats if it is
+   * a floating point format). Only for software encoders with NV12, YUV420P or
+   * P010 video_pix_fmt, other outputs are converted on the GPU.
+   */
+  bool cpu_color_convert;
+  /**
+   * @brief Detect frames identical to the previous one in render mode, by
+   * hashing the framebuffer on the GPU (see sve2/gl/frame_diff.h). The result
+   * is read back asynchronously, so detected frames are still converted and
+   * read back, but not encoded again. Unchanged frames can also be declared
+   * with context_set_frame_unchanged(), which costs nothing.
+   */
+  bool detect_unchanged_frames;
+  /**
+   * @brief Leave unchanged frames out of the video stream, so the previous
+   * frame lasts longer (variable frame rate, which the container must
+   * support). Otherwise, unchanged frames are still encoded, as the previous
+   * frame again.
+   */
+  bool drop_unchanged_frames;
+  /**
+   * @brief Number of frames in flight between rendering and encoding in render
+   * mode: frames being read back asynchronously with a software encoder, or
+   * surfaces the frames are converted into with a hardware encoder (plus the
+   * surface of the last submitted frame). 0 means the default (3).
+   */
+  i32 readback_depth;
+  /**
+   * @brief Keyframe interval of the video encoder, in frames. 0 means the
+   * encoder default.
+   */
+  i32 gop_size;
+  /**
+   * @brief Number of frames to render: context_get_should_close() returns true
+   * once this many frames are rendered. 0 means no limit.
+   */
+  i32 num_frames;
+  /**
+   * @brief Leave the video/audio stream out of the output (render mode only).
+   * Audio samples submitted without an audio stream are still counted by the
+   * audio timer. At least one stream must be kept.
+   */
+  bool skip_video, skip_audio;
+  /**
+   * @brief Additional outputs of the render, encoded from the same rendered
+   * frames, so a ladder of resolutions or bitrates costs the composition once.
+   * Renditions have the streams of the main output (the audio is encoded once
+   * per output). Frames are not converted on the CPU for scaled renditions.
+   * The array is copied, but the output paths must stay valid until the
+   * context is freed. Ignored in preview mode.
+   */
+  i32 num_renditions;
+  const context_rendition_t *renditions;
+  /**
+   * @brief Height of the proxies of video sources taller than this (see
+   * sve2/media/proxy.h), which are transcoded in the background and decoded in
+   * place of the sources once ready. 0 disables proxies. Ignored in render
+   * mode, where the sources are always decoded.
+   */
+  i32 proxy_height;
 } context_init_t;
 
 /**
@@ -61,39 +211,208 @@ typedef struct {
    */
   ma_device audio_device;
   /**
-   * @brief Mutex for audio_fifo
+   * @brief Internal buffer for audio playback, in the output sample format. The
+   * render thread is the producer (via context_unmap_audio()), and the
+   * miniaudio callback is the consumer, so no locking is needed on the
+   * real-time thread.
+   */
+  spsc_ring_t audio_ring;
+  /**
+   * @brief Playback position, published by the miniaudio callback
+   */
+  audio_clock_t audio_clock;
+  /**
+   * @brief Number of samples buffered inside the audio device (after they
+   * leave audio_ring), as reported by miniaudio
+   */
+  i64 audio_latency;
+  /**
+   * @brief Number of samples requested by the audio device per callback
    */
-  mtx_t audio_fifo_mutex;
+  i64 audio_period;
   /**
-   * @brief Internal buffer for audio playback
+   * @brief Proxy manager, only initialized if proxies are enabled (see
+   * context_init_t::proxy_height)
    */
-  AVAudioFifo *audio_fifo;
+  bool has_proxies;
+  proxy_manager_t proxies;
   /**
-   * @brief Internal staging buffer returned by context_map_audio()
+   * @brief Frame pacing, see context_get_target_time() and
+   * context_get_preview_quality()
    */
-  void *audio_staging_buffer;
+  frame_scheduler_t scheduler;
 } preview_context_t;
 
 /**
- * @brief Render context, only defined in render mode
+ * @brief A frame of an output between rendering and encoding: an asynchronous
+ * readback into a pixel pack buffer for software encoders, or the surface the
+ * frame was converted into for hardware encoders
+ */
+typedef struct {
+  GLuint pbo;
+  /**
+   * @brief Signalled once the frame is in the buffer
+   */
+  GLsync fence;
+  i32 surface;
+  i64 pts;
+  /**
+   * @brief Whether the frame was converted (and read back). Frames declared
+   * unchanged are not.
+   */
+  bool converted;
+  /**
+   * @brief Whether it is known if the frame changed (see
+   * render_context_t::frame_diff), and if so, whether it is a repetition of
+   * the previous frame, and whether it is left out of the video
+   */
+  bool decided, repeat, drop;
+} readback_slot_t;
+
+/**
+ * @brief An NV12 surface exported to a hardware encoder
  */
 typedef struct {
+  GLuint texture;
+  /**
+   * @brief The texture exported via DRM PRIME (the descriptor of prime_frame)
+   */
+  EGLImage image;
+  AVFrame *prime_frame;
+  /**
+   * @brief The VAAPI frame last mapped from the surface. It is referenced by
+   * the encoder (queue, lookahead, reference frames) as long as its buffer has
+   * other references than this one.
+   */
+  AVFrame *hw_frame;
+  /**
+   * @brief Whether the surface holds a pending frame, or the last submitted
+   * frame (submitted again for unchanged frames)
+   */
+  bool in_use;
+} hw_surface_t;
+
+/**
+ * @brief An output of a render, i.e. the main output or a rendition, with the
+ * objects converting rendered frames for its video encoder
+ */
+typedef struct {
+  /**
+   * @brief Path, video size and encoder of the output (the size is never 0)
+   */
+  context_rendition_t info;
   output_ctx_t output_ctx;
   /**
-   * @brief Color conversion shader (from RGB to YUV) for encoding.
+   * @brief Last frame submitted to the software encoder, submitted again for
+   * unchanged frames
+   */
+  AVFrame *last_frame;
+  /**
+   * @brief Color conversion (from RGB to YUV) for encoding, on the GPU or on
+   * the CPU (with render_context_t::convert_pool) if cpu_color_convert is set
+   */
+  bool cpu_color_convert;
+  color_convert_t color_convert;
+  rgba_to_yuv_t cpu_convert;
+  /**
+   * @brief Regions read back for every frame: the converted planes, or the
+   * framebuffer itself if the conversion runs on the CPU
+   */
+  color_convert_plane_t readback_planes[3];
+  i32 num_readback_planes;
+  /**
+   * @brief Whether the video encoder takes VAAPI surfaces. If so, frames are
+   * converted into hw_surfaces and mapped via DRM PRIME, otherwise they are
+   * read back to system memory.
+   */
+  bool hw_encode;
+  /**
+   * @brief Ring of surfaces exported to the hardware encoder (only for
+   * hardware encoders). Every frame is converted into the next surface not in
+   * use, so the encoder works on the previous ones meanwhile.
+   * hw_surface_index is the surface of the last converted frame, and
+   * hw_last_surface the one of the last submitted frame (-1 if none).
+   */
+  hw_surface_t *hw_surfaces;
+  i32 num_hw_surfaces, hw_surface_index, hw_last_surface;
+  /**
+   * @brief Pool of buffers for frames read back to system memory (only for
+   * software encoders)
+   */
+  AVBufferPool *frame_pool;
+  /**
+   * @brief Ring of readback slots. A frame is read back (or converted into a
+   * hardware surface) in the slot after the pending ones, and submitted to
+   * the encoder once it is decided and its fence has signalled, so readback
+   * overlaps with the rendering of the next frames. readback_head is the
+   * oldest pending slot.
+   */
+  readback_slot_t *readback_slots;
+  i32 readback_depth, readback_head, num_pending_readbacks;
+  /**
+   * @brief Size of a readback buffer, i.e. of the tightly packed planes
+   */
+  i32 readback_size;
+} render_output_t;
+
+/**
+ * @brief Render context, only defined in render mode
+ */
+typedef struct {
+  /**
+   * @brief Outputs of the render: the main output, then the renditions
+   */
+  render_output_t *outputs;
+  i32 num_outputs;
+  /**
+   * @brief Indices of the video and audio streams in the output contexts (the
+   * same for every output), -1 if the stream is skipped
+   */
+  i32 video_si, audio_si;
+  /**
+   * @brief Whether the outputs are open, i.e. the render is not finished (see
+   * context_finish_render())
+   */
+  bool output_open;
+  /**
+   * @brief Unchanged frame detection (only if detect_unchanged_frames is set),
+   * and whether the current frame was declared unchanged by the application
    */
-  shader_t *color_convert_shader;
+  frame_diff_t frame_diff;
+  bool frame_unchanged;
   /**
-   * @brief OpenGL objects for capturing rendering output.
+   * @brief Number of frames whose comparison with the previous frame is
+   * pending, i.e. the last undecided readback slots of every output
    */
-  GLuint fbo, fbo_color_attachment, output_texture;
+  i32 num_undecided_frames;
   /**
-   * @brief Audio mapping frame
+   * @brief Whether a video frame was queued in this render, i.e. there is a
+   * frame to repeat (the first one is always submitted)
+   */
+  bool has_previous_frame;
+  /**
+   * @brief Timestamp of the last unchanged frame left out of the video stream
+   * after the last submitted frame (-1 if none). It is submitted when the
+   * render finishes, otherwise the video would end early.
+   */
+  i64 dropped_pts;
+  i32 num_unchanged_frames;
+  /**
+   * @brief Threads of the CPU color conversion, shared by the outputs (only
+   * initialized if has_convert_pool is set)
+   */
+  bool has_convert_pool;
+  thread_pool_t convert_pool;
+  /**
+   * @brief OpenGL objects for capturing rendering output. Frames are rendered
+   * once, and converted for every output.
+   */
+  GLuint fbo, fbo_color_attachment;
+  /**
+   * @brief Audio frame submitted to the encoder, the audio bus is converted
+   * into it by context_unmap_audio()
    */
   AVFrame *audio_mapping_frame;
-  AVFrame *output_video_texture_prime;
-  EGLImage output_texture_image;
-  i32 offset_uv_y;
 } render_context_t;
 
 typedef struct context_t {
@@ -103,9 +422,23 @@ typedef struct context_t {
    */
   context_init_t info;
   /**
-   * @brief GLFW window (wrapping both the native window and the GL context)
+   * @brief GLFW window (wrapping both the native window and the GL context),
+   * only in preview mode
    */
   GLFWwindow *window;
+  /**
+   * @brief Headless EGL display and context (render mode only). surface is a
+   * pbuffer if the display does not support surfaceless contexts, and
+   * EGL_NO_SURFACE otherwise.
+   */
+  EGLDisplay egl_display;
+  EGLContext egl_context;
+  EGLSurface egl_surface;
+  /**
+   * @brief Close flag in render mode (in preview mode, the one of the window is
+   * used)
+   */
+  bool should_close;
   /**
    * @brief Global shader manager, managing all context GL shaders
    */
@@ -124,15 +457,25 @@ typedef struct context_t {
    * @brief Number of samples since last seek of audio timer. This is used to
    * implement seeking for this timer.
    */
-  i32 num_samples_from_last_seek;
+  i64 num_samples_from_last_seek;
   /**
-   * @brief Total number of samples played.
+   * @brief Total number of samples submitted via context_unmap_audio().
    */
-  i32 num_total_samples;
+  i64 num_total_samples;
   /**
    * @brief Total number of samples played in this frame.
    */
   i32 num_frame_samples;
+  /**
+   * @brief Audio bus: planar float buffers (one per channel) of audio_bus_size
+   * samples, returned by context_map_audio()
+   */
+  f32 *audio_bus[SVE2_MAX_AUDIO_CHANNELS];
+  i32 audio_bus_size;
+  /**
+   * @brief Dither state for the conversion of the bus to the output format
+   */
+  audio_dither_t audio_dither;
   /**
    * @brief Content scaling. This is used to support HiDPI displays (not like
    * it's any useful for this type of application though).
@@ -187,6 +530,40 @@ context_t *context_init(const context_init_t *info);
  */
 void context_free(context_t *c);
 
+/**
+ * @brief Finish the render of a render-mode context: pending frames are
+ * encoded and the output is written out. This is done by context_free() too,
+ * and does nothing if the render is already finished.
+ *
+ * @param c The context
+ */
+void context_finish_render(context_t *c);
+/**
+ * @brief Declare the current frame (between context_begin_frame() and
+ * context_end_frame()) identical to the previous one, so it is not converted
+ * and read back again, or not encoded at all (see context_init_t). This is
+ * ignored in preview mode.
+ *
+ * @param c The context
+ */
+void context_set_frame_unchanged(context_t *c);
+/**
+ * @brief Start a new render with a render-mode context, instead of creating a
+ * new context: the current render is finished, and a new output is opened with
+ * the same encoding parameters (renditions are written to their paths again).
+ * The per-render state (frame counter, audio timer and close flag) is reset,
+ * while the OpenGL context, the shaders and the capture objects are kept. This
+ * is meant for long-lived processes rendering many short jobs (see
+ * sve2/context/render_server.h).
+ *
+ * @param c The context
+ * @param output_path Path of the new output. It must stay valid until the
+ * context is freed or restarted again.
+ * @param num_frames Number of frames to render (see context_init_t)
+ */
+void context_restart_render(context_t *c, const char *output_path,
+                            i32 num_frames);
+
 /**
  * @brief Set whether the context should be closed (freed) or not. This does not
  * free the context (as it must be manually done via context_free).
@@ -252,6 +629,27 @@ void context_end_frame(context_t *c);
  * @return The OpenGL handle of the main framebuffer
  */
 GLuint context_default_framebuffer(context_t *c);
+/**
+ * @brief Get the internal format of the color buffer of the main framebuffer
+ * (see context_init_t::framebuffer_format). This is GL_RGBA8 in preview mode.
+ *
+ * @param c The context
+ * @return The internal format, e.g. GL_RGBA16F
+ */
+GLenum context_framebuffer_format(context_t *c);
+/**
+ * @brief Enable alpha blending ("over" compositing) for the main framebuffer.
+ *
+ * Colors are blended with the source alpha, and alpha accumulates coverage,
+ * so the alpha channel stays meaningful across layers. Float framebuffers
+ * keep out-of-range intermediate results (they are only clamped by the color
+ * conversion), and dithering is disabled since they do not quantize. 8-bit
+ * framebuffers clamp after every draw, and are dithered if the implementation
+ * supports it.
+ *
+ * @param c The context
+ */
+void context_enable_blending(context_t *c);
 
 /**
  * @brief Set the context audio timer to time. This is used to seek the global
@@ -267,37 +665,82 @@ void context_set_audio_timer(context_t *c, i64 time);
  * based on the number of samples played. Video is expected to be synchronized
  * with this timer.
  *
+ * In preview mode, this is the position currently heard from the audio device:
+ * it is interpolated between device callbacks and compensated for the device
+ * latency. This never blocks, so it is cheap to query every frame.
+ *
  * @param c The context
  * @return The value of the audio timer in nanoseconds
  */
 i64 context_get_audio_timer(context_t *c);
+/**
+ * @brief Get the timestamp to render the current frame at, on the audio timer:
+ * in preview mode, this is the audio timer at the deadline of the frame (when
+ * it is expected to be presented), so decoders can fetch the frame which will
+ * be on screen then. This is the audio timer in render mode.
+ *
+ * @param c The context
+ * @return The target timestamp, in nanoseconds
+ */
+i64 context_get_target_time(context_t *c);
+/**
+ * @brief Get the quality the preview should be rendered at, which is lowered
+ * when frames miss their deadlines (see sve2/context/frame_scheduler.h), e.g.
+ * to scale the preview size of videos (see video_set_preview_size())
+ *
+ * @param c The context
+ * @return A fraction of the full resolution, always 1 in render mode
+ */
+f32 context_get_preview_quality(context_t *c);
 
 /**
  * @brief Begin transferring audio samples to audio device. At most *nb_samples
- * samples (per channel) can be written to *staging_buffer.
+ * samples (per channel) can be written to the audio bus.
+ *
+ * The audio bus is planar float (one plane per channel of the context layout),
+ * whatever the output sample format, so sources can be summed into it without
+ * clipping. It is converted to the output format once, by
+ * context_unmap_audio(). Callers should keep mapping until this function
+ * returns false.
  *
  * @param c The context
- * @param staging_buffer Pointer to return the address of the audio staging
- * buffer. This must not be NULL.
+ * @param planes Pointer to return the planes of the audio bus. This must not be
+ * NULL.
  * @param nb_samples Pointer to return the maximum number of writable samples
- * (per channel) in *staging_buffer.
+ * (per channel) in the bus.
  * @return Whether the map operation succeeded. The operation fails when the
  * audio buffer is full.
  */
-bool context_map_audio(context_t *c, u8 *staging_buffer[static 1],
+bool context_map_audio(context_t *c, f32 **planes[static 1],
                        i32 nb_samples[static 1]);
 /**
  * @brief Submit audio samples to audio device. Samples are written to the
- * staging buffer returned by context_map_audio. This function could only be
- * called when the context_map_audio operation succeeded.
+ * audio bus returned by context_map_audio, and are converted (with dithering
+ * and clipping) to the output sample format, straight into the playback ring
+ * buffer (preview mode) or an encoder frame (render mode). This function could
+ * only be called when the context_map_audio operation succeeded.
  *
  * @param c The context
- * @param nb_samples Number of samples (per channel) written to the staging
- * buffer. This must be at most the returned number of samples returned from
+ * @param nb_samples Number of samples (per channel) written to the bus. This
+ * must be at most the returned number of samples returned from
  * context_map_audio.
  */
 void context_unmap_audio(context_t *c, i32 nb_samples);
 
+/**
+ * @brief Get audio playback statistics. This is only meaningful in preview
+ * mode (both values are 0 in render mode). Pass NULL if not interested in a
+ * value.
+ *
+ * @param c The context
+ * @param num_underruns Number of device periods that could not be completely
+ * filled (the rest is filled with silence)
+ * @param num_overruns Number of writes to the playback buffer whose mapped
+ * span was shorter than the samples to write, i.e. that did not fit
+ */
+void context_get_audio_stats(context_t *c, i64 *num_underruns,
+                             i64 *num_overruns);
+
 /**
  * @brief Set user pointer to context
  *
@@ -325,9 +768,18 @@ context_t *context_get_from_window(GLFWwindow *window);
  * @return The shader manager of the context c.
  */
 shader_manager_t *context_get_shader_manager(context_t *c);
+/**
+ * @brief Get the proxy manager of a context
+ *
+ * @param c The context
+ * @return The proxy manager of the context c, or NULL if proxies are disabled
+ * (always in render mode)
+ */
+proxy_manager_t *context_get_proxy_manager(context_t *c);
 
 /**
- * @brief Set GLFW key callback to window owned by context c
+ * @brief Set GLFW key callback to window owned by context c. This does nothing
+ * in render mode, where there is no window.
  *
  * @param c The context
  * @param key New GLFW key callback of the window
@@ -0,0 +1,78 @@
+#include "frame_scheduler.h"
+
+#include <log.h>
+
+#include "sve2/utils/threads.h"
+
+// weight of the last frame in frame_scheduler_t::load
+#define LOAD_SMOOTHING 0.1f
+// the quality is lowered above this load, and raised back below the other one
+// (which leaves room for the render time to double)
+#define HIGH_LOAD 0.85f
+#define LOW_LOAD 0.4f
+
+// number of frames the quality stays the same after a change (and after the
+// start, where shaders are compiled and decoders are opened), so the load is
+// measured at the new quality. Changes may reopen decoders (see
+// video_set_preview_size()), which must not happen every frame.
+static i32 get_quality_cooldown(const frame_scheduler_t *s) {
+  return (i32)(SVE2_NS_PER_SEC / s->frame_period);
+}
+
+void frame_scheduler_init(frame_scheduler_t *s, i32 fps) {
+  *s = (frame_scheduler_t){.frame_period = SVE2_NS_PER_SEC / fps};
+  s->quality_cooldown = get_quality_cooldown(s);
+}
+
+void frame_scheduler_begin_frame(frame_scheduler_t *s, i64 now) {
+  if (!s->deadline) {
+    s->deadline = now + s->frame_period;
+  }
+  s->frame_start = now;
+}
+
+void frame_scheduler_wait(frame_scheduler_t *s) {
+  i64 now = threads_timer_now();
+  f32 load = (f32)(now - s->frame_start) / (f32)s->frame_period;
+  s->load += (load - s->load) * LOAD_SMOOTHING;
+
+  // with vsync, presenting then blocks until the vertical blank closest to the
+  // deadline. If the display refreshes faster than the frame rate, this skips
+  // the vertical blanks in between, and without vsync, this is the pacing.
+  sve2_sleep_until(s->deadline - s->frame_period / 2);
+}
+
+void frame_scheduler_end_frame(frame_scheduler_t *s, i64 now) {
+  ++s->num_frames;
+  i64 late = now - s->deadline;
+  bool missed = late >= s->frame_period / 2;
+  if (missed) {
+    // skip the deadlines the frame overran
+    i64 num_skipped = (late + s->frame_period / 2) / s->frame_period;
+    ++s->num_missed_deadlines;
+    s->num_skipped_frames += num_skipped;
+    s->deadline += num_skipped * s->frame_period;
+    log_trace("frame presented %.1f ms late, %" PRIi64 " frames skipped",
+              (f64)late / 1e6, num_skipped);
+  }
+  s->deadline += s->frame_period;
+
+  if (s->quality_cooldown > 0) {
+    --s->quality_cooldown;
+  } else if ((missed || s->load > HIGH_LOAD) &&
+             s->quality_level < FRAME_SCHEDULER_MAX_QUALITY_LEVEL) {
+    ++s->quality_level;
+    s->quality_cooldown = get_quality_cooldown(s);
+    log_info("preview quality lowered to 1/%d (load: %.2f)",
+             1 << s->quality_level, (f64)s->load);
+  } else if (!missed && s->load < LOW_LOAD && s->quality_level > 0) {
+    --s->quality_level;
+    s->quality_cooldown = get_quality_cooldown(s);
+    log_info("preview quality raised to 1/%d (load: %.2f)",
+             1 << s->quality_level, (f64)s->load);
+  }
+}
+
+f32 frame_scheduler_get_quality(const frame_scheduler_t *s) {
+  return 1.0f / (f32)(1 << s->quality_level);
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "sve2/utils/types.h"
+
+// maximum number of halvings of the preview quality, see
+// frame_scheduler_t::quality_level
+#define FRAME_SCHEDULER_MAX_QUALITY_LEVEL 2
+
+/**
+ * @brief Frame pacing of preview mode. Frames are presented on a grid of
+ * deadlines, one frame period apart (measured by threads_timer_now()), which
+ * follows the vertical blanks of the display when swapping buffers blocks
+ * until them.
+ *
+ * Frames are rendered as soon as the previous one is presented, for the
+ * deadline they will be presented at (so decoders can work ahead), and the
+ * render thread only sleeps right before presenting. A frame presented late
+ * misses its deadline: the deadlines it overran are skipped, so the
+ * presentation catches up with the audio instead of lagging behind it. When
+ * deadlines are missed (or almost), the quality of the preview is lowered,
+ * and raised again once the load is low enough for a while.
+ */
+typedef struct {
+  i64 frame_period;
+  /**
+   * @brief Deadline of the frame being rendered, 0 before the first frame
+   */
+  i64 deadline;
+  /**
+   * @brief When the frame being rendered was started
+   */
+  i64 frame_start;
+  /**
+   * @brief Render time of the last frames relative to the frame period
+   * (exponential moving average), 1 meaning the whole period
+   */
+  f32 load;
+  /**
+   * @brief Number of halvings of the preview quality (at most
+   * FRAME_SCHEDULER_MAX_QUALITY_LEVEL), and the number of frames before it may
+   * change again
+   */
+  i32 quality_level;
+  i32 quality_cooldown;
+  i64 num_frames, num_missed_deadlines, num_skipped_frames;
+} frame_scheduler_t;
+
+/**
+ * @brief Initialize a frame scheduler
+ *
+ * @param s The frame scheduler
+ * @param fps Target frame rate
+ */
+void frame_scheduler_init(frame_scheduler_t *s, i32 fps);
+
+/**
+ * @brief Start a frame. Its deadline is then s->deadline.
+ *
+ * @param s The frame scheduler
+ * @param now Current time, measured by threads_timer_now()
+ */
+void frame_scheduler_begin_frame(frame_scheduler_t *s, i64 now);
+
+/**
+ * @brief Wait until the frame can be presented, i.e. shortly before its
+ * deadline. This returns immediately for late frames. This is to be called
+ * after the frame is rendered, right before presenting it.
+ *
+ * @param s The frame scheduler
+ */
+void frame_scheduler_wait(frame_scheduler_t *s);
+
+/**
+ * @brief End a frame presented at time now, and schedule the next one
+ *
+ * @param s The frame scheduler
+ * @param now Time of the presentation, measured by threads_timer_now() (right
+ * after swapping buffers)
+ */
+void frame_scheduler_end_frame(frame_scheduler_t *s, i64 now);
+
+/**
+ * @brief Get the preview quality, as a fraction of the full resolution
+ *
+ * @param s The frame scheduler
+ * @return 1 for full quality, 1/2 or 1/4 when degraded
+ */
+f32 frame_scheduler_get_quality(const frame_scheduler_t *s);
@@ -0,0 +1,279 @@
+#include "render_server.h"
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <libavformat/avformat.h>
+#include <log.h>
+#include <stb/stb_ds.h>
+
+#include "sve2/log/logging.h"
+#include "sve2/utils/asprintf.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+// maximum number of connections waiting for their turn
+#define RENDER_SERVER_BACKLOG 64
+// connections are served one at a time, so a client that stalls while sending
+// its request (or receiving the reply) is dropped after this many seconds
+// instead of blocking the others
+#define RENDER_SERVER_TIMEOUT_SEC 5
+
+static i32 open_socket(const char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof addr.sun_path) {
+    log_error("render server socket path is too long: %s", path);
+    panic();
+  }
+  strcpy(addr.sun_path, path);
+
+  i32 fd;
+  nassert((fd = socket(AF_UNIX, SOCK_STREAM, 0)) >= 0);
+  // a socket file left by a previous server
+  unlink(path);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 ||
+      listen(fd, RENDER_SERVER_BACKLOG) < 0) {
+    log_error("unable to listen on %s: %s", path, strerror(errno));
+    panic();
+  }
+  return fd;
+}
+
+static void set_timeouts(i32 fd) {
+  struct timeval timeout = {.tv_sec = RENDER_SERVER_TIMEOUT_SEC};
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0 ||
+      setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout) < 0) {
+    log_warn("unable to set render server client timeouts: %s",
+             strerror(errno));
+  }
+}
+
+// send a reply line, ignoring clients that are gone
+static void reply(i32 fd, const char *fmt, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, fmt);
+  // leave room for the newline
+  vsnprintf(line, sizeof line - 1, fmt, args);
+  va_end(args);
+  i32 len = (i32)strlen(line);
+  line[len++] = '\n';
+  for (i32 sent = 0; sent < len;) {
+    ssize_t n = send(fd, line + sent, len - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      log_warn("unable to reply to render server client: %s",
+               strerror(errno));
+      return;
+    }
+    sent += (i32)n;
+  }
+}
+
+static void free_job(render_job_t *job) {
+  free((char *)job->output_path);
+  for (i32 i = 0; i < job->num_inputs; ++i) {
+    free(job->inputs[i]);
+  }
+  stbds_arrfree(job->inputs);
+  *job = (render_job_t){0};
+}
+
+typedef enum {
+  REQUEST_JOB,
+  REQUEST_QUIT,
+  REQUEST_INVALID,
+} request_t;
+
+// read the request of a connection. For invalid requests, *error is set to a
+// description of the problem
+static request_t read_request(FILE *f, render_job_t *job,
+                              const char *error[static 1]) {
+  *job = (render_job_t){0};
+  request_t request = REQUEST_JOB;
+  bool has_frames = false;
+  char *line = NULL;
+  size_t capacity = 0;
+  ssize_t len;
+  while ((len = getline(&line, &capacity, f)) > 0) {
+    if (line[len - 1] == '\n') {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      break;
+    }
+    if (strcmp(line, "quit") == 0) {
+      request = REQUEST_QUIT;
+      break;
+    }
+
+    // the value is the rest of the line, so paths may contain spaces
+    char *value = strchr(line, ' ');
+    if (!value) {
+      *error = "expected lines of the form \"<key> <value>\"";
+      request = REQUEST_INVALID;
+      break;
+    }
+    *value++ = '\0';
+    char *end;
+    if (strcmp(line, "output") == 0) {
+      free((char *)job->output_path);
+      job->output_path = sve2_strdup(value);
+    } else if (strcmp(line, "frames") == 0) {
+      job->num_frames = (i32)strtol(value, &end, 10);
+      has_frames = *end == '\0' && job->num_frames > 0;
+    } else if (strcmp(line, "start") == 0) {
+      job->start_time = strtoll(value, &end, 10);
+      if (*end != '\0' || job->start_time < 0) {
+        *error = "invalid start time";
+        request = REQUEST_INVALID;
+        break;
+      }
+    } else if (strcmp(line, "input") == 0) {
+      stbds_arrput(job->inputs, sve2_strdup(value));
+      job->num_inputs = (i32)stbds_arrlen(job->inputs);
+    } else {
+      *error = "unknown key";
+      request = REQUEST_INVALID;
+      break;
+    }
+  }
+  free(line);
+
+  if (request == REQUEST_JOB) {
+    if (len < 0 && ferror(f)) {
+      *error = "unable to read the request (timed out?)";
+      request = REQUEST_INVALID;
+    } else if (!job->output_path) {
+      *error = "no output path";
+      request = REQUEST_INVALID;
+    } else if (!has_frames) {
+      *error = "invalid or missing frame count";
+      request = REQUEST_INVALID;
+    } else if (job->num_inputs == 0) {
+      *error = "no input";
+      request = REQUEST_INVALID;
+    }
+  }
+  if (request != REQUEST_JOB) {
+    free_job(job);
+  }
+  return request;
+}
+
+// check that every input of a job is a media file, so a bad path is rejected
+// before any output is created
+static bool probe_inputs(const render_job_t *job) {
+  for (i32 i = 0; i < job->num_inputs; ++i) {
+    AVFormatContext *fmt_ctx = NULL;
+    int err = avformat_open_input(&fmt_ctx, job->inputs[i], NULL, NULL);
+    if (err >= 0) {
+      err = avformat_find_stream_info(fmt_ctx, NULL);
+      avformat_close_input(&fmt_ctx);
+    }
+    if (err < 0) {
+      log_warn("unable to open render job input '%s': %s", job->inputs[i],
+               av_err2str(err));
+      return false;
+    }
+  }
+  return true;
+}
+
+void render_server_run(const render_server_info_t *info) {
+  // the context is only initialized with the first job, but the server logs
+  // before that
+  init_logging();
+  init_threads_timer();
+  i32 server_fd = open_socket(info->socket_path);
+  log_info("render server listening on %s", info->socket_path);
+
+  context_t *c = NULL;
+  // the job being rendered, kept until the next one since the context
+  // references its output path
+  render_job_t job = {0};
+  i32 num_jobs = 0;
+  while (true) {
+    i32 fd = accept(server_fd, NULL, NULL);
+    if (fd < 0) {
+      nassert(errno == EINTR || errno == ECONNABORTED);
+      continue;
+    }
+    set_timeouts(fd);
+    FILE *f;
+    nassert(f = fdopen(fd, "r"));
+
+    render_job_t next_job;
+    const char *error = NULL;
+    request_t request = read_request(f, &next_job, &error);
+    if (request == REQUEST_QUIT) {
+      reply(fd, "done");
+      fclose(f);
+      break;
+    }
+    if (request == REQUEST_JOB && !probe_inputs(&next_job)) {
+      error = "unable to open an input";
+      request = REQUEST_INVALID;
+      free_job(&next_job);
+    }
+    if (request == REQUEST_INVALID) {
+      log_warn("invalid render job: %s", error);
+      reply(fd, "error %s", error);
+      fclose(f);
+      continue;
+    }
+
+    log_info("render job %" PRIi32 ": %" PRIi32 " frames to %s", num_jobs,
+             next_job.num_frames, next_job.output_path);
+    i64 start = threads_timer_now();
+    if (!c) {
+      context_init_t job_info = *info->info;
+      job_info.mode = CONTEXT_MODE_RENDER;
+      job_info.output_path = next_job.output_path;
+      job_info.num_frames = next_job.num_frames;
+      job_info.num_renditions = 0;
+      c = context_init(&job_info);
+    } else {
+      context_restart_render(c, next_job.output_path, next_job.num_frames);
+    }
+    free_job(&job);
+    job = next_job;
+
+    context_set_audio_timer(c, job.start_time);
+    bool rendered = info->render(c, &job, info->userdata);
+    context_finish_render(c);
+    if (rendered) {
+      log_info("render job %" PRIi32 " done in %.3f s", num_jobs,
+               (f64)(threads_timer_now() - start) / SVE2_NS_PER_SEC);
+      reply(fd, "done");
+    } else {
+      // the output was opened for nothing
+      log_warn("render job %" PRIi32 " failed", num_jobs);
+      remove(job.output_path);
+      reply(fd, "error unable to render the inputs");
+    }
+    fclose(f);
+    ++num_jobs;
+  }
+
+  log_info("render server stopped after %" PRIi32 " jobs", num_jobs);
+  close(server_fd);
+  unlink(info->socket_path);
+  if (c) {
+    if (info->cleanup) {
+      info->cleanup(c, info->userdata);
+    }
+    context_free(c);
+  }
+  free_job(&job);
+  done_logging();
+}
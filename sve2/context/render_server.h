@@ -0,0 +1,94 @@
+#pragma once
+
+#include "sve2/context/context.h"
+#include "sve2/utils/types.h"
+
+/**
+ * @brief A render job, as sent by a client of the render server
+ */
+typedef struct {
+  /**
+   * @brief Path of the output, and the number of frames to render
+   */
+  const char *output_path;
+  i32 num_frames;
+  /**
+   * @brief Timestamp of the first frame in the inputs, in nanoseconds
+   */
+  i64 start_time;
+  /**
+   * @brief Input media files, in the order they were sent
+   */
+  i32 num_inputs;
+  char **inputs;
+} render_job_t;
+
+/**
+ * @brief Render callback, called for every job with a render-mode context
+ * whose output is the one of the job. The audio timer of the context is
+ * already set to job->start_time, so the callback only has to seek its
+ * sources there, then render frames until context_get_should_close() returns
+ * true (after job->num_frames frames).
+ *
+ * The context is the same for every job, so anything created with it (shaders,
+ * decoders etc.) can be kept by the callback for the next jobs.
+ *
+ * Inputs are sent by clients, so the callback must not panic on inputs it
+ * cannot use (e.g. a file without the expected stream). It returns false
+ * instead, and the server replies with an error.
+ */
+typedef bool (*render_server_callback_t)(context_t *c, const render_job_t *job,
+                                         void *userdata);
+/**
+ * @brief Called once the server stops, before the context is freed (only if a
+ * job was rendered), to free what the render callback kept
+ */
+typedef void (*render_server_cleanup_t)(context_t *c, void *userdata);
+
+typedef struct {
+  /**
+   * @brief Context parameters of every job. mode, output_path and num_frames
+   * are overridden by every job. Renditions are ignored, since jobs only
+   * name one output.
+   */
+  const context_init_t *info;
+  /**
+   * @brief Path of the UNIX socket the server listens on. An existing socket
+   * file at this path is replaced.
+   */
+  const char *socket_path;
+  /**
+   * @brief Render and cleanup callbacks (cleanup may be NULL), and their user
+   * pointer
+   */
+  render_server_callback_t render;
+  render_server_cleanup_t cleanup;
+  void *userdata;
+} render_server_info_t;
+
+/**
+ * @brief Run a render server, which renders jobs sent over a UNIX socket with
+ * a single long-lived context, so the start-up cost of a process (context
+ * creation, shader compilation, opening media etc.) is paid once for many
+ * jobs. The context is created with the first job, and restarted with
+ * context_restart_render() for the next ones.
+ *
+ * A client sends one job per connection, as lines of the form "<key> <value>":
+ * - "output <path>": path of the output (required)
+ * - "frames <count>": number of frames to render (required)
+ * - "start <nanoseconds>": timestamp of the first frame (0 by default)
+ * - "input <path>": an input media file, repeated for every input (at least
+ *   one is required)
+ * The job ends with an empty line (or when the client shuts down its side of
+ * the connection). The server replies with "done" once the output is written,
+ * or "error <message>" if the job is invalid, i.e. malformed, with an input
+ * which is not a media file, or rejected by the render callback. Jobs are
+ * rendered one at a time, in the order of the connections. A connection sending
+ * the line "quit" instead stops the server (which replies "done" too).
+ *
+ * Other errors during a render (e.g. of the encoder) are fatal, as in any other
+ * render: the client then sees the connection closed without a reply.
+ *
+ * @param info Render server parameters
+ */
+void render_server_run(const render_server_info_t *info);
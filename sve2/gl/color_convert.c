@@ -0,0 +1,183 @@
+#include "color_convert.h"
+
+#include <libavutil/pixdesc.h>
+
+#include "sve2/log/logging.h"
+#include "sve2/media/yuv_matrix.h"
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+
+// must match TILE_SIZE in color_convert.comp.glsl
+#define TILE_SIZE 16
+
+// how the chroma samples are stored (chroma_layout in the shader)
+enum {
+  CHROMA_PLANAR,
+  CHROMA_INTERLEAVED,
+  CHROMA_INTERLEAVED_SPLIT,
+};
+
+typedef struct {
+  enum AVPixelFormat pix_fmt;
+  // internal formats of the luma and chroma textures
+  GLenum luma_format, chroma_format;
+  i32 chroma_layout, bit_depth;
+  f32 quantization[2];
+} format_info_t;
+
+static const format_info_t formats[] = {
+    {AV_PIX_FMT_NV12, GL_R8, GL_RG8, CHROMA_INTERLEAVED, 8, {0.0f, 0.0f}},
+    {AV_PIX_FMT_P010, GL_R16, GL_RG16, CHROMA_INTERLEAVED, 10,
+     {1023.0f, 64.0f / 65535.0f}},
+    {AV_PIX_FMT_YUV420P, GL_R8, GL_R8, CHROMA_PLANAR, 8, {0.0f, 0.0f}},
+    {AV_PIX_FMT_YUV422P, GL_R8, GL_R8, CHROMA_PLANAR, 8, {0.0f, 0.0f}},
+    {AV_PIX_FMT_YUV444P, GL_R8, GL_R8, CHROMA_PLANAR, 8, {0.0f, 0.0f}},
+    {AV_PIX_FMT_YUV420P10, GL_R16, GL_R16, CHROMA_PLANAR, 10,
+     {1023.0f, 1.0f / 65535.0f}},
+};
+
+static const format_info_t *find_format(enum AVPixelFormat pix_fmt) {
+  for (i32 i = 0; i < sve2_arrlen(formats); ++i) {
+    if (formats[i].pix_fmt == pix_fmt) {
+      return &formats[i];
+    }
+  }
+  return NULL;
+}
+
+bool color_convert_supports(enum AVPixelFormat pix_fmt) {
+  return find_format(pix_fmt) != NULL;
+}
+
+// make a plane covering a whole texture of the given internal format
+static color_convert_plane_t make_plane(GLuint texture, GLenum internal_format,
+                                        i32 width, i32 height) {
+  color_convert_plane_t p = {
+      .texture = texture,
+      .width = width,
+      .height = height,
+      .internal_format = internal_format,
+  };
+  switch (internal_format) {
+  case GL_R8:
+    p.format = GL_RED, p.type = GL_UNSIGNED_BYTE, p.texel_size = 1;
+    break;
+  case GL_RG8:
+    p.format = GL_RG, p.type = GL_UNSIGNED_BYTE, p.texel_size = 2;
+    break;
+  case GL_R16:
+    p.format = GL_RED, p.type = GL_UNSIGNED_SHORT, p.texel_size = 2;
+    break;
+  case GL_RG16:
+    p.format = GL_RG, p.type = GL_UNSIGNED_SHORT, p.texel_size = 4;
+    break;
+  default:
+    assert(false && "unreachable");
+  }
+  return p;
+}
+
+void color_convert_init(context_t *c, color_convert_t *cc,
+                        const color_convert_init_t *info) {
+  const format_info_t *format = find_format(info->pix_fmt);
+  if (!format) {
+    log_error("pixel format %s is not supported by the color converter",
+              av_get_pix_fmt_name(info->pix_fmt));
+    panic();
+  }
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(info->pix_fmt);
+
+  *cc = (color_convert_t){
+      .info = *info,
+      .chroma_shift = {desc->log2_chroma_w, desc->log2_chroma_h},
+      .chroma_layout = format->chroma_layout,
+      .quantization = {format->quantization[0], format->quantization[1]},
+  };
+  yuv_matrix_from_rgb(cc->rgb_to_yuv, info->color_space, info->color_range,
+                      format->bit_depth);
+  nassert(cc->shader = shader_new_c(c, "color_convert.comp.glsl"));
+  // the edges are clamped, so scaled edge pixels are not blended with the
+  // other side of the frame
+  glCreateSamplers(1, &cc->sampler);
+  glSamplerParameteri(cc->sampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+  glSamplerParameteri(cc->sampler, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  glSamplerParameteri(cc->sampler, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+  glSamplerParameteri(cc->sampler, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+  i32 width = info->width, height = info->height;
+  i32 chroma_width = -((-width) >> cc->chroma_shift[0]);
+  i32 chroma_height = -((-height) >> cc->chroma_shift[1]);
+  if (info->surface) {
+    // interleaved chroma is written as pairs of R8 texels
+    nassert(info->pix_fmt == AV_PIX_FMT_NV12);
+    cc->chroma_layout = CHROMA_INTERLEAVED_SPLIT;
+    cc->planes[0] = make_plane(info->surface, GL_R8, width, height);
+    cc->planes[1] =
+        make_plane(info->surface, GL_R8, chroma_width * 2, chroma_height);
+    cc->planes[1].y = info->surface_chroma_y;
+    cc->num_planes = 2;
+    return;
+  }
+
+  cc->num_planes = cc->num_textures =
+      format->chroma_layout == CHROMA_PLANAR ? 3 : 2;
+  glCreateTextures(GL_TEXTURE_2D, cc->num_textures, cc->textures);
+  for (i32 i = 0; i < cc->num_textures; ++i) {
+    GLenum internal_format =
+        i == 0 ? format->luma_format : format->chroma_format;
+    i32 plane_width = i == 0 ? width : chroma_width;
+    i32 plane_height = i == 0 ? height : chroma_height;
+    glTextureStorage2D(cc->textures[i], 1, internal_format, plane_width,
+                       plane_height);
+    cc->planes[i] = make_plane(cc->textures[i], internal_format, plane_width,
+                               plane_height);
+  }
+}
+
+void color_convert_free(color_convert_t *cc) {
+  glDeleteTextures(cc->num_textures, cc->textures);
+  glDeleteSamplers(1, &cc->sampler);
+  shader_free(cc->shader);
+}
+
+void color_convert_set_surface(color_convert_t *cc, GLuint surface) {
+  assert(cc->info.surface && surface);
+  cc->info.surface = surface;
+  for (i32 i = 0; i < cc->num_planes; ++i) {
+    cc->planes[i].texture = surface;
+  }
+}
+
+void color_convert_run(color_convert_t *cc, GLuint rgb_texture,
+                       bool flip_vertical) {
+  nassert(shader_use(cc->shader) >= 0);
+  // uniforms are set every time, since the shader might have been reloaded
+  glUniform1i(0, flip_vertical);
+  glUniform2iv(1, 1, cc->chroma_shift);
+  glUniform1i(2, cc->chroma_layout);
+  glUniformMatrix4fv(3, 1, GL_TRUE, cc->rgb_to_yuv);
+  GLint offsets[6] = {0};
+  for (i32 i = 0; i < cc->num_planes; ++i) {
+    offsets[i * 2] = cc->planes[i].x;
+    offsets[i * 2 + 1] = cc->planes[i].y;
+  }
+  glUniform2iv(4, 3, offsets);
+  glUniform2fv(7, 1, cc->quantization);
+  glUniform2i(8, cc->info.width, cc->info.height);
+
+  glBindTextureUnit(0, rgb_texture);
+  glBindSampler(0, cc->sampler);
+  // with interleaved chroma, the V image is unused, but still bound to a valid
+  // image
+  for (i32 i = 0; i < 3; ++i) {
+    const color_convert_plane_t *p =
+        &cc->planes[sve2_min_i32(i, cc->num_planes - 1)];
+    glBindImageTexture(i + 1, p->texture, 0, GL_FALSE, 0, GL_WRITE_ONLY,
+                       p->internal_format);
+  }
+  glDispatchCompute((cc->info.width + TILE_SIZE - 1) / TILE_SIZE,
+                    (cc->info.height + TILE_SIZE - 1) / TILE_SIZE, 1);
+  glBindSampler(0, 0);
+  glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT |
+                  GL_TEXTURE_UPDATE_BARRIER_BIT);
+}
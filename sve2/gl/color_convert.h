@@ -0,0 +1,121 @@
+#pragma once
+
+#include <glad/gl.h>
+#include <libavutil/pixfmt.h>
+
+#include "sve2/gl/shader.h"
+#include "sve2/utils/types.h"
+
+/**
+ * @brief A plane of a converted frame, i.e. a region of a texture
+ */
+typedef struct {
+  GLuint texture;
+  GLenum internal_format;
+  /**
+   * @brief Region of the plane, in texels
+   */
+  i32 x, y, width, height;
+  /**
+   * @brief Format and type to read the plane back with (e.g. via
+   * glGetTextureSubImage()), and the size of a texel in that format
+   */
+  GLenum format, type;
+  i32 texel_size;
+} color_convert_plane_t;
+
+typedef struct {
+  /**
+   * @brief Output pixel format, see color_convert_supports()
+   */
+  enum AVPixelFormat pix_fmt;
+  /**
+   * @brief Size of the converted frame. Frames of another size are scaled to
+   * it.
+   */
+  i32 width, height;
+  /**
+   * @brief YUV matrix (BT.601, BT.709 or BT.2020 non-constant luminance).
+   * AVCOL_SPC_UNSPECIFIED means BT.601.
+   */
+  enum AVColorSpace color_space;
+  /**
+   * @brief AVCOL_RANGE_UNSPECIFIED means limited (MPEG) range
+   */
+  enum AVColorRange color_range;
+  /**
+   * @brief If not 0, an R8 texture laid out like an NV12 surface, which the
+   * frame is converted into instead of textures owned by the converter: luma
+   * at the top left, interleaved chroma from row surface_chroma_y. pix_fmt must
+   * then be AV_PIX_FMT_NV12.
+   */
+  GLuint surface;
+  i32 surface_chroma_y;
+} color_convert_init_t;
+
+/**
+ * @brief RGB to YUV converter, running on the GPU.
+ *
+ * The conversion is a compute shader working on 16x16 tiles, one pixel per
+ * invocation. The chroma of a tile is downsampled through shared memory, so
+ * every RGB texel is fetched once, and every output sample is written once
+ * (interleaved chroma with a single store where the plane format allows).
+ * Frames are scaled in the same pass, so converting a frame for outputs of
+ * several sizes reads it once per output, without intermediate textures.
+ */
+typedef struct {
+  shader_t *shader;
+  color_convert_init_t info;
+  /**
+   * @brief Planes of the converted frame (Y, then U and V or interleaved UV)
+   */
+  color_convert_plane_t planes[3];
+  i32 num_planes;
+  /**
+   * @brief Shader parameters (see color_convert.comp.glsl)
+   */
+  i32 chroma_shift[2], chroma_layout;
+  f32 rgb_to_yuv[16], quantization[2];
+  /**
+   * @brief Textures of the planes owned by the converter (none if it converts
+   * into a surface)
+   */
+  GLuint textures[3];
+  i32 num_textures;
+  /**
+   * @brief Bilinear sampler of the RGB frame, for scaling
+   */
+  GLuint sampler;
+} color_convert_t;
+
+/**
+ * @brief Check whether a pixel format is supported by the converter.
+ *
+ * Supported formats are NV12, P010, YUV420P, YUV422P, YUV444P and YUV420P10.
+ */
+bool color_convert_supports(enum AVPixelFormat pix_fmt);
+
+void color_convert_init(context_t *c, color_convert_t *cc,
+                        const color_convert_init_t *info);
+void color_convert_free(color_convert_t *cc);
+/**
+ * @brief Change the surface the frames are converted into, e.g. to cycle
+ * through several surfaces. The converter must have been created with a
+ * surface, and the new one must have the same size and layout.
+ */
+void color_convert_set_surface(color_convert_t *cc, GLuint surface);
+
+/**
+ * @brief Convert a frame. The planes are ready to be read (or exported) once
+ * this returns, the necessary memory barriers are issued.
+ *
+ * @param cc The converter
+ * @param rgb_texture Texture of the RGB frame, in any color format. If it is
+ * not of the size of the converter, it is scaled with a box filter
+ * (approximated with up to 4x4 bilinear taps per pixel, so downscaling by more
+ * than 4 aliases). Otherwise, it is read with texelFetch().
+ * @param flip_vertical Whether to flip the frame upside down, e.g. for frames
+ * rendered by OpenGL (whose origin is at the bottom left)
+ */
+void color_convert_run(color_convert_t *cc, GLuint rgb_texture,
+                       bool flip_vertical);
@@ -0,0 +1,91 @@
+#include "frame_diff.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+
+#include "sve2/utils/runtime.h"
+
+// must match TILE_SIZE in frame_diff.comp.glsl
+#define TILE_SIZE 16
+
+static i32 get_num_tiles(i32 size) {
+  return (size + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+void frame_diff_init(context_t *c, frame_diff_t *d, i32 width, i32 height,
+                     i32 depth) {
+  *d = (frame_diff_t){.width = width, .height = height, .depth = depth};
+  nassert(d->shader = shader_new_c(c, "frame_diff.comp.glsl"));
+  // the change flag, then a hash per tile
+  i64 size = (1 + (i64)get_num_tiles(width) * get_num_tiles(height)) *
+             sve2_sizeof(GLuint);
+  glCreateBuffers(1, &d->buffer);
+  // only cleared and read with buffer commands, so it needs no flags
+  glNamedBufferStorage(d->buffer, size, NULL, 0);
+
+  // written by the GPU only, and read by the CPU once the fence of the copy
+  // has signalled, so the mapping stays for the whole lifetime
+  GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT |
+                     GL_MAP_COHERENT_BIT;
+  glCreateBuffers(1, &d->results_buffer);
+  glNamedBufferStorage(d->results_buffer, depth * sve2_sizeof(GLuint), NULL,
+                       flags);
+  nassert(d->results = glMapNamedBufferRange(
+              d->results_buffer, 0, depth * sve2_sizeof(GLuint), flags));
+  d->fences = sve2_calloc(depth, sizeof *d->fences);
+}
+
+void frame_diff_free(frame_diff_t *d) {
+  for (i32 i = 0; i < d->num_pending; ++i) {
+    glDeleteSync(d->fences[(d->head + i) % d->depth]);
+  }
+  free(d->fences);
+  glUnmapNamedBuffer(d->results_buffer);
+  glDeleteBuffers(1, &d->results_buffer);
+  glDeleteBuffers(1, &d->buffer);
+  shader_free(d->shader);
+}
+
+void frame_diff_start(frame_diff_t *d, GLuint texture) {
+  assert(d->num_pending < d->depth);
+  i32 slot = (d->head + d->num_pending) % d->depth;
+  ++d->num_pending;
+
+  // the first frame has nothing to be compared with, so it starts changed
+  const GLuint changed = !d->has_previous;
+  d->has_previous = true;
+  glClearNamedBufferSubData(d->buffer, GL_R32UI, 0, sizeof changed,
+                            GL_RED_INTEGER, GL_UNSIGNED_INT, &changed);
+  nassert(shader_use(d->shader) >= 0);
+  glBindTextureUnit(0, texture);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, d->buffer);
+  glDispatchCompute(get_num_tiles(d->width), get_num_tiles(d->height), 1);
+  glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  glCopyNamedBufferSubData(d->buffer, d->results_buffer, 0,
+                           slot * sve2_sizeof(GLuint), sizeof changed);
+  d->fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  // make sure the fence reaches the GPU, otherwise it never signals when
+  // polled by frame_diff_ready()
+  glFlush();
+}
+
+bool frame_diff_ready(frame_diff_t *d) {
+  assert(d->num_pending > 0);
+  GLint status;
+  glGetSynciv(d->fences[d->head], GL_SYNC_STATUS, 1, NULL, &status);
+  return status == GL_SIGNALED;
+}
+
+bool frame_diff_finish(frame_diff_t *d) {
+  assert(d->num_pending > 0);
+  GLsync *fence = &d->fences[d->head];
+  nassert(glClientWaitSync(*fence, GL_SYNC_FLUSH_COMMANDS_BIT,
+                           GL_TIMEOUT_IGNORED) != GL_WAIT_FAILED);
+  glDeleteSync(*fence);
+  *fence = NULL;
+  bool changed = d->results[d->head];
+  d->head = (d->head + 1) % d->depth;
+  --d->num_pending;
+  return changed;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <glad/gl.h>
+
+#include "sve2/gl/shader.h"
+#include "sve2/utils/types.h"
+
+/**
+ * @brief Change detection between consecutive frames, running on the GPU.
+ *
+ * Frames are hashed by 16x16 tiles with a compute shader, and the hashes are
+ * compared with those of the previous frame on the GPU too, so only a single
+ * flag is read back. It is read back asynchronously, like the frames
+ * themselves: whether a frame changed is only known a few frames later, once
+ * the GPU is done with it.
+ */
+typedef struct {
+  shader_t *shader;
+  /**
+   * @brief Storage buffer of the shader: the change flag, then the hashes of
+   * the tiles of the previous frame
+   */
+  GLuint buffer;
+  /**
+   * @brief Copies of the change flag, one per slot, persistently mapped to
+   * results
+   */
+  GLuint results_buffer;
+  const GLuint *results;
+  /**
+   * @brief Ring of fences of the copies. A frame is compared into the slot
+   * after the pending ones, and its result is read once the fence has
+   * signalled. head is the oldest pending slot.
+   */
+  GLsync *fences;
+  i32 depth, head, num_pending;
+  i32 width, height;
+  /**
+   * @brief Whether a frame was hashed already, i.e. there is something to
+   * compare with
+   */
+  bool has_previous;
+} frame_diff_t;
+
+/**
+ * @brief Initialize a change detector.
+ *
+ * @param c The context
+ * @param d The change detector
+ * @param width Width of the frames
+ * @param height Height of the frames
+ * @param depth Maximum number of frames being compared at once
+ */
+void frame_diff_init(context_t *c, frame_diff_t *d, i32 width, i32 height,
+                     i32 depth);
+void frame_diff_free(frame_diff_t *d);
+
+/**
+ * @brief Start comparing a frame with the previous one passed to this
+ * function. Less than depth comparisons must be pending.
+ *
+ * @param d The change detector
+ * @param texture Texture of the frame, of the size of the detector
+ */
+void frame_diff_start(frame_diff_t *d, GLuint texture);
+
+/**
+ * @brief Whether the oldest pending comparison is done, i.e.
+ * frame_diff_finish() does not block.
+ */
+bool frame_diff_ready(frame_diff_t *d);
+
+/**
+ * @brief Wait for the oldest pending comparison.
+ *
+ * @param d The change detector
+ * @return Whether the frame differs from the previous one (true for the first
+ * frame). Identical frames are always detected, while a change might be
+ * missed if the hash of a tile collides (with a 2^-32 chance).
+ */
+bool frame_diff_finish(frame_diff_t *d);
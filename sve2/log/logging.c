@@ -83,7 +83,14 @@ static int get_log_level() {
   return env ? atoi(env) : 0;
 }
 
+// number of init_logging() calls without a matching done_logging(), so that
+// e.g. the render server can log before (and after) its context exists
+static int num_logging_users = 0;
+
 void init_logging() {
+  if (num_logging_users++ > 0) {
+    return;
+  }
   sve2_mtx_init(&log_mtx, mtx_plain);
   log_set_lock(lock_fn, NULL);
   log_set_level(get_log_level());
@@ -92,4 +99,9 @@ void init_logging() {
   av_log_set_level(AV_LOG_DEBUG);
 }
 
-void done_logging() { log_buffer_free(&ffmpeg_buffer); }
+void done_logging() {
+  assert(num_logging_users > 0);
+  if (--num_logging_users == 0) {
+    log_buffer_free(&ffmpeg_buffer);
+  }
+}
@@ -15,6 +15,8 @@
 void raw_log(const char *fmt, ...) RAW_LOG_ATTRIBUTE;
 noreturn void raw_log_panic(const char *fmt, ...) RAW_LOG_ATTRIBUTE;
 
-// init the common logging interface provided by log.c
+// init the common logging interface provided by log.c. Calls can be nested
+// (from the main thread only), the interface is kept until the matching number
+// of done_logging() calls
 void init_logging(); // panic on failure
 void done_logging();
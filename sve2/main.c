@@ -1,90 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include <libavutil/pixdesc.h>
 
+#include "sve2/context/batch_render.h"
 #include "sve2/context/context.h"
+#include "sve2/context/render_server.h"
 #include "sve2/gl/shader.h"
 #include "sve2/log/logging.h"
 #include "sve2/media/audio.h"
+#include "sve2/media/audio_mixer.h"
 #include "sve2/media/video.h"
 #include "sve2/media/video_frame.h"
+#include "sve2/utils/asprintf.h"
 #include "sve2/utils/runtime.h"
 #include "sve2/utils/threads.h"
 
-int main(int argc, char *argv[]) {
-  if (argc != 2) {
-    raw_log_panic("usage: %s <media file>\n", argv[0]);
+// the sources of a render: the video of a media file, and the audio of the
+// file with every extra audio file mixed in. Streams the context does not
+// output (e.g. the video in the audio pass of a batch render) are not opened.
+typedef struct {
+  i32 num_paths;
+  char **paths;
+  bool has_video, has_audio;
+  video_t video;
+  audio_t *audios;
+  audio_mixer_t mixer;
+} media_t;
+
+static void media_free_paths(media_t *m) {
+  for (i32 i = 0; i < m->num_paths; ++i) {
+    free(m->paths[i]);
   }
+  free(m->paths);
+}
 
-  AVChannelLayout ch_layout = AV_CHANNEL_LAYOUT_STEREO;
+// returns false if a file could not be opened, e.g. a missing file or stream
+static bool media_open(context_t *c, media_t *m, i32 num_paths,
+                       char *paths[num_paths]) {
+  m->num_paths = num_paths;
+  m->paths = sve2_calloc(num_paths, sizeof *m->paths);
+  for (i32 i = 0; i < num_paths; ++i) {
+    m->paths[i] = sve2_strdup(paths[i]);
+  }
 
-  context_t *c;
-  char *output_path = getenv("OUTPUT_PATH");
-  nassert(c = context_init(&(context_init_t){
-              .mode = output_path ? CONTEXT_MODE_RENDER : CONTEXT_MODE_PREVIEW,
-              .width = 1920,
-              .height = 1080,
-              .fps = 60,
-              .output_path = output_path,
-              .sample_rate = 48000,
-              .sample_fmt = AV_SAMPLE_FMT_S16,
-              .num_buffered_audio_frames = 4,
-              .ch_layout = &ch_layout}));
-
-  shader_t *yuv_shader = shader_new_vf(c, "quad.vert.glsl", "y_uv.frag.glsl");
-  shader_t *rgb_shader =
-      shader_new_vf(c, "quad.vert.glsl", "rgba_array.frag.glsl");
+  m->has_video = c->info.mode == CONTEXT_MODE_PREVIEW || !c->info.skip_video;
+  m->has_audio = c->info.mode == CONTEXT_MODE_PREVIEW || !c->info.skip_audio;
+  if (m->has_video && !video_open(c, &m->video, paths[0], SVE2_SI(VIDEO, 0),
+                                  VIDEO_FORMAT_FFMPEG_STREAM)) {
+    media_free_paths(m);
+    return false;
+  }
+  if (!m->has_audio) {
+    return true;
+  }
 
-  video_t video;
-  audio_t audio;
-  nassert(video_open(c, &video, argv[1], SVE2_SI(VIDEO, 0),
-                     VIDEO_FORMAT_FFMPEG_STREAM));
-  nassert(audio_open(c, &audio, argv[1], SVE2_SI(AUDIO, 0),
-                     AUDIO_FORMAT_FFMPEG_STREAM));
-
-  i64 seek_time = 115 * SVE2_NS_PER_SEC;
-  video_seek(&video, seek_time);
-  audio_seek(&audio, seek_time);
+  // the audio of the media file, plus every extra audio file, mixed together
+  m->audios = sve2_calloc(num_paths, sizeof *m->audios);
+  for (i32 i = 0; i < num_paths; ++i) {
+    if (!audio_open(c, &m->audios[i], paths[i], SVE2_SI(AUDIO, 0),
+                    AUDIO_FORMAT_FFMPEG_STREAM)) {
+      while (i-- > 0) {
+        audio_close(&m->audios[i]);
+      }
+      free(m->audios);
+      if (m->has_video) {
+        video_close(&m->video);
+      }
+      media_free_paths(m);
+      return false;
+    }
+  }
+  audio_mixer_init(c, &m->mixer);
+  for (i32 i = 0; i < num_paths; ++i) {
+    i32 track = audio_mixer_add_track(&m->mixer, &m->audios[i]);
+    // cut rumble below the audible range
+    audio_mixer_add_fx(&m->mixer, track,
+                       &(audio_fx_params_t){.type = AUDIO_FX_EQ,
+                                            .eq = {.type = AUDIO_EQ_HIGH_PASS,
+                                                   .frequency = 30.0f,
+                                                   .q = 0.707f}});
+    if (i > 0) {
+      // spread extra tracks across the stereo field
+      audio_mixer_set_gain(&m->mixer, track, 0.5f, 0);
+      audio_mixer_set_pan(&m->mixer, track, i % 2 ? -0.5f : 0.5f, 0);
+    }
+  }
+  audio_mixer_add_fx(&m->mixer, AUDIO_MIXER_MASTER,
+                     &(audio_fx_params_t){.type = AUDIO_FX_LIMITER,
+                                          .limiter = {.ceiling_db = -1.0f,
+                                                      .release_ms = 50.0f}});
+  // mix half a second ahead
+  audio_mixer_start(&m->mixer, c->info.sample_rate / 2);
+  return true;
+}
+
+static void media_close(media_t *m) {
+  if (m->has_video) {
+    video_close(&m->video);
+  }
+  if (m->has_audio) {
+    audio_mixer_free(&m->mixer);
+    for (i32 i = 0; i < m->num_paths; ++i) {
+      audio_close(&m->audios[i]);
+    }
+    free(m->audios);
+  }
+  media_free_paths(m);
+}
+
+static bool media_has_paths(const media_t *m, i32 num_paths,
+                            char *paths[num_paths]) {
+  if (m->num_paths != num_paths) {
+    return false;
+  }
+  for (i32 i = 0; i < num_paths; ++i) {
+    if (strcmp(m->paths[i], paths[i]) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// what is needed to render: the shaders, and the media of the last render,
+// which the render server keeps open since consecutive jobs often cut clips
+// from the same files
+typedef struct {
+  shader_t *yuv_shader, *rgb_shader;
+  bool has_media;
+  media_t media;
+} renderer_t;
+
+static void renderer_init(context_t *c, renderer_t *r) {
+  *r = (renderer_t){0};
+  r->yuv_shader = shader_new_vf(c, "quad.vert.glsl", "y_uv.frag.glsl");
+  r->rgb_shader = shader_new_vf(c, "quad.vert.glsl", "rgba_array.frag.glsl");
+}
+
+static void renderer_free(renderer_t *r) {
+  if (r->has_media) {
+    media_close(&r->media);
+  }
+  shader_free(r->yuv_shader);
+  shader_free(r->rgb_shader);
+}
+
+// draw the video frame at the target time
+static void draw_video(context_t *c, renderer_t *r) {
+  glClearColor(0, 0, 0, 0);
+  glClear(GL_COLOR_BUFFER_BIT);
+  context_enable_blending(c);
+  i64 time = context_get_target_time(c);
+  if (c->info.mode == CONTEXT_MODE_PREVIEW) {
+    // the video covers the whole window
+    i32 width, height;
+    context_get_framebuffer_info(c, &width, &height, NULL, NULL);
+    f32 quality = context_get_preview_quality(c);
+    video_set_preview_size(&r->media.video, (i32)((f32)width * quality),
+                           (i32)((f32)height * quality));
+  }
+  video_frame_t tex;
+  if (video_get_texture(&r->media.video, time, &tex)) {
+    shader_t *shader = NULL;
+    if (av_pix_fmt_desc_get(tex.sw_format)->flags & AV_PIX_FMT_FLAG_RGB) {
+      shader = r->rgb_shader;
+    } else if (tex.sw_format == AV_PIX_FMT_NV12 ||
+               tex.sw_format == AV_PIX_FMT_YUV420P) {
+      shader = r->yuv_shader;
+    } else {
+      log_error("unsupported pixel format: %s",
+                av_get_pix_fmt_name(tex.sw_format));
+    }
+    if (shader && shader_use(shader) >= 0) {
+      for (i32 i = 0; i < sve2_arrlen(tex.textures); ++i) {
+        if (!tex.textures[i]) {
+          continue;
+        }
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(tex.texture_array_index < 0 ? GL_TEXTURE_2D
+                                                  : GL_TEXTURE_2D_ARRAY,
+                      tex.textures[i]);
+        log_trace("binding texture %u to bind slot %" PRIi32, tex.textures[i],
+                  i);
+      }
+      glUniform1f(glGetUniformLocation(shader->program, "frame"),
+                  tex.texture_array_index);
+      glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+    }
+  }
+}
+
+// render the media file (with every extra audio file mixed in) from seek_time
+// until the context should close. Returns false (without rendering anything)
+// if the media could not be opened.
+static bool render(context_t *c, renderer_t *r, i32 num_paths,
+                   char *paths[num_paths], i64 seek_time) {
+  if (r->has_media && !media_has_paths(&r->media, num_paths, paths)) {
+    media_close(&r->media);
+    r->has_media = false;
+  }
+  if (!r->has_media) {
+    if (!media_open(c, &r->media, num_paths, paths)) {
+      return false;
+    }
+    r->has_media = true;
+  }
+  media_t *m = &r->media;
+
+  if (m->has_video) {
+    video_seek(&m->video, seek_time);
+  }
+  if (m->has_audio) {
+    audio_mixer_seek(&m->mixer, seek_time);
+  }
   context_set_audio_timer(c, seek_time);
 
   for (i32 j = 0; !context_get_should_close(c); ++j) {
     context_begin_frame(c);
-    glClearColor(0, 0, 0, 0);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    i64 time = context_get_audio_timer(c);
-    video_frame_t tex;
-    if (video_get_texture(&video, time, &tex)) {
-      shader_t *shader = NULL;
-      if (av_pix_fmt_desc_get(tex.sw_format)->flags & AV_PIX_FMT_FLAG_RGB) {
-        shader = rgb_shader;
-      } else if (tex.sw_format == AV_PIX_FMT_NV12 ||
-                 tex.sw_format == AV_PIX_FMT_YUV420P) {
-        shader = yuv_shader;
+    if (m->has_video) {
+      draw_video(c, r);
+    }
+    f32 **planes;
+    i32 num_samples;
+    while (context_map_audio(c, &planes, &num_samples)) {
+      if (m->has_audio) {
+        audio_mixer_get_samples(&m->mixer, &num_samples, planes);
       } else {
-        log_error("unsupported pixel format: %s",
-                  av_get_pix_fmt_name(tex.sw_format));
-      }
-      if (shader && shader_use(shader) >= 0) {
-        for (i32 i = 0; i < sve2_arrlen(tex.textures); ++i) {
-          if (!tex.textures[i]) {
-            continue;
-          }
-          glActiveTexture(GL_TEXTURE0 + i);
-          glBindTexture(tex.texture_array_index < 0 ? GL_TEXTURE_2D
-                                                    : GL_TEXTURE_2D_ARRAY,
-                        tex.textures[i]);
-          log_trace("binding texture %u to bind slot %" PRIi32, tex.textures[i],
-                    i);
+        // silence, which still drives the audio timer (thus the video)
+        for (i32 i = 0; i < c->info.ch_layout->nb_channels; ++i) {
+          memset(planes[i], 0, (size_t)num_samples * sizeof *planes[i]);
         }
-        glUniform1f(glGetUniformLocation(shader->program, "frame"),
-                    tex.texture_array_index);
-        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
       }
-    }
-    u8 *samples;
-    i32 num_samples;
-    while (context_map_audio(c, &samples, &num_samples)) {
-      audio_get_samples(&audio, &num_samples, samples);
       context_unmap_audio(c, num_samples);
 
       if (num_samples == 0) {
@@ -93,10 +239,140 @@ int main(int argc, char *argv[]) {
     }
     context_end_frame(c);
   }
+  return true;
+}
+
+static void render_segment(context_t *c, const batch_segment_t *segment,
+                           void *userdata) {
+  char **argv = userdata;
+  i32 num_paths = 0;
+  while (argv[num_paths]) {
+    ++num_paths;
+  }
+  renderer_t r;
+  renderer_init(c, &r);
+  nassert(render(c, &r, num_paths, argv, segment->start_time));
+  renderer_free(&r);
+}
 
-  video_close(&video);
-  audio_close(&audio);
+static bool render_job(context_t *c, const render_job_t *job, void *userdata) {
+  renderer_t *r = userdata;
+  // the shaders belong to the context, which only exists from the first job
+  if (!r->yuv_shader) {
+    renderer_init(c, r);
+  }
+  return render(c, r, job->num_inputs, job->inputs, job->start_time);
+}
+
+static void free_renderer(context_t *c, void *userdata) {
+  (void)c;
+  renderer_free(userdata);
+}
+
+// maximum number of renditions given by RENDITIONS
+#define MAX_RENDITIONS 8
+
+// parse a comma-separated list of heights (e.g. "720,480") into 16:9
+// renditions of the output, written next to it (e.g. out.720p.mp4) with the
+// encoder of the output. Returns the number of renditions.
+static i32 parse_renditions(const context_init_t *info, const char *list,
+                            context_rendition_t renditions[MAX_RENDITIONS]) {
+  const char *path = info->output_path;
+  const char *ext = strrchr(path, '.');
+  if (!ext || strchr(ext, '/')) {
+    ext = path + strlen(path);
+  }
+  i32 num_renditions = 0;
+  for (char *end; *list && num_renditions < MAX_RENDITIONS; list = end) {
+    i32 height = (i32)strtol(list, &end, 10);
+    if (end == list || height <= 0 || height % 2 != 0) {
+      raw_log_panic("invalid rendition height in RENDITIONS: %s\n", list);
+    }
+    end += *end == ',';
+    renditions[num_renditions++] = (context_rendition_t){
+        .output_path = sve2_asprintf("%.*s.%" PRIi32 "p%s",
+                                     (int)(ext - path), path, height, ext),
+        // rounded to an even width, for 4:2:0 chroma
+        .width = (height * 16 / 9 + 1) & ~1,
+        .height = height,
+        .video_encoder = info->video_encoder,
+        .video_encoder_options = info->video_encoder_options,
+        .video_pix_fmt = info->video_pix_fmt,
+    };
+  }
+  return num_renditions;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    raw_log_panic("usage: %s <media file> [extra audio files...]\n", argv[0]);
+  }
+
+  AVChannelLayout ch_layout = AV_CHANNEL_LAYOUT_STEREO;
+
+  char *output_path = getenv("OUTPUT_PATH");
+  context_init_t info = {
+      .mode = output_path ? CONTEXT_MODE_RENDER : CONTEXT_MODE_PREVIEW,
+      .width = 1920,
+      .height = 1080,
+      .fps = 60,
+      .output_path = output_path,
+      // the sources are 8-bit SDR video, so more precision would be wasted
+      .framebuffer_format = CONTEXT_FRAMEBUFFER_RGBA8,
+      .sample_rate = 48000,
+      .sample_fmt = AV_SAMPLE_FMT_S16,
+      .num_buffered_audio_frames = 4,
+      .ch_layout = &ch_layout};
+
+  // e.g. BATCH_FRAMES=3600 renders the first minute with worker processes
+  char *batch_frames = getenv("BATCH_FRAMES");
+  if (output_path && batch_frames) {
+    batch_render(&(batch_render_info_t){.info = &info,
+                                        .num_frames = atoi(batch_frames),
+                                        .render = render_segment,
+                                        .userdata = argv + 1});
+    return 0;
+  }
+
+  // e.g. RENDER_SERVER=/tmp/sve2.sock renders the jobs sent to that socket
+  // (see sve2/context/render_server.h), the arguments are ignored
+  char *socket_path = getenv("RENDER_SERVER");
+  if (socket_path) {
+    renderer_t r = {0};
+    render_server_run(&(render_server_info_t){.info = &info,
+                                              .socket_path = socket_path,
+                                              .render = render_job,
+                                              .cleanup = free_renderer,
+                                              .userdata = &r});
+    return 0;
+  }
+
+  // e.g. RENDITIONS=720,480 also renders 720p and 480p versions of the output
+  // (from the same composited frames)
+  context_rendition_t renditions[MAX_RENDITIONS];
+  char *rendition_list = getenv("RENDITIONS");
+  if (output_path && rendition_list) {
+    info.num_renditions = parse_renditions(&info, rendition_list, renditions);
+    info.renditions = renditions;
+  }
+
+  // e.g. PROXY_HEIGHT=540 previews 4K sources through 540p proxies, once they
+  // are transcoded in the background
+  char *proxy_height = getenv("PROXY_HEIGHT");
+  if (proxy_height) {
+    info.proxy_height = atoi(proxy_height);
+  }
+
+  context_t *c;
+  nassert(c = context_init(&info));
+  renderer_t r;
+  renderer_init(c, &r);
+  nassert(render(c, &r, argc - 1, argv + 1, 115 * SVE2_NS_PER_SEC));
+  renderer_free(&r);
   context_free(c);
+  for (i32 i = 0; i < info.num_renditions; ++i) {
+    free((char *)renditions[i].output_path);
+  }
 
   return 0;
 }
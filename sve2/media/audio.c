@@ -12,17 +12,26 @@ bool audio_open(context_t *ctx, audio_t *a, const char *path,
     return ffmpeg_audio_stream_open(ctx, &a->ffmpeg, path, index);
   case AUDIO_FORMAT_PCM_SAMPLES:
     return audio_pcm_open(ctx, &a->pcm, path, index);
+  case AUDIO_FORMAT_PCM_COMPRESSED:
+    return audio_pcm_open_compressed(ctx, &a->pcm, path, index, 0);
   }
 
   return false;
 }
 
+bool audio_open_compressed(context_t *ctx, audio_t *a, const char *path,
+                           stream_index_t index, i32 bits) {
+  a->format = AUDIO_FORMAT_PCM_COMPRESSED;
+  return audio_pcm_open_compressed(ctx, &a->pcm, path, index, bits);
+}
+
 void audio_close(audio_t *a) {
   switch (a->format) {
   case AUDIO_FORMAT_FFMPEG_STREAM:
     ffmpeg_audio_stream_close(&a->ffmpeg);
     break;
   case AUDIO_FORMAT_PCM_SAMPLES:
+  case AUDIO_FORMAT_PCM_COMPRESSED:
     audio_pcm_close(&a->pcm);
     break;
   }
@@ -34,18 +43,21 @@ void audio_seek(audio_t *a, i64 time) {
     ffmpeg_audio_stream_seek(&a->ffmpeg, time);
     break;
   case AUDIO_FORMAT_PCM_SAMPLES:
+  case AUDIO_FORMAT_PCM_COMPRESSED:
     audio_pcm_seek(&a->pcm, time);
     break;
   }
 }
 
-void audio_get_samples(audio_t *a, i32 num_samples[static 1], u8 *samples) {
+void audio_get_samples(audio_t *a, i32 num_samples[static 1],
+                       f32 *const planes[]) {
   switch (a->format) {
   case AUDIO_FORMAT_FFMPEG_STREAM:
-    ffmpeg_audio_stream_get_samples(&a->ffmpeg, num_samples, samples);
+    ffmpeg_audio_stream_get_samples(&a->ffmpeg, num_samples, planes);
     break;
   case AUDIO_FORMAT_PCM_SAMPLES:
-    audio_pcm_get_samples(&a->pcm, num_samples, samples);
+  case AUDIO_FORMAT_PCM_COMPRESSED:
+    audio_pcm_get_samples(&a->pcm, num_samples, planes);
     break;
   }
 }
@@ -13,12 +13,17 @@
  * is save computing power but consumes a lot of memory if the audio file is
  * large.
  *
+ * AUDIO_FORMAT_PCM_COMPRESSED: same as AUDIO_FORMAT_PCM_SAMPLES, but the
+ * decoded audio is compressed in memory (with 24 bits of precision, see
+ * audio_open_compressed()). This is a good trade-off for long tracks.
+ *
  * AUDIO_FORMAT_FFMPEG_STREAM: stream the audio file from disk, might cause lag
  * due to the disk I/O and on-the-fly decoding.
  */
 typedef enum {
   AUDIO_FORMAT_FFMPEG_STREAM,
   AUDIO_FORMAT_PCM_SAMPLES,
+  AUDIO_FORMAT_PCM_COMPRESSED,
 } audio_format_t;
 
 typedef struct {
@@ -40,6 +45,21 @@ typedef struct {
  */
 bool audio_open(context_t *ctx, audio_t *a, const char *path,
                 stream_index_t index, audio_format_t format);
+/**
+ * @brief Open an audio object with AUDIO_FORMAT_PCM_COMPRESSED, choosing the
+ * precision of the samples
+ *
+ * @param a Destination audio_t object
+ * @param path Path to the audio file
+ * @param index Audio stream index
+ * @param bits Number of bits of precision kept per sample, 0 for lossless.
+ * Decoded samples are float, which is quantized to 24 bits (or to this many
+ * bits), so compressing them is lossy either way. Only integer WAV files are
+ * compressed losslessly.
+ * @return Whether the operation succeeded or failed (media file not exists)
+ */
+bool audio_open_compressed(context_t *ctx, audio_t *a, const char *path,
+                           stream_index_t index, i32 bits);
 /**
  * @brief Close an audio object
  *
@@ -54,12 +74,13 @@ void audio_close(audio_t *a);
  */
 void audio_seek(audio_t *a, i64 time);
 /**
- * @brief Retrieve sample data from the audio object.
+ * @brief Retrieve sample data from the audio object, as planar float samples
+ * (the format of the context audio bus, see context_map_audio()).
  *
  * @param a An opened audio object
- * @param num_samples in: Maximum number of samples (per channel) that `samples`
+ * @param num_samples in: Maximum number of samples (per channel) that `planes`
  * can hold. out: The actual number of samples (per channel) actually retrieved.
- * @param samples Sample data buffer
+ * @param planes Destination planes, one per channel of the context layout
  */
 void audio_get_samples(audio_t *a, i32 num_samples[static 1],
-                       u8 samples[*num_samples]);
+                       f32 *const planes[]);
@@ -0,0 +1,343 @@
+#include "audio_fx.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stb/stb_ds.h>
+
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+
+#define TWO_PI 6.28318530718f
+// delay lines are processed in chunks of at most this many samples, through a
+// buffer on the stack
+#define DELAY_CHUNK_SIZE 256
+// delay feedback is bounded, so the delay line can not blow up
+#define MAX_DELAY_FEEDBACK 0.99f
+// filter state below this is flushed to zero, to avoid denormals in the decay
+// tails
+#define DENORMAL_THRESHOLD 1e-25f
+
+static f32 db_to_linear(f32 db) { return powf(10.0f, db / 20.0f); }
+
+// coefficient of a one-pole smoother with the given time constant, updated
+// once per control block
+static f32 smoothing_coef(i32 sample_rate, f32 time_ms) {
+  f32 num_blocks =
+      time_ms * 0.001f * (f32)sample_rate / (f32)AUDIO_FX_CONTROL_BLOCK;
+  return num_blocks > 0.0f ? expf(-1.0f / num_blocks) : 0.0f;
+}
+
+static void compute_eq(audio_fx_t *fx, i32 sample_rate) {
+  const audio_fx_params_t *p = &fx->params;
+  f32 frequency = sve2_max_f32(
+      sve2_min_f32(p->eq.frequency, 0.49f * (f32)sample_rate), 1.0f);
+  f32 w0 = TWO_PI * frequency / (f32)sample_rate;
+  f32 cw = cosf(w0);
+  f32 q = p->eq.q > 0.0f ? p->eq.q : 0.70710678f;
+  f32 alpha = sinf(w0) / (2.0f * q);
+  f32 a = powf(10.0f, p->eq.gain_db / 40.0f);
+  f32 sa = 2.0f * sqrtf(a) * alpha;
+
+  f32 b0, b1, b2, a0, a1, a2;
+  switch (p->eq.type) {
+  case AUDIO_EQ_LOW_PASS:
+    b0 = b2 = (1.0f - cw) * 0.5f;
+    b1 = 1.0f - cw;
+    a0 = 1.0f + alpha;
+    a1 = -2.0f * cw;
+    a2 = 1.0f - alpha;
+    break;
+  case AUDIO_EQ_HIGH_PASS:
+    b0 = b2 = (1.0f + cw) * 0.5f;
+    b1 = -(1.0f + cw);
+    a0 = 1.0f + alpha;
+    a1 = -2.0f * cw;
+    a2 = 1.0f - alpha;
+    break;
+  case AUDIO_EQ_PEAK:
+    b0 = 1.0f + alpha * a;
+    b1 = -2.0f * cw;
+    b2 = 1.0f - alpha * a;
+    a0 = 1.0f + alpha / a;
+    a1 = -2.0f * cw;
+    a2 = 1.0f - alpha / a;
+    break;
+  case AUDIO_EQ_LOW_SHELF:
+    b0 = a * ((a + 1.0f) - (a - 1.0f) * cw + sa);
+    b1 = 2.0f * a * ((a - 1.0f) - (a + 1.0f) * cw);
+    b2 = a * ((a + 1.0f) - (a - 1.0f) * cw - sa);
+    a0 = (a + 1.0f) + (a - 1.0f) * cw + sa;
+    a1 = -2.0f * ((a - 1.0f) + (a + 1.0f) * cw);
+    a2 = (a + 1.0f) + (a - 1.0f) * cw - sa;
+    break;
+  case AUDIO_EQ_HIGH_SHELF:
+    b0 = a * ((a + 1.0f) + (a - 1.0f) * cw + sa);
+    b1 = -2.0f * a * ((a - 1.0f) + (a + 1.0f) * cw);
+    b2 = a * ((a + 1.0f) + (a - 1.0f) * cw - sa);
+    a0 = (a + 1.0f) - (a - 1.0f) * cw + sa;
+    a1 = 2.0f * ((a - 1.0f) - (a + 1.0f) * cw);
+    a2 = (a + 1.0f) - (a - 1.0f) * cw - sa;
+    break;
+  default:
+    assert(false && "invalid EQ type");
+    return;
+  }
+
+  fx->b0 = b0 / a0;
+  fx->b1 = b1 / a0;
+  fx->b2 = b2 / a0;
+  fx->a1 = a1 / a0;
+  fx->a2 = a2 / a0;
+}
+
+static void reset_fx(audio_fx_chain_t *chain, audio_fx_t *fx) {
+  memset(fx->z1, 0, sizeof fx->z1);
+  memset(fx->z2, 0, sizeof fx->z2);
+  fx->envelope = 0.0f;
+  switch (fx->params.type) {
+  case AUDIO_FX_COMPRESSOR:
+    fx->gain = fx->target_gain = fx->makeup;
+    break;
+  case AUDIO_FX_LIMITER:
+    fx->gain = fx->target_gain = 1.0f;
+    break;
+  default:
+    fx->gain = fx->target_gain;
+    break;
+  }
+  for (i32 c = 0; c < chain->nb_channels; ++c) {
+    if (fx->delay_lines[c]) {
+      memset(fx->delay_lines[c], 0, fx->delay_length * sizeof(f32));
+    }
+  }
+  fx->delay_pos = 0;
+}
+
+// compute the derived coefficients from fx->params
+static void configure_fx(audio_fx_chain_t *chain, audio_fx_t *fx) {
+  audio_fx_params_t *p = &fx->params;
+  i32 sample_rate = chain->sample_rate;
+  switch (p->type) {
+  case AUDIO_FX_GAIN:
+    fx->target_gain = db_to_linear(p->gain.gain_db);
+    break;
+  case AUDIO_FX_EQ:
+    compute_eq(fx, sample_rate);
+    break;
+  case AUDIO_FX_COMPRESSOR:
+    fx->threshold = db_to_linear(p->compressor.threshold_db);
+    fx->slope = 1.0f / sve2_max_f32(p->compressor.ratio, 1.0f) - 1.0f;
+    fx->attack = smoothing_coef(sample_rate, p->compressor.attack_ms);
+    fx->release = smoothing_coef(sample_rate, p->compressor.release_ms);
+    fx->makeup = db_to_linear(p->compressor.makeup_db);
+    break;
+  case AUDIO_FX_DELAY: {
+    p->delay.feedback = sve2_max_f32(
+        sve2_min_f32(p->delay.feedback, MAX_DELAY_FEEDBACK),
+        -MAX_DELAY_FEEDBACK);
+    i32 length = (i32)sve2_max_i64(
+        lrintf(p->delay.time_ms * 0.001f * (f32)sample_rate), 1);
+    if (length != fx->delay_length) {
+      for (i32 c = 0; c < chain->nb_channels; ++c) {
+        free(fx->delay_lines[c]);
+        fx->delay_lines[c] = sve2_calloc(length, sizeof(f32));
+      }
+      fx->delay_length = length;
+      fx->delay_pos = 0;
+    }
+    break;
+  }
+  case AUDIO_FX_LIMITER:
+    fx->threshold = db_to_linear(p->limiter.ceiling_db);
+    fx->release = smoothing_coef(sample_rate, p->limiter.release_ms);
+    break;
+  }
+}
+
+void audio_fx_chain_init(audio_fx_chain_t *chain, i32 nb_channels,
+                         i32 sample_rate) {
+  assert(nb_channels > 0 && nb_channels <= SVE2_MAX_AUDIO_CHANNELS);
+  chain->effects = NULL;
+  chain->nb_channels = nb_channels;
+  chain->sample_rate = sample_rate;
+}
+
+void audio_fx_chain_free(audio_fx_chain_t *chain) {
+  for (i32 i = 0; i < (i32)stbds_arrlen(chain->effects); ++i) {
+    for (i32 c = 0; c < chain->nb_channels; ++c) {
+      free(chain->effects[i].delay_lines[c]);
+    }
+  }
+  stbds_arrfree(chain->effects);
+}
+
+i32 audio_fx_chain_add(audio_fx_chain_t *chain,
+                       const audio_fx_params_t *params) {
+  audio_fx_t fx = {.params = *params};
+  configure_fx(chain, &fx);
+  reset_fx(chain, &fx);
+  stbds_arrput(chain->effects, fx);
+  return (i32)stbds_arrlen(chain->effects) - 1;
+}
+
+void audio_fx_chain_set(audio_fx_chain_t *chain, i32 index,
+                        const audio_fx_params_t *params) {
+  audio_fx_t *fx = &chain->effects[index];
+  assert(fx->params.type == params->type);
+  fx->params = *params;
+  configure_fx(chain, fx);
+}
+
+void audio_fx_chain_reset(audio_fx_chain_t *chain) {
+  for (i32 i = 0; i < (i32)stbds_arrlen(chain->effects); ++i) {
+    reset_fx(chain, &chain->effects[i]);
+  }
+}
+
+static void process_gain(audio_fx_chain_t *chain, audio_fx_t *fx,
+                         f32 *const planes[], i32 num_samples) {
+  if (fx->gain == 1.0f && fx->target_gain == 1.0f) {
+    return;
+  }
+
+  // gain changes are ramped over the block to avoid zipper noise
+  f32 step = (fx->target_gain - fx->gain) / (f32)num_samples;
+  for (i32 c = 0; c < chain->nb_channels; ++c) {
+    audio_kernel_apply_ramp(planes[c], num_samples, fx->gain, step);
+  }
+  fx->gain = fx->target_gain;
+}
+
+// the recursion of IIR filters is serial, so this is a scalar loop per
+// channel, with the state kept in registers
+static void process_eq(audio_fx_chain_t *chain, audio_fx_t *fx,
+                       f32 *const planes[], i32 num_samples) {
+  const f32 b0 = fx->b0, b1 = fx->b1, b2 = fx->b2, a1 = fx->a1, a2 = fx->a2;
+  for (i32 c = 0; c < chain->nb_channels; ++c) {
+    f32 *x = planes[c];
+    f32 z1 = fx->z1[c], z2 = fx->z2[c];
+    for (i32 i = 0; i < num_samples; ++i) {
+      f32 in = x[i];
+      f32 out = b0 * in + z1;
+      z1 = b1 * in - a1 * out + z2;
+      z2 = b2 * in - a2 * out;
+      x[i] = out;
+    }
+    fx->z1[c] = fabsf(z1) < DENORMAL_THRESHOLD ? 0.0f : z1;
+    fx->z2[c] = fabsf(z2) < DENORMAL_THRESHOLD ? 0.0f : z2;
+  }
+}
+
+// loudest sample of all channels in [offset, offset + count)
+static f32 get_peak(audio_fx_chain_t *chain, f32 *const planes[], i32 offset,
+                    i32 count) {
+  f32 peak = 0.0f;
+  for (i32 c = 0; c < chain->nb_channels; ++c) {
+    peak = sve2_max_f32(peak, audio_kernel_peak(planes[c] + offset, count));
+  }
+  return peak;
+}
+
+static void apply_gain_ramp(audio_fx_chain_t *chain, f32 *const planes[],
+                            i32 offset, i32 count, f32 from, f32 to) {
+  if (from == 1.0f && to == 1.0f) {
+    return;
+  }
+
+  f32 step = (to - from) / (f32)count;
+  for (i32 c = 0; c < chain->nb_channels; ++c) {
+    audio_kernel_apply_ramp(planes[c] + offset, count, from, step);
+  }
+}
+
+static void process_compressor(audio_fx_chain_t *chain, audio_fx_t *fx,
+                               f32 *const planes[], i32 num_samples) {
+  for (i32 i = 0; i < num_samples; i += AUDIO_FX_CONTROL_BLOCK) {
+    i32 count = sve2_min_i32(AUDIO_FX_CONTROL_BLOCK, num_samples - i);
+    f32 peak = get_peak(chain, planes, i, count);
+    f32 coef = peak > fx->envelope ? fx->attack : fx->release;
+    fx->envelope = peak + coef * (fx->envelope - peak);
+
+    f32 target = fx->makeup;
+    if (fx->envelope > fx->threshold) {
+      target *= powf(fx->envelope / fx->threshold, fx->slope);
+    }
+    apply_gain_ramp(chain, planes, i, count, fx->gain, target);
+    fx->gain = target;
+  }
+}
+
+static void process_delay(audio_fx_chain_t *chain, audio_fx_t *fx,
+                          f32 *const planes[], i32 num_samples) {
+  f32 feedback = fx->params.delay.feedback, mix = fx->params.delay.mix;
+  f32 delayed[DELAY_CHUNK_SIZE];
+  for (i32 i = 0; i < num_samples;) {
+    // contiguous until the wrap-around point of the delay lines
+    i32 count = sve2_min_i32(
+        sve2_min_i32(num_samples - i, fx->delay_length - fx->delay_pos),
+        DELAY_CHUNK_SIZE);
+    for (i32 c = 0; c < chain->nb_channels; ++c) {
+      f32 *x = planes[c] + i;
+      f32 *line = fx->delay_lines[c] + fx->delay_pos;
+      memcpy(delayed, line, count * sizeof(f32));
+      // line = x + feedback * delayed
+      memcpy(line, x, count * sizeof(f32));
+      audio_kernel_mix_ramp(line, delayed, count, feedback, 0.0f);
+      // x = (1 - mix) * x + mix * delayed
+      audio_kernel_apply_ramp(x, count, 1.0f - mix, 0.0f);
+      audio_kernel_mix_ramp(x, delayed, count, mix, 0.0f);
+    }
+    fx->delay_pos = (fx->delay_pos + count) % fx->delay_length;
+    i += count;
+  }
+}
+
+static void process_limiter(audio_fx_chain_t *chain, audio_fx_t *fx,
+                            f32 *const planes[], i32 num_samples) {
+  for (i32 i = 0; i < num_samples; i += AUDIO_FX_CONTROL_BLOCK) {
+    i32 count = sve2_min_i32(AUDIO_FX_CONTROL_BLOCK, num_samples - i);
+    f32 peak = get_peak(chain, planes, i, count);
+    f32 needed = peak > fx->threshold ? fx->threshold / peak : 1.0f;
+    if (needed <= fx->gain) {
+      // instant attack: the whole block gets the reduced gain, so the peak
+      // (wherever it is in the block) stays below the ceiling
+      fx->gain = needed;
+      apply_gain_ramp(chain, planes, i, count, needed, needed);
+    } else {
+      // release towards the needed gain, never above it
+      f32 target = needed + fx->release * (fx->gain - needed);
+      apply_gain_ramp(chain, planes, i, count, fx->gain, target);
+      fx->gain = target;
+    }
+  }
+}
+
+void audio_fx_chain_process(audio_fx_chain_t *chain, f32 *const planes[],
+                            i32 num_samples) {
+  if (num_samples <= 0) {
+    return;
+  }
+
+  for (i32 i = 0; i < (i32)stbds_arrlen(chain->effects); ++i) {
+    audio_fx_t *fx = &chain->effects[i];
+    switch (fx->params.type) {
+    case AUDIO_FX_GAIN:
+      process_gain(chain, fx, planes, num_samples);
+      break;
+    case AUDIO_FX_EQ:
+      process_eq(chain, fx, planes, num_samples);
+      break;
+    case AUDIO_FX_COMPRESSOR:
+      process_compressor(chain, fx, planes, num_samples);
+      break;
+    case AUDIO_FX_DELAY:
+      process_delay(chain, fx, planes, num_samples);
+      break;
+    case AUDIO_FX_LIMITER:
+      process_limiter(chain, fx, planes, num_samples);
+      break;
+    }
+  }
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "sve2/media/audio_kernels.h"
+#include "sve2/utils/types.h"
+
+// dynamics (compressor, limiter) compute their gain once per control block of
+// this many samples, and ramp it linearly across the block
+#define AUDIO_FX_CONTROL_BLOCK 32
+
+typedef enum {
+  AUDIO_FX_GAIN,
+  AUDIO_FX_EQ,
+  AUDIO_FX_COMPRESSOR,
+  AUDIO_FX_DELAY,
+  AUDIO_FX_LIMITER,
+} audio_fx_type_t;
+
+/**
+ * Biquad filter shapes, with the coefficients from the RBJ audio EQ cookbook.
+ * gain_db is only used by the peak and shelf filters.
+ */
+typedef enum {
+  AUDIO_EQ_LOW_PASS,
+  AUDIO_EQ_HIGH_PASS,
+  AUDIO_EQ_PEAK,
+  AUDIO_EQ_LOW_SHELF,
+  AUDIO_EQ_HIGH_SHELF,
+} audio_eq_type_t;
+
+/**
+ * @brief Parameters of an effect
+ */
+typedef struct {
+  audio_fx_type_t type;
+  union {
+    struct {
+      f32 gain_db;
+    } gain;
+    struct {
+      audio_eq_type_t type;
+      f32 frequency, q, gain_db;
+    } eq;
+    /**
+     * @brief Feed-forward compressor with a hard knee. The channels are linked
+     * (the detector uses the loudest channel), so the stereo image is kept.
+     */
+    struct {
+      f32 threshold_db, ratio, attack_ms, release_ms, makeup_db;
+    } compressor;
+    /**
+     * @brief Feedback delay. mix is the wet/dry ratio, 0 is dry only.
+     */
+    struct {
+      f32 time_ms, feedback, mix;
+    } delay;
+    /**
+     * @brief Peak limiter. The gain is reduced before the loudest sample of
+     * every control block, so the output never exceeds the ceiling.
+     */
+    struct {
+      f32 ceiling_db, release_ms;
+    } limiter;
+  };
+} audio_fx_params_t;
+
+/**
+ * @brief An effect of a chain, with its derived coefficients and state
+ */
+typedef struct {
+  audio_fx_params_t params;
+  /**
+   * @brief Current linear gain (gain, compressor and limiter), and its target
+   */
+  f32 gain, target_gain;
+  /**
+   * @brief Biquad coefficients (normalized so a0 = 1) and per-channel state
+   * (transposed direct form II)
+   */
+  f32 b0, b1, b2, a1, a2;
+  f32 z1[SVE2_MAX_AUDIO_CHANNELS], z2[SVE2_MAX_AUDIO_CHANNELS];
+  /**
+   * @brief Dynamics: linear threshold/ceiling, gain slope, per-control-block
+   * smoothing coefficients, linear makeup gain and envelope
+   */
+  f32 threshold, slope, attack, release, makeup, envelope;
+  /**
+   * @brief Delay lines (one per channel) of delay_length samples
+   */
+  f32 *delay_lines[SVE2_MAX_AUDIO_CHANNELS];
+  i32 delay_length, delay_pos;
+} audio_fx_t;
+
+/**
+ * @brief A chain of effects, processing planar float blocks in place.
+ *
+ * Every effect processes the whole block before the next one runs, so the
+ * chain needs no intermediate buffers and the inner loops are either
+ * vectorized kernels (see audio_kernels.h) or tight recursive filters over
+ * cache-resident planes. Dynamics run at control rate (see
+ * AUDIO_FX_CONTROL_BLOCK) and apply their gain with vectorized ramps.
+ */
+typedef struct {
+  /**
+   * @brief stb_ds array of effects, processed in order
+   */
+  audio_fx_t *effects;
+  i32 nb_channels, sample_rate;
+} audio_fx_chain_t;
+
+void audio_fx_chain_init(audio_fx_chain_t *chain, i32 nb_channels,
+                         i32 sample_rate);
+void audio_fx_chain_free(audio_fx_chain_t *chain);
+
+/**
+ * @brief Append an effect to the chain.
+ *
+ * @return The index of the effect in the chain
+ */
+i32 audio_fx_chain_add(audio_fx_chain_t *chain,
+                       const audio_fx_params_t *params);
+/**
+ * @brief Change the parameters of an effect. The effect type must not change.
+ * The state is kept (gain changes are ramped over the next block), except for
+ * delay lines, which are cleared if the delay time changes.
+ */
+void audio_fx_chain_set(audio_fx_chain_t *chain, i32 index,
+                        const audio_fx_params_t *params);
+/**
+ * @brief Clear the state of every effect (filter memory, envelopes, delay
+ * lines), e.g. after seeking.
+ */
+void audio_fx_chain_reset(audio_fx_chain_t *chain);
+
+/**
+ * @brief Process a block of samples in place.
+ *
+ * @param chain The chain
+ * @param planes Planes of the block, one per channel
+ * @param num_samples Number of samples (per channel)
+ */
+void audio_fx_chain_process(audio_fx_chain_t *chain, f32 *const planes[],
+                            i32 num_samples);
@@ -0,0 +1,603 @@
+#include "audio_kernels.h"
+
+#include <math.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <string.h>
+#include <threads.h>
+
+#include <log.h>
+
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+
+#if !defined(SVE2_NO_NONSTD) && defined(__x86_64__)
+#define SVE2_AUDIO_KERNELS_X86
+#include <immintrin.h>
+#define AVX2_FN __attribute__((target("avx2")))
+#endif
+
+// largest float below 2^31, so the conversion to i32 does not overflow
+#define F32_S32_MAX 2147483520.0f
+
+// kernels operating on contiguous buffers, interleaving is done separately
+typedef struct {
+  const char *name;
+  void (*mix_ramp)(f32 *dst, const f32 *src, i32 count, f32 gain,
+                   f32 gain_step);
+  void (*apply_ramp)(f32 *dst, i32 count, f32 gain, f32 gain_step);
+  f32 (*peak)(const f32 *src, i32 count);
+  void (*s16_to_f32)(const i16 *src, f32 *dst, i32 count);
+  void (*s32_to_f32)(const i32 *src, f32 *dst, i32 count);
+  void (*f32_to_s16)(const f32 *src, i16 *dst, i32 count);
+  void (*f32_to_s32)(const f32 *src, i32 *dst, i32 count);
+  void (*f32_clip)(const f32 *src, f32 *dst, i32 count);
+  void (*add_dither)(audio_dither_t *d, f32 *dst, i32 count, f32 amplitude);
+} kernels_t;
+
+// scalar kernels, these also handle the tails of the vectorized kernels
+static void mix_ramp_scalar(f32 *dst, const f32 *src, i32 count, f32 gain,
+                            f32 gain_step) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] += src[i] * (gain + (f32)i * gain_step);
+  }
+}
+
+static void apply_ramp_scalar(f32 *dst, i32 count, f32 gain, f32 gain_step) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] *= gain + (f32)i * gain_step;
+  }
+}
+
+static f32 peak_scalar(const f32 *src, i32 count) {
+  f32 peak = 0.0f;
+  for (i32 i = 0; i < count; ++i) {
+    peak = sve2_max_f32(peak, fabsf(src[i]));
+  }
+  return peak;
+}
+
+static void s16_to_f32_scalar(const i16 *src, f32 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = (f32)src[i] * (1.0f / 32768.0f);
+  }
+}
+
+static void s32_to_f32_scalar(const i32 *src, f32 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = (f32)src[i] * (1.0f / 2147483648.0f);
+  }
+}
+
+static void f32_to_s16_scalar(const f32 *src, i16 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    f32 x = sve2_max_f32(sve2_min_f32(src[i] * 32768.0f, 32767.0f), -32768.0f);
+    dst[i] = (i16)lrintf(x);
+  }
+}
+
+static void f32_to_s32_scalar(const f32 *src, i32 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    f32 x = sve2_max_f32(sve2_min_f32(src[i] * 2147483648.0f, F32_S32_MAX),
+                         -2147483648.0f);
+    dst[i] = (i32)lrintf(x);
+  }
+}
+
+static void f32_clip_scalar(const f32 *src, f32 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = sve2_max_f32(sve2_min_f32(src[i], 1.0f), -1.0f);
+  }
+}
+
+// one step of a xorshift32 generator
+static u32 xorshift32(u32 x) {
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return x;
+}
+
+// uniform float in [0, 1), using the upper 23 bits as the mantissa
+static f32 u32_to_unit_f32(u32 x) {
+  u32 bits = (x >> 9) | 0x3f800000u;
+  f32 f;
+  memcpy(&f, &bits, sizeof f);
+  return f - 1.0f;
+}
+
+// TPDF noise (the difference of two uniform values) in (-amplitude,
+// amplitude). Element i uses lane i % 4, so every implementation produces the
+// same noise
+static void add_dither_scalar(audio_dither_t *d, f32 *dst, i32 count,
+                              f32 amplitude) {
+  for (i32 i = 0; i < count; ++i) {
+    u32 *lane = &d->state[i % 4];
+    u32 a = *lane = xorshift32(*lane);
+    u32 b = *lane = xorshift32(*lane);
+    dst[i] += (u32_to_unit_f32(a) - u32_to_unit_f32(b)) * amplitude;
+  }
+}
+
+// u8 is rarely used, so it only has a scalar implementation
+static void u8_to_f32(const u8 *src, f32 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = ((f32)src[i] - 128.0f) * (1.0f / 128.0f);
+  }
+}
+
+static void f32_to_u8(const f32 *src, u8 *dst, i32 count) {
+  for (i32 i = 0; i < count; ++i) {
+    f32 x = sve2_max_f32(sve2_min_f32(src[i] * 128.0f + 128.0f, 255.0f), 0.0f);
+    dst[i] = (u8)lrintf(x);
+  }
+}
+
+static const kernels_t scalar_kernels = {
+    .name = "scalar",
+    .mix_ramp = mix_ramp_scalar,
+    .apply_ramp = apply_ramp_scalar,
+    .peak = peak_scalar,
+    .s16_to_f32 = s16_to_f32_scalar,
+    .s32_to_f32 = s32_to_f32_scalar,
+    .f32_to_s16 = f32_to_s16_scalar,
+    .f32_to_s32 = f32_to_s32_scalar,
+    .f32_clip = f32_clip_scalar,
+    .add_dither = add_dither_scalar,
+};
+
+#ifdef SVE2_AUDIO_KERNELS_X86
+// SSE2 is part of the x86-64 baseline, so no target attribute is needed
+static void mix_ramp_sse2(f32 *dst, const f32 *src, i32 count, f32 gain,
+                          f32 gain_step) {
+  __m128 g = _mm_add_ps(_mm_set1_ps(gain),
+                        _mm_mul_ps(_mm_set1_ps(gain_step),
+                                   _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f)));
+  __m128 step = _mm_set1_ps(gain_step * 4.0f);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 d = _mm_loadu_ps(dst + i);
+    d = _mm_add_ps(d, _mm_mul_ps(_mm_loadu_ps(src + i), g));
+    _mm_storeu_ps(dst + i, d);
+    g = _mm_add_ps(g, step);
+  }
+  mix_ramp_scalar(dst + i, src + i, count - i, gain + (f32)i * gain_step,
+                  gain_step);
+}
+
+static void apply_ramp_sse2(f32 *dst, i32 count, f32 gain, f32 gain_step) {
+  __m128 g = _mm_add_ps(_mm_set1_ps(gain),
+                        _mm_mul_ps(_mm_set1_ps(gain_step),
+                                   _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f)));
+  __m128 step = _mm_set1_ps(gain_step * 4.0f);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_loadu_ps(dst + i), g));
+    g = _mm_add_ps(g, step);
+  }
+  apply_ramp_scalar(dst + i, count - i, gain + (f32)i * gain_step, gain_step);
+}
+
+// horizontal maximum of the 4 lanes
+static f32 hmax_sse2(__m128 x) {
+  x = _mm_max_ps(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(1, 0, 3, 2)));
+  x = _mm_max_ps(x, _mm_shuffle_ps(x, x, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(x);
+}
+
+static f32 peak_sse2(const f32 *src, i32 count) {
+  // clearing the sign bit is the absolute value
+  const __m128 mask = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+  __m128 peak = _mm_setzero_ps();
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    peak = _mm_max_ps(peak, _mm_and_ps(_mm_loadu_ps(src + i), mask));
+  }
+  return sve2_max_f32(hmax_sse2(peak), peak_scalar(src + i, count - i));
+}
+
+static void s16_to_f32_sse2(const i16 *src, f32 *dst, i32 count) {
+  const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    // sign-extend by unpacking into the upper halves and shifting back
+    __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+    __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dst + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+  }
+  s16_to_f32_scalar(src + i, dst + i, count - i);
+}
+
+static void s32_to_f32_sse2(const i32 *src, f32 *dst, i32 count) {
+  const __m128 scale = _mm_set1_ps(1.0f / 2147483648.0f);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_ps(dst + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+  }
+  s32_to_f32_scalar(src + i, dst + i, count - i);
+}
+
+static void f32_to_s16_sse2(const f32 *src, i16 *dst, i32 count) {
+  // clamp before scaling, so the conversion to i32 can not overflow. Then
+  // 32768 is saturated to 32767 by packs
+  const __m128 lo = _mm_set1_ps(-1.0f), hi = _mm_set1_ps(1.0f);
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128 a = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i), lo), hi);
+    __m128 b = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4), lo), hi);
+    __m128i ia = _mm_cvtps_epi32(_mm_mul_ps(a, scale));
+    __m128i ib = _mm_cvtps_epi32(_mm_mul_ps(b, scale));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(ia, ib));
+  }
+  f32_to_s16_scalar(src + i, dst + i, count - i);
+}
+
+static void f32_to_s32_sse2(const f32 *src, i32 *dst, i32 count) {
+  const __m128 lo = _mm_set1_ps(-2147483648.0f), hi = _mm_set1_ps(F32_S32_MAX);
+  const __m128 scale = _mm_set1_ps(2147483648.0f);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_mul_ps(_mm_loadu_ps(src + i), scale);
+    x = _mm_min_ps(_mm_max_ps(x, lo), hi);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_cvtps_epi32(x));
+  }
+  f32_to_s32_scalar(src + i, dst + i, count - i);
+}
+
+static void f32_clip_sse2(const f32 *src, f32 *dst, i32 count) {
+  const __m128 lo = _mm_set1_ps(-1.0f), hi = _mm_set1_ps(1.0f);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_loadu_ps(src + i);
+    _mm_storeu_ps(dst + i, _mm_min_ps(_mm_max_ps(x, lo), hi));
+  }
+  f32_clip_scalar(src + i, dst + i, count - i);
+}
+
+static __m128i xorshift32_sse2(__m128i x) {
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  return _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+}
+
+static __m128 u32_to_unit_f32_sse2(__m128i x) {
+  __m128i bits =
+      _mm_or_si128(_mm_srli_epi32(x, 9), _mm_set1_epi32(0x3f800000));
+  return _mm_sub_ps(_mm_castsi128_ps(bits), _mm_set1_ps(1.0f));
+}
+
+static void add_dither_sse2(audio_dither_t *d, f32 *dst, i32 count,
+                            f32 amplitude) {
+  const __m128 scale = _mm_set1_ps(amplitude);
+  __m128i state = _mm_loadu_si128((const __m128i *)d->state);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = state = xorshift32_sse2(state);
+    __m128i b = state = xorshift32_sse2(state);
+    __m128 noise =
+        _mm_sub_ps(u32_to_unit_f32_sse2(a), u32_to_unit_f32_sse2(b));
+    _mm_storeu_ps(dst + i, _mm_add_ps(_mm_loadu_ps(dst + i),
+                                      _mm_mul_ps(noise, scale)));
+  }
+  _mm_storeu_si128((__m128i *)d->state, state);
+  add_dither_scalar(d, dst + i, count - i, amplitude);
+}
+
+static const kernels_t sse2_kernels = {
+    .name = "sse2",
+    .mix_ramp = mix_ramp_sse2,
+    .apply_ramp = apply_ramp_sse2,
+    .peak = peak_sse2,
+    .s16_to_f32 = s16_to_f32_sse2,
+    .s32_to_f32 = s32_to_f32_sse2,
+    .f32_to_s16 = f32_to_s16_sse2,
+    .f32_to_s32 = f32_to_s32_sse2,
+    .f32_clip = f32_clip_sse2,
+    .add_dither = add_dither_sse2,
+};
+
+static AVX2_FN void mix_ramp_avx2(f32 *dst, const f32 *src, i32 count,
+                                  f32 gain, f32 gain_step) {
+  __m256 g = _mm256_add_ps(
+      _mm256_set1_ps(gain),
+      _mm256_mul_ps(_mm256_set1_ps(gain_step),
+                    _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f,
+                                   7.0f)));
+  __m256 step = _mm256_set1_ps(gain_step * 8.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 d = _mm256_loadu_ps(dst + i);
+    d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_loadu_ps(src + i), g));
+    _mm256_storeu_ps(dst + i, d);
+    g = _mm256_add_ps(g, step);
+  }
+  mix_ramp_sse2(dst + i, src + i, count - i, gain + (f32)i * gain_step,
+                gain_step);
+}
+
+static AVX2_FN void apply_ramp_avx2(f32 *dst, i32 count, f32 gain,
+                                    f32 gain_step) {
+  __m256 g = _mm256_add_ps(
+      _mm256_set1_ps(gain),
+      _mm256_mul_ps(_mm256_set1_ps(gain_step),
+                    _mm256_setr_ps(0.0f, 1.0f, 2.0f, 3.0f, 4.0f, 5.0f, 6.0f,
+                                   7.0f)));
+  __m256 step = _mm256_set1_ps(gain_step * 8.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_loadu_ps(dst + i), g));
+    g = _mm256_add_ps(g, step);
+  }
+  apply_ramp_sse2(dst + i, count - i, gain + (f32)i * gain_step, gain_step);
+}
+
+static AVX2_FN f32 peak_avx2(const f32 *src, i32 count) {
+  const __m256 mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  __m256 peak = _mm256_setzero_ps();
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    peak = _mm256_max_ps(peak, _mm256_and_ps(_mm256_loadu_ps(src + i), mask));
+  }
+  __m128 half = _mm_max_ps(_mm256_castps256_ps128(peak),
+                           _mm256_extractf128_ps(peak, 1));
+  return sve2_max_f32(hmax_sse2(half), peak_sse2(src + i, count - i));
+}
+
+static AVX2_FN void s16_to_f32_avx2(const i16 *src, f32 *dst, i32 count) {
+  const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i x = _mm256_cvtepi16_epi32(
+        _mm_loadu_si128((const __m128i *)(src + i)));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+  }
+  s16_to_f32_scalar(src + i, dst + i, count - i);
+}
+
+static AVX2_FN void s32_to_f32_avx2(const i32 *src, f32 *dst, i32 count) {
+  const __m256 scale = _mm256_set1_ps(1.0f / 2147483648.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+  }
+  s32_to_f32_scalar(src + i, dst + i, count - i);
+}
+
+static AVX2_FN void f32_to_s16_avx2(const f32 *src, i16 *dst, i32 count) {
+  const __m256 lo = _mm256_set1_ps(-1.0f), hi = _mm256_set1_ps(1.0f);
+  const __m256 scale = _mm256_set1_ps(32768.0f);
+  i32 i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256 a = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + i), lo), hi);
+    __m256 b =
+        _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(src + i + 8), lo), hi);
+    __m256i ia = _mm256_cvtps_epi32(_mm256_mul_ps(a, scale));
+    __m256i ib = _mm256_cvtps_epi32(_mm256_mul_ps(b, scale));
+    // packs works per 128-bit lane: [a0 b0 | a1 b1], reorder the 64-bit
+    // quarters to [a0 a1 | b0 b1]
+    __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(ia, ib),
+                                              _MM_SHUFFLE(3, 1, 2, 0));
+    _mm256_storeu_si256((__m256i *)(dst + i), packed);
+  }
+  f32_to_s16_sse2(src + i, dst + i, count - i);
+}
+
+static AVX2_FN void f32_to_s32_avx2(const f32 *src, i32 *dst, i32 count) {
+  const __m256 lo = _mm256_set1_ps(-2147483648.0f);
+  const __m256 hi = _mm256_set1_ps(F32_S32_MAX);
+  const __m256 scale = _mm256_set1_ps(2147483648.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_mul_ps(_mm256_loadu_ps(src + i), scale);
+    x = _mm256_min_ps(_mm256_max_ps(x, lo), hi);
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_cvtps_epi32(x));
+  }
+  f32_to_s32_scalar(src + i, dst + i, count - i);
+}
+
+static AVX2_FN void f32_clip_avx2(const f32 *src, f32 *dst, i32 count) {
+  const __m256 lo = _mm256_set1_ps(-1.0f), hi = _mm256_set1_ps(1.0f);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_loadu_ps(src + i);
+    _mm256_storeu_ps(dst + i, _mm256_min_ps(_mm256_max_ps(x, lo), hi));
+  }
+  f32_clip_scalar(src + i, dst + i, count - i);
+}
+
+static const kernels_t avx2_kernels = {
+    .name = "avx2",
+    .mix_ramp = mix_ramp_avx2,
+    .apply_ramp = apply_ramp_avx2,
+    .peak = peak_avx2,
+    .s16_to_f32 = s16_to_f32_avx2,
+    .s32_to_f32 = s32_to_f32_avx2,
+    .f32_to_s16 = f32_to_s16_avx2,
+    .f32_to_s32 = f32_to_s32_avx2,
+    .f32_clip = f32_clip_avx2,
+    .add_dither = add_dither_sse2,
+};
+#endif
+
+static kernels_t kernels;
+static once_flag kernels_once = ONCE_FLAG_INIT;
+
+static void init_kernels() {
+  kernels = scalar_kernels;
+#ifdef SVE2_AUDIO_KERNELS_X86
+  kernels = sse2_kernels;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    kernels = avx2_kernels;
+  }
+#endif
+  log_info("using %s audio kernels", kernels.name);
+}
+
+static const kernels_t *get_kernels() {
+  call_once(&kernels_once, init_kernels);
+  return &kernels;
+}
+
+// (de)interleaving, stereo is special-cased since it is by far the most common
+// channel layout
+static void interleave(const f32 *const src[], i32 offset, i32 nb_channels,
+                       i32 nb_samples, f32 *dst) {
+  i32 i = 0;
+#ifdef SVE2_AUDIO_KERNELS_X86
+  if (nb_channels == 2) {
+    const f32 *l = src[0] + offset, *r = src[1] + offset;
+    for (; i + 4 <= nb_samples; i += 4) {
+      __m128 a = _mm_loadu_ps(l + i), b = _mm_loadu_ps(r + i);
+      _mm_storeu_ps(dst + 2 * i, _mm_unpacklo_ps(a, b));
+      _mm_storeu_ps(dst + 2 * i + 4, _mm_unpackhi_ps(a, b));
+    }
+  }
+#endif
+  for (; i < nb_samples; ++i) {
+    for (i32 c = 0; c < nb_channels; ++c) {
+      dst[i * nb_channels + c] = src[c][offset + i];
+    }
+  }
+}
+
+static void deinterleave(const f32 *src, i32 nb_channels, i32 nb_samples,
+                         f32 *const dst[], i32 offset) {
+  i32 i = 0;
+#ifdef SVE2_AUDIO_KERNELS_X86
+  if (nb_channels == 2) {
+    f32 *l = dst[0] + offset, *r = dst[1] + offset;
+    for (; i + 4 <= nb_samples; i += 4) {
+      __m128 a = _mm_loadu_ps(src + 2 * i), b = _mm_loadu_ps(src + 2 * i + 4);
+      _mm_storeu_ps(l + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+      _mm_storeu_ps(r + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+    }
+  }
+#endif
+  for (; i < nb_samples; ++i) {
+    for (i32 c = 0; c < nb_channels; ++c) {
+      dst[c][offset + i] = src[i * nb_channels + c];
+    }
+  }
+}
+
+void audio_dither_init(audio_dither_t *d, u32 seed) {
+  for (i32 i = 0; i < 4; ++i) {
+    // xorshift32 is stuck at 0, so make sure no lane is
+    d->state[i] = xorshift32(seed + 0x9e3779b9u * (u32)(i + 1)) | 1u;
+  }
+}
+
+void audio_kernel_mix_ramp(f32 *dst, const f32 *src, i32 count, f32 gain,
+                           f32 gain_step) {
+  get_kernels()->mix_ramp(dst, src, count, gain, gain_step);
+}
+
+void audio_kernel_apply_ramp(f32 *dst, i32 count, f32 gain, f32 gain_step) {
+  get_kernels()->apply_ramp(dst, count, gain, gain_step);
+}
+
+f32 audio_kernel_peak(const f32 *src, i32 count) {
+  return get_kernels()->peak(src, count);
+}
+
+// conversions go through a small interleaved float buffer on the stack, so
+// that every step is a contiguous (vectorizable) loop
+#define CHUNK_SIZE 1024
+
+void audio_kernel_planar_from_interleaved(enum AVSampleFormat fmt,
+                                          const u8 *src, i32 nb_channels,
+                                          i32 nb_samples, f32 *const dst[]) {
+  const kernels_t *k = get_kernels();
+  assert(nb_channels > 0 && nb_channels <= SVE2_MAX_AUDIO_CHANNELS);
+  i32 bytes = av_get_bytes_per_sample(fmt);
+  // e.g. the data chunk of a mapped WAV file is only 2-byte aligned, so such
+  // samples are copied to an aligned buffer before being read as i32 or f32
+  bool misaligned = bytes > 0 && (uintptr_t)src % bytes != 0;
+  if (fmt == AV_SAMPLE_FMT_FLT && !misaligned) {
+    deinterleave((const f32 *)src, nb_channels, nb_samples, dst, 0);
+    return;
+  }
+
+  f32 chunk[CHUNK_SIZE];
+  alignas(f32) u8 aligned[CHUNK_SIZE * sizeof(f32)];
+  i32 chunk_samples = CHUNK_SIZE / nb_channels;
+  i32 sample_size = bytes * nb_channels;
+  for (i32 i = 0; i < nb_samples; i += chunk_samples) {
+    i32 n = sve2_min_i32(chunk_samples, nb_samples - i);
+    const u8 *s = src + (i64)i * sample_size;
+    if (misaligned) {
+      memcpy(aligned, s, (size_t)n * sample_size);
+      s = aligned;
+    }
+    switch (fmt) {
+    case AV_SAMPLE_FMT_FLT:
+      deinterleave((const f32 *)s, nb_channels, n, dst, i);
+      continue;
+    case AV_SAMPLE_FMT_U8:
+      u8_to_f32(s, chunk, n * nb_channels);
+      break;
+    case AV_SAMPLE_FMT_S16:
+      k->s16_to_f32((const i16 *)s, chunk, n * nb_channels);
+      break;
+    case AV_SAMPLE_FMT_S32:
+      k->s32_to_f32((const i32 *)s, chunk, n * nb_channels);
+      break;
+    default:
+      log_error("unsupported sample format: %s", av_get_sample_fmt_name(fmt));
+      panic();
+    }
+    deinterleave(chunk, nb_channels, n, dst, i);
+  }
+}
+
+void audio_kernel_interleaved_from_planar(enum AVSampleFormat fmt,
+                                          const f32 *const src[],
+                                          i32 nb_channels, i32 nb_samples,
+                                          audio_dither_t *dither, u8 *dst) {
+  const kernels_t *k = get_kernels();
+  assert(nb_channels > 0 && nb_channels <= SVE2_MAX_AUDIO_CHANNELS);
+  // 1 LSB of the destination format, wider formats are not dithered
+  f32 dither_amplitude = 0.0f;
+  if (fmt == AV_SAMPLE_FMT_S16) {
+    dither_amplitude = 1.0f / 32768.0f;
+  } else if (fmt == AV_SAMPLE_FMT_U8) {
+    dither_amplitude = 1.0f / 128.0f;
+  }
+
+  f32 chunk[CHUNK_SIZE];
+  i32 chunk_samples = CHUNK_SIZE / nb_channels;
+  i32 sample_size = av_get_bytes_per_sample(fmt) * nb_channels;
+  for (i32 i = 0; i < nb_samples; i += chunk_samples) {
+    i32 n = sve2_min_i32(chunk_samples, nb_samples - i);
+    u8 *d = dst + (i64)i * sample_size;
+    interleave(src, i, nb_channels, n, chunk);
+    if (dither && dither_amplitude > 0.0f) {
+      k->add_dither(dither, chunk, n * nb_channels, dither_amplitude);
+    }
+    switch (fmt) {
+    case AV_SAMPLE_FMT_U8:
+      f32_to_u8(chunk, d, n * nb_channels);
+      break;
+    case AV_SAMPLE_FMT_S16:
+      k->f32_to_s16(chunk, (i16 *)d, n * nb_channels);
+      break;
+    case AV_SAMPLE_FMT_S32:
+      k->f32_to_s32(chunk, (i32 *)d, n * nb_channels);
+      break;
+    case AV_SAMPLE_FMT_FLT:
+      k->f32_clip(chunk, (f32 *)d, n * nb_channels);
+      break;
+    default:
+      log_error("unsupported sample format: %s", av_get_sample_fmt_name(fmt));
+      panic();
+    }
+  }
+}
+
+const char *audio_kernel_impl_name() { return get_kernels()->name; }
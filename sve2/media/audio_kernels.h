@@ -0,0 +1,85 @@
+#pragma once
+
+#include <libavutil/samplefmt.h>
+
+#include "sve2/utils/types.h"
+
+// maximum number of channels of planar audio buffers used throughout sve2
+#define SVE2_MAX_AUDIO_CHANNELS 8
+
+// vectorized audio sample kernels
+//
+// the implementation is chosen at runtime: AVX2 if supported by the CPU, SSE2
+// on other x86-64 CPUs and a portable scalar fallback everywhere else (or if
+// SVE2_NO_NONSTD is defined, since this requires compiler intrinsics).
+//
+// float samples are in [-1, 1]. Conversions to integer formats saturate, so
+// summed buses with no headroom are clipped instead of wrapped around.
+
+/**
+ * @brief State of the dither noise generator (4 xorshift32 lanes)
+ */
+typedef struct {
+  u32 state[4];
+} audio_dither_t;
+
+void audio_dither_init(audio_dither_t *d, u32 seed);
+
+// dst[c] = planes[c] + offset for every channel, to address the middle of a
+// block of planar samples
+static inline void audio_planes_offset(f32 *const planes[], i32 nb_channels,
+                                       i64 offset, f32 *dst[]) {
+  for (i32 c = 0; c < nb_channels; ++c) {
+    dst[c] = planes[c] + offset;
+  }
+}
+
+/**
+ * @brief dst[i] += src[i] * (gain + i * gain_step) for i in [0, count). This is
+ * used to sum a track with a gain ramp into a mixing bus.
+ */
+void audio_kernel_mix_ramp(f32 *dst, const f32 *src, i32 count, f32 gain,
+                           f32 gain_step);
+
+/**
+ * @brief dst[i] *= gain + i * gain_step for i in [0, count), in place.
+ */
+void audio_kernel_apply_ramp(f32 *dst, i32 count, f32 gain, f32 gain_step);
+
+/**
+ * @brief Get the maximum absolute value of src[0..count) (0 if count is 0)
+ */
+f32 audio_kernel_peak(const f32 *src, i32 count);
+
+/**
+ * @brief Convert interleaved samples (of a non-planar format) to planar float.
+ *
+ * @param fmt Sample format of src, must be u8, s16, s32 or flt
+ * @param src Interleaved samples
+ * @param nb_channels Number of channels (at most SVE2_MAX_AUDIO_CHANNELS)
+ * @param nb_samples Number of samples (per channel)
+ * @param dst Destination planes, one per channel
+ */
+void audio_kernel_planar_from_interleaved(enum AVSampleFormat fmt,
+                                          const u8 *src, i32 nb_channels,
+                                          i32 nb_samples, f32 *const dst[]);
+
+/**
+ * @brief Convert planar float samples to interleaved samples (of a non-planar
+ * format) with saturation, in one pass.
+ *
+ * @param fmt Sample format of dst, must be u8, s16, s32 or flt
+ * @param src Source planes, one per channel
+ * @param nb_channels Number of channels (at most SVE2_MAX_AUDIO_CHANNELS)
+ * @param nb_samples Number of samples (per channel)
+ * @param dither If not NULL, TPDF dither of 1 LSB is added before quantizing
+ * to u8 or s16 (s32 and flt are not dithered)
+ * @param dst Interleaved destination
+ */
+void audio_kernel_interleaved_from_planar(enum AVSampleFormat fmt,
+                                          const f32 *const src[],
+                                          i32 nb_channels, i32 nb_samples,
+                                          audio_dither_t *dither, u8 *dst);
+
+// name of the selected implementation ("avx2", "sse2" or "scalar")
+const char *audio_kernel_impl_name();
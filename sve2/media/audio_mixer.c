@@ -0,0 +1,336 @@
+#include "audio_mixer.h"
+
+#include <string.h>
+
+#include <stb/stb_ds.h>
+
+#include "sve2/media/audio_kernels.h"
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+// number of samples (per channel) mixed at once
+#define MIXER_BLOCK_SIZE 1024
+
+// element of the worker ring: a block of mixed samples, with the planes stored
+// one after another
+typedef struct {
+  i32 num_samples;
+  f32 samples[];
+} mixer_block_t;
+
+static f32 *block_plane(mixer_block_t *b, i32 c) {
+  return b->samples + c * MIXER_BLOCK_SIZE;
+}
+
+void audio_mixer_init(context_t *ctx, audio_mixer_t *m) {
+  m->ctx = ctx;
+  m->tracks = NULL;
+  m->nb_channels = ctx->info.ch_layout->nb_channels;
+  assert(m->nb_channels <= SVE2_MAX_AUDIO_CHANNELS);
+  for (i32 c = 0; c < m->nb_channels; ++c) {
+    m->track_planes[c] = sve2_malloc(MIXER_BLOCK_SIZE * sve2_sizeof(f32));
+  }
+  audio_fx_chain_init(&m->master_fx, m->nb_channels, ctx->info.sample_rate);
+  sve2_mtx_init(&m->lock, mtx_plain);
+  sve2_mtx_init(&m->worker_lock, mtx_plain);
+  sve2_cnd_init(&m->worker_cond);
+  m->has_worker = false;
+}
+
+static void stop_worker(audio_mixer_t *m) {
+  sve2_mtx_lock(&m->worker_lock);
+  m->stopping = true;
+  sve2_cnd_broadcast(&m->worker_cond);
+  sve2_mtx_unlock(&m->worker_lock);
+  thrd_join(m->worker, NULL);
+}
+
+void audio_mixer_free(audio_mixer_t *m) {
+  if (m->has_worker) {
+    stop_worker(m);
+    spsc_ring_free(&m->ring);
+  }
+  cnd_destroy(&m->worker_cond);
+  mtx_destroy(&m->worker_lock);
+  mtx_destroy(&m->lock);
+
+  for (i32 c = 0; c < m->nb_channels; ++c) {
+    sve2_freep(&m->track_planes[c]);
+  }
+  for (i32 i = 0; i < (i32)stbds_arrlen(m->tracks); ++i) {
+    audio_fx_chain_free(&m->tracks[i].fx);
+  }
+  audio_fx_chain_free(&m->master_fx);
+  stbds_arrfree(m->tracks);
+}
+
+static void update_track_targets(audio_mixer_t *m, audio_mixer_track_t *t,
+                                 i32 ramp_samples) {
+  for (i32 c = 0; c < m->nb_channels; ++c) {
+    t->channel_targets[c] = t->gain;
+  }
+  if (m->nb_channels >= 2) {
+    // balance law on the front left/right channels
+    t->channel_targets[0] *= sve2_min_f32(1.0f - t->pan, 1.0f);
+    t->channel_targets[1] *= sve2_min_f32(1.0f + t->pan, 1.0f);
+  }
+
+  t->ramp_samples = sve2_max_i32(ramp_samples, 0);
+  for (i32 c = 0; c < m->nb_channels; ++c) {
+    if (t->ramp_samples == 0) {
+      t->channel_gains[c] = t->channel_targets[c];
+      t->channel_steps[c] = 0.0f;
+    } else {
+      t->channel_steps[c] = (t->channel_targets[c] - t->channel_gains[c]) /
+                            (f32)t->ramp_samples;
+    }
+  }
+}
+
+i32 audio_mixer_add_track(audio_mixer_t *m, audio_t *source) {
+  audio_mixer_track_t track = {
+      .source = source,
+      .gain = 1.0f,
+      .pan = 0.0f,
+  };
+  update_track_targets(m, &track, 0);
+  audio_fx_chain_init(&track.fx, m->nb_channels, m->ctx->info.sample_rate);
+  sve2_mtx_lock(&m->lock);
+  stbds_arrput(m->tracks, track);
+  i32 id = (i32)stbds_arrlen(m->tracks) - 1;
+  sve2_mtx_unlock(&m->lock);
+  return id;
+}
+
+void audio_mixer_remove_track(audio_mixer_t *m, i32 track) {
+  sve2_mtx_lock(&m->lock);
+  m->tracks[track].source = NULL;
+  audio_fx_chain_free(&m->tracks[track].fx);
+  sve2_mtx_unlock(&m->lock);
+}
+
+void audio_mixer_set_gain(audio_mixer_t *m, i32 track, f32 gain,
+                          i32 ramp_samples) {
+  sve2_mtx_lock(&m->lock);
+  m->tracks[track].gain = gain;
+  update_track_targets(m, &m->tracks[track], ramp_samples);
+  sve2_mtx_unlock(&m->lock);
+}
+
+void audio_mixer_set_pan(audio_mixer_t *m, i32 track, f32 pan,
+                         i32 ramp_samples) {
+  sve2_mtx_lock(&m->lock);
+  m->tracks[track].pan = sve2_max_f32(sve2_min_f32(pan, 1.0f), -1.0f);
+  update_track_targets(m, &m->tracks[track], ramp_samples);
+  sve2_mtx_unlock(&m->lock);
+}
+
+static audio_fx_chain_t *get_fx_chain(audio_mixer_t *m, i32 track) {
+  return track == AUDIO_MIXER_MASTER ? &m->master_fx : &m->tracks[track].fx;
+}
+
+i32 audio_mixer_add_fx(audio_mixer_t *m, i32 track,
+                       const audio_fx_params_t *params) {
+  sve2_mtx_lock(&m->lock);
+  i32 fx = audio_fx_chain_add(get_fx_chain(m, track), params);
+  sve2_mtx_unlock(&m->lock);
+  return fx;
+}
+
+void audio_mixer_set_fx(audio_mixer_t *m, i32 track, i32 fx,
+                        const audio_fx_params_t *params) {
+  sve2_mtx_lock(&m->lock);
+  audio_fx_chain_set(get_fx_chain(m, track), fx, params);
+  sve2_mtx_unlock(&m->lock);
+}
+
+// sum num_samples samples of track_planes into the bus
+static void mix_track(audio_mixer_t *m, audio_mixer_track_t *t,
+                      f32 *const bus[], i32 num_samples) {
+  // the block is split in two parts: the end of the gain ramp (if any), and
+  // constant gain
+  i32 ramp = sve2_min_i32(t->ramp_samples, num_samples);
+  for (i32 c = 0; c < m->nb_channels; ++c) {
+    audio_kernel_mix_ramp(bus[c], m->track_planes[c], ramp,
+                          t->channel_gains[c], t->channel_steps[c]);
+    // snap to the target at the end of the ramp to avoid accumulating errors
+    if (ramp == t->ramp_samples) {
+      t->channel_gains[c] = t->channel_targets[c];
+    } else {
+      t->channel_gains[c] += ramp * t->channel_steps[c];
+    }
+    audio_kernel_mix_ramp(bus[c] + ramp, m->track_planes[c] + ramp,
+                          num_samples - ramp, t->channel_gains[c], 0.0f);
+  }
+  t->ramp_samples -= ramp;
+}
+
+// mix num_samples samples into planes, with the lock held
+static void mix(audio_mixer_t *m, i32 num_samples[static 1],
+                f32 *const planes[]) {
+  i32 num_total = 0;
+  while (num_total < *num_samples) {
+    i32 block_size = sve2_min_i32(MIXER_BLOCK_SIZE, *num_samples - num_total);
+    f32 *bus[SVE2_MAX_AUDIO_CHANNELS];
+    audio_planes_offset(planes, m->nb_channels, num_total, bus);
+    for (i32 c = 0; c < m->nb_channels; ++c) {
+      memset(bus[c], 0, block_size * sizeof(f32));
+    }
+
+    i32 num_mixed = 0;
+    for (i32 i = 0; i < (i32)stbds_arrlen(m->tracks); ++i) {
+      audio_mixer_track_t *t = &m->tracks[i];
+      if (!t->source || t->ended) {
+        continue;
+      }
+
+      i32 num_read = block_size;
+      audio_get_samples(t->source, &num_read, m->track_planes);
+      t->ended = num_read < block_size;
+      audio_fx_chain_process(&t->fx, m->track_planes, num_read);
+      mix_track(m, t, bus, num_read);
+      num_mixed = sve2_max_i32(num_mixed, num_read);
+    }
+    audio_fx_chain_process(&m->master_fx, bus, num_mixed);
+
+    num_total += num_mixed;
+    if (num_mixed < block_size) {
+      break;
+    }
+  }
+
+  *num_samples = num_total;
+}
+
+static int run_worker(void *arg) {
+  audio_mixer_t *m = arg;
+  while (true) {
+    sve2_mtx_lock(&m->worker_lock);
+    while (!m->stopping &&
+           (m->worker_ended || spsc_ring_space(&m->ring) == 0)) {
+      sve2_cnd_wait(&m->worker_cond, &m->worker_lock);
+    }
+    bool stopping = m->stopping;
+    sve2_mtx_unlock(&m->worker_lock);
+    if (stopping) {
+      break;
+    }
+
+    // mix straight into the ring
+    u8 *data;
+    spsc_ring_write_map(&m->ring, 1, &data);
+    mixer_block_t *block = (mixer_block_t *)data;
+    f32 *planes[SVE2_MAX_AUDIO_CHANNELS];
+    for (i32 c = 0; c < m->nb_channels; ++c) {
+      planes[c] = block_plane(block, c);
+    }
+    block->num_samples = MIXER_BLOCK_SIZE;
+    sve2_mtx_lock(&m->lock);
+    mix(m, &block->num_samples, planes);
+    sve2_mtx_unlock(&m->lock);
+    bool ended = block->num_samples < MIXER_BLOCK_SIZE;
+    spsc_ring_write_commit(&m->ring, 1);
+
+    sve2_mtx_lock(&m->worker_lock);
+    m->worker_ended = ended;
+    sve2_cnd_broadcast(&m->worker_cond);
+    sve2_mtx_unlock(&m->worker_lock);
+  }
+
+  return 0;
+}
+
+static void start_worker(audio_mixer_t *m) {
+  m->stopping = m->worker_ended = false;
+  m->block_offset = 0;
+  spsc_ring_clear(&m->ring);
+  sve2_thrd_create(&m->worker, run_worker, m);
+}
+
+void audio_mixer_start(audio_mixer_t *m, i32 buffer_size) {
+  assert(!m->has_worker);
+  i32 num_blocks = sve2_max_i32(
+      (buffer_size + MIXER_BLOCK_SIZE - 1) / MIXER_BLOCK_SIZE, 2);
+  spsc_ring_init(&m->ring,
+                 sve2_sizeof(mixer_block_t) +
+                     m->nb_channels * MIXER_BLOCK_SIZE * sve2_sizeof(f32),
+                 num_blocks);
+  m->has_worker = true;
+  start_worker(m);
+}
+
+void audio_mixer_seek(audio_mixer_t *m, i64 time) {
+  // blocks mixed ahead are from the old position, so the worker is restarted
+  if (m->has_worker) {
+    stop_worker(m);
+  }
+
+  for (i32 i = 0; i < (i32)stbds_arrlen(m->tracks); ++i) {
+    audio_mixer_track_t *t = &m->tracks[i];
+    if (t->source) {
+      audio_seek(t->source, time);
+      t->ended = false;
+      audio_fx_chain_reset(&t->fx);
+    }
+  }
+  audio_fx_chain_reset(&m->master_fx);
+
+  if (m->has_worker) {
+    start_worker(m);
+  }
+}
+
+// copy mixed blocks out of the worker ring
+static void read_blocks(audio_mixer_t *m, i32 num_samples[static 1],
+                        f32 *const planes[]) {
+  i32 num_done = 0;
+  while (num_done < *num_samples) {
+    u8 *data;
+    if (spsc_ring_read_map(&m->ring, &data) == 0) {
+      // wait for the worker, unless every track has ended
+      sve2_mtx_lock(&m->worker_lock);
+      while (spsc_ring_size(&m->ring) == 0 && !m->worker_ended) {
+        sve2_cnd_wait(&m->worker_cond, &m->worker_lock);
+      }
+      bool ended = spsc_ring_size(&m->ring) == 0;
+      sve2_mtx_unlock(&m->worker_lock);
+      if (ended) {
+        break;
+      }
+      continue;
+    }
+
+    mixer_block_t *block = (mixer_block_t *)data;
+    i32 count = sve2_min_i32(block->num_samples - m->block_offset,
+                             *num_samples - num_done);
+    for (i32 c = 0; c < m->nb_channels; ++c) {
+      memcpy(planes[c] + num_done, block_plane(block, c) + m->block_offset,
+             count * sizeof(f32));
+    }
+    num_done += count;
+    m->block_offset += count;
+
+    if (m->block_offset == block->num_samples) {
+      m->block_offset = 0;
+      spsc_ring_read_commit(&m->ring, 1);
+      sve2_mtx_lock(&m->worker_lock);
+      sve2_cnd_broadcast(&m->worker_cond);
+      sve2_mtx_unlock(&m->worker_lock);
+    }
+  }
+
+  *num_samples = num_done;
+}
+
+void audio_mixer_get_samples(audio_mixer_t *m, i32 num_samples[static 1],
+                             f32 *const planes[]) {
+  if (m->has_worker) {
+    read_blocks(m, num_samples, planes);
+    return;
+  }
+
+  sve2_mtx_lock(&m->lock);
+  mix(m, num_samples, planes);
+  sve2_mtx_unlock(&m->lock);
+}
@@ -0,0 +1,182 @@
+#pragma once
+
+#include <threads.h>
+
+#include "sve2/context/context.h"
+#include "sve2/media/audio.h"
+#include "sve2/media/audio_fx.h"
+#include "sve2/media/audio_kernels.h"
+#include "sve2/utils/spsc_ring.h"
+#include "sve2/utils/types.h"
+
+// track ID of the master bus, for the effect functions
+#define AUDIO_MIXER_MASTER -1
+
+/**
+ * @brief A mixer track. Gain and pan changes are ramped linearly over a number
+ * of samples to avoid zipper noise.
+ */
+typedef struct {
+  /**
+   * @brief The audio source (not owned by the mixer). NULL for removed tracks.
+   */
+  audio_t *source;
+  /**
+   * @brief Target linear gain and pan (-1 is left, 0 is center, 1 is right)
+   */
+  f32 gain, pan;
+  /**
+   * @brief Current per-channel gains, their targets and the per-sample steps
+   * to get there
+   */
+  f32 channel_gains[SVE2_MAX_AUDIO_CHANNELS];
+  f32 channel_targets[SVE2_MAX_AUDIO_CHANNELS];
+  f32 channel_steps[SVE2_MAX_AUDIO_CHANNELS];
+  /**
+   * @brief Remaining length (in samples) of the current gain ramp
+   */
+  i32 ramp_samples;
+  /**
+   * @brief Whether the source has run out of samples (until the next seek)
+   */
+  bool ended;
+  /**
+   * @brief Effects of the track, applied before the gain and pan
+   */
+  audio_fx_chain_t fx;
+} audio_mixer_track_t;
+
+/**
+ * @brief Multi-track audio mixer. Tracks are pulled in blocks of planar float
+ * samples, scaled and summed straight into the destination bus using the
+ * vectorized kernels in audio_kernels.h. The bus is float, so there is headroom
+ * for summing: clipping only happens once, when the context converts the bus to
+ * the output sample format.
+ *
+ * Every track has a chain of effects (see audio_fx.h), and so does the master
+ * bus (applied after summing).
+ *
+ * The mixer can be used anywhere an audio_t can, e.g. to fill the bus returned
+ * by context_map_audio(). Mixing (and effects) can also run on a worker thread,
+ * see audio_mixer_start().
+ */
+typedef struct {
+  context_t *ctx;
+  /**
+   * @brief stb_ds array of tracks, indexed by track ID
+   */
+  audio_mixer_track_t *tracks;
+  i32 nb_channels;
+  /**
+   * @brief Block of samples of the current track
+   */
+  f32 *track_planes[SVE2_MAX_AUDIO_CHANNELS];
+  audio_fx_chain_t master_fx;
+  /**
+   * @brief Protects the tracks and effects, which are used by the worker
+   */
+  mtx_t lock;
+  /**
+   * @brief Mixing worker (see audio_mixer_start()), which fills `ring` with
+   * blocks of mixed samples
+   */
+  bool has_worker;
+  thrd_t worker;
+  spsc_ring_t ring;
+  /**
+   * @brief Number of samples of the first block of the ring already returned
+   */
+  i32 block_offset;
+  /**
+   * @brief Signaled when a block is produced or consumed. `stopping` and
+   * `worker_ended` (every track ended) are protected by `worker_lock`.
+   */
+  mtx_t worker_lock;
+  cnd_t worker_cond;
+  bool stopping, worker_ended;
+} audio_mixer_t;
+
+void audio_mixer_init(context_t *ctx, audio_mixer_t *m);
+void audio_mixer_free(audio_mixer_t *m);
+
+/**
+ * @brief Add a track to the mixer, with unity gain and center pan.
+ *
+ * @param m The mixer
+ * @param source An opened audio object. This must outlive the track.
+ * @return The track ID
+ */
+i32 audio_mixer_add_track(audio_mixer_t *m, audio_t *source);
+/**
+ * @brief Remove a track from the mixer. The track ID is not reused.
+ */
+void audio_mixer_remove_track(audio_mixer_t *m, i32 track);
+
+/**
+ * @brief Set the gain of a track.
+ *
+ * @param m The mixer
+ * @param track The track ID
+ * @param gain The new linear gain
+ * @param ramp_samples Length of the transition (in samples), 0 to change the
+ * gain immediately
+ */
+void audio_mixer_set_gain(audio_mixer_t *m, i32 track, f32 gain,
+                          i32 ramp_samples);
+/**
+ * @brief Set the pan of a track. Panning uses the balance law (the louder side
+ * stays at unity gain) on the first two channels, so a centered track is not
+ * attenuated.
+ *
+ * @param m The mixer
+ * @param track The track ID
+ * @param pan The new pan, in [-1, 1]
+ * @param ramp_samples Length of the transition (in samples), 0 to change the
+ * pan immediately
+ */
+void audio_mixer_set_pan(audio_mixer_t *m, i32 track, f32 pan,
+                         i32 ramp_samples);
+
+/**
+ * @brief Append an effect to the chain of a track, or of the master bus.
+ *
+ * @param m The mixer
+ * @param track The track ID, or AUDIO_MIXER_MASTER
+ * @param params The effect parameters
+ * @return The index of the effect in the chain
+ */
+i32 audio_mixer_add_fx(audio_mixer_t *m, i32 track,
+                       const audio_fx_params_t *params);
+/**
+ * @brief Change the parameters of an effect, see audio_fx_chain_set()
+ *
+ * @param m The mixer
+ * @param track The track ID, or AUDIO_MIXER_MASTER
+ * @param fx The index of the effect in the chain
+ * @param params The new effect parameters
+ */
+void audio_mixer_set_fx(audio_mixer_t *m, i32 track, i32 fx,
+                        const audio_fx_params_t *params);
+
+/**
+ * @brief Move mixing (and effects) off the calling thread. A worker thread
+ * mixes ahead of audio_mixer_get_samples(), which then only copies finished
+ * blocks (and waits for the worker if it falls behind). In render mode, the
+ * worker runs as fast as the sources can be decoded.
+ *
+ * Parameter changes are picked up by the worker for the next block it mixes,
+ * so they are heard with a delay of up to buffer_size samples.
+ *
+ * @param m The mixer
+ * @param buffer_size Number of samples (per channel) mixed ahead
+ */
+void audio_mixer_start(audio_mixer_t *m, i32 buffer_size);
+
+// same API as in audio.h, applied to every track
+void audio_mixer_seek(audio_mixer_t *m, i64 time);
+/**
+ * @brief Mix samples from all tracks. Fewer samples are returned only when
+ * every track has run out of samples.
+ */
+void audio_mixer_get_samples(audio_mixer_t *m, i32 num_samples[static 1],
+                             f32 *const planes[]);
@@ -1,66 +1,599 @@
 #include "audio_pcm.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <libavutil/frame.h>
 #include <libavutil/samplefmt.h>
 #include <libswresample/swresample.h>
 
+#include "sve2/media/audio_kernels.h"
 #include "sve2/media/ffmpeg_stream.h"
+#include "sve2/media/pcm_blocks.h"
+#include "sve2/media/wav.h"
+#include "sve2/utils/cache.h"
+#include "sve2/utils/hash.h"
 #include "sve2/utils/minmax.h"
 #include "sve2/utils/runtime.h"
 #include "sve2/utils/threads.h"
 
-bool audio_pcm_open(context_t *ctx, audio_pcm_t *a, const char *path,
-                    stream_index_t index) {
-  a->ctx = ctx;
-  a->cur_index = 0;
+#define PCM_CACHE_MAGIC "SVE2PCM1"
+
+// decoded samples are resampled straight to float, whatever the context sample
+// format, so reads only deinterleave them into the bus planes
+#define BUFFER_SAMPLE_FMT AV_SAMPLE_FMT_FLT
+
+// header of decoded PCM cache files, followed by the interleaved samples
+typedef struct {
+  char magic[8];
+  i64 num_samples;
+  i32 sample_rate, sample_fmt, nb_channels, reserved;
+} pcm_cache_header_t;
+
+// destination of decoded samples: a cache file, compressed blocks or a heap
+// buffer
+typedef struct {
+  FILE *file;
+  bool compress;
+  pcm_blocks_t blocks;
+  // the heap buffer, or a staging buffer for files and compressed blocks
+  u8 *buffer;
+  i64 num_samples, capacity;
+  i32 sample_size;
+  bool failed;
+} pcm_sink_t;
+
+static bool sink_is_staged(const pcm_sink_t *s) {
+  return s->file || s->compress;
+}
+
+// get space for up to max_samples samples
+static u8 *sink_map(pcm_sink_t *s, i32 max_samples) {
+  i64 offset = sink_is_staged(s) ? 0 : s->num_samples;
+  if (offset + max_samples > s->capacity) {
+    s->capacity = sve2_max_i64(s->capacity * 2, offset + max_samples);
+    s->buffer = sve2_realloc(s->buffer, s->capacity * s->sample_size);
+  }
+
+  return s->buffer + offset * s->sample_size;
+}
+
+static void sink_commit(pcm_sink_t *s, i32 num_samples) {
+  if (s->file && !s->failed) {
+    s->failed = fwrite(s->buffer, (size_t)s->sample_size, (size_t)num_samples,
+                       s->file) != (size_t)num_samples;
+  } else if (s->compress) {
+    pcm_blocks_append(&s->blocks, s->buffer, num_samples);
+  }
+
+  s->num_samples += num_samples;
+}
+
+static void sink_free(pcm_sink_t *s) {
+  sve2_freep(&s->buffer);
+  pcm_blocks_free(&s->blocks);
+}
 
-  // we load the data using FFmpeg, and we will do the resampling manually, so
-  // we use the base ffmpeg_stream_t type
+// segments shorter than this (in seconds) are not worth a separate decoder
+#define MIN_SEGMENT_DURATION 60
+#define MAX_NUM_SEGMENTS 16
+// amount of audio (in ns) decoded before the start of a segment and discarded,
+// so decoders with inter-frame state (MP3 bit reservoir, AAC/Opus overlap) and
+// the resampler filter are primed exactly like in a serial decode
+#define SEGMENT_PREROLL (SVE2_NS_PER_SEC / 2)
+
+// a range of output samples [begin, end) decoded by a worker thread. end is
+// negative for the last segment (decode until EOF).
+typedef struct {
+  context_t *ctx;
+  const char *path;
+  stream_index_t index;
+  i64 begin, end;
+  // start time of the stream (ns), sample 0 of the output
+  i64 origin;
+  // the stream, only opened beforehand for the first segment
   ffmpeg_stream_t stream;
-  if (!ffmpeg_stream_open(ctx, &stream, path, index, false)) {
-    return false;
+  bool opened;
+  // cache file being written (in file mode), opened separately by each worker
+  const char *file_path;
+  pcm_sink_t sink;
+  // PTS of the first decoded frame (ns)
+  i64 first_pts;
+  // whether the segment was decoded successfully and landed on its range
+  bool ok;
+} pcm_segment_t;
+
+// convert samples, and only keep those in [begin, end). pos is the output
+// position of the first converted sample, and the new position is returned.
+static i64 segment_convert(pcm_segment_t *s, struct SwrContext *resampler,
+                           const u8 **in, i32 in_count, i64 pos) {
+  i32 max_out = swr_get_out_samples(resampler, in_count);
+  u8 *out = sink_map(&s->sink, max_out);
+  i32 num_out;
+  nassert_ffmpeg(num_out = swr_convert(resampler, (u8 *const[]){out}, max_out,
+                                       in, in_count));
+
+  i64 first = sve2_min_i64(sve2_max_i64(s->begin - pos, 0), num_out);
+  i64 last = s->end < 0 ? num_out : sve2_min_i64(s->end - pos, num_out);
+  if (last > first) {
+    memmove(out, out + first * s->sink.sample_size,
+            (size_t)((last - first) * s->sink.sample_size));
+    sink_commit(&s->sink, (i32)(last - first));
+  }
+
+  return pos + num_out;
+}
+
+static int decode_segment(void *arg) {
+  pcm_segment_t *s = arg;
+  context_t *ctx = s->ctx;
+  s->ok = false;
+  if (!s->opened &&
+      !ffmpeg_stream_open(ctx, &s->stream, s->path, s->index, false)) {
+    return 0;
+  }
+  s->opened = false;
+
+  if (s->file_path) {
+    // the only segment truncates the file, others write to their own range
+    bool whole = s->begin == 0 && s->end < 0;
+    s->sink.file = fopen(s->file_path, whole ? "wb" : "r+b");
+    s->sink.failed =
+        !s->sink.file ||
+        fseek(s->sink.file,
+              (long)(sve2_sizeof(pcm_cache_header_t) +
+                     s->begin * s->sink.sample_size),
+              SEEK_SET) != 0;
   }
 
   struct SwrContext *resampler = NULL;
   nassert_ffmpeg(swr_alloc_set_opts2(
-      &resampler, ctx->info.ch_layout, ctx->info.sample_fmt,
-      ctx->info.sample_rate, &stream.cdc_ctx->ch_layout,
-      stream.cdc_ctx->sample_fmt, stream.cdc_ctx->sample_rate, 0, NULL));
+      &resampler, ctx->info.ch_layout, BUFFER_SAMPLE_FMT,
+      ctx->info.sample_rate, &s->stream.cdc_ctx->ch_layout,
+      s->stream.cdc_ctx->sample_fmt, s->stream.cdc_ctx->sample_rate, 0, NULL));
   nassert_ffmpeg(swr_init(resampler));
 
-  AVFrame *frame = ctx->temp_frames[0];
-  while (ffmpeg_stream_get_frame(&stream, frame)) {
-    // this submits the frame to the resampler context (which acts as an audio
-    // FIFO buffer). We can retrieve the audio PCM data in one go later.
-    swr_convert_frame(resampler, NULL, frame);
+  i32 sample_rate = ctx->info.sample_rate;
+  if (s->begin > 0) {
+    // some demuxers fail to seek before the start of the stream
+    i64 seek_time =
+        s->origin + av_rescale(s->begin, SVE2_NS_PER_SEC, sample_rate);
+    nassert(ffmpeg_stream_seek(
+        &s->stream, sve2_max_i64(seek_time - SEGMENT_PREROLL, s->origin)));
+  }
+
+  AVFrame *frame;
+  nassert(frame = av_frame_alloc());
+  bool positioned = false, landed = s->begin == 0;
+  i64 pos = 0;
+  while ((s->end < 0 || pos < s->end) &&
+         ffmpeg_stream_get_frame(&s->stream, frame)) {
+    if (!positioned) {
+      positioned = true;
+      s->first_pts = frame->pts;
+      if (s->begin > 0) {
+        // the first segment starts at sample 0 by definition (like a serial
+        // decode), the others are positioned using timestamps
+        pos = av_rescale(frame->pts - s->origin, sample_rate, SVE2_NS_PER_SEC);
+        landed = pos <= s->begin;
+      }
+    }
+
+    // convert each frame right away, so the resampler never buffers more than
+    // a few samples
+    pos = segment_convert(s, resampler, (const u8 **)frame->extended_data,
+                          frame->nb_samples, pos);
     av_frame_unref(frame);
   }
+  if (s->end < 0) {
+    // flush the samples delayed by the resampler
+    segment_convert(s, resampler, NULL, 0, pos);
+  }
 
-  a->sample_size = av_get_bytes_per_sample(ctx->info.sample_fmt) *
-                   ctx->info.ch_layout->nb_channels;
-  // this might be incorrect, so we will reassign it below
-  a->num_samples = swr_get_out_samples(resampler, 0);
-  a->buffer = (u8 *)sve2_malloc(a->num_samples * a->sample_size);
-  nassert_ffmpeg(a->num_samples =
-                     swr_convert(resampler, (u8 *const[]){a->buffer},
-                                 a->num_samples, NULL, 0));
-
-  ffmpeg_stream_close(&stream);
+  av_frame_free(&frame);
   swr_free(&resampler);
+  ffmpeg_stream_close(&s->stream);
+  if (s->sink.file) {
+    s->sink.failed = fclose(s->sink.file) != 0 || s->sink.failed;
+    s->sink.file = NULL;
+  }
+  if (s->sink.compress) {
+    pcm_blocks_finish(&s->sink.blocks);
+  }
+
+  s->ok = landed && (s->end < 0 || s->sink.num_samples == s->end - s->begin);
+  return 0;
+}
+
+// split the stream into segments, return the number of segments
+static i32 plan_segments(pcm_segment_t *first, pcm_segment_t **segments) {
+  const AVStream *ff_stream =
+      first->stream.fmt_ctx->streams[first->stream.index.offset];
+  i64 duration = AV_NOPTS_VALUE;
+  if (ff_stream->duration != AV_NOPTS_VALUE) {
+    duration = av_rescale_q(ff_stream->duration, ff_stream->time_base,
+                            (AVRational){1, SVE2_NS_PER_SEC});
+  } else if (first->stream.fmt_ctx->duration != AV_NOPTS_VALUE) {
+    duration = first->stream.fmt_ctx->duration *
+               (SVE2_NS_PER_SEC / AV_TIME_BASE);
+  }
+  if (ff_stream->start_time != AV_NOPTS_VALUE) {
+    first->origin = av_rescale_q(ff_stream->start_time, ff_stream->time_base,
+                                 (AVRational){1, SVE2_NS_PER_SEC});
+  }
+
+  i32 num_segments = 1;
+  if (duration != AV_NOPTS_VALUE) {
+    num_segments = (i32)sve2_min_i64(
+        duration / (MIN_SEGMENT_DURATION * SVE2_NS_PER_SEC),
+        sve2_min_i32(sve2_get_num_cpus(), MAX_NUM_SEGMENTS));
+    num_segments = sve2_max_i32(num_segments, 1);
+  }
+
+  *segments = sve2_calloc(num_segments, sve2_sizeof(pcm_segment_t));
+  i64 num_samples =
+      av_rescale(duration, first->ctx->info.sample_rate, SVE2_NS_PER_SEC);
+  for (i32 i = 0; i < num_segments; ++i) {
+    pcm_segment_t *s = &(*segments)[i];
+    *s = *first;
+    s->opened = i == 0;
+    s->begin = num_samples * i / num_segments;
+    s->end = i + 1 < num_segments ? num_samples * (i + 1) / num_segments : -1;
+  }
+
+  return num_segments;
+}
+
+// decode and resample the whole stream into out. Long streams are split into
+// segments decoded in parallel, each writing directly to its own range of the
+// output (the samples near the boundaries are not bit-exact, see
+// audio_pcm.h). If the segments do not line up exactly (e.g. broken timestamps
+// or inaccurate seeking), the stream is decoded serially instead.
+//
+// in file mode (file_path is not NULL), the samples are written to the file
+// after the header, and only out->num_samples and out->failed are set. If
+// out->compress is set, the samples are stored in out->blocks instead of
+// out->buffer. returns false if and only if the stream could not be opened.
+static bool decode(context_t *ctx, const char *path, stream_index_t index,
+                   const char *file_path, pcm_sink_t *out) {
+  pcm_segment_t first = {
+      .ctx = ctx,
+      .path = path,
+      .index = index,
+      .end = -1,
+      .file_path = file_path,
+      .sink = *out,
+  };
+  if (!ffmpeg_stream_open(ctx, &first.stream, path, index, false)) {
+    return false;
+  }
+  first.opened = true;
+
+  pcm_segment_t *segments;
+  i32 num_segments = plan_segments(&first, &segments);
+  if (num_segments > 1) {
+    log_info("decoding '%s' in %" PRIi32 " parallel segments", path,
+             num_segments);
+  }
+
+  thrd_t *threads = sve2_calloc(num_segments, sve2_sizeof(thrd_t));
+  for (i32 i = 1; i < num_segments; ++i) {
+    sve2_thrd_create(&threads[i], decode_segment, &segments[i]);
+  }
+  decode_segment(&segments[0]);
+  for (i32 i = 1; i < num_segments; ++i) {
+    thrd_join(threads[i], NULL);
+  }
+  free(threads);
+
+  // the first segment must start at the stream origin like the others assume
+  bool ok = av_rescale(segments[0].first_pts - first.origin,
+                       ctx->info.sample_rate, SVE2_NS_PER_SEC) == 0 ||
+            num_segments == 1;
+  for (i32 i = 0; i < num_segments; ++i) {
+    ok = ok && segments[i].ok;
+  }
+
+  if (ok) {
+    *out = segments[0].sink;
+    for (i32 i = 1; i < num_segments; ++i) {
+      pcm_sink_t *sink = &segments[i].sink;
+      if (sink->compress) {
+        pcm_blocks_concat(&out->blocks, &sink->blocks);
+      } else if (!file_path) {
+        u8 *dst = sink_map(out, (i32)sink->num_samples);
+        memcpy(dst, sink->buffer,
+               (size_t)(sink->num_samples * sink->sample_size));
+      }
+      out->num_samples += sink->num_samples;
+      out->failed = out->failed || sink->failed;
+    }
+  }
+
+  for (i32 i = ok ? 1 : 0; i < num_segments; ++i) {
+    sink_free(&segments[i].sink);
+  }
+  free(segments);
+  if (sink_is_staged(out)) {
+    sve2_freep(&out->buffer);
+  }
+
+  if (!ok) {
+    if (num_segments == 1) {
+      return false;
+    }
+
+    log_warn("segments of '%s' do not line up, decoding serially", path);
+    pcm_segment_t whole = first;
+    whole.opened = false;
+    decode_segment(&whole);
+    if (!whole.ok) {
+      sink_free(&whole.sink);
+      return false;
+    }
+
+    *out = whole.sink;
+    if (sink_is_staged(out)) {
+      sve2_freep(&out->buffer);
+    }
+  }
 
   return true;
 }
 
-void audio_pcm_close(audio_pcm_t *a) { free(a->buffer); }
+static pcm_cache_header_t cache_header(context_t *ctx, i64 num_samples) {
+  pcm_cache_header_t header = {
+      .num_samples = num_samples,
+      .sample_rate = ctx->info.sample_rate,
+      .sample_fmt = BUFFER_SAMPLE_FMT,
+      .nb_channels = ctx->info.ch_layout->nb_channels,
+  };
+  memcpy(header.magic, PCM_CACHE_MAGIC, sizeof header.magic);
+  return header;
+}
+
+static char *cache_path(context_t *ctx, const char *path,
+                        stream_index_t index) {
+  u64 key;
+  if (!cache_hash_source(sve2_hash_str(SVE2_HASH_INIT, PCM_CACHE_MAGIC), path,
+                         &key)) {
+    return NULL;
+  }
+
+  char layout[64];
+  av_channel_layout_describe(ctx->info.ch_layout, layout, sizeof layout);
+  i32 params[] = {index.type, index.offset, ctx->info.sample_rate,
+                  BUFFER_SAMPLE_FMT};
+  key = sve2_hash_value(key, params);
+  key = sve2_hash_str(key, layout);
+  return cache_get_path(key, ".pcm");
+}
+
+static bool load_cache(audio_pcm_t *a, const char *path) {
+  if (!mapped_file_open(&a->mapping, path)) {
+    return false;
+  }
+
+  pcm_cache_header_t header;
+  if (a->mapping.size < sve2_sizeof(header)) {
+    goto fail;
+  }
+  memcpy(&header, a->mapping.data, sizeof header);
+  pcm_cache_header_t expected = cache_header(a->ctx, header.num_samples);
+  if (memcmp(&header, &expected, sizeof header) != 0 ||
+      a->mapping.size !=
+          sve2_sizeof(header) + header.num_samples * a->sample_size) {
+    goto fail;
+  }
+
+  a->buffer = a->mapping.data + sizeof header;
+  a->num_samples = header.num_samples;
+  log_info("loaded %" PRIi64 " decoded audio samples from cache file '%s'",
+           a->num_samples, path);
+  return true;
+
+fail:
+  log_warn("invalid audio cache file '%s'", path);
+  mapped_file_close(&a->mapping);
+  return false;
+}
+
+// returns false if and only if the stream could not be opened
+static bool write_cache(audio_pcm_t *a, const char *path, const char *src_path,
+                        stream_index_t index) {
+  char *temp_path;
+  FILE *f = cache_file_create(path, &temp_path);
+  if (!f) {
+    return true;
+  }
+
+  // the samples are written by the decoders through their own file handles,
+  // the header is written last
+  pcm_sink_t sink = {.sample_size = a->sample_size};
+  if (!decode(a->ctx, src_path, index, temp_path, &sink)) {
+    cache_file_abort(f, temp_path);
+    return false;
+  }
+
+  pcm_cache_header_t header = cache_header(a->ctx, sink.num_samples);
+  if (sink.failed || fwrite(&header, sizeof header, 1, f) != 1) {
+    log_warn("unable to write audio cache file '%s'", path);
+    cache_file_abort(f, temp_path);
+    return true;
+  }
+
+  cache_file_commit(f, temp_path, path);
+  return true;
+}
+
+static bool wav_layout_matches(const wav_info_t *info,
+                               const AVChannelLayout *layout) {
+  AVChannelLayout wav_layout;
+  if (info->channel_mask) {
+    if (av_channel_layout_from_mask(&wav_layout, info->channel_mask) < 0) {
+      return false;
+    }
+  } else {
+    av_channel_layout_default(&wav_layout, info->nb_channels);
+  }
+
+  bool matches = wav_layout.nb_channels == info->nb_channels &&
+                 av_channel_layout_compare(&wav_layout, layout) == 0;
+  av_channel_layout_uninit(&wav_layout);
+  return matches;
+}
+
+// serve WAV files with the context sample rate and channel layout straight from
+// a mapping of the file, without decoding
+static bool open_wav(audio_pcm_t *a, const char *path) {
+  context_t *ctx = a->ctx;
+  if (!mapped_file_open(&a->mapping, path)) {
+    return false;
+  }
+
+  wav_info_t info;
+  if (!wav_parse(a->mapping.data, a->mapping.size, &info) ||
+      info.sample_fmt == AV_SAMPLE_FMT_NONE ||
+      info.sample_rate != ctx->info.sample_rate ||
+      !wav_layout_matches(&info, ctx->info.ch_layout) ||
+      info.nb_channels > SVE2_MAX_AUDIO_CHANNELS) {
+    mapped_file_close(&a->mapping);
+    return false;
+  }
+
+  a->buffer = a->mapping.data + info.data_offset;
+  a->buffer_fmt = info.sample_fmt;
+  a->sample_size = info.block_align;
+  a->num_samples = info.data_size / info.block_align;
+  log_info("serving %" PRIi64 " samples (%s) of WAV file '%s' from memory",
+           a->num_samples, av_get_sample_fmt_name(a->buffer_fmt), path);
+  return true;
+}
+
+static bool open_pcm(context_t *ctx, audio_pcm_t *a, const char *path,
+                     stream_index_t index, bool compressed, i32 bits) {
+  a->ctx = ctx;
+  a->cur_index = 0;
+  a->mapping = (mapped_file_t){0};
+  a->compressed = compressed;
+  a->buffer_fmt = BUFFER_SAMPLE_FMT;
+  a->sample_size = av_get_bytes_per_sample(BUFFER_SAMPLE_FMT) *
+                   ctx->info.ch_layout->nb_channels;
+
+  pcm_sink_t sink = {.sample_size = a->sample_size, .compress = compressed};
+  pcm_blocks_init(&sink.blocks, BUFFER_SAMPLE_FMT,
+                  ctx->info.ch_layout->nb_channels, bits);
+
+  bool found = open_wav(a, path);
+  if (found && !compressed) {
+    return true;
+  } else if (found && a->buffer_fmt != BUFFER_SAMPLE_FMT) {
+    // reads convert from any format, so keep the format of the file
+    pcm_blocks_free(&sink.blocks);
+    pcm_blocks_init(&sink.blocks, a->buffer_fmt,
+                    ctx->info.ch_layout->nb_channels, bits);
+  }
+
+  char *cached_path = found ? NULL : cache_path(ctx, path, index);
+  if (cached_path) {
+    found = load_cache(a, cached_path);
+    if (!found && !write_cache(a, cached_path, path, index)) {
+      free(cached_path);
+      return false;
+    }
+    found = found || load_cache(a, cached_path);
+    free(cached_path);
+  }
+
+  if (found && compressed) {
+    // compress straight from the WAV or cache file, so the stream is only
+    // decoded once, then drop the mapping
+    pcm_blocks_append(&sink.blocks, a->buffer, a->num_samples);
+    pcm_blocks_finish(&sink.blocks);
+    sink.num_samples = a->num_samples;
+    mapped_file_close(&a->mapping);
+  } else if (!found) {
+    // caching is not available, decode to the heap instead
+    if (!decode(ctx, path, index, NULL, &sink)) {
+      return false;
+    }
+  }
+
+  if (compressed) {
+    a->buffer = NULL;
+    a->num_samples = sink.num_samples;
+    a->blocks = sink.blocks;
+    pcm_block_cache_init(&a->block_cache, &a->blocks);
+    log_info("compressed %" PRIi64 " audio samples of '%s' to %.1f%% "
+             "(%" PRIi32 " blocks)",
+             a->num_samples, path,
+             100.0 * (f64)a->blocks.size /
+                 (f64)sve2_max_i64(a->num_samples * a->sample_size, 1),
+             a->blocks.num_blocks);
+  } else if (!found) {
+    a->buffer = sink.buffer;
+    a->num_samples = sink.num_samples;
+  }
+
+  return true;
+}
+
+bool audio_pcm_open(context_t *ctx, audio_pcm_t *a, const char *path,
+                    stream_index_t index) {
+  return open_pcm(ctx, a, path, index, false, 0);
+}
+
+bool audio_pcm_open_compressed(context_t *ctx, audio_pcm_t *a,
+                               const char *path, stream_index_t index,
+                               i32 bits) {
+  return open_pcm(ctx, a, path, index, true, bits);
+}
+
+void audio_pcm_close(audio_pcm_t *a) {
+  if (a->compressed) {
+    pcm_block_cache_free(&a->block_cache);
+    pcm_blocks_free(&a->blocks);
+  } else if (a->mapping.data) {
+    mapped_file_close(&a->mapping);
+  } else {
+    free(a->buffer);
+  }
+}
 
 void audio_pcm_seek(audio_pcm_t *a, i64 time) {
   // convert from ns to 1/sample_rate unit
-  a->cur_index = time * a->ctx->info.sample_rate / SVE2_NS_PER_SEC;
+  a->cur_index =
+      sve2_max_i64(time * a->ctx->info.sample_rate / SVE2_NS_PER_SEC, 0);
 }
+
 void audio_pcm_get_samples(audio_pcm_t *a, i32 num_samples[static 1],
-                           u8 *samples) {
-  *num_samples = sve2_min_i32(*num_samples, a->num_samples - a->cur_index);
-  memcpy(samples, a->buffer + a->cur_index * a->sample_size,
-         *num_samples * a->sample_size);
-  a->cur_index += *num_samples;
+                           f32 *const planes[]) {
+  i32 nb_channels = a->ctx->info.ch_layout->nb_channels;
+  *num_samples = (i32)sve2_max_i64(
+      sve2_min_i64(*num_samples, a->num_samples - a->cur_index), 0);
+  if (!a->compressed) {
+    audio_kernel_planar_from_interleaved(
+        a->buffer_fmt, a->buffer + a->cur_index * a->sample_size, nb_channels,
+        *num_samples, planes);
+    a->cur_index += *num_samples;
+    return;
+  }
+
+  // only decode the blocks in range (through the block cache)
+  for (i32 num_done = 0; num_done < *num_samples;) {
+    i32 block = pcm_blocks_find(&a->blocks, a->cur_index);
+    const u8 *data = pcm_block_cache_get(&a->block_cache, &a->blocks, block);
+    i64 offset = a->cur_index - a->blocks.blocks[block].first_sample;
+    i32 count = (i32)sve2_min_i64(
+        *num_samples - num_done,
+        pcm_blocks_get_length(&a->blocks, block) - offset);
+    f32 *dst[SVE2_MAX_AUDIO_CHANNELS];
+    audio_planes_offset(planes, nb_channels, num_done, dst);
+    audio_kernel_planar_from_interleaved(
+        a->blocks.sample_fmt, data + offset * a->blocks.sample_size,
+        nb_channels, count, dst);
+    num_done += count;
+    a->cur_index += count;
+  }
 }
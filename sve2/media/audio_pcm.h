@@ -4,54 +4,102 @@
 #include <libavutil/samplefmt.h>
 
 #include "sve2/context/context.h"
+#include "sve2/media/pcm_blocks.h"
 #include "sve2/media/stream_index.h"
+#include "sve2/utils/mapped_file.h"
 #include "sve2/utils/types.h"
 
 /**
  * @brief Implementation of audio_t where raw audio PCM stored directly in
  * memory. Good for short audio segments (sound effects), and if you got enough
- * RAM, it might be better to use this for long audio tracks too. The memory
- * usage is basically the same as a WAV file (if you are using s16 sample
- * format, that is).
+ * RAM, it might be better to use this for long audio tracks too. Decoded audio
+ * is resampled straight to float (like the mixing bus), so the memory usage is
+ * basically the same as a 32-bit float WAV file.
  *
  * A sample here is defined to be the amount of sound data per 1/sample_rate
- * seconds. For example, with stereo (2 channels) channel layout and s16 sample
- * format, a sample is 2 * sizeof(i16) = 4 bytes.
+ * seconds. For example, with stereo (2 channels) channel layout and float
+ * samples, a sample is 2 * sizeof(f32) = 8 bytes.
  *
  * This definition makes calculation easier (it is also what FFmpeg meant by
  * samples, and what miniaudio calls frames). The number of samples only depends
  * on the duration of an audio track and the audio sample rate, independent of
  * the channel layout.
+ *
+ * Decoded audio is cached on disk (see cache.h), keyed by the source file and
+ * the context audio parameters. Later opens of the same file map the cache file
+ * into memory instead of decoding it again, so opening is instant and the pages
+ * are shared between processes and can be evicted by the OS. If caching is not
+ * available, the audio is decoded into heap memory.
+ *
+ * Uncompressed WAV files with the context sample rate and channel layout are
+ * not decoded at all: samples are served straight from a mapping of the file,
+ * whatever their sample format.
+ *
+ * Long tracks are split into segments which are decoded in parallel, each with
+ * its own demuxer, decoder and resampler. Segments are placed using the
+ * timestamps of their first frame, and the track is decoded serially instead
+ * if they do not line up sample-exactly. Samples around segment boundaries may
+ * still differ slightly from a serial decode, since each resampler starts
+ * without the history of the previous segment and decoders start after a
+ * preroll.
+ *
+ * Alternatively, the samples can be kept compressed in memory (see
+ * pcm_blocks.h), which is opened by audio_pcm_open_compressed(). Reads then
+ * only decode the blocks they touch, so long tracks take a fraction of the
+ * memory while seeking stays instant.
  */
 typedef struct {
   context_t *ctx;
   /**
    * @brief Buffer containing audio data. Total size (in bytes) of
-   * `buffer` is `sample_size * num_samples`. Because context_t only allows
-   * interleaved audio formats, this data is also guaranteed to be interleaved
-   * audio.
+   * `buffer` is `sample_size * num_samples`. Samples are stored interleaved,
+   * and are deinterleaved into the planar float bus on read.
    */
   u8 *buffer;
   /**
-   * @brief Size (in bytes) of a sample (see definition in struct docs)
+   * @brief Whether the samples are stored in `blocks` (and `buffer` is NULL)
+   */
+  bool compressed;
+  pcm_blocks_t blocks;
+  pcm_block_cache_t block_cache;
+  /**
+   * @brief Mapping of the cache file containing `buffer`. If the data is stored
+   * on the heap instead, `mapping.data` is NULL.
+   */
+  mapped_file_t mapping;
+  /**
+   * @brief Sample format of `buffer`. This is float, except for mapped WAV
+   * files in another format.
+   */
+  enum AVSampleFormat buffer_fmt;
+  /**
+   * @brief Size (in bytes) of a sample (see definition in struct docs) in
+   * `buffer`
    */
   i32 sample_size;
   /**
    * @brief Total count of samples in `buffer`.
    */
-  i32 num_samples;
+  i64 num_samples;
   /**
    * @brief Current sample index. It will be increased by *num_samples
    * (out-value) after every call to audio_pcm_get_samples, and can be resetted
    * to a specific value using audio_pcm_seek.
    */
-  i32 cur_index;
+  i64 cur_index;
 } audio_pcm_t;
 
 // Exact same API as in audio.h
 bool audio_pcm_open(context_t *ctx, audio_pcm_t *a, const char *path,
                     stream_index_t index);
+// same as audio_pcm_open(), but the samples are compressed in memory, keeping
+// bits bits of precision per sample (0 for lossless, see pcm_blocks.h). Decoded
+// samples are float, which is quantized to 24 bits (or to bits bits), so
+// compressing them is always lossy. WAV files keep their sample format.
+bool audio_pcm_open_compressed(context_t *ctx, audio_pcm_t *a,
+                               const char *path, stream_index_t index,
+                               i32 bits);
 void audio_pcm_close(audio_pcm_t *a);
 void audio_pcm_seek(audio_pcm_t *a, i64 time);
 void audio_pcm_get_samples(audio_pcm_t *a, i32 num_samples[static 1],
-                           u8 *samples);
+                           f32 *const planes[]);
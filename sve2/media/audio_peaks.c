@@ -0,0 +1,350 @@
+#include "audio_peaks.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sve2/media/audio.h"
+#include "sve2/media/audio_kernels.h"
+#include "sve2/utils/asprintf.h"
+#include "sve2/utils/cache.h"
+#include "sve2/utils/hash.h"
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+#define PEAKS_CACHE_MAGIC "SVE2PKS1"
+// number of samples decoded at once by the worker
+#define ANALYSIS_BLOCK_SIZE 1024
+
+// header of peak sidecar files, followed by the buckets of every level
+typedef struct {
+  char magic[8];
+  i64 num_samples;
+  i32 nb_channels, sample_rate, num_levels, reserved;
+} peaks_header_t;
+
+static i16 to_i16(f32 x) {
+  return (i16)lrintf(sve2_max_f32(sve2_min_f32(x, 1.0f), -1.0f) * 32767.0f);
+}
+
+static f32 from_i16(i16 x) { return (f32)x / 32767.0f; }
+
+// compute the level layout from num_samples
+static void compute_levels(audio_peaks_t *p) {
+  p->num_levels = 0;
+  i64 size = (p->num_samples + AUDIO_PEAKS_BASE_BUCKET - 1) /
+             AUDIO_PEAKS_BASE_BUCKET;
+  i64 offset = 0;
+  while (size > 0 && p->num_levels < AUDIO_PEAKS_MAX_LEVELS) {
+    p->level_offsets[p->num_levels] = offset;
+    p->level_sizes[p->num_levels] = size;
+    ++p->num_levels;
+    offset += size;
+    size = size == 1 ? 0 : (size + 1) / 2;
+  }
+}
+
+static i64 get_num_buckets(const audio_peaks_t *p) {
+  if (p->num_levels == 0) {
+    return 0;
+  }
+
+  i32 last = p->num_levels - 1;
+  return p->level_offsets[last] + p->level_sizes[last];
+}
+
+static i16 *get_bucket(const audio_peaks_t *p, i32 level, i64 bucket,
+                       i32 channel) {
+  return p->data +
+         ((p->level_offsets[level] + bucket) * p->nb_channels + channel) * 3;
+}
+
+static char *sidecar_path(audio_peaks_t *p) {
+  u64 key;
+  if (!cache_hash_source(sve2_hash_str(SVE2_HASH_INIT, PEAKS_CACHE_MAGIC),
+                         p->path, &key)) {
+    return NULL;
+  }
+
+  i32 params[] = {p->index.type, p->index.offset, p->ctx->info.sample_rate};
+  key = sve2_hash_value(key, params);
+  return cache_get_path(key, ".peaks");
+}
+
+static peaks_header_t sidecar_header(audio_peaks_t *p) {
+  peaks_header_t header = {
+      .num_samples = p->num_samples,
+      .nb_channels = p->nb_channels,
+      .sample_rate = p->ctx->info.sample_rate,
+      .num_levels = p->num_levels,
+  };
+  memcpy(header.magic, PEAKS_CACHE_MAGIC, sizeof header.magic);
+  return header;
+}
+
+static bool load_sidecar(audio_peaks_t *p, const char *path) {
+  if (!mapped_file_open(&p->mapping, path)) {
+    return false;
+  }
+
+  peaks_header_t header;
+  if (p->mapping.size < sve2_sizeof(header)) {
+    goto fail;
+  }
+  memcpy(&header, p->mapping.data, sizeof header);
+  p->num_samples = header.num_samples;
+  compute_levels(p);
+  peaks_header_t expected = sidecar_header(p);
+  if (memcmp(&header, &expected, sizeof header) != 0 ||
+      p->mapping.size != sve2_sizeof(header) + get_num_buckets(p) *
+                                                   p->nb_channels * 3 *
+                                                   sve2_sizeof(i16)) {
+    goto fail;
+  }
+
+  p->data = (i16 *)(p->mapping.data + sizeof header);
+  log_info("loaded waveform peaks of '%s' from cache file '%s'", p->path,
+           path);
+  return true;
+
+fail:
+  log_warn("invalid waveform peaks cache file '%s'", path);
+  mapped_file_close(&p->mapping);
+  p->num_samples = 0;
+  return false;
+}
+
+static void save_sidecar(audio_peaks_t *p, const char *path) {
+  char *temp_path;
+  FILE *f = cache_file_create(path, &temp_path);
+  if (!f) {
+    return;
+  }
+
+  peaks_header_t header = sidecar_header(p);
+  i64 num_values = get_num_buckets(p) * p->nb_channels * 3;
+  if (fwrite(&header, sizeof header, 1, f) != 1 ||
+      fwrite(p->data, sizeof(i16), (size_t)num_values, f) !=
+          (size_t)num_values) {
+    cache_file_abort(f, temp_path);
+    return;
+  }
+
+  cache_file_commit(f, temp_path, path);
+}
+
+// build the levels above level 0
+static void build_pyramid(audio_peaks_t *p) {
+  for (i32 level = 1; level < p->num_levels; ++level) {
+    for (i64 i = 0; i < p->level_sizes[level]; ++i) {
+      bool has_right = 2 * i + 1 < p->level_sizes[level - 1];
+      for (i32 c = 0; c < p->nb_channels; ++c) {
+        i16 *dst = get_bucket(p, level, i, c);
+        const i16 *left = get_bucket(p, level - 1, 2 * i, c);
+        const i16 *right = has_right ? left + p->nb_channels * 3 : left;
+        dst[0] = SVE2_MIN(left[0], right[0]);
+        dst[1] = SVE2_MAX(left[1], right[1]);
+        // RMS of the union of two buckets of the same length
+        f32 l = from_i16(left[2]), r = from_i16(right[2]);
+        dst[2] = to_i16(sqrtf((l * l + r * r) * 0.5f));
+      }
+    }
+  }
+}
+
+static int analyze(void *arg) {
+  audio_peaks_t *p = arg;
+  context_t *ctx = p->ctx;
+  i32 nb_channels = p->nb_channels;
+
+  audio_t audio;
+  if (!audio_open(ctx, &audio, p->path, p->index,
+                  AUDIO_FORMAT_FFMPEG_STREAM)) {
+    atomic_store_explicit(&p->ready, true, memory_order_release);
+    return 0;
+  }
+
+  f32 *planes[SVE2_MAX_AUDIO_CHANNELS];
+  for (i32 c = 0; c < nb_channels; ++c) {
+    planes[c] = sve2_malloc(ANALYSIS_BLOCK_SIZE * sve2_sizeof(f32));
+  }
+
+  // level 0 buckets, grown as the stream is decoded
+  i16 *buckets = NULL;
+  i64 num_buckets = 0, capacity = 0;
+  f32 mins[SVE2_MAX_AUDIO_CHANNELS], maxs[SVE2_MAX_AUDIO_CHANNELS];
+  f64 sums[SVE2_MAX_AUDIO_CHANNELS];
+  i32 bucket_fill = 0;
+
+  while (true) {
+    bool done = atomic_load_explicit(&p->cancelled, memory_order_relaxed);
+    i32 n = done ? 0 : ANALYSIS_BLOCK_SIZE;
+    if (!done) {
+      audio_get_samples(&audio, &n, planes);
+      p->num_samples += n;
+      done = n == 0;
+    }
+
+    for (i32 i = 0; i < n || (done && bucket_fill > 0);) {
+      if (bucket_fill == 0) {
+        for (i32 c = 0; c < nb_channels; ++c) {
+          mins[c] = 1.0f;
+          maxs[c] = -1.0f;
+          sums[c] = 0.0;
+        }
+      }
+
+      i32 count = sve2_min_i32(n - i, AUDIO_PEAKS_BASE_BUCKET - bucket_fill);
+      for (i32 c = 0; c < nb_channels; ++c) {
+        for (i32 j = i; j < i + count; ++j) {
+          f32 x = planes[c][j];
+          mins[c] = sve2_min_f32(mins[c], x);
+          maxs[c] = sve2_max_f32(maxs[c], x);
+          sums[c] += (f64)x * x;
+        }
+      }
+      bucket_fill += count;
+      i += count;
+
+      if (bucket_fill == AUDIO_PEAKS_BASE_BUCKET || (done && i == n)) {
+        if (num_buckets == capacity) {
+          capacity = sve2_max_i64(capacity * 2, 1024);
+          buckets = sve2_realloc(buckets, capacity * nb_channels * 3 *
+                                              sve2_sizeof(i16));
+        }
+        for (i32 c = 0; c < nb_channels; ++c) {
+          i16 *b = buckets + (num_buckets * nb_channels + c) * 3;
+          b[0] = to_i16(mins[c]);
+          b[1] = to_i16(maxs[c]);
+          b[2] = to_i16((f32)sqrt(sums[c] / bucket_fill));
+        }
+        ++num_buckets;
+        bucket_fill = 0;
+      }
+    }
+
+    if (done) {
+      break;
+    }
+  }
+
+  for (i32 c = 0; c < nb_channels; ++c) {
+    free(planes[c]);
+  }
+  audio_close(&audio);
+
+  if (atomic_load_explicit(&p->cancelled, memory_order_relaxed)) {
+    free(buckets);
+    return 0;
+  }
+
+  compute_levels(p);
+  assert(p->num_levels == 0 || p->level_sizes[0] == num_buckets);
+  p->data = sve2_realloc(buckets, get_num_buckets(p) * nb_channels * 3 *
+                                      sve2_sizeof(i16));
+  build_pyramid(p);
+
+  char *path = sidecar_path(p);
+  if (path) {
+    save_sidecar(p, path);
+    free(path);
+  }
+
+  log_info("computed waveform peaks of '%s' (%" PRIi64 " samples, %" PRIi32
+           " levels)",
+           p->path, p->num_samples, p->num_levels);
+  atomic_store_explicit(&p->ready, true, memory_order_release);
+  return 0;
+}
+
+void audio_peaks_open(context_t *ctx, audio_peaks_t *p, const char *path,
+                      stream_index_t index) {
+  p->ctx = ctx;
+  p->path = sve2_strdup(path);
+  p->index = index;
+  p->nb_channels = ctx->info.ch_layout->nb_channels;
+  assert(p->nb_channels <= SVE2_MAX_AUDIO_CHANNELS);
+  p->num_samples = 0;
+  p->data = NULL;
+  p->mapping = (mapped_file_t){0};
+  p->num_levels = 0;
+  p->has_worker = false;
+  atomic_init(&p->ready, false);
+  atomic_init(&p->cancelled, false);
+
+  char *cached_path = sidecar_path(p);
+  bool found = cached_path && load_sidecar(p, cached_path);
+  free(cached_path);
+  if (found) {
+    atomic_store_explicit(&p->ready, true, memory_order_release);
+    return;
+  }
+
+  sve2_thrd_create(&p->worker, analyze, p);
+  p->has_worker = true;
+}
+
+void audio_peaks_close(audio_peaks_t *p) {
+  if (p->has_worker) {
+    atomic_store_explicit(&p->cancelled, true, memory_order_relaxed);
+    thrd_join(p->worker, NULL);
+  }
+
+  if (p->mapping.data) {
+    mapped_file_close(&p->mapping);
+  } else {
+    free(p->data);
+  }
+  free(p->path);
+}
+
+bool audio_peaks_is_ready(audio_peaks_t *p) {
+  return atomic_load_explicit(&p->ready, memory_order_acquire);
+}
+
+bool audio_peaks_query(audio_peaks_t *p, i64 start, i64 end, i32 channel,
+                       i32 width, audio_peak_t peaks[width]) {
+  if (!audio_peaks_is_ready(p)) {
+    return false;
+  }
+
+  i32 sample_rate = p->ctx->info.sample_rate;
+  i64 first_sample = av_rescale(start, sample_rate, SVE2_NS_PER_SEC);
+  i64 num_samples = av_rescale(end - start, sample_rate, SVE2_NS_PER_SEC);
+
+  // the coarsest level whose buckets are not wider than a column, so every
+  // column spans at most 3 buckets
+  i64 samples_per_column = num_samples / sve2_max_i32(width, 1);
+  i32 level = 0;
+  while (level + 1 < p->num_levels &&
+         ((i64)AUDIO_PEAKS_BASE_BUCKET << (level + 1)) <= samples_per_column) {
+    ++level;
+  }
+  i64 bucket_size = (i64)AUDIO_PEAKS_BASE_BUCKET << level;
+
+  for (i32 x = 0; x < width; ++x) {
+    i64 a = first_sample + av_rescale(x, num_samples, width);
+    i64 b = first_sample + av_rescale(x + 1, num_samples, width);
+    b = sve2_min_i64(sve2_max_i64(b, a + 1), p->num_samples);
+    a = sve2_max_i64(a, 0);
+    if (p->num_levels == 0 || a >= b) {
+      peaks[x] = (audio_peak_t){0};
+      continue;
+    }
+
+    audio_peak_t peak = {.min = 1.0f, .max = -1.0f};
+    i64 last = (b - 1) / bucket_size;
+    for (i64 i = a / bucket_size; i <= last; ++i) {
+      const i16 *bucket = get_bucket(p, level, i, channel);
+      peak.min = sve2_min_f32(peak.min, from_i16(bucket[0]));
+      peak.max = sve2_max_f32(peak.max, from_i16(bucket[1]));
+      f32 rms = from_i16(bucket[2]);
+      peak.rms += rms * rms;
+    }
+    peak.rms = sqrtf(peak.rms / (f32)(last - a / bucket_size + 1));
+    peaks[x] = peak;
+  }
+
+  return true;
+}
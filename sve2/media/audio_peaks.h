@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "sve2/context/context.h"
+#include "sve2/media/stream_index.h"
+#include "sve2/utils/mapped_file.h"
+#include "sve2/utils/types.h"
+
+// number of samples (per channel) summarized by a bucket of the finest level.
+// Every level above has buckets twice as large.
+#define AUDIO_PEAKS_BASE_BUCKET 256
+#define AUDIO_PEAKS_MAX_LEVELS 48
+
+/**
+ * @brief Waveform summary of a range of samples of one channel, with values in
+ * [-1, 1]
+ */
+typedef struct {
+  f32 min, max, rms;
+} audio_peak_t;
+
+/**
+ * @brief Multi-resolution waveform peaks of an audio stream, for drawing audio
+ * tracks at any zoom level.
+ *
+ * The stream is decoded once on a worker thread, which builds a pyramid of
+ * min/max/RMS buckets (one level per power-of-two zoom level). The pyramid is
+ * saved as a sidecar file in the cache directory (see cache.h), so later opens
+ * of the same file are instant.
+ *
+ * Queries cost O(output), independently of the stream duration and of the
+ * zoom level. The finest resolution is one bucket per AUDIO_PEAKS_BASE_BUCKET
+ * samples, finer queries return repeated buckets.
+ */
+typedef struct {
+  context_t *ctx;
+  char *path;
+  stream_index_t index;
+  i32 nb_channels;
+  /**
+   * @brief Total number of samples of the stream
+   */
+  i64 num_samples;
+  /**
+   * @brief Buckets of all levels, stored as (min, max, rms) i16 triples,
+   * interleaved by channel. This is heap memory, or points into `mapping` if
+   * the sidecar file was loaded.
+   */
+  i16 *data;
+  mapped_file_t mapping;
+  i32 num_levels;
+  /**
+   * @brief Offset (in buckets) and number of buckets of every level
+   */
+  i64 level_offsets[AUDIO_PEAKS_MAX_LEVELS];
+  i64 level_sizes[AUDIO_PEAKS_MAX_LEVELS];
+  /**
+   * @brief Analysis worker. The fields above are written by the worker until
+   * `ready` is set.
+   */
+  thrd_t worker;
+  bool has_worker;
+  atomic_bool ready, cancelled;
+} audio_peaks_t;
+
+/**
+ * @brief Start computing the peaks of an audio stream, or load them from the
+ * cache directory.
+ *
+ * @param ctx The context
+ * @param p Destination audio_peaks_t object
+ * @param path Path to the media file
+ * @param index Audio stream index
+ */
+void audio_peaks_open(context_t *ctx, audio_peaks_t *p, const char *path,
+                      stream_index_t index);
+/**
+ * @brief Free the peaks. This cancels the analysis if it is still running.
+ */
+void audio_peaks_close(audio_peaks_t *p);
+
+/**
+ * @brief Check whether the analysis finished. audio_peaks_query() fails until
+ * then.
+ */
+bool audio_peaks_is_ready(audio_peaks_t *p);
+
+/**
+ * @brief Get the peaks of a time range, one per pixel column
+ *
+ * @param p The peaks object
+ * @param start Start of the time range (in ns)
+ * @param end End of the time range (in ns)
+ * @param channel The channel index
+ * @param width Number of columns
+ * @param peaks Destination array. Columns past the end of the stream are
+ * zeroed.
+ * @return Whether the operation succeeded (false if the analysis has not
+ * finished yet)
+ */
+bool audio_peaks_query(audio_peaks_t *p, i64 start, i64 end, i32 channel,
+                       i32 width, audio_peak_t peaks[width]);
@@ -1,11 +1,40 @@
 #include "ffmpeg_audio_stream.h"
 
+#include <string.h>
+
+#include <libavutil/samplefmt.h>
 #include <libswresample/swresample.h>
 
+#include "sve2/media/audio_kernels.h"
 #include "sve2/utils/minmax.h"
 #include "sve2/utils/runtime.h"
 #include "sve2/utils/threads.h"
 
+// amount of audio decoded (and discarded) before a seek target, so that
+// decoders with inter-frame state (MP3 bit reservoir, AAC/Opus overlap) and the
+// resampler filter are primed
+#define SEEK_PREROLL (SVE2_NS_PER_SEC / 5)
+// number of seek attempts (with an increasing pre-roll) if the demuxer lands
+// after the target
+#define MAX_SEEK_ATTEMPTS 3
+// forward seeks shorter than this are done by decoding through
+#define SEEK_SKIP_THRESHOLD (SVE2_NS_PER_SEC / 2)
+// length of the seek cache windows
+#define SEEK_CACHE_DURATION SVE2_NS_PER_SEC
+// the resampler outputs float straight away. Samples are buffered interleaved
+// (so the buffer and the seek cache are simple byte ranges) and deinterleaved
+// into the bus planes on output
+#define BUFFER_SAMPLE_FMT AV_SAMPLE_FMT_FLT
+
+static i64 ns_to_samples(ffmpeg_audio_stream_t *a, i64 time) {
+  return av_rescale(time, a->base.ctx->info.sample_rate, SVE2_NS_PER_SEC);
+}
+
+static i64 samples_to_ns(ffmpeg_audio_stream_t *a, i64 num_samples) {
+  return av_rescale(num_samples, SVE2_NS_PER_SEC,
+                    a->base.ctx->info.sample_rate);
+}
+
 bool ffmpeg_audio_stream_open(context_t *c, ffmpeg_audio_stream_t *a,
                               const char *path, stream_index_t index) {
   if (!ffmpeg_stream_open(c, &a->base, path, index, false)) {
@@ -14,75 +43,302 @@ bool ffmpeg_audio_stream_open(context_t *c, ffmpeg_audio_stream_t *a,
 
   a->audio_resampler = NULL;
   nassert_ffmpeg(swr_alloc_set_opts2(
-      &a->audio_resampler, c->info.ch_layout, c->info.sample_fmt,
+      &a->audio_resampler, c->info.ch_layout, BUFFER_SAMPLE_FMT,
       c->info.sample_rate, &a->base.cdc_ctx->ch_layout,
       a->base.cdc_ctx->sample_fmt, a->base.cdc_ctx->sample_rate, 0, NULL));
   nassert_ffmpeg(swr_init(a->audio_resampler));
+  nassert(a->frame = av_frame_alloc());
+
+  const AVStream *ff_stream = a->base.fmt_ctx->streams[a->base.index.offset];
+  a->origin = 0;
+  if (ff_stream->start_time != AV_NOPTS_VALUE) {
+    a->origin = av_rescale_q(ff_stream->start_time, ff_stream->time_base,
+                             (AVRational){1, SVE2_NS_PER_SEC});
+  }
 
+  a->sample_size = sve2_sizeof(f32) * c->info.ch_layout->nb_channels;
+  a->position = a->decoded_position = 0;
+  a->buffer = NULL;
+  a->buffer_offset = a->buffer_size = a->buffer_capacity = 0;
+  a->eof = a->needs_seek = false;
+  memset(a->seek_cache, 0, sizeof a->seek_cache);
+  a->seek_cache_clock = 0;
+  a->serving = a->capturing = -1;
   return true;
 }
 
 void ffmpeg_audio_stream_close(ffmpeg_audio_stream_t *a) {
+  for (i32 i = 0; i < AUDIO_SEEK_CACHE_SIZE; ++i) {
+    sve2_freep(&a->seek_cache[i].samples);
+  }
+  sve2_freep(&a->buffer);
+  av_frame_free(&a->frame);
   swr_free(&a->audio_resampler);
   ffmpeg_stream_close(&a->base);
 }
 
-void ffmpeg_audio_stream_seek(ffmpeg_audio_stream_t *a, i64 time) {
-  ffmpeg_stream_seek(&a->base, time);
+// get space for num_samples more samples at the end of the buffer
+static u8 *buffer_reserve(ffmpeg_audio_stream_t *a, i32 num_samples) {
+  if (a->buffer_offset > 0) {
+    memmove(a->buffer, a->buffer + a->buffer_offset * a->sample_size,
+            (size_t)(a->buffer_size * a->sample_size));
+    a->buffer_offset = 0;
+  }
+  if (a->buffer_size + num_samples > a->buffer_capacity) {
+    a->buffer_capacity =
+        sve2_max_i32(a->buffer_capacity * 2, a->buffer_size + num_samples);
+    a->buffer = sve2_realloc(a->buffer,
+                             (i64)a->buffer_capacity * a->sample_size);
+  }
+
+  return a->buffer + a->buffer_size * a->sample_size;
+}
+
+// convert samples into the buffer, dropping those before the seek target
+static void convert_samples(ffmpeg_audio_stream_t *a, const u8 **in,
+                            i32 in_count) {
+  i32 max_out = swr_get_out_samples(a->audio_resampler, in_count);
+  u8 *out = buffer_reserve(a, max_out);
+  i32 num_out;
+  nassert_ffmpeg(num_out = swr_convert(a->audio_resampler, (u8 *const[]){out},
+                                       max_out, in, in_count));
 
-  // flush audio buffer
-  nassert_ffmpeg(swr_convert(a->audio_resampler, NULL, 0, NULL, 0));
+  i64 num_dropped = a->position + a->buffer_size - a->decoded_position;
+  num_dropped = sve2_min_i64(sve2_max_i64(num_dropped, 0), num_out);
+  memmove(out, out + num_dropped * a->sample_size,
+          (size_t)((num_out - num_dropped) * a->sample_size));
+  a->buffer_size += num_out - (i32)num_dropped;
+  a->decoded_position += num_out;
+}
+
+// decode the next frame into the buffer, return false at the end of stream
+static bool decode_frame(ffmpeg_audio_stream_t *a) {
+  if (a->eof) {
+    return false;
+  }
 
-  AVFrame *audio_frame = a->base.ctx->temp_frames[0];
-  do {
-    av_frame_unref(audio_frame);
-    if (!ffmpeg_stream_get_frame(&a->base, audio_frame)) {
+  AVFrame *frame = a->frame;
+  if (!ffmpeg_stream_get_frame(&a->base, frame)) {
+    // flush the samples delayed by the resampler
+    a->eof = true;
+    convert_samples(a, NULL, 0);
+    return a->buffer_size > 0;
+  }
+
+  convert_samples(a, (const u8 **)frame->extended_data, frame->nb_samples);
+  av_frame_unref(frame);
+  return true;
+}
+
+// move the decoder to the sample `target` (sample-accurately)
+static void seek_decoder(ffmpeg_audio_stream_t *a, i64 target) {
+  AVFrame *frame = a->frame;
+  i64 target_time = a->origin + samples_to_ns(a, target);
+  i64 preroll = SEEK_PREROLL;
+  a->position = target;
+  a->buffer_offset = a->buffer_size = 0;
+  a->eof = false;
+  a->needs_seek = false;
+
+  for (i32 attempt = 0;; ++attempt) {
+    // there is nothing to pre-roll before the start of the stream, and some
+    // demuxers fail to seek to negative timestamps
+    i64 seek_time = sve2_max_i64(target_time - preroll, a->origin);
+    if (!ffmpeg_stream_seek(&a->base, seek_time) &&
+        !ffmpeg_stream_seek(&a->base, a->origin)) {
+      log_error("unable to seek audio stream, playing silence");
+      a->eof = true;
+      a->decoded_position = target;
+      return;
+    }
+    // reset the resampler state
+    nassert_ffmpeg(swr_init(a->audio_resampler));
+
+    if (!ffmpeg_stream_get_frame(&a->base, frame)) {
+      a->eof = true;
+      a->decoded_position = target;
       return;
     }
-  } while (audio_frame->pts + audio_frame->duration < time);
 
-  nassert_ffmpeg(swr_convert(a->audio_resampler, NULL, 0,
-                             (const u8 *const *)audio_frame->data,
-                             audio_frame->nb_samples));
+    // position the decoded samples using their timestamps
+    a->decoded_position = ns_to_samples(a, frame->pts - a->origin);
+    if (a->decoded_position <= target || attempt + 1 == MAX_SEEK_ATTEMPTS ||
+        target_time - preroll <= a->origin) {
+      break;
+    }
 
-  i32 num_dropped = (time - audio_frame->pts) * SVE2_NS_PER_SEC /
-                    a->base.cdc_ctx->sample_rate;
-  num_dropped = sve2_min_i32(num_dropped, audio_frame->nb_samples);
-  num_dropped = sve2_max_i32(num_dropped, 0);
-  nassert_ffmpeg(swr_drop_output(a->audio_resampler, num_dropped));
+    // the demuxer landed after the target, seek further back
+    av_frame_unref(frame);
+    preroll *= 4;
+  }
+
+  if (a->decoded_position > target) {
+    // there is nothing before the first frame, play silence until then
+    i32 gap = (i32)sve2_min_i64(a->decoded_position - target, INT32_MAX / 2);
+    u8 *out = buffer_reserve(a, gap);
+    av_samples_set_silence(&out, 0, gap,
+                           a->base.ctx->info.ch_layout->nb_channels,
+                           BUFFER_SAMPLE_FMT);
+    a->buffer_size += gap;
+    a->decoded_position = target + gap;
+  }
 
-  av_frame_unref(audio_frame);
+  convert_samples(a, (const u8 **)frame->extended_data, frame->nb_samples);
+  av_frame_unref(frame);
 }
 
-static bool convert_samples(SwrContext *swr, AVFrame *frame,
-                            i32 *num_samples_left, u8 **samples,
-                            i32 sample_size) {
-  const u8 *const *data = frame ? (const u8 *const *)frame->data : NULL;
-  i32 num_samples_in = frame ? frame->nb_samples : 0;
-  i32 num_samples_read;
-  nassert_ffmpeg(num_samples_read =
-                     swr_convert(swr, (u8 *const[]){*samples},
-                                 *num_samples_left, data, num_samples_in));
-  *num_samples_left -= num_samples_read;
-  *samples += sample_size * num_samples_read;
-  return *num_samples_left > 0;
+static i32 find_seek_cache_entry(ffmpeg_audio_stream_t *a, i64 target) {
+  for (i32 i = 0; i < AUDIO_SEEK_CACHE_SIZE; ++i) {
+    audio_seek_cache_entry_t *e = &a->seek_cache[i];
+    if (e->samples && e->start <= target &&
+        target < e->start + e->num_samples) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// start filling the least recently used seek cache entry at position
+static void start_capture(ffmpeg_audio_stream_t *a) {
+  i32 lru = 0;
+  for (i32 i = 1; i < AUDIO_SEEK_CACHE_SIZE; ++i) {
+    if (a->seek_cache[i].last_used < a->seek_cache[lru].last_used) {
+      lru = i;
+    }
+  }
+
+  audio_seek_cache_entry_t *e = &a->seek_cache[lru];
+  if (!e->samples) {
+    e->samples = sve2_malloc(ns_to_samples(a, SEEK_CACHE_DURATION) *
+                             a->sample_size);
+  }
+  e->start = a->position;
+  e->num_samples = 0;
+  e->last_used = ++a->seek_cache_clock;
+  a->capturing = lru;
+}
+
+// append samples returned at position to the entry being filled
+static void capture(ffmpeg_audio_stream_t *a, const u8 *samples,
+                    i32 num_samples) {
+  if (a->capturing < 0) {
+    return;
+  }
+
+  audio_seek_cache_entry_t *e = &a->seek_cache[a->capturing];
+  i32 capacity = (i32)ns_to_samples(a, SEEK_CACHE_DURATION);
+  if (e->start + e->num_samples != a->position) {
+    a->capturing = -1;
+    return;
+  }
+
+  i32 count = sve2_min_i32(num_samples, capacity - e->num_samples);
+  memcpy(e->samples + e->num_samples * a->sample_size, samples,
+         (size_t)(count * a->sample_size));
+  e->num_samples += count;
+  if (e->num_samples == capacity) {
+    a->capturing = -1;
+  }
+}
+
+void ffmpeg_audio_stream_seek(ffmpeg_audio_stream_t *a, i64 time) {
+  i64 target = sve2_max_i64(ns_to_samples(a, time), 0);
+
+  // short forward seeks: decode through, which is cheaper than seeking
+  bool decoder_live = a->serving < 0 && !a->needs_seek;
+  if (decoder_live && target >= a->position &&
+      target - a->position <= ns_to_samples(a, SEEK_SKIP_THRESHOLD)) {
+    i32 num_skipped = (i32)sve2_min_i64(target - a->position, a->buffer_size);
+    a->buffer_offset += num_skipped;
+    a->buffer_size -= num_skipped;
+    // the rest is dropped by convert_samples()
+    a->position = target;
+    a->capturing = -1;
+    return;
+  }
+
+  i32 entry = find_seek_cache_entry(a, target);
+  if (entry >= 0) {
+    // the decoder is moved lazily, once the cached samples run out
+    a->serving = entry;
+    a->seek_cache[entry].last_used = ++a->seek_cache_clock;
+    a->position = target;
+    a->buffer_offset = a->buffer_size = 0;
+    a->capturing = -1;
+    return;
+  }
+
+  a->serving = -1;
+  seek_decoder(a, target);
+  start_capture(a);
+}
+
+// deinterleave count buffered samples into the output planes at offset
+static void output_samples(ffmpeg_audio_stream_t *a, const u8 *src, i32 count,
+                           f32 *const planes[], i32 offset) {
+  i32 nb_channels = a->base.ctx->info.ch_layout->nb_channels;
+  f32 *dst[SVE2_MAX_AUDIO_CHANNELS];
+  audio_planes_offset(planes, nb_channels, offset, dst);
+  audio_kernel_planar_from_interleaved(BUFFER_SAMPLE_FMT, src, nb_channels,
+                                       count, dst);
 }
 
 void ffmpeg_audio_stream_get_samples(ffmpeg_audio_stream_t *a,
-                                     i32 num_samples[static 1], u8 *samples) {
-  i32 sample_size = av_get_bytes_per_sample(a->base.ctx->info.sample_fmt) *
-                    a->base.cdc_ctx->ch_layout.nb_channels;
-  i32 num_samples_left = *num_samples;
-  AVFrame *frame = NULL;
-  while (convert_samples(a->audio_resampler, frame, &num_samples_left, &samples,
-                         sample_size)) {
-    av_frame_unref(frame);
-    frame = a->base.ctx->temp_frames[0];
-    if (!ffmpeg_stream_get_frame(&a->base, frame)) {
+                                     i32 num_samples[static 1],
+                                     f32 *const planes[]) {
+  i32 num_done = 0;
+  while (num_done < *num_samples) {
+    if (a->serving >= 0) {
+      audio_seek_cache_entry_t *e = &a->seek_cache[a->serving];
+      i64 offset = a->position - e->start;
+      if (offset < e->num_samples) {
+        i32 count = (i32)sve2_min_i64(*num_samples - num_done,
+                                      e->num_samples - offset);
+        output_samples(a, e->samples + offset * a->sample_size, count, planes,
+                       num_done);
+        num_done += count;
+        a->position += count;
+        continue;
+      }
+
+      // continue with the entry which follows, if any (e.g. when looping over
+      // a region), so it is not captured again
+      i32 next = find_seek_cache_entry(a, a->position);
+      if (next >= 0) {
+        a->serving = next;
+        a->seek_cache[next].last_used = ++a->seek_cache_clock;
+        continue;
+      }
+
+      // otherwise, continue after the cached samples with the decoder
+      a->serving = -1;
+      a->needs_seek = true;
+    }
+
+    if (a->needs_seek) {
+      // the decoder might already be there, if it stopped where the cached
+      // samples end
+      if (a->eof || a->decoded_position != a->position) {
+        seek_decoder(a, a->position);
+      }
+      a->needs_seek = false;
+      start_capture(a);
+    }
+
+    if (a->buffer_size == 0 && !decode_frame(a)) {
       break;
     }
+
+    i32 count = sve2_min_i32(*num_samples - num_done, a->buffer_size);
+    const u8 *src = a->buffer + a->buffer_offset * a->sample_size;
+    output_samples(a, src, count, planes, num_done);
+    capture(a, src, count);
+    num_done += count;
+    a->buffer_offset += count;
+    a->buffer_size -= count;
+    a->position += count;
   }
 
-  av_frame_unref(frame);
-  *num_samples = *num_samples - num_samples_left;
+  *num_samples = num_done;
 }
@@ -5,18 +5,84 @@
 
 #include "sve2/media/ffmpeg_stream.h"
 
+// number of decoded windows kept by ffmpeg_audio_stream_t
+#define AUDIO_SEEK_CACHE_SIZE 4
+
+/**
+ * @brief Samples decoded right after a seek target, so that seeking there
+ * again (scrubbing, looping) does not need to seek and decode again.
+ */
+typedef struct {
+  /**
+   * @brief Index (in output samples) of the first sample
+   */
+  i64 start;
+  i32 num_samples;
+  u8 *samples;
+  u64 last_used;
+} audio_seek_cache_entry_t;
+
 /**
  * @brief An audio_t implementation based on FFmpeg demuxer and decoder. This
  * streams the audio, which is more efficient (memory-wise) at the cost of
  * latency (I/O) and being more error-prone in general.
+ *
+ * Seeking is sample-accurate: the demuxer seeks a bit before the target (so
+ * decoders with inter-frame state are primed), and the decoded samples are
+ * positioned using their timestamps. The first second after every seek target
+ * is kept in a small cache, which is used to serve later seeks near those
+ * targets without touching the demuxer.
  */
 typedef struct {
   ffmpeg_stream_t base;
   /**
-   * @brief An audio resampler that converts from the source audio format to the
-   * common audio format specified by the context. This is required for mixing.
+   * @brief An audio resampler that converts from the source audio format to
+   * float samples, with the sample rate and channel layout of the context. This
+   * is required for mixing.
    */
   SwrContext *audio_resampler;
+  /**
+   * @brief Decoded frame buffer. This is per-stream (instead of using
+   * context_t::temp_frames), so audio can be decoded on worker threads.
+   */
+  AVFrame *frame;
+  /**
+   * @brief Size (in bytes) of a buffered sample (interleaved float)
+   */
+  i32 sample_size;
+  /**
+   * @brief Start time of the stream (in ns), which is output sample 0
+   */
+  i64 origin;
+  /**
+   * @brief Index (in output samples) of the next sample returned by
+   * ffmpeg_audio_stream_get_samples()
+   */
+  i64 position;
+  /**
+   * @brief Index (in output samples) of the next sample produced by the
+   * resampler. This is position + buffer_size, except right after a seek,
+   * where samples before position are dropped.
+   */
+  i64 decoded_position;
+  /**
+   * @brief Converted samples that are not returned yet
+   */
+  u8 *buffer;
+  i32 buffer_offset, buffer_size, buffer_capacity;
+  bool eof;
+  /**
+   * @brief Whether the decoder has to be moved to position before decoding
+   * (after samples were served from the seek cache)
+   */
+  bool needs_seek;
+  audio_seek_cache_entry_t seek_cache[AUDIO_SEEK_CACHE_SIZE];
+  u64 seek_cache_clock;
+  /**
+   * @brief Index of the seek cache entry being served, or being filled with
+   * decoded samples (-1 if none)
+   */
+  i32 serving, capturing;
 } ffmpeg_audio_stream_t;
 
 // this is the same API as in audio.h
@@ -25,4 +91,5 @@ bool ffmpeg_audio_stream_open(context_t *ctx, ffmpeg_audio_stream_t *a,
 void ffmpeg_audio_stream_close(ffmpeg_audio_stream_t *a);
 void ffmpeg_audio_stream_seek(ffmpeg_audio_stream_t *a, i64 time);
 void ffmpeg_audio_stream_get_samples(ffmpeg_audio_stream_t *a,
-                                     i32 num_samples[static 1], u8 *samples);
+                                     i32 num_samples[static 1],
+                                     f32 *const planes[]);
@@ -6,6 +6,7 @@
 #include <log.h>
 
 #include "sve2/media/stream_index.h"
+#include "sve2/utils/minmax.h"
 #include "sve2/utils/runtime.h"
 #include "sve2/utils/threads.h"
 
@@ -16,6 +17,32 @@ static enum AVPixelFormat get_format_vaapi(struct AVCodecContext *s,
   return AV_PIX_FMT_VAAPI;
 }
 
+void ffmpeg_stream_open_decoder(ffmpeg_stream_t *stream, bool hw_accel,
+                                i32 lowres) {
+  avcodec_free_context(&stream->cdc_ctx);
+  const AVStream *ff_stream = stream->fmt_ctx->streams[stream->index.offset];
+  const AVCodec *codec = avcodec_find_decoder(ff_stream->codecpar->codec_id);
+  nassert(stream->cdc_ctx = avcodec_alloc_context3(codec));
+  nassert_ffmpeg(
+      avcodec_parameters_to_context(stream->cdc_ctx, ff_stream->codecpar));
+  if (hw_accel) {
+    if (ff_stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
+      log_warn("hardware accelerated decoding is only supported for video");
+    } else {
+      nassert_ffmpeg(av_hwdevice_ctx_create(&stream->cdc_ctx->hw_device_ctx,
+                                            AV_HWDEVICE_TYPE_VAAPI, NULL, NULL,
+                                            0));
+      stream->cdc_ctx->get_format = get_format_vaapi;
+      stream->cdc_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
+    }
+  }
+  stream->cdc_ctx->lowres = sve2_min_i32(lowres, codec->max_lowres);
+
+  nassert_ffmpeg(avcodec_open2(stream->cdc_ctx, codec, NULL));
+  // this is unused but we copy to make accessing this easier
+  stream->cdc_ctx->time_base = ff_stream->time_base;
+}
+
 bool ffmpeg_stream_open(context_t *ctx, ffmpeg_stream_t *stream,
                         const char *path, stream_index_t index, bool hw_accel) {
   stream->fmt_ctx = NULL;
@@ -31,53 +58,52 @@ bool ffmpeg_stream_open(context_t *ctx, ffmpeg_stream_t *stream,
   log_trace("media file '%s' opened with AVFormatContext %p", path,
             (void *)stream->fmt_ctx);
 
-  nassert_ffmpeg(avformat_find_stream_info(stream->fmt_ctx, NULL));
+  if ((err = avformat_find_stream_info(stream->fmt_ctx, NULL)) < 0) {
+    log_error("unable to read the streams of media file '%s': '%s'", path,
+              av_err2str(err));
+    avformat_close_input(&stream->fmt_ctx);
+    return false;
+  }
   av_dump_format(stream->fmt_ctx, 0, path, false);
 
   if (!stream_index_make_canonical(&stream->index, stream->fmt_ctx->nb_streams,
                                   stream->fmt_ctx->streams)) {
     log_error("stream %s not found in media file '%s'", SVE2_SI2STR(index),
               path);
+    avformat_close_input(&stream->fmt_ctx);
+    return false;
   }
   log_info("resolved stream index %s in media '%s' to be '%s'",
            SVE2_SI2STR(index), path, SVE2_SI2STR(stream->index));
 
   assert(stream->index.type == AVMEDIA_TYPE_UNKNOWN);
-  const AVStream *ff_stream = stream->fmt_ctx->streams[stream->index.offset];
-  const AVCodec *codec = avcodec_find_decoder(ff_stream->codecpar->codec_id);
-  nassert(stream->cdc_ctx = avcodec_alloc_context3(codec));
-  nassert_ffmpeg(
-      avcodec_parameters_to_context(stream->cdc_ctx, ff_stream->codecpar));
-  if (hw_accel) {
-    if (ff_stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO) {
-      log_warn("hardware accelerated decoding is only supported for video");
-    } else {
-      nassert_ffmpeg(av_hwdevice_ctx_create(&stream->cdc_ctx->hw_device_ctx,
-                                            AV_HWDEVICE_TYPE_VAAPI, NULL, NULL,
-                                            0));
-      stream->cdc_ctx->get_format = get_format_vaapi;
-      stream->cdc_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
-    }
-  }
-
-  nassert_ffmpeg(avcodec_open2(stream->cdc_ctx, codec, NULL));
+  stream->cdc_ctx = NULL;
+  ffmpeg_stream_open_decoder(stream, hw_accel, 0);
+  nassert(stream->packet = av_packet_alloc());
   log_info("AVCodecContext %p initialized for stream %s (%s) of media '%s'",
            (void *)stream->cdc_ctx, SVE2_SI2STR(index),
            SVE2_SI2STR(stream->index), path);
-  // this is unused but we copy to make accessing this easier
-  stream->cdc_ctx->time_base = ff_stream->time_base;
   return true;
 }
 
 void ffmpeg_stream_close(ffmpeg_stream_t *stream) {
+  av_packet_free(&stream->packet);
   avcodec_free_context(&stream->cdc_ctx);
   avformat_close_input(&stream->fmt_ctx);
 }
 
-void ffmpeg_stream_seek(ffmpeg_stream_t *stream, i64 timestamp) {
-  nassert_ffmpeg(av_seek_frame(stream->fmt_ctx, -1,
-                               timestamp / (SVE2_NS_PER_SEC / AV_TIME_BASE),
-                               AVSEEK_FLAG_BACKWARD));
+bool ffmpeg_stream_seek(ffmpeg_stream_t *stream, i64 timestamp) {
+  int err = av_seek_frame(stream->fmt_ctx, -1,
+                          timestamp / (SVE2_NS_PER_SEC / AV_TIME_BASE),
+                          AVSEEK_FLAG_BACKWARD);
+  if (err < 0) {
+    log_warn("unable to seek to %" PRIi64 " ns: %s", timestamp,
+             av_err2str(err));
+    return false;
+  }
+  // drop frames (and decoder state) from before the seek
+  avcodec_flush_buffers(stream->cdc_ctx);
+  return true;
 }
 
 void convert_pts(AVFrame *frame, i64 orig_time_base_num,
@@ -95,7 +121,7 @@ void convert_pts(AVFrame *frame, i64 orig_time_base_num,
 }
 
 bool ffmpeg_stream_get_frame(ffmpeg_stream_t *stream, AVFrame *frame) {
-  AVPacket *packet = stream->ctx->temp_packet;
+  AVPacket *packet = stream->packet;
   int err;
   while ((err = avcodec_receive_frame(stream->cdc_ctx, frame)) ==
          AVERROR(EAGAIN)) {
@@ -15,6 +15,12 @@ typedef struct {
   context_t *ctx;
   AVFormatContext *fmt_ctx;
   AVCodecContext *cdc_ctx;
+  /**
+   * @brief Demuxed packet buffer. This is per-stream (instead of using
+   * context_t::temp_packet), so different streams can be decoded on different
+   * threads.
+   */
+  AVPacket *packet;
   stream_index_t index;
 } ffmpeg_stream_t;
 
@@ -26,10 +32,24 @@ typedef struct {
  * @param path Media file path
  * @param stream_index Media stream index
  * @param hw_accel Whether to use hardware-acceleration for decoding or not
- * @return Whether the operation succeeded or failed (file not found)
+ * @return Whether the operation succeeded or failed (file not found or not a
+ * media file, stream not found)
  */
 bool ffmpeg_stream_open(context_t *ctx, ffmpeg_stream_t *stream,
                         const char *path, stream_index_t index, bool hw_accel);
+/**
+ * @brief (Re)open the decoder of a FFmpeg stream, e.g. to decode at a different
+ * resolution. Decoding resumes at the next keyframe, so the stream should be
+ * seeked afterwards.
+ *
+ * @param stream An opened FFmpeg stream
+ * @param hw_accel Whether to use hardware-acceleration for decoding or not
+ * @param lowres Decode at a resolution divided by 2^lowres, if the codec
+ * supports it (up to AVCodec::max_lowres). This is only supported by software
+ * decoders, and by few codecs (e.g. MJPEG, MPEG-2 and MPEG-4 part 2).
+ */
+void ffmpeg_stream_open_decoder(ffmpeg_stream_t *stream, bool hw_accel,
+                                i32 lowres);
 /**
  * @brief Close a FFmpeg stream
  *
@@ -38,12 +58,15 @@ bool ffmpeg_stream_open(context_t *ctx, ffmpeg_stream_t *stream,
 void ffmpeg_stream_close(ffmpeg_stream_t *stream);
 
 /**
- * @brief Seek a FFmpeg stream to the specified timestamp
+ * @brief Seek a FFmpeg stream to the specified timestamp (or the keyframe
+ * before it)
  *
  * @param stream The FFmpeg stream
  * @param timestamp The timestamp to seek to, in nanoseconds
+ * @return Whether the seek succeeded. Otherwise, a warning is logged and the
+ * stream is left where it was.
  */
-void ffmpeg_stream_seek(ffmpeg_stream_t *stream, i64 timestamp);
+bool ffmpeg_stream_seek(ffmpeg_stream_t *stream, i64 timestamp);
 
 /**
  * @brief Get the next frame within the FFmpeg stream
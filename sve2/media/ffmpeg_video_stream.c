@@ -4,9 +4,11 @@
 #include <libavutil/hwcontext_drm.h>
 #include <libavutil/pixdesc.h>
 #include <libdrm/drm_fourcc.h>
+#include <math.h>
 #include <unistd.h>
 
 #include "sve2/media/ffmpeg_stream.h"
+#include "sve2/utils/minmax.h"
 #include "sve2/utils/runtime.h"
 
 static void map_hw_texture(ffmpeg_video_stream_t *v, const AVFrame *vaapi_frame,
@@ -99,8 +101,70 @@ static void map_hw_texture(ffmpeg_video_stream_t *v, const AVFrame *vaapi_frame,
   }
 }
 
+// maximum number of halvings of software frames on upload
+#define MAX_UPLOAD_SHIFT 4
+
+// scale a software frame down to the preview size, and upload it to the
+// NV12 textures of v
+static void upload_sw_texture(ffmpeg_video_stream_t *v, const AVFrame *frame) {
+  // both dimensions are scaled by the same power of two (like lowres does),
+  // the largest reduction which still covers the on-screen size, so the
+  // aspect ratio is kept
+  i32 shift = 0;
+  if (v->preview_width > 0 && v->preview_height > 0) {
+    f64 scale = fmin((f64)v->preview_width / frame->width,
+                     (f64)v->preview_height / frame->height);
+    while (shift < MAX_UPLOAD_SHIFT && ldexp(1.0, -(shift + 1)) >= scale) {
+      ++shift;
+    }
+  }
+  // the chroma plane is half the size
+  i32 width = (AV_CEIL_RSHIFT(frame->width, shift) + 1) & ~1;
+  i32 height = (AV_CEIL_RSHIFT(frame->height, shift) + 1) & ~1;
+  if (width != v->sw_width || height != v->sw_height) {
+    glDeleteTextures(sve2_arrlen(v->sw_textures), v->sw_textures);
+    glCreateTextures(GL_TEXTURE_2D, sve2_arrlen(v->sw_textures),
+                     v->sw_textures);
+    glTextureStorage2D(v->sw_textures[0], 1, GL_R8, width, height);
+    glTextureStorage2D(v->sw_textures[1], 1, GL_RG8, width / 2, height / 2);
+    for (i32 i = 0; i < sve2_arrlen(v->sw_textures); ++i) {
+      glTextureParameteri(v->sw_textures[i], GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+      glTextureParameteri(v->sw_textures[i], GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+      glTextureParameteri(v->sw_textures[i], GL_TEXTURE_WRAP_S,
+                          GL_CLAMP_TO_EDGE);
+      glTextureParameteri(v->sw_textures[i], GL_TEXTURE_WRAP_T,
+                          GL_CLAMP_TO_EDGE);
+    }
+    v->sw_width = width;
+    v->sw_height = height;
+  }
+
+  // frames decoded with lowres are usually uploaded as is, and other
+  // reductions are exact halvings, which bilinear filtering handles fine
+  AVFrame *out = v->upload_frame;
+  nassert(v->scaler = sws_getCachedContext(
+              v->scaler, frame->width, frame->height, frame->format, width,
+              height, AV_PIX_FMT_NV12, SWS_FAST_BILINEAR, NULL, NULL, NULL));
+  nassert_ffmpeg(sws_scale_frame(v->scaler, out, frame));
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, out->linesize[0]);
+  glTextureSubImage2D(v->sw_textures[0], 0, 0, 0, width, height, GL_RED,
+                      GL_UNSIGNED_BYTE, out->data[0]);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, out->linesize[1] / 2);
+  glTextureSubImage2D(v->sw_textures[1], 0, 0, 0, width / 2, height / 2,
+                      GL_RG, GL_UNSIGNED_BYTE, out->data[1]);
+  glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+  av_frame_unref(out);
+
+  v->cur_frame.sw_format = AV_PIX_FMT_NV12;
+  v->cur_frame.texture_array_index = -1;
+  v->cur_frame.textures[0] = v->sw_textures[0];
+  v->cur_frame.textures[1] = v->sw_textures[1];
+}
+
 static void unmap_hw_texture(ffmpeg_video_stream_t *v) {
-  if (v->cur_frame.sw_format != AV_PIX_FMT_NONE) {
+  // software frames live in sw_textures, which are reused
+  if (v->cur_frame.sw_format != AV_PIX_FMT_NONE && !v->sw_decode) {
     for (int i = 0; i < AV_DRM_MAX_PLANES; ++i) {
       if (v->cur_frame.textures[i]) {
         glDeleteTextures(1, &v->cur_frame.textures[i]);
@@ -131,6 +195,15 @@ bool ffmpeg_video_stream_open(context_t *ctx, ffmpeg_video_stream_t *v,
 
   v->next_frame_pts = -1;
   v->cur_frame.sw_format = AV_PIX_FMT_NONE;
+  v->preview_width = v->preview_height = 0;
+  v->hw_accel = hw_accel;
+  v->sw_decode = !hw_accel;
+  v->lowres = 0;
+  v->reopen_decoder = false;
+  v->scaler = NULL;
+  nassert(v->upload_frame = av_frame_alloc());
+  v->sw_textures[0] = v->sw_textures[1] = 0;
+  v->sw_width = v->sw_height = 0;
   unmap_hw_texture(v);
 
   return true;
@@ -138,11 +211,27 @@ bool ffmpeg_video_stream_open(context_t *ctx, ffmpeg_video_stream_t *v,
 
 void ffmpeg_video_stream_close(ffmpeg_video_stream_t *v) {
   unmap_hw_texture(v);
+  glDeleteTextures(sve2_arrlen(v->sw_textures), v->sw_textures);
+  sws_freeContext(v->scaler);
+  av_frame_free(&v->upload_frame);
   ffmpeg_stream_close(&v->base);
 }
 
+// replace the current frame of v with a decoded frame
+static void set_frame(ffmpeg_video_stream_t *v, AVFrame *frame,
+                      AVFrame *prime_frame) {
+  unmap_hw_texture(v);
+  if (v->sw_decode) {
+    upload_sw_texture(v, frame);
+  } else {
+    map_hw_texture(v, frame, prime_frame);
+  }
+  av_frame_unref(frame);
+  av_frame_unref(prime_frame);
+}
+
 void ffmpeg_video_stream_seek(ffmpeg_video_stream_t *v, i64 time) {
-  ffmpeg_stream_seek(&v->base, time);
+  nassert(ffmpeg_stream_seek(&v->base, time));
 
   AVFrame *vaapi_frame = v->base.ctx->temp_frames[0],
           *prime_frame = v->base.ctx->temp_frames[1];
@@ -153,12 +242,22 @@ void ffmpeg_video_stream_seek(ffmpeg_video_stream_t *v, i64 time) {
     v->next_frame_pts = vaapi_frame->pts + vaapi_frame->duration;
   } while (v->next_frame_pts < time);
 
-  map_hw_texture(v, vaapi_frame, prime_frame);
-  av_frame_unref(vaapi_frame);
-  av_frame_unref(prime_frame);
+  set_frame(v, vaapi_frame, prime_frame);
 }
 bool ffmpeg_video_stream_get_texture(ffmpeg_video_stream_t *v, i64 time,
                                      video_frame_t *tex) {
+  if (v->reopen_decoder) {
+    // lowres is only supported by software decoders
+    unmap_hw_texture(v);
+    v->reopen_decoder = false;
+    v->sw_decode = !v->hw_accel || v->lowres > 0;
+    ffmpeg_stream_open_decoder(&v->base, !v->sw_decode, v->lowres);
+    // the new decoder does not skip the loop filter yet
+    ffmpeg_video_stream_set_preview_size(v, v->preview_width,
+                                         v->preview_height);
+    ffmpeg_video_stream_seek(v, time);
+  }
+
   AVFrame *vaapi_frame = v->base.ctx->temp_frames[0],
           *prime_frame = v->base.ctx->temp_frames[1];
   bool updated = false;
@@ -171,10 +270,7 @@ bool ffmpeg_video_stream_get_texture(ffmpeg_video_stream_t *v, i64 time,
   }
 
   if (updated) {
-    unmap_hw_texture(v);
-    map_hw_texture(v, vaapi_frame, prime_frame);
-    av_frame_unref(vaapi_frame);
-    av_frame_unref(prime_frame);
+    set_frame(v, vaapi_frame, prime_frame);
   }
 
   if (tex) {
@@ -183,3 +279,33 @@ bool ffmpeg_video_stream_get_texture(ffmpeg_video_stream_t *v, i64 time,
 
   return true;
 }
+
+void ffmpeg_video_stream_set_preview_size(ffmpeg_video_stream_t *v, i32 width,
+                                          i32 height) {
+  v->preview_width = width;
+  v->preview_height = height;
+  const AVCodecParameters *par =
+      v->base.fmt_ctx->streams[v->base.index.offset]->codecpar;
+  AVCodecContext *cdc_ctx = v->base.cdc_ctx;
+  bool preview = width > 0 && height > 0;
+
+  // the largest power of two reduction which is still at least as large as
+  // the video on screen
+  i32 lowres = 0;
+  while (preview && lowres < cdc_ctx->codec->max_lowres &&
+         (par->width >> (lowres + 1)) >= width &&
+         (par->height >> (lowres + 1)) >= height) {
+    ++lowres;
+  }
+  if (lowres != v->lowres) {
+    v->lowres = lowres;
+    v->reopen_decoder = true;
+  }
+
+  // the loop filter smooths out blocking artifacts, which are hardly visible
+  // once the frames are halved on screen, and costs a good part of the
+  // decoding time of software decoders (hardware decoders ignore this)
+  bool halved =
+      preview && width * 2 <= par->width && height * 2 <= par->height;
+  cdc_ctx->skip_loop_filter = halved ? AVDISCARD_ALL : AVDISCARD_DEFAULT;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <libavutil/hwcontext_drm.h>
+#include <libswscale/swscale.h>
 
 #include "sve2/media/ffmpeg_stream.h"
 #include "sve2/media/video_frame.h"
@@ -24,6 +25,29 @@ typedef struct {
   // frames
   EGLImage prime_images[AV_DRM_MAX_PLANES];
   int prime_fds[AV_DRM_MAX_PLANES];
+  /**
+   * @brief On-screen size of the video, 0 for full quality (see
+   * ffmpeg_video_stream_set_preview_size())
+   */
+  i32 preview_width, preview_height;
+  /**
+   * @brief Whether hardware decoding was requested, and whether frames are
+   * decoded in software instead, which is the case when the decoder scales
+   * them down (lowres, as a power of two). Software frames are scaled down to
+   * the preview size and uploaded as NV12 to sw_textures (of size sw_width x
+   * sw_height), instead of being mapped.
+   */
+  bool hw_accel, sw_decode;
+  i32 lowres;
+  /**
+   * @brief Set when lowres changes, so the decoder is reopened with the next
+   * frame
+   */
+  bool reopen_decoder;
+  struct SwsContext *scaler;
+  AVFrame *upload_frame;
+  GLuint sw_textures[2];
+  i32 sw_width, sw_height;
 } ffmpeg_video_stream_t;
 
 // this is the same API as in video.h
@@ -34,3 +58,5 @@ void ffmpeg_video_stream_close(ffmpeg_video_stream_t *v);
 void ffmpeg_video_stream_seek(ffmpeg_video_stream_t *v, i64 time);
 bool ffmpeg_video_stream_get_texture(ffmpeg_video_stream_t *v, i64 time,
                                      video_frame_t *tex);
+void ffmpeg_video_stream_set_preview_size(ffmpeg_video_stream_t *v, i32 width,
+                                          i32 height);
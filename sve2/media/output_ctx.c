@@ -3,26 +3,113 @@
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/channel_layout.h>
+#include <libavutil/dict.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/rational.h>
 
 #include "sve2/context/context.h"
+#include "sve2/gl/color_convert.h"
 #include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+// number of frames queued for the encode thread, a few video frames (with the
+// audio in between) are enough to absorb hiccups of either side
+#define OUTPUT_QUEUE_SIZE 8
+
+// element of the frame queue
+typedef struct {
+  AVFrame *frame;
+  i32 stream_idx;
+} output_job_t;
+
+static int run_encode_thread(void *arg);
+
+bool output_ctx_is_hw_encoder(const AVCodec *codec) {
+  const AVCodecHWConfig *config;
+  for (i32 i = 0; (config = avcodec_get_hw_config(codec, i)); ++i) {
+    if (config->pix_fmt == AV_PIX_FMT_VAAPI &&
+        (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_FRAMES_CTX)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// software encoders are fed with frames read back from the GPU, in any format
+// of the color converter the encoder also takes
+static enum AVPixelFormat get_sw_pix_fmt(const AVCodec *codec,
+                                         enum AVPixelFormat pix_fmt) {
+  if (!color_convert_supports(pix_fmt)) {
+    log_error("pixel format %s is not supported by the color converter",
+              av_get_pix_fmt_name(pix_fmt));
+    panic();
+  }
+  // encoders like rawvideo accept anything
+  const enum AVPixelFormat *supported = codec->pix_fmts;
+  for (; supported && *supported != AV_PIX_FMT_NONE; ++supported) {
+    if (*supported == pix_fmt) {
+      break;
+    }
+  }
+  if (supported && *supported == AV_PIX_FMT_NONE) {
+    log_error("encoder %s does not support pixel format %s", codec->name,
+              av_get_pix_fmt_name(pix_fmt));
+    panic();
+  }
+  return pix_fmt;
+}
+
+// tag the video stream with the colorimetry of the color converter
+static void set_color_properties(context_t *ctx, AVCodecContext *codec_ctx) {
+  codec_ctx->color_range = ctx->info.color_range == AVCOL_RANGE_JPEG
+                               ? AVCOL_RANGE_JPEG
+                               : AVCOL_RANGE_MPEG;
+  switch (ctx->info.color_space) {
+  case AVCOL_SPC_BT709:
+    codec_ctx->colorspace = AVCOL_SPC_BT709;
+    codec_ctx->color_primaries = AVCOL_PRI_BT709;
+    codec_ctx->color_trc = AVCOL_TRC_BT709;
+    break;
+  case AVCOL_SPC_BT2020_NCL:
+    codec_ctx->colorspace = AVCOL_SPC_BT2020_NCL;
+    codec_ctx->color_primaries = AVCOL_PRI_BT2020;
+    codec_ctx->color_trc = AVCOL_TRC_BT2020_10;
+    break;
+  default:
+    codec_ctx->colorspace = ctx->info.color_space == AVCOL_SPC_UNSPECIFIED
+                                ? AVCOL_SPC_SMPTE170M
+                                : ctx->info.color_space;
+    codec_ctx->color_primaries = AVCOL_PRI_SMPTE170M;
+    codec_ctx->color_trc = AVCOL_TRC_SMPTE170M;
+    break;
+  }
+}
 
 void config_stream(context_t *ctx, output_ctx_t *o, AVStream *stream,
                    AVCodecContext *codec_ctx) {
   switch (codec_ctx->codec->type) {
   case AVMEDIA_TYPE_VIDEO:
-    codec_ctx->width = ctx->info.width;
-    codec_ctx->height = ctx->info.height;
+    codec_ctx->width = o->video.width;
+    codec_ctx->height = o->video.height;
     codec_ctx->time_base = (AVRational){1, ctx->info.fps};
     codec_ctx->framerate = (AVRational){ctx->info.fps, 1};
     codec_ctx->sample_aspect_ratio = (AVRational){1, 1};
-    codec_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
-    codec_ctx->sw_pix_fmt = AV_PIX_FMT_NV12;
-    codec_ctx->bit_rate =
-        (i64)(ctx->info.width * ctx->info.height * ctx->info.fps * 1.0);
+    if (codec_ctx->hw_frames_ctx) {
+      codec_ctx->pix_fmt = AV_PIX_FMT_VAAPI;
+      codec_ctx->sw_pix_fmt = AV_PIX_FMT_NV12;
+      codec_ctx->bit_rate =
+          (i64)(o->video.width * o->video.height * ctx->info.fps * 1.0);
+    } else {
+      // software encoders pick their own rate control (e.g. CRF) unless told
+      // otherwise via the codec options
+      codec_ctx->pix_fmt = codec_ctx->sw_pix_fmt =
+          get_sw_pix_fmt(codec_ctx->codec, o->video.pix_fmt);
+    }
+    set_color_properties(ctx, codec_ctx);
     codec_ctx->max_b_frames = 0;
+    if (ctx->info.gop_size > 0) {
+      codec_ctx->gop_size = ctx->info.gop_size;
+    }
     log_info("initializing video encoder with w=%d, h=%d, fr=%f, br=%" PRIi64
              ", pixfmt=%s, sw_pixfmt=%s",
              codec_ctx->width, codec_ctx->height, av_q2d(codec_ctx->framerate),
@@ -51,9 +138,11 @@ void config_stream(context_t *ctx, output_ctx_t *o, AVStream *stream,
 }
 
 void output_ctx_open(context_t *ctx, output_ctx_t *o, const char *path,
-                     i32 num_streams,
-                     const AVCodec *stream_codecs[num_streams]) {
+                     const output_ctx_video_info_t *video, i32 num_streams,
+                     const AVCodec *stream_codecs[num_streams],
+                     const char *stream_options[num_streams]) {
   o->ctx = ctx;
+  o->video = *video;
 
   nassert_ffmpeg(avformat_alloc_output_context2(&o->fmt_ctx, NULL, NULL, path));
   if (!(o->fmt_ctx->flags & AVFMT_NOFILE)) {
@@ -65,7 +154,8 @@ void output_ctx_open(context_t *ctx, output_ctx_t *o, const char *path,
     AVStream *stream = avformat_new_stream(o->fmt_ctx, stream_codecs[i]);
     stream->id = i;
     nassert(o->cdc_ctx[i] = avcodec_alloc_context3(stream_codecs[i]));
-    if (stream_codecs[i]->type == AVMEDIA_TYPE_VIDEO) {
+    if (stream_codecs[i]->type == AVMEDIA_TYPE_VIDEO &&
+        output_ctx_is_hw_encoder(stream_codecs[i])) {
       nassert_ffmpeg(av_hwdevice_ctx_create(&o->cdc_ctx[i]->hw_device_ctx,
                                             AV_HWDEVICE_TYPE_VAAPI, NULL, NULL,
                                             0));
@@ -75,14 +165,26 @@ void output_ctx_open(context_t *ctx, output_ctx_t *o, const char *path,
           (AVHWFramesContext *)o->cdc_ctx[i]->hw_frames_ctx->data;
       hw_frames_ctx->format = AV_PIX_FMT_VAAPI;
       hw_frames_ctx->sw_format = AV_PIX_FMT_NV12;
-      hw_frames_ctx->width = ctx->info.width;
-      hw_frames_ctx->height = ctx->info.height;
+      hw_frames_ctx->width = o->video.width;
+      hw_frames_ctx->height = o->video.height;
 
       nassert_ffmpeg(av_hwframe_ctx_init(o->cdc_ctx[i]->hw_frames_ctx));
     }
 
     config_stream(ctx, o, stream, o->cdc_ctx[i]);
-    nassert_ffmpeg(avcodec_open2(o->cdc_ctx[i], stream_codecs[i], NULL));
+    AVDictionary *options = NULL;
+    if (stream_options && stream_options[i]) {
+      nassert_ffmpeg(
+          av_dict_parse_string(&options, stream_options[i], "=", ":", 0));
+    }
+    nassert_ffmpeg(avcodec_open2(o->cdc_ctx[i], stream_codecs[i], &options));
+    // avcodec_open2 leaves the options it did not consume
+    const AVDictionaryEntry *entry = NULL;
+    while ((entry = av_dict_iterate(options, entry))) {
+      log_warn("unknown option for encoder %s: %s=%s", stream_codecs[i]->name,
+               entry->key, entry->value);
+    }
+    av_dict_free(&options);
 
     stream->time_base = o->cdc_ctx[i]->time_base;
     stream->avg_frame_rate = o->cdc_ctx[i]->framerate;
@@ -91,6 +193,16 @@ void output_ctx_open(context_t *ctx, output_ctx_t *o, const char *path,
   }
 
   nassert_ffmpeg(avformat_write_header(o->fmt_ctx, NULL));
+
+  nassert(o->packet = av_packet_alloc());
+  spsc_ring_init(&o->queue, sve2_sizeof(output_job_t), OUTPUT_QUEUE_SIZE);
+  for (i32 i = 0; i < OUTPUT_QUEUE_SIZE; ++i) {
+    nassert(((output_job_t *)o->queue.data)[i].frame = av_frame_alloc());
+  }
+  sve2_mtx_init(&o->lock, mtx_plain);
+  sve2_cnd_init(&o->cond);
+  o->closing = false;
+  sve2_thrd_create(&o->encode_thread, run_encode_thread, o);
 }
 
 void output_ctx_init_hwframe(output_ctx_t *o, AVFrame *hw_frame,
@@ -107,7 +219,7 @@ static bool is_eof_or_eagain(int err) {
 }
 
 void flush_packets(output_ctx_t *o, i32 stream_idx) {
-  AVPacket *packet = o->ctx->temp_packet;
+  AVPacket *packet = o->packet;
   int err;
   while (!is_eof_or_eagain(
       err = avcodec_receive_packet(o->cdc_ctx[stream_idx], packet))) {
@@ -120,7 +232,7 @@ void flush_packets(output_ctx_t *o, i32 stream_idx) {
   }
 }
 
-void output_ctx_submit_frame(output_ctx_t *o, AVFrame *frame, i32 stream_idx) {
+static void encode_frame(output_ctx_t *o, AVFrame *frame, i32 stream_idx) {
   int err;
   do {
     flush_packets(o, stream_idx);
@@ -131,14 +243,83 @@ void output_ctx_submit_frame(output_ctx_t *o, AVFrame *frame, i32 stream_idx) {
   flush_packets(o, stream_idx);
 }
 
+static int run_encode_thread(void *arg) {
+  output_ctx_t *o = arg;
+  while (true) {
+    sve2_mtx_lock(&o->lock);
+    while (!o->closing && spsc_ring_size(&o->queue) == 0) {
+      sve2_cnd_wait(&o->cond, &o->lock);
+    }
+    // when closing, the queue is drained before exiting
+    bool done = spsc_ring_size(&o->queue) == 0;
+    sve2_mtx_unlock(&o->lock);
+    if (done) {
+      break;
+    }
+
+    u8 *data;
+    spsc_ring_read_map(&o->queue, &data);
+    output_job_t *job = (output_job_t *)data;
+    encode_frame(o, job->frame, job->stream_idx);
+    av_frame_unref(job->frame);
+    spsc_ring_read_commit(&o->queue, 1);
+
+    sve2_mtx_lock(&o->lock);
+    sve2_cnd_broadcast(&o->cond);
+    sve2_mtx_unlock(&o->lock);
+  }
+
+  return 0;
+}
+
+void output_ctx_submit_frame(output_ctx_t *o, AVFrame *frame, i32 stream_idx) {
+  sve2_mtx_lock(&o->lock);
+  while (spsc_ring_space(&o->queue) == 0) {
+    sve2_cnd_wait(&o->cond, &o->lock);
+  }
+  sve2_mtx_unlock(&o->lock);
+
+  u8 *data;
+  spsc_ring_write_map(&o->queue, 1, &data);
+  output_job_t *job = (output_job_t *)data;
+  av_frame_move_ref(job->frame, frame);
+  job->stream_idx = stream_idx;
+  spsc_ring_write_commit(&o->queue, 1);
+
+  sve2_mtx_lock(&o->lock);
+  sve2_cnd_broadcast(&o->cond);
+  sve2_mtx_unlock(&o->lock);
+}
+
+void output_ctx_wait(output_ctx_t *o) {
+  sve2_mtx_lock(&o->lock);
+  while (spsc_ring_size(&o->queue) > 0) {
+    sve2_cnd_wait(&o->cond, &o->lock);
+  }
+  sve2_mtx_unlock(&o->lock);
+}
+
 void output_ctx_close(output_ctx_t *o) {
+  sve2_mtx_lock(&o->lock);
+  o->closing = true;
+  sve2_cnd_broadcast(&o->cond);
+  sve2_mtx_unlock(&o->lock);
+  thrd_join(o->encode_thread, NULL);
+
   for (i32 i = 0; i < (i32)o->fmt_ctx->nb_streams; ++i) {
-    output_ctx_submit_frame(o, NULL, i);
+    encode_frame(o, NULL, i);
     flush_packets(o, i);
     avcodec_free_context(&o->cdc_ctx[i]);
   }
 
   free(o->cdc_ctx);
+  for (i32 i = 0; i < OUTPUT_QUEUE_SIZE; ++i) {
+    av_frame_free(&((output_job_t *)o->queue.data)[i].frame);
+  }
+  spsc_ring_free(&o->queue);
+  av_packet_free(&o->packet);
+  cnd_destroy(&o->cond);
+  mtx_destroy(&o->lock);
 
   nassert_ffmpeg(av_write_trailer(o->fmt_ctx));
   if (!(o->fmt_ctx->flags & AVFMT_NOFILE)) {
@@ -1,35 +1,93 @@
 #pragma once
 
+#include <threads.h>
+
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 
+#include "sve2/utils/spsc_ring.h"
 #include "sve2/utils/types.h"
 
 typedef struct context_t context_t;
 
+/**
+ * @brief Parameters of the video stream of an output context
+ */
+typedef struct {
+  i32 width, height;
+  /**
+   * @brief Pixel format of the frames fed to a software encoder (see
+   * context_init_t::video_pix_fmt)
+   */
+  enum AVPixelFormat pix_fmt;
+} output_ctx_video_info_t;
+
 /**
  * @brief Output context. This wraps a muxer and several encoders for the output
  * media file in render mode.
+ *
+ * Encoding and muxing run on a dedicated encode thread, fed through a bounded
+ * queue of frames, so they overlap with rendering. Packets of every stream are
+ * interleaved on that thread.
  */
 typedef struct {
   context_t *ctx;
+  output_ctx_video_info_t video;
   AVFormatContext *fmt_ctx;
   AVCodecContext **cdc_ctx;
+  /**
+   * @brief Packet received from the encoders
+   */
+  AVPacket *packet;
+  /**
+   * @brief Queue of frames to encode (see output_ctx.c for the element type).
+   * Every slot owns an AVFrame, so the queue doubles as a frame pool: submitted
+   * frames are moved into a free slot, and unreferenced by the encode thread
+   * once encoded.
+   */
+  spsc_ring_t queue;
+  thrd_t encode_thread;
+  /**
+   * @brief Protects nothing but the waits for the queue (both ways) and
+   * closing
+   */
+  mtx_t lock;
+  cnd_t cond;
+  bool closing;
 } output_ctx_t;
 
 /**
  * @brief Open an output context.
  *
+ * Video encoders taking VAAPI surfaces (see output_ctx_is_hw_encoder()) are
+ * given a VAAPI frames context with NV12 surfaces. Other (software) video
+ * encoders take frames in system memory, in the pixel format of video. Video
+ * streams are tagged with the color space and range of the context.
+ *
  * @param ctx The context which output streams information will be based on
  * @param o The output context
  * @param path Path to the output file
+ * @param video Parameters of the video stream (if any), which may differ from
+ * the ones of the context, e.g. for the renditions of a render
  * @param num_streams Number of streams in the output media file
  * @param stream_codecs An array of stream codecs used to encode the output
  * media streams
+ * @param stream_options An array of encoder options (in the form
+ * "key=value:key=value", e.g. "crf=18:preset=slow"), one per stream. The array
+ * and its elements may be NULL.
  */
 void output_ctx_open(context_t *ctx, output_ctx_t *o, const char *path,
-                     i32 num_streams,
-                     const AVCodec *stream_codecs[num_streams]);
+                     const output_ctx_video_info_t *video, i32 num_streams,
+                     const AVCodec *stream_codecs[num_streams],
+                     const char *stream_options[num_streams]);
+/**
+ * @brief Check whether a video encoder is hardware-accelerated, i.e. it takes
+ * VAAPI surfaces instead of frames in system memory.
+ *
+ * @param codec The encoder
+ * @return Whether the encoder takes VAAPI surfaces
+ */
+bool output_ctx_is_hw_encoder(const AVCodec *codec);
 /**
  * @brief Create a hardware-acceleration-based AVFrame for video encoding. The
  * data could be mapped to this frame using av_hwframe_map().
@@ -41,15 +99,26 @@ void output_ctx_open(context_t *ctx, output_ctx_t *o, const char *path,
 void output_ctx_init_hwframe(output_ctx_t *o, AVFrame *hw_frame,
                              i32 stream_idx);
 /**
- * @brief Submit a frame to the output context for encoding.
+ * @brief Submit a frame to the output context for encoding. The frame is queued
+ * and encoded on the encode thread. If the queue is full, this blocks until the
+ * encode thread catches up.
  *
  * @param o The output context
- * @param frame The frame
+ * @param frame The frame. It must be reference-counted, and its reference is
+ * moved into the queue (so frame is reset when this returns).
  * @param stream_idx The stream index this frame belongs to
  */
 void output_ctx_submit_frame(output_ctx_t *o, AVFrame *frame, i32 stream_idx);
 /**
- * @brief Close (and flush) the output context.
+ * @brief Wait until every submitted frame is encoded, e.g. before reusing the
+ * memory a submitted frame points to without owning it.
+ *
+ * @param o The output context
+ */
+void output_ctx_wait(output_ctx_t *o);
+/**
+ * @brief Close (and flush) the output context. Queued frames are encoded
+ * before the encoders are flushed.
  *
  * @param o An opened output context.
  */
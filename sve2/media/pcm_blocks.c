@@ -0,0 +1,415 @@
+#include "pcm_blocks.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+
+#define MAX_ORDER 4
+// unary-coded quotients are capped at this length, larger residuals are
+// written verbatim
+#define RICE_ESCAPE 32
+#define ESCAPED_BITS 40
+// float samples are quantized to 24-bit integers
+#define FLOAT_SCALE 8388608.0f
+
+static i32 format_bits(enum AVSampleFormat fmt) {
+  switch (fmt) {
+  case AV_SAMPLE_FMT_U8:
+    return 8;
+  case AV_SAMPLE_FMT_S16:
+    return 16;
+  case AV_SAMPLE_FMT_S32:
+    return 32;
+  case AV_SAMPLE_FMT_FLT:
+    return 24;
+  default:
+    assert(false && "unsupported sample format");
+    return 0;
+  }
+}
+
+void pcm_blocks_init(pcm_blocks_t *b, enum AVSampleFormat sample_fmt,
+                     i32 nb_channels, i32 bits) {
+  *b = (pcm_blocks_t){
+      .sample_fmt = sample_fmt,
+      .nb_channels = nb_channels,
+      .sample_size = av_get_bytes_per_sample(sample_fmt) * nb_channels,
+      .shift = bits > 0 ? sve2_max_i32(format_bits(sample_fmt) - bits, 0) : 0,
+  };
+}
+
+void pcm_blocks_free(pcm_blocks_t *b) {
+  sve2_freep(&b->data);
+  sve2_freep(&b->blocks);
+  sve2_freep(&b->pending);
+}
+
+// load channel c of a block as integers (with the low bits dropped)
+static void load_channel(const pcm_blocks_t *b, const u8 *samples, i32 n,
+                         i32 c, i32 out[static n]) {
+  i32 bytes = av_get_bytes_per_sample(b->sample_fmt);
+  const u8 *p = samples + c * bytes;
+  for (i32 i = 0; i < n; ++i, p += b->sample_size) {
+    i32 value;
+    switch (b->sample_fmt) {
+    case AV_SAMPLE_FMT_U8:
+      value = (i32)*p - 128;
+      break;
+    case AV_SAMPLE_FMT_S16: {
+      i16 s;
+      memcpy(&s, p, sizeof s);
+      value = s;
+      break;
+    }
+    case AV_SAMPLE_FMT_S32:
+      memcpy(&value, p, sizeof value);
+      break;
+    default: {
+      f32 f;
+      memcpy(&f, p, sizeof f);
+      f = sve2_max_f32(sve2_min_f32(f, 1.0f), -1.0f);
+      value = (i32)sve2_min_i64(lrintf(f * FLOAT_SCALE), FLOAT_SCALE - 1);
+      break;
+    }
+    }
+    out[i] = value >> b->shift;
+  }
+}
+
+static void store_channel(const pcm_blocks_t *b, const i32 *values, i32 n,
+                          i32 c, u8 *samples) {
+  i32 bytes = av_get_bytes_per_sample(b->sample_fmt);
+  u8 *p = samples + c * bytes;
+  // reconstruct dropped bits at the middle of their range, so the error is
+  // centered around zero
+  i64 bias = b->shift > 0 ? (i64)1 << (b->shift - 1) : 0;
+  for (i32 i = 0; i < n; ++i, p += b->sample_size) {
+    i32 value = (i32)(((i64)values[i] << b->shift) + bias);
+    switch (b->sample_fmt) {
+    case AV_SAMPLE_FMT_U8:
+      *p = (u8)(value + 128);
+      break;
+    case AV_SAMPLE_FMT_S16: {
+      i16 s = (i16)value;
+      memcpy(p, &s, sizeof s);
+      break;
+    }
+    case AV_SAMPLE_FMT_S32:
+      memcpy(p, &value, sizeof value);
+      break;
+    default: {
+      f32 f = (f32)value / FLOAT_SCALE;
+      memcpy(p, &f, sizeof f);
+      break;
+    }
+    }
+  }
+}
+
+// fixed polynomial predictor residual of order `order` at index i >= order
+static i64 residual(const i32 *x, i32 i, i32 order) {
+  switch (order) {
+  case 0:
+    return x[i];
+  case 1:
+    return (i64)x[i] - x[i - 1];
+  case 2:
+    return (i64)x[i] - 2 * (i64)x[i - 1] + x[i - 2];
+  case 3:
+    return (i64)x[i] - 3 * (i64)x[i - 1] + 3 * (i64)x[i - 2] - x[i - 3];
+  default:
+    return (i64)x[i] - 4 * (i64)x[i - 1] + 6 * (i64)x[i - 2] -
+           4 * (i64)x[i - 3] + x[i - 4];
+  }
+}
+
+static u64 zigzag(i64 value) { return ((u64)value << 1) ^ (u64)(value >> 63); }
+static i64 unzigzag(u64 value) { return (i64)(value >> 1) ^ -(i64)(value & 1); }
+
+typedef struct {
+  u8 *data;
+  u64 acc;
+  i32 num_bits;
+} bit_writer_t;
+
+// count <= 32
+static void write_bits(bit_writer_t *w, u64 value, i32 count) {
+  w->acc = (w->acc << count) | (value & (((u64)1 << count) - 1));
+  w->num_bits += count;
+  while (w->num_bits >= 8) {
+    w->num_bits -= 8;
+    *w->data++ = (u8)(w->acc >> w->num_bits);
+  }
+}
+
+static void flush_bits(bit_writer_t *w) {
+  if (w->num_bits > 0) {
+    write_bits(w, 0, 8 - w->num_bits);
+  }
+}
+
+static void write_rice(bit_writer_t *w, u64 value, i32 k) {
+  u64 q = value >> k;
+  if (q >= RICE_ESCAPE) {
+    write_bits(w, UINT32_MAX, RICE_ESCAPE);
+    write_bits(w, value >> 20, ESCAPED_BITS - 20);
+    write_bits(w, value, 20);
+    return;
+  }
+
+  // q ones, then a zero
+  write_bits(w, (((u64)1 << q) - 1) << 1, (i32)q + 1);
+  if (k > 0) {
+    write_bits(w, value >> (k > 32 ? 32 : 0), sve2_max_i32(k - 32, 0));
+    write_bits(w, value, sve2_min_i32(k, 32));
+  }
+}
+
+typedef struct {
+  const u8 *data;
+  u64 acc;
+  i32 num_bits;
+} bit_reader_t;
+
+// count <= 32
+static u64 read_bits(bit_reader_t *r, i32 count) {
+  while (r->num_bits < count) {
+    r->acc = (r->acc << 8) | *r->data++;
+    r->num_bits += 8;
+  }
+  r->num_bits -= count;
+  return (r->acc >> r->num_bits) & (((u64)1 << count) - 1);
+}
+
+static u64 read_rice(bit_reader_t *r, i32 k) {
+  u64 q = 0;
+  while (q < RICE_ESCAPE && read_bits(r, 1)) {
+    ++q;
+  }
+  if (q == RICE_ESCAPE) {
+    u64 high = read_bits(r, ESCAPED_BITS - 20);
+    return (high << 20) | read_bits(r, 20);
+  }
+
+  u64 value = q;
+  if (k > 32) {
+    value = (value << (k - 32)) | read_bits(r, k - 32);
+  }
+  if (k > 0) {
+    value = (value << sve2_min_i32(k, 32)) | read_bits(r, sve2_min_i32(k, 32));
+  }
+  return value;
+}
+
+static void encode_block(pcm_blocks_t *b, const u8 *samples, i32 n,
+                         i64 first_sample) {
+  if (b->num_blocks == b->blocks_capacity) {
+    b->blocks_capacity = sve2_max_i32(b->blocks_capacity * 2, 64);
+    b->blocks = sve2_realloc(b->blocks,
+                             b->blocks_capacity * sve2_sizeof(pcm_block_t));
+  }
+  b->blocks[b->num_blocks++] = (pcm_block_t){
+      .first_sample = first_sample,
+      .offset = b->size,
+  };
+
+  // worst case: every residual is escaped
+  i64 max_size =
+      (i64)n * b->nb_channels * (RICE_ESCAPE + ESCAPED_BITS) / 8 + 64;
+  if (b->size + max_size > b->capacity) {
+    b->capacity = sve2_max_i64(b->capacity * 2, b->size + max_size);
+    b->data = sve2_realloc(b->data, b->capacity);
+  }
+
+  bit_writer_t w = {.data = b->data + b->size};
+  i32 x[PCM_BLOCK_SIZE];
+  for (i32 c = 0; c < b->nb_channels; ++c) {
+    load_channel(b, samples, n, c, x);
+
+    // pick the predictor with the smallest residuals
+    i32 order = 0;
+    u64 best_sum = UINT64_MAX;
+    for (i32 o = 0; o <= sve2_min_i32(MAX_ORDER, n - 1); ++o) {
+      u64 sum = 0;
+      for (i32 i = o; i < n; ++i) {
+        sum += zigzag(residual(x, i, o));
+      }
+      if (sum < best_sum) {
+        best_sum = sum;
+        order = o;
+      }
+    }
+
+    // Rice parameter estimate: the mean of the residuals is about 2^k
+    i32 k = 0;
+    i64 num_residuals = sve2_max_i32(n - order, 1);
+    while (k < 40 && ((u64)num_residuals << (k + 1)) < best_sum) {
+      ++k;
+    }
+
+    write_bits(&w, (u64)order, 3);
+    write_bits(&w, (u64)k, 6);
+    for (i32 i = 0; i < sve2_min_i32(order, n); ++i) {
+      write_bits(&w, (u32)x[i], 32);
+    }
+    for (i32 i = order; i < n; ++i) {
+      write_rice(&w, zigzag(residual(x, i, order)), k);
+    }
+  }
+
+  flush_bits(&w);
+  b->size = w.data - b->data;
+}
+
+void pcm_blocks_decode(const pcm_blocks_t *b, i32 block, u8 *samples) {
+  i32 n = pcm_blocks_get_length(b, block);
+  bit_reader_t r = {.data = b->data + b->blocks[block].offset};
+  i32 x[PCM_BLOCK_SIZE];
+  for (i32 c = 0; c < b->nb_channels; ++c) {
+    i32 order = (i32)read_bits(&r, 3);
+    i32 k = (i32)read_bits(&r, 6);
+    for (i32 i = 0; i < sve2_min_i32(order, n); ++i) {
+      x[i] = (i32)(u32)read_bits(&r, 32);
+    }
+    for (i32 i = order; i < n; ++i) {
+      // the residual is linear in x[i], with a coefficient of 1
+      x[i] = 0;
+      i64 prediction = -residual(x, i, order);
+      x[i] = (i32)(unzigzag(read_rice(&r, k)) + prediction);
+    }
+
+    store_channel(b, x, n, c, samples);
+  }
+}
+
+void pcm_blocks_append(pcm_blocks_t *b, const u8 *samples, i64 num_samples) {
+  if (!b->pending) {
+    b->pending = sve2_malloc(PCM_BLOCK_SIZE * b->sample_size);
+  }
+
+  while (num_samples > 0) {
+    // encode full blocks straight from the input
+    if (b->num_pending == 0 && num_samples >= PCM_BLOCK_SIZE) {
+      encode_block(b, samples, PCM_BLOCK_SIZE, b->num_samples);
+      b->num_samples += PCM_BLOCK_SIZE;
+      samples += PCM_BLOCK_SIZE * b->sample_size;
+      num_samples -= PCM_BLOCK_SIZE;
+      continue;
+    }
+
+    i32 count = (i32)sve2_min_i64(PCM_BLOCK_SIZE - b->num_pending, num_samples);
+    memcpy(b->pending + b->num_pending * b->sample_size, samples,
+           (size_t)(count * b->sample_size));
+    b->num_pending += count;
+    b->num_samples += count;
+    samples += count * b->sample_size;
+    num_samples -= count;
+    if (b->num_pending == PCM_BLOCK_SIZE) {
+      encode_block(b, b->pending, PCM_BLOCK_SIZE,
+                   b->num_samples - PCM_BLOCK_SIZE);
+      b->num_pending = 0;
+    }
+  }
+}
+
+void pcm_blocks_finish(pcm_blocks_t *b) {
+  if (b->num_pending > 0) {
+    encode_block(b, b->pending, b->num_pending,
+                 b->num_samples - b->num_pending);
+    b->num_pending = 0;
+  }
+  sve2_freep(&b->pending);
+
+  // give back the worst-case headroom
+  b->capacity = b->size;
+  b->data = sve2_realloc(b->data, b->capacity);
+  b->blocks_capacity = b->num_blocks;
+  b->blocks =
+      sve2_realloc(b->blocks, b->blocks_capacity * sve2_sizeof(pcm_block_t));
+}
+
+void pcm_blocks_concat(pcm_blocks_t *b, pcm_blocks_t *other) {
+  assert(b->num_pending == 0 && other->num_pending == 0);
+  assert(b->sample_fmt == other->sample_fmt &&
+         b->nb_channels == other->nb_channels && b->shift == other->shift);
+
+  b->capacity = b->size + other->size;
+  b->data = sve2_realloc(b->data, b->capacity);
+  memcpy(b->data + b->size, other->data, (size_t)other->size);
+
+  b->blocks_capacity = b->num_blocks + other->num_blocks;
+  b->blocks =
+      sve2_realloc(b->blocks, b->blocks_capacity * sve2_sizeof(pcm_block_t));
+  for (i32 i = 0; i < other->num_blocks; ++i) {
+    b->blocks[b->num_blocks++] = (pcm_block_t){
+        .first_sample = other->blocks[i].first_sample + b->num_samples,
+        .offset = other->blocks[i].offset + b->size,
+    };
+  }
+
+  b->size += other->size;
+  b->num_samples += other->num_samples;
+  pcm_blocks_free(other);
+}
+
+i32 pcm_blocks_find(const pcm_blocks_t *b, i64 sample) {
+  if (sample < 0 || sample >= b->num_samples - b->num_pending) {
+    return -1;
+  }
+
+  // last block with first_sample <= sample
+  i32 lo = 0, hi = b->num_blocks - 1;
+  while (lo < hi) {
+    i32 mid = lo + (hi - lo + 1) / 2;
+    if (b->blocks[mid].first_sample <= sample) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+
+  return lo;
+}
+
+i32 pcm_blocks_get_length(const pcm_blocks_t *b, i32 block) {
+  i64 end = block + 1 < b->num_blocks ? b->blocks[block + 1].first_sample
+                                      : b->num_samples - b->num_pending;
+  return (i32)(end - b->blocks[block].first_sample);
+}
+
+void pcm_block_cache_init(pcm_block_cache_t *c, const pcm_blocks_t *b) {
+  c->clock = 0;
+  for (i32 i = 0; i < PCM_BLOCK_CACHE_SIZE; ++i) {
+    c->blocks[i] = -1;
+    c->samples[i] = sve2_malloc(PCM_BLOCK_SIZE * b->sample_size);
+    c->last_used[i] = 0;
+  }
+}
+
+void pcm_block_cache_free(pcm_block_cache_t *c) {
+  for (i32 i = 0; i < PCM_BLOCK_CACHE_SIZE; ++i) {
+    sve2_freep(&c->samples[i]);
+  }
+}
+
+const u8 *pcm_block_cache_get(pcm_block_cache_t *c, const pcm_blocks_t *b,
+                              i32 block) {
+  i32 lru = 0;
+  for (i32 i = 0; i < PCM_BLOCK_CACHE_SIZE; ++i) {
+    if (c->blocks[i] == block) {
+      c->last_used[i] = ++c->clock;
+      return c->samples[i];
+    }
+    if (c->last_used[i] < c->last_used[lru]) {
+      lru = i;
+    }
+  }
+
+  pcm_blocks_decode(b, block, c->samples[lru]);
+  c->blocks[lru] = block;
+  c->last_used[lru] = ++c->clock;
+  return c->samples[lru];
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <libavutil/samplefmt.h>
+
+#include "sve2/utils/types.h"
+
+// number of samples (per channel) in a block. Only the last block of an
+// encoding pass can be shorter.
+#define PCM_BLOCK_SIZE 4096
+// number of decoded blocks kept by pcm_block_cache_t
+#define PCM_BLOCK_CACHE_SIZE 4
+
+typedef struct {
+  /**
+   * @brief Index of the first sample in the block
+   */
+  i64 first_sample;
+  /**
+   * @brief Offset (in bytes) of the encoded block in pcm_blocks_t::data
+   */
+  i64 offset;
+} pcm_block_t;
+
+/**
+ * @brief Compressed interleaved PCM audio, stored as a sequence of
+ * independently decodable blocks and a block index, so that any sample can be
+ * accessed by decoding a single block.
+ *
+ * Every block and channel is coded with the best fixed polynomial predictor
+ * (order 0 to 4, like FLAC) and Rice-coded residuals. This is lossless for
+ * integer sample formats. Float samples are quantized to 24 bits first.
+ *
+ * In lossy mode, only the highest `bits` bits of every sample are coded, which
+ * roughly saves one bit per dropped bit per sample, at the cost of 6 dB of
+ * noise floor per dropped bit.
+ */
+typedef struct {
+  enum AVSampleFormat sample_fmt;
+  i32 nb_channels, sample_size;
+  /**
+   * @brief Number of low-order bits dropped from every sample (0 for lossless)
+   */
+  i32 shift;
+  /**
+   * @brief Encoded blocks
+   */
+  u8 *data;
+  i64 size, capacity;
+  /**
+   * @brief Block index, sorted by first sample
+   */
+  pcm_block_t *blocks;
+  i32 num_blocks, blocks_capacity;
+  /**
+   * @brief Total number of samples appended (including pending samples)
+   */
+  i64 num_samples;
+  /**
+   * @brief Samples of the incomplete block being accumulated
+   */
+  u8 *pending;
+  i32 num_pending;
+} pcm_blocks_t;
+
+/**
+ * @brief Initialize an empty compressed PCM buffer. This does not allocate, so
+ * initialized pcm_blocks_t objects can be copied until samples are appended.
+ *
+ * @param b Destination pcm_blocks_t object
+ * @param sample_fmt Sample format, must be u8, s16, s32 or flt
+ * @param nb_channels Number of channels
+ * @param bits Number of bits kept per sample, 0 for lossless
+ */
+void pcm_blocks_init(pcm_blocks_t *b, enum AVSampleFormat sample_fmt,
+                     i32 nb_channels, i32 bits);
+void pcm_blocks_free(pcm_blocks_t *b);
+
+/**
+ * @brief Append interleaved samples. Full blocks are encoded immediately.
+ */
+void pcm_blocks_append(pcm_blocks_t *b, const u8 *samples, i64 num_samples);
+/**
+ * @brief Encode the last (incomplete) block and trim the buffers. Samples must
+ * not be appended after this.
+ */
+void pcm_blocks_finish(pcm_blocks_t *b);
+/**
+ * @brief Move all blocks of `other` to the end of `b`. Both must be finished,
+ * and have the same parameters. `other` is freed.
+ */
+void pcm_blocks_concat(pcm_blocks_t *b, pcm_blocks_t *other);
+
+/**
+ * @brief Find the block containing a sample
+ *
+ * @return The block index, or -1 if the sample is out of range
+ */
+i32 pcm_blocks_find(const pcm_blocks_t *b, i64 sample);
+// number of samples in a block
+i32 pcm_blocks_get_length(const pcm_blocks_t *b, i32 block);
+/**
+ * @brief Decode a block
+ *
+ * @param b A finished pcm_blocks_t object
+ * @param block The block index
+ * @param samples Destination buffer (interleaved), which must be able to hold
+ * PCM_BLOCK_SIZE samples
+ */
+void pcm_blocks_decode(const pcm_blocks_t *b, i32 block, u8 *samples);
+
+/**
+ * @brief LRU cache of decoded blocks, so that sequential reads and small seeks
+ * only decode every block once.
+ */
+typedef struct {
+  i32 blocks[PCM_BLOCK_CACHE_SIZE];
+  u8 *samples[PCM_BLOCK_CACHE_SIZE];
+  u64 last_used[PCM_BLOCK_CACHE_SIZE];
+  u64 clock;
+} pcm_block_cache_t;
+
+void pcm_block_cache_init(pcm_block_cache_t *c, const pcm_blocks_t *b);
+void pcm_block_cache_free(pcm_block_cache_t *c);
+/**
+ * @brief Get the decoded samples of a block, decoding it if necessary. The
+ * returned pointer is valid until the next call.
+ */
+const u8 *pcm_block_cache_get(pcm_block_cache_t *c, const pcm_blocks_t *b,
+                              i32 block);
@@ -0,0 +1,403 @@
+#include "proxy.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/dict.h>
+#include <libavutil/mathematics.h>
+#include <libswscale/swscale.h>
+#include <log.h>
+#include <stb/stb_ds.h>
+
+#ifndef SVE2_NO_NONSTD
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "sve2/log/logging.h"
+#include "sve2/media/ffmpeg_stream.h"
+#include "sve2/utils/asprintf.h"
+#include "sve2/utils/cache.h"
+#include "sve2/utils/hash.h"
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+#define PROXY_CACHE_MAGIC "SVE2PRX1"
+
+// encoders of the proxies, by preference. Both are intra-only with a GOP size
+// of 1, and fast to decode.
+static const struct {
+  const char *name, *options;
+} proxy_encoders[] = {
+    {"libx264", "preset=veryfast:tune=fastdecode:crf=23"},
+    {"mjpeg", "q=4"},
+};
+
+static char *get_proxy_path(const proxy_manager_t *pm, const char *path,
+                            stream_index_t index) {
+  u64 key;
+  if (!cache_hash_source(sve2_hash_str(SVE2_HASH_INIT, PROXY_CACHE_MAGIC),
+                         path, &key)) {
+    return NULL;
+  }
+
+  i32 params[] = {index.type, index.offset, pm->height};
+  key = sve2_hash_value(key, params);
+  return cache_get_path(key, ".proxy.mkv");
+}
+
+// whether a proxy file can be used, i.e. it opens and has a video stream (it
+// might be unreadable, or damaged)
+static bool proxy_file_opens(const char *proxy_path) {
+  AVFormatContext *fmt_ctx = NULL;
+  if (avformat_open_input(&fmt_ctx, proxy_path, NULL, NULL) < 0) {
+    return false;
+  }
+  bool ok = avformat_find_stream_info(fmt_ctx, NULL) >= 0 &&
+            av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0) >=
+                0;
+  avformat_close_input(&fmt_ctx);
+  return ok;
+}
+
+static const AVCodec *find_proxy_encoder(const char *options[static 1]) {
+  for (i32 i = 0; i < sve2_arrlen(proxy_encoders); ++i) {
+    const AVCodec *codec =
+        avcodec_find_encoder_by_name(proxy_encoders[i].name);
+    if (codec) {
+      *options = proxy_encoders[i].options;
+      return codec;
+    }
+  }
+  return NULL;
+}
+
+// a proxy being transcoded
+typedef struct {
+  proxy_t *proxy;
+  ffmpeg_stream_t in;
+  AVCodecContext *enc_ctx;
+  AVFormatContext *fmt_ctx;
+  struct SwsContext *scaler;
+  AVFrame *in_frame, *out_frame;
+  AVPacket *packet;
+  /**
+   * @brief Timestamp of the start of the source and its duration (0 if
+   * unknown), in nanoseconds, for the progress
+   */
+  i64 start_time, duration;
+} transcode_t;
+
+// send a frame (or NULL to flush) to the encoder, and write the packets out
+static bool encode_frame(transcode_t *t, AVFrame *frame) {
+  int err = avcodec_send_frame(t->enc_ctx, frame);
+  while (err >= 0) {
+    err = avcodec_receive_packet(t->enc_ctx, t->packet);
+    if (err == AVERROR(EAGAIN) || err == AVERROR_EOF) {
+      return true;
+    }
+    if (err >= 0) {
+      av_packet_rescale_ts(t->packet, t->enc_ctx->time_base,
+                           t->fmt_ctx->streams[0]->time_base);
+      t->packet->stream_index = 0;
+      err = av_interleaved_write_frame(t->fmt_ctx, t->packet);
+    }
+  }
+  log_warn("unable to encode the proxy of '%s': %s", t->proxy->path,
+           av_err2str(err));
+  return false;
+}
+
+// open the encoder and the muxer of the proxy, written to path
+static bool open_output(proxy_manager_t *pm, transcode_t *t,
+                        const char *path) {
+  const AVCodecContext *dec_ctx = t->in.cdc_ctx;
+  const AVStream *in_stream = t->in.fmt_ctx->streams[t->in.index.offset];
+  const char *encoder_options;
+  const AVCodec *codec = find_proxy_encoder(&encoder_options);
+  if (!codec) {
+    log_warn("no proxy encoder is available");
+    return false;
+  }
+
+  nassert(t->enc_ctx = avcodec_alloc_context3(codec));
+  // the aspect ratio is kept, with an even width for 4:2:0 chroma
+  t->enc_ctx->height = pm->height;
+  t->enc_ctx->width =
+      (i32)av_rescale(dec_ctx->width, pm->height, dec_ctx->height) & ~1;
+  t->enc_ctx->sample_aspect_ratio = dec_ctx->sample_aspect_ratio;
+  t->enc_ctx->pix_fmt = codec->pix_fmts[0];
+  // timestamps are the ones of the source
+  t->enc_ctx->time_base = in_stream->time_base;
+  t->enc_ctx->framerate = in_stream->avg_frame_rate;
+  t->enc_ctx->gop_size = 1;
+  t->enc_ctx->max_b_frames = 0;
+  t->enc_ctx->colorspace = dec_ctx->colorspace;
+  t->enc_ctx->color_primaries = dec_ctx->color_primaries;
+  t->enc_ctx->color_trc = dec_ctx->color_trc;
+  if (avformat_alloc_output_context2(&t->fmt_ctx, NULL, "matroska", path) <
+      0) {
+    return false;
+  }
+  if (t->fmt_ctx->oformat->flags & AVFMT_GLOBALHEADER) {
+    t->enc_ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+  }
+
+  AVDictionary *options = NULL;
+  nassert_ffmpeg(av_dict_parse_string(&options, encoder_options, "=", ":", 0));
+  int err = avcodec_open2(t->enc_ctx, codec, &options);
+  av_dict_free(&options);
+  if (err < 0) {
+    log_warn("unable to open proxy encoder %s: %s", codec->name,
+             av_err2str(err));
+    return false;
+  }
+
+  AVStream *stream;
+  nassert(stream = avformat_new_stream(t->fmt_ctx, codec));
+  stream->time_base = t->enc_ctx->time_base;
+  stream->avg_frame_rate = t->enc_ctx->framerate;
+  nassert_ffmpeg(
+      avcodec_parameters_from_context(stream->codecpar, t->enc_ctx));
+  if ((err = avio_open(&t->fmt_ctx->pb, path, AVIO_FLAG_WRITE)) < 0 ||
+      (err = avformat_write_header(t->fmt_ctx, NULL)) < 0) {
+    log_warn("unable to write proxy file '%s': %s", path, av_err2str(err));
+    return false;
+  }
+  return true;
+}
+
+static void close_transcode(transcode_t *t) {
+  if (t->fmt_ctx) {
+    avio_closep(&t->fmt_ctx->pb);
+    avformat_free_context(t->fmt_ctx);
+  }
+  avcodec_free_context(&t->enc_ctx);
+  sws_freeContext(t->scaler);
+  av_frame_free(&t->in_frame);
+  av_frame_free(&t->out_frame);
+  av_packet_free(&t->packet);
+  ffmpeg_stream_close(&t->in);
+}
+
+// transcode a proxy into the file at path. Returns the new state of the proxy.
+static proxy_state_t transcode(proxy_manager_t *pm, transcode_t *t,
+                               const char *path) {
+  proxy_t *p = t->proxy;
+  // no context: the stream is decoded in software, without OpenGL
+  if (!ffmpeg_stream_open(NULL, &t->in, p->path, p->index, false)) {
+    return PROXY_STATE_FAILED;
+  }
+  if (t->in.cdc_ctx->codec_type != AVMEDIA_TYPE_VIDEO) {
+    log_warn("stream %s of '%s' is not a video stream, no proxy is made",
+             SVE2_SI2STR(p->index), p->path);
+    return PROXY_STATE_FAILED;
+  }
+  if (t->in.cdc_ctx->height <= pm->height) {
+    return PROXY_STATE_NOT_NEEDED;
+  }
+
+  AVFormatContext *in_fmt_ctx = t->in.fmt_ctx;
+  if (in_fmt_ctx->start_time != AV_NOPTS_VALUE) {
+    t->start_time = av_rescale(in_fmt_ctx->start_time, SVE2_NS_PER_SEC,
+                               AV_TIME_BASE);
+  }
+  if (in_fmt_ctx->duration != AV_NOPTS_VALUE) {
+    t->duration =
+        av_rescale(in_fmt_ctx->duration, SVE2_NS_PER_SEC, AV_TIME_BASE);
+  }
+  if (!open_output(pm, t, path)) {
+    return PROXY_STATE_FAILED;
+  }
+  log_info("transcoding the proxy of '%s' (%dx%d, %s)", p->path,
+           t->enc_ctx->width, t->enc_ctx->height, t->enc_ctx->codec->name);
+
+  nassert(t->in_frame = av_frame_alloc());
+  nassert(t->out_frame = av_frame_alloc());
+  nassert(t->packet = av_packet_alloc());
+  while (ffmpeg_stream_get_frame(&t->in, t->in_frame)) {
+    if (atomic_load_explicit(&pm->cancelled, memory_order_relaxed)) {
+      return PROXY_STATE_FAILED;
+    }
+
+    // the source format may change midstream
+    nassert(t->scaler = sws_getCachedContext(
+                t->scaler, t->in_frame->width, t->in_frame->height,
+                t->in_frame->format, t->enc_ctx->width, t->enc_ctx->height,
+                t->enc_ctx->pix_fmt, SWS_BILINEAR, NULL, NULL, NULL));
+    nassert_ffmpeg(sws_scale_frame(t->scaler, t->out_frame, t->in_frame));
+    // back from nanoseconds (see ffmpeg_stream_get_frame()), which is exact
+    // since the time base is much coarser
+    t->out_frame->pts =
+        av_rescale_q(t->in_frame->pts, (AVRational){1, SVE2_NS_PER_SEC},
+                     t->enc_ctx->time_base);
+    bool ok = encode_frame(t, t->out_frame);
+    av_frame_unref(t->out_frame);
+    if (!ok) {
+      return PROXY_STATE_FAILED;
+    }
+
+    if (t->duration > 0) {
+      f32 progress = (f32)(t->in_frame->pts - t->start_time) / t->duration;
+      atomic_store_explicit(&p->progress,
+                            sve2_max_f32(sve2_min_f32(progress, 1.0f), 0.0f),
+                            memory_order_relaxed);
+    }
+    av_frame_unref(t->in_frame);
+  }
+
+  if (!encode_frame(t, NULL) || av_write_trailer(t->fmt_ctx) < 0) {
+    return PROXY_STATE_FAILED;
+  }
+  return PROXY_STATE_READY;
+}
+
+static void make_proxy(proxy_manager_t *pm, proxy_t *p) {
+  atomic_store_explicit(&p->state, PROXY_STATE_TRANSCODING,
+                        memory_order_relaxed);
+  // the file is written by the muxer through its own handle, f only makes
+  // the entry appear atomically once complete
+  char *temp_path;
+  FILE *f = cache_file_create(p->proxy_path, &temp_path);
+  if (!f) {
+    log_warn("unable to create proxy file '%s'", p->proxy_path);
+    atomic_store_explicit(&p->state, PROXY_STATE_FAILED, memory_order_release);
+    return;
+  }
+
+  i64 start = threads_timer_now();
+  transcode_t t = {.proxy = p};
+  proxy_state_t state = transcode(pm, &t, temp_path);
+  close_transcode(&t);
+  if (state != PROXY_STATE_READY) {
+    cache_file_abort(f, temp_path);
+  } else if (cache_file_commit(f, temp_path, p->proxy_path)) {
+    log_info("proxy of '%s' transcoded in %.1f s", p->path,
+             (f64)(threads_timer_now() - start) / SVE2_NS_PER_SEC);
+    atomic_store_explicit(&p->progress, 1.0f, memory_order_relaxed);
+  } else {
+    state = PROXY_STATE_FAILED;
+  }
+  atomic_store_explicit(&p->state, state, memory_order_release);
+}
+
+static int run_worker(void *arg) {
+  proxy_manager_t *pm = arg;
+#ifndef SVE2_NO_NONSTD
+  // the nice value is per thread on Linux, and the decoder threads inherit it
+  if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19) < 0) {
+    log_warn("unable to lower the priority of a proxy worker");
+  }
+#endif
+
+  while (true) {
+    sve2_mtx_lock(&pm->lock);
+    while (!pm->closing && pm->next_proxy == (i32)stbds_arrlen(pm->proxies)) {
+      sve2_cnd_wait(&pm->cond, &pm->lock);
+    }
+    // take the next queued proxy. The others are ready or failed already,
+    // and only the worker taking a proxy changes its state.
+    proxy_t *p = NULL;
+    while (!pm->closing && !p &&
+           pm->next_proxy < (i32)stbds_arrlen(pm->proxies)) {
+      proxy_t *next = pm->proxies[pm->next_proxy++];
+      if (atomic_load_explicit(&next->state, memory_order_relaxed) ==
+          PROXY_STATE_QUEUED) {
+        p = next;
+      }
+    }
+    bool closing = pm->closing;
+    sve2_mtx_unlock(&pm->lock);
+    if (closing) {
+      break;
+    }
+    if (p) {
+      make_proxy(pm, p);
+    }
+  }
+  return 0;
+}
+
+void proxy_manager_init(proxy_manager_t *pm, i32 height, i32 num_workers) {
+  *pm = (proxy_manager_t){
+      .height = height,
+      .num_workers = num_workers > 0
+                         ? num_workers
+                         : sve2_max_i32(sve2_get_num_cpus() / 8, 1),
+  };
+  atomic_init(&pm->cancelled, false);
+  sve2_mtx_init(&pm->lock, mtx_plain);
+  sve2_cnd_init(&pm->cond);
+  pm->workers = sve2_calloc(pm->num_workers, sizeof *pm->workers);
+  for (i32 i = 0; i < pm->num_workers; ++i) {
+    sve2_thrd_create(&pm->workers[i], run_worker, pm);
+  }
+}
+
+void proxy_manager_free(proxy_manager_t *pm) {
+  atomic_store_explicit(&pm->cancelled, true, memory_order_relaxed);
+  sve2_mtx_lock(&pm->lock);
+  pm->closing = true;
+  sve2_cnd_broadcast(&pm->cond);
+  sve2_mtx_unlock(&pm->lock);
+  for (i32 i = 0; i < pm->num_workers; ++i) {
+    thrd_join(pm->workers[i], NULL);
+  }
+  free(pm->workers);
+
+  for (i32 i = 0; i < (i32)stbds_arrlen(pm->proxies); ++i) {
+    proxy_t *p = pm->proxies[i];
+    free(p->path);
+    free(p->proxy_path);
+    free(p);
+  }
+  stbds_arrfree(pm->proxies);
+  cnd_destroy(&pm->cond);
+  mtx_destroy(&pm->lock);
+}
+
+proxy_t *proxy_request(proxy_manager_t *pm, const char *path,
+                       stream_index_t index) {
+  sve2_mtx_lock(&pm->lock);
+  for (i32 i = 0; i < (i32)stbds_arrlen(pm->proxies); ++i) {
+    proxy_t *p = pm->proxies[i];
+    if (strcmp(p->path, path) == 0 && p->index.type == index.type &&
+        p->index.offset == index.offset) {
+      sve2_mtx_unlock(&pm->lock);
+      return p;
+    }
+  }
+
+  proxy_t *p = sve2_calloc(1, sizeof *p);
+  p->path = sve2_strdup(path);
+  p->index = index;
+  p->proxy_path = get_proxy_path(pm, path, index);
+  proxy_state_t state = PROXY_STATE_QUEUED;
+  if (!p->proxy_path) {
+    log_warn("caching is disabled, no proxy is made for '%s'", path);
+    state = PROXY_STATE_FAILED;
+  } else if (proxy_file_opens(p->proxy_path)) {
+    log_info("using proxy file '%s' for '%s'", p->proxy_path, path);
+    state = PROXY_STATE_READY;
+  }
+  atomic_init(&p->state, state);
+  atomic_init(&p->progress, state == PROXY_STATE_READY ? 1.0f : 0.0f);
+  // proxies which are not queued are skipped by the workers
+  stbds_arrput(pm->proxies, p);
+  if (state == PROXY_STATE_QUEUED) {
+    sve2_cnd_signal(&pm->cond);
+  }
+  sve2_mtx_unlock(&pm->lock);
+  return p;
+}
+
+proxy_state_t proxy_get_state(proxy_t *p, f32 *progress) {
+  if (progress) {
+    *progress = atomic_load_explicit(&p->progress, memory_order_relaxed);
+  }
+  return atomic_load_explicit(&p->state, memory_order_acquire);
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <threads.h>
+
+#include "sve2/media/stream_index.h"
+#include "sve2/utils/types.h"
+
+typedef enum {
+  /**
+   * @brief Waiting for a worker
+   */
+  PROXY_STATE_QUEUED,
+  PROXY_STATE_TRANSCODING,
+  /**
+   * @brief The proxy file is complete, see proxy_t::proxy_path
+   */
+  PROXY_STATE_READY,
+  /**
+   * @brief The source is not larger than a proxy, so it is used as is
+   */
+  PROXY_STATE_NOT_NEEDED,
+  /**
+   * @brief The source could not be transcoded (or caching is disabled), so it
+   * is used as is
+   */
+  PROXY_STATE_FAILED,
+} proxy_state_t;
+
+/**
+ * @brief Proxy of a video stream: a low resolution, intra-only (every frame is
+ * a keyframe) transcode of the stream, which is much cheaper to decode and to
+ * seek in than long-GOP sources, e.g. for scrubbing through 4K HEVC footage
+ * while editing.
+ */
+typedef struct {
+  char *path;
+  stream_index_t index;
+  /**
+   * @brief Path of the proxy file in the cache directory (see cache.h), NULL if
+   * caching is disabled. The file only exists once the proxy is ready.
+   */
+  char *proxy_path;
+  /**
+   * @brief A proxy_state_t, and the fraction of the source transcoded so far
+   * (in [0, 1]), written by the worker transcoding the proxy
+   */
+  atomic_int state;
+  _Atomic(f32) progress;
+} proxy_t;
+
+/**
+ * @brief Manager of the proxies of a session. Proxies are transcoded in the
+ * background, in the order they are requested, by a few worker threads running
+ * at the lowest scheduling priority (so the preview keeps the CPU), and are
+ * kept in the cache directory, so every source is only transcoded once.
+ *
+ * Proxies are H.264 (or MJPEG if libx264 is not available), so they can be
+ * decoded by VAAPI too. Timestamps are the ones of the source, so a stream can
+ * switch between the source and its proxy at any time.
+ */
+typedef struct {
+  /**
+   * @brief Height of the proxies. Sources which are not taller are not
+   * transcoded.
+   */
+  i32 height;
+  thrd_t *workers;
+  i32 num_workers;
+  /**
+   * @brief Every requested proxy (stb_ds array), and the index of the next one
+   * for the workers to look at (they skip proxies which are not queued).
+   * Protected by lock.
+   */
+  proxy_t **proxies;
+  i32 next_proxy;
+  mtx_t lock;
+  /**
+   * @brief Signalled when a proxy is requested (or the manager is freed)
+   */
+  cnd_t cond;
+  bool closing;
+  /**
+   * @brief Set when the manager is freed, so running transcodes stop early
+   */
+  atomic_bool cancelled;
+} proxy_manager_t;
+
+/**
+ * @brief Initialize a proxy manager, and start its workers
+ *
+ * @param pm The proxy manager
+ * @param height Height of the proxies, e.g. 720
+ * @param num_workers Number of proxies transcoded at once. 0 means an eighth
+ * of the CPUs (at least 1), the decoders being multithreaded already.
+ */
+void proxy_manager_init(proxy_manager_t *pm, i32 height, i32 num_workers);
+/**
+ * @brief Free a proxy manager. Running transcodes are cancelled (their partial
+ * files are removed), and every proxy is freed.
+ */
+void proxy_manager_free(proxy_manager_t *pm);
+
+/**
+ * @brief Request the proxy of a video stream. If the proxy is already in the
+ * cache directory, it is ready immediately, otherwise it is queued for the
+ * workers. Requesting the same stream again returns the same proxy.
+ *
+ * @param pm The proxy manager
+ * @param path Path to the media file
+ * @param index Video stream index
+ * @return The proxy, owned by the manager (valid until it is freed)
+ */
+proxy_t *proxy_request(proxy_manager_t *pm, const char *path,
+                       stream_index_t index);
+/**
+ * @brief Get the state of a proxy. This never blocks, so it is cheap to query
+ * every frame.
+ *
+ * @param p The proxy
+ * @param progress If not NULL, set to the fraction of the source transcoded so
+ * far (1 if the proxy is ready)
+ * @return The state of the proxy
+ */
+proxy_state_t proxy_get_state(proxy_t *p, f32 *progress);
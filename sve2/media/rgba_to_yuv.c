@@ -0,0 +1,655 @@
+#include "rgba_to_yuv.h"
+
+#include <math.h>
+#include <string.h>
+#include <threads.h>
+
+#include <libavutil/pixdesc.h>
+#include <log.h>
+
+#include "sve2/log/logging.h"
+#include "sve2/media/yuv_matrix.h"
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+
+#if !defined(SVE2_NO_NONSTD) && defined(__x86_64__)
+#define SVE2_YUV_KERNELS_X86
+#include <immintrin.h>
+#define SSE4_FN __attribute__((target("sse4.1")))
+#define AVX2_FN __attribute__((target("avx2,f16c")))
+#elif !defined(SVE2_NO_NONSTD) && defined(__aarch64__)
+#define SVE2_YUV_KERNELS_NEON
+#include <arm_neon.h>
+#endif
+
+// pixels per chunk of a row pair, so the unpacked chunk (two rows of planar
+// floats) stays in the L1 cache
+#define CHUNK_SIZE 256
+// rows per job when converting on a thread pool
+#define BAND_HEIGHT 16
+
+// kernels operating on a chunk of a row, the unpacked samples are planar
+typedef struct {
+  const char *name;
+  void (*unpack_rgba8)(const u8 *src, i32 count, f32 *r, f32 *g, f32 *b);
+  void (*unpack_rgba16f)(const u16 *src, i32 count, f32 *r, f32 *g, f32 *b);
+  // dst[i] = a[2i] + a[2i + 1] + b[2i] + b[2i + 1], i.e. the sum of a 2x2 block
+  void (*sum_2x2)(const f32 *a, const f32 *b, i32 count, f32 *dst);
+  // dst[i] = clamp(round(c . (r[i], g[i], b[i], 1)), 0, max) * post_scale
+  void (*transform)(const f32 *r, const f32 *g, const f32 *b, i32 count,
+                    const f32 c[static 4], f32 max, f32 post_scale, f32 *dst);
+  // the packing kernels take code values (integral and in range)
+  void (*pack_u8)(const f32 *src, i32 count, u8 *dst);
+  void (*pack_u16)(const f32 *src, i32 count, u16 *dst);
+  void (*pack_uv_u8)(const f32 *u, const f32 *v, i32 count, u8 *dst);
+  void (*pack_uv_u16)(const f32 *u, const f32 *v, i32 count, u16 *dst);
+} kernels_t;
+
+// scalar kernels, these also handle the tails of the vectorized kernels
+static void unpack_rgba8_scalar(const u8 *src, i32 count, f32 *r, f32 *g,
+                                f32 *b) {
+  for (i32 i = 0; i < count; ++i) {
+    r[i] = (f32)src[4 * i];
+    g[i] = (f32)src[4 * i + 1];
+    b[i] = (f32)src[4 * i + 2];
+  }
+}
+
+static f32 f16_to_f32(u16 h) {
+  u32 sign = (u32)(h & 0x8000) << 16;
+  u32 exp = (h >> 10) & 0x1f, mantissa = h & 0x3ff;
+  u32 bits;
+  if (exp == 0x1f) {
+    // infinity or NaN
+    bits = sign | 0x7f800000u | (mantissa << 13);
+  } else if (exp != 0) {
+    // the exponent biases are 15 and 127
+    bits = sign | ((exp + 112) << 23) | (mantissa << 13);
+  } else {
+    // zero or subnormal, i.e. mantissa * 2^-24
+    f32 f = (f32)mantissa * (1.0f / 16777216.0f);
+    return sign ? -f : f;
+  }
+  f32 f;
+  memcpy(&f, &bits, sizeof f);
+  return f;
+}
+
+static void unpack_rgba16f_scalar(const u16 *src, i32 count, f32 *r, f32 *g,
+                                  f32 *b) {
+  for (i32 i = 0; i < count; ++i) {
+    r[i] = f16_to_f32(src[4 * i]);
+    g[i] = f16_to_f32(src[4 * i + 1]);
+    b[i] = f16_to_f32(src[4 * i + 2]);
+  }
+}
+
+static void sum_2x2_scalar(const f32 *a, const f32 *b, i32 count, f32 *dst) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = (a[2 * i] + a[2 * i + 1]) + (b[2 * i] + b[2 * i + 1]);
+  }
+}
+
+static void transform_scalar(const f32 *r, const f32 *g, const f32 *b,
+                             i32 count, const f32 c[static 4], f32 max,
+                             f32 post_scale, f32 *dst) {
+  // same order of operations as the vectorized kernels
+  for (i32 i = 0; i < count; ++i) {
+    f32 x = r[i] * c[0] + c[3];
+    x += g[i] * c[1];
+    x += b[i] * c[2];
+    dst[i] = sve2_min_f32(sve2_max_f32(rintf(x), 0.0f), max) * post_scale;
+  }
+}
+
+static void pack_u8_scalar(const f32 *src, i32 count, u8 *dst) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = (u8)src[i];
+  }
+}
+
+static void pack_u16_scalar(const f32 *src, i32 count, u16 *dst) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[i] = (u16)src[i];
+  }
+}
+
+static void pack_uv_u8_scalar(const f32 *u, const f32 *v, i32 count,
+                              u8 *dst) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[2 * i] = (u8)u[i];
+    dst[2 * i + 1] = (u8)v[i];
+  }
+}
+
+static void pack_uv_u16_scalar(const f32 *u, const f32 *v, i32 count,
+                               u16 *dst) {
+  for (i32 i = 0; i < count; ++i) {
+    dst[2 * i] = (u16)u[i];
+    dst[2 * i + 1] = (u16)v[i];
+  }
+}
+
+static const kernels_t scalar_kernels = {
+    .name = "scalar",
+    .unpack_rgba8 = unpack_rgba8_scalar,
+    .unpack_rgba16f = unpack_rgba16f_scalar,
+    .sum_2x2 = sum_2x2_scalar,
+    .transform = transform_scalar,
+    .pack_u8 = pack_u8_scalar,
+    .pack_u16 = pack_u16_scalar,
+    .pack_uv_u8 = pack_uv_u8_scalar,
+    .pack_uv_u16 = pack_uv_u16_scalar,
+};
+
+#ifdef SVE2_YUV_KERNELS_X86
+SSE4_FN static void unpack_rgba8_sse4(const u8 *src, i32 count, f32 *r,
+                                      f32 *g, f32 *b) {
+  // RGBA RGBA RGBA RGBA -> RRRR GGGG BBBB AAAA
+  const __m128i shuffle =
+      _mm_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i v = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i *)(src + 4 * i)), shuffle);
+    _mm_storeu_ps(r + i, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(v)));
+    _mm_storeu_ps(g + i,
+                  _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 4))));
+    _mm_storeu_ps(b + i,
+                  _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(v, 8))));
+  }
+  unpack_rgba8_scalar(src + 4 * i, count - i, r + i, g + i, b + i);
+}
+
+SSE4_FN static void sum_2x2_sse4(const f32 *a, const f32 *b, i32 count,
+                                 f32 *dst) {
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 s = _mm_add_ps(_mm_loadu_ps(a + 2 * i), _mm_loadu_ps(b + 2 * i));
+    __m128 t =
+        _mm_add_ps(_mm_loadu_ps(a + 2 * i + 4), _mm_loadu_ps(b + 2 * i + 4));
+    _mm_storeu_ps(dst + i, _mm_hadd_ps(s, t));
+  }
+  sum_2x2_scalar(a + 2 * i, b + 2 * i, count - i, dst + i);
+}
+
+SSE4_FN static void transform_sse4(const f32 *r, const f32 *g, const f32 *b,
+                                   i32 count, const f32 c[static 4], f32 max,
+                                   f32 post_scale, f32 *dst) {
+  __m128 c0 = _mm_set1_ps(c[0]), c1 = _mm_set1_ps(c[1]);
+  __m128 c2 = _mm_set1_ps(c[2]), c3 = _mm_set1_ps(c[3]);
+  __m128 vmax = _mm_set1_ps(max), scale = _mm_set1_ps(post_scale);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128 x = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(r + i), c0), c3);
+    x = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(g + i), c1));
+    x = _mm_add_ps(x, _mm_mul_ps(_mm_loadu_ps(b + i), c2));
+    x = _mm_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm_min_ps(_mm_max_ps(x, _mm_setzero_ps()), vmax);
+    _mm_storeu_ps(dst + i, _mm_mul_ps(x, scale));
+  }
+  transform_scalar(r + i, g + i, b + i, count - i, c, max, post_scale,
+                   dst + i);
+}
+
+SSE4_FN static void pack_u8_sse4(const f32 *src, i32 count, u8 *dst) {
+  i32 i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i a = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src + i)),
+                                 _mm_cvtps_epi32(_mm_loadu_ps(src + i + 4)));
+    __m128i b = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src + i + 8)),
+                                 _mm_cvtps_epi32(_mm_loadu_ps(src + i + 12)));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(a, b));
+  }
+  pack_u8_scalar(src + i, count - i, dst + i);
+}
+
+SSE4_FN static void pack_u16_sse4(const f32 *src, i32 count, u16 *dst) {
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src + i)),
+                                 _mm_cvtps_epi32(_mm_loadu_ps(src + i + 4)));
+    _mm_storeu_si128((__m128i *)(dst + i), a);
+  }
+  pack_u16_scalar(src + i, count - i, dst + i);
+}
+
+SSE4_FN static void pack_uv_u8_sse4(const f32 *u, const f32 *v, i32 count,
+                                    u8 *dst) {
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m128i a = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(u + i)),
+                                 _mm_cvtps_epi32(_mm_loadu_ps(u + i + 4)));
+    __m128i b = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(v + i)),
+                                 _mm_cvtps_epi32(_mm_loadu_ps(v + i + 4)));
+    // samples fit in a byte, so U | V << 8 interleaves them
+    _mm_storeu_si128((__m128i *)(dst + 2 * i),
+                     _mm_or_si128(a, _mm_slli_epi16(b, 8)));
+  }
+  pack_uv_u8_scalar(u + i, v + i, count - i, dst + 2 * i);
+}
+
+SSE4_FN static void pack_uv_u16_sse4(const f32 *u, const f32 *v, i32 count,
+                                     u16 *dst) {
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    __m128i a = _mm_cvtps_epi32(_mm_loadu_ps(u + i));
+    __m128i b = _mm_cvtps_epi32(_mm_loadu_ps(v + i));
+    _mm_storeu_si128((__m128i *)(dst + 2 * i),
+                     _mm_or_si128(a, _mm_slli_epi32(b, 16)));
+  }
+  pack_uv_u16_scalar(u + i, v + i, count - i, dst + 2 * i);
+}
+
+static const kernels_t sse4_kernels = {
+    .name = "SSE4.1",
+    .unpack_rgba8 = unpack_rgba8_sse4,
+    // F16C is not implied by SSE4.1
+    .unpack_rgba16f = unpack_rgba16f_scalar,
+    .sum_2x2 = sum_2x2_sse4,
+    .transform = transform_sse4,
+    .pack_u8 = pack_u8_sse4,
+    .pack_u16 = pack_u16_sse4,
+    .pack_uv_u8 = pack_uv_u8_sse4,
+    .pack_uv_u16 = pack_uv_u16_sse4,
+};
+
+AVX2_FN static void unpack_rgba8_avx2(const u8 *src, i32 count, f32 *r,
+                                      f32 *g, f32 *b) {
+  // in every lane: RGBA RGBA RGBA RGBA -> RRRR GGGG BBBB AAAA
+  const __m256i shuffle =
+      _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15, 0,
+                       4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+  // then across lanes: R0-7 G0-7 | B0-7 A0-7
+  const __m256i permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+    v = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), permute);
+    __m128i lo = _mm256_castsi256_si128(v), hi = _mm256_extracti128_si256(v, 1);
+    _mm256_storeu_ps(r + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(lo)));
+    _mm256_storeu_ps(
+        g + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(lo, 8))));
+    _mm256_storeu_ps(b + i, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(hi)));
+  }
+  // the scalar tail is SSE code, and GCC does not clear the upper halves
+  // before tail calls
+  _mm256_zeroupper();
+  unpack_rgba8_scalar(src + 4 * i, count - i, r + i, g + i, b + i);
+}
+
+AVX2_FN static void unpack_rgba16f_avx2(const u16 *src, i32 count, f32 *r,
+                                        f32 *g, f32 *b) {
+  // in every lane (2 pixels): RGBA RGBA -> RR GG BB AA
+  const __m256i shuffle = _mm256_setr_epi8(
+      0, 1, 8, 9, 2, 3, 10, 11, 4, 5, 12, 13, 6, 7, 14, 15, 0, 1, 8, 9, 2, 3,
+      10, 11, 4, 5, 12, 13, 6, 7, 14, 15);
+  // then across lanes (4 pixels): RRRR GGGG | BBBB AAAA
+  const __m256i permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + 4 * i));
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 4 * i + 16));
+    v0 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v0, shuffle), permute);
+    v1 = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v1, shuffle), permute);
+    // R0-7 | B0-7 and G0-7 | A0-7
+    __m256i rb = _mm256_unpacklo_epi64(v0, v1);
+    __m256i ga = _mm256_unpackhi_epi64(v0, v1);
+    _mm256_storeu_ps(r + i, _mm256_cvtph_ps(_mm256_castsi256_si128(rb)));
+    _mm256_storeu_ps(g + i, _mm256_cvtph_ps(_mm256_castsi256_si128(ga)));
+    _mm256_storeu_ps(b + i, _mm256_cvtph_ps(_mm256_extracti128_si256(rb, 1)));
+  }
+  _mm256_zeroupper();
+  unpack_rgba16f_scalar(src + 4 * i, count - i, r + i, g + i, b + i);
+}
+
+AVX2_FN static void sum_2x2_avx2(const f32 *a, const f32 *b, i32 count,
+                                 f32 *dst) {
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 s =
+        _mm256_add_ps(_mm256_loadu_ps(a + 2 * i), _mm256_loadu_ps(b + 2 * i));
+    __m256 t = _mm256_add_ps(_mm256_loadu_ps(a + 2 * i + 8),
+                             _mm256_loadu_ps(b + 2 * i + 8));
+    // the horizontal add works within lanes, so the halves are swapped back
+    __m256d h = _mm256_castps_pd(_mm256_hadd_ps(s, t));
+    _mm256_storeu_ps(dst + i, _mm256_castpd_ps(_mm256_permute4x64_pd(
+                                  h, _MM_SHUFFLE(3, 1, 2, 0))));
+  }
+  _mm256_zeroupper();
+  sum_2x2_scalar(a + 2 * i, b + 2 * i, count - i, dst + i);
+}
+
+AVX2_FN static void transform_avx2(const f32 *r, const f32 *g, const f32 *b,
+                                   i32 count, const f32 c[static 4], f32 max,
+                                   f32 post_scale, f32 *dst) {
+  __m256 c0 = _mm256_set1_ps(c[0]), c1 = _mm256_set1_ps(c[1]);
+  __m256 c2 = _mm256_set1_ps(c[2]), c3 = _mm256_set1_ps(c[3]);
+  __m256 vmax = _mm256_set1_ps(max), scale = _mm256_set1_ps(post_scale);
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    __m256 x = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(r + i), c0), c3);
+    x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_loadu_ps(g + i), c1));
+    x = _mm256_add_ps(x, _mm256_mul_ps(_mm256_loadu_ps(b + i), c2));
+    x = _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_min_ps(_mm256_max_ps(x, _mm256_setzero_ps()), vmax);
+    _mm256_storeu_ps(dst + i, _mm256_mul_ps(x, scale));
+  }
+  _mm256_zeroupper();
+  transform_scalar(r + i, g + i, b + i, count - i, c, max, post_scale,
+                   dst + i);
+}
+
+// convert 16 code values to u16, in order
+AVX2_FN static __m256i pack_16_avx2(const f32 *src) {
+  __m256i p =
+      _mm256_packus_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(src)),
+                          _mm256_cvtps_epi32(_mm256_loadu_ps(src + 8)));
+  // the pack works within lanes, so the middle quarters are swapped back
+  return _mm256_permute4x64_epi64(p, _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+AVX2_FN static void pack_u8_avx2(const f32 *src, i32 count, u8 *dst) {
+  i32 i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m256i p = pack_16_avx2(src + i);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_packus_epi16(_mm256_castsi256_si128(p),
+                                      _mm256_extracti128_si256(p, 1)));
+  }
+  _mm256_zeroupper();
+  pack_u8_scalar(src + i, count - i, dst + i);
+}
+
+AVX2_FN static void pack_u16_avx2(const f32 *src, i32 count, u16 *dst) {
+  i32 i = 0;
+  for (; i + 16 <= count; i += 16) {
+    _mm256_storeu_si256((__m256i *)(dst + i), pack_16_avx2(src + i));
+  }
+  _mm256_zeroupper();
+  pack_u16_scalar(src + i, count - i, dst + i);
+}
+
+static const kernels_t avx2_kernels = {
+    .name = "AVX2",
+    .unpack_rgba8 = unpack_rgba8_avx2,
+    .unpack_rgba16f = unpack_rgba16f_avx2,
+    .sum_2x2 = sum_2x2_avx2,
+    .transform = transform_avx2,
+    .pack_u8 = pack_u8_avx2,
+    .pack_u16 = pack_u16_avx2,
+    // chroma is a quarter of the samples, SSE4.1 is good enough
+    .pack_uv_u8 = pack_uv_u8_sse4,
+    .pack_uv_u16 = pack_uv_u16_sse4,
+};
+#endif
+
+#ifdef SVE2_YUV_KERNELS_NEON
+// NEON is part of the AArch64 baseline, so no target attribute is needed
+static void store_u8x8_f32(uint8x8_t v, f32 *dst) {
+  uint16x8_t w = vmovl_u8(v);
+  vst1q_f32(dst, vcvtq_f32_u32(vmovl_u16(vget_low_u16(w))));
+  vst1q_f32(dst + 4, vcvtq_f32_u32(vmovl_high_u16(w)));
+}
+
+static void unpack_rgba8_neon(const u8 *src, i32 count, f32 *r, f32 *g,
+                              f32 *b) {
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x4_t p = vld4_u8(src + 4 * i);
+    store_u8x8_f32(p.val[0], r + i);
+    store_u8x8_f32(p.val[1], g + i);
+    store_u8x8_f32(p.val[2], b + i);
+  }
+  unpack_rgba8_scalar(src + 4 * i, count - i, r + i, g + i, b + i);
+}
+
+static void unpack_rgba16f_neon(const u16 *src, i32 count, f32 *r, f32 *g,
+                                f32 *b) {
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint16x4x4_t p = vld4_u16(src + 4 * i);
+    vst1q_f32(r + i, vcvt_f32_f16(vreinterpret_f16_u16(p.val[0])));
+    vst1q_f32(g + i, vcvt_f32_f16(vreinterpret_f16_u16(p.val[1])));
+    vst1q_f32(b + i, vcvt_f32_f16(vreinterpret_f16_u16(p.val[2])));
+  }
+  unpack_rgba16f_scalar(src + 4 * i, count - i, r + i, g + i, b + i);
+}
+
+static void sum_2x2_neon(const f32 *a, const f32 *b, i32 count, f32 *dst) {
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t s = vaddq_f32(vld1q_f32(a + 2 * i), vld1q_f32(b + 2 * i));
+    float32x4_t t =
+        vaddq_f32(vld1q_f32(a + 2 * i + 4), vld1q_f32(b + 2 * i + 4));
+    vst1q_f32(dst + i, vpaddq_f32(s, t));
+  }
+  sum_2x2_scalar(a + 2 * i, b + 2 * i, count - i, dst + i);
+}
+
+static void transform_neon(const f32 *r, const f32 *g, const f32 *b,
+                           i32 count, const f32 c[static 4], f32 max,
+                           f32 post_scale, f32 *dst) {
+  float32x4_t c0 = vdupq_n_f32(c[0]), c1 = vdupq_n_f32(c[1]);
+  float32x4_t c2 = vdupq_n_f32(c[2]), c3 = vdupq_n_f32(c[3]);
+  float32x4_t vmax = vdupq_n_f32(max), scale = vdupq_n_f32(post_scale);
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    float32x4_t x = vaddq_f32(vmulq_f32(vld1q_f32(r + i), c0), c3);
+    x = vaddq_f32(x, vmulq_f32(vld1q_f32(g + i), c1));
+    x = vaddq_f32(x, vmulq_f32(vld1q_f32(b + i), c2));
+    x = vminq_f32(vmaxq_f32(vrndnq_f32(x), vdupq_n_f32(0.0f)), vmax);
+    vst1q_f32(dst + i, vmulq_f32(x, scale));
+  }
+  transform_scalar(r + i, g + i, b + i, count - i, c, max, post_scale,
+                   dst + i);
+}
+
+static uint16x4_t to_u16x4(const f32 *src) {
+  return vmovn_u32(vcvtq_u32_f32(vld1q_f32(src)));
+}
+
+static void pack_u8_neon(const f32 *src, i32 count, u8 *dst) {
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    vst1_u8(dst + i,
+            vmovn_u16(vcombine_u16(to_u16x4(src + i), to_u16x4(src + i + 4))));
+  }
+  pack_u8_scalar(src + i, count - i, dst + i);
+}
+
+static void pack_u16_neon(const f32 *src, i32 count, u16 *dst) {
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    vst1_u16(dst + i, to_u16x4(src + i));
+  }
+  pack_u16_scalar(src + i, count - i, dst + i);
+}
+
+static void pack_uv_u8_neon(const f32 *u, const f32 *v, i32 count, u8 *dst) {
+  i32 i = 0;
+  for (; i + 8 <= count; i += 8) {
+    uint8x8x2_t uv = {{
+        vmovn_u16(vcombine_u16(to_u16x4(u + i), to_u16x4(u + i + 4))),
+        vmovn_u16(vcombine_u16(to_u16x4(v + i), to_u16x4(v + i + 4))),
+    }};
+    vst2_u8(dst + 2 * i, uv);
+  }
+  pack_uv_u8_scalar(u + i, v + i, count - i, dst + 2 * i);
+}
+
+static void pack_uv_u16_neon(const f32 *u, const f32 *v, i32 count,
+                             u16 *dst) {
+  i32 i = 0;
+  for (; i + 4 <= count; i += 4) {
+    uint16x4x2_t uv = {{to_u16x4(u + i), to_u16x4(v + i)}};
+    vst2_u16(dst + 2 * i, uv);
+  }
+  pack_uv_u16_scalar(u + i, v + i, count - i, dst + 2 * i);
+}
+
+static const kernels_t neon_kernels = {
+    .name = "NEON",
+    .unpack_rgba8 = unpack_rgba8_neon,
+    .unpack_rgba16f = unpack_rgba16f_neon,
+    .sum_2x2 = sum_2x2_neon,
+    .transform = transform_neon,
+    .pack_u8 = pack_u8_neon,
+    .pack_u16 = pack_u16_neon,
+    .pack_uv_u8 = pack_uv_u8_neon,
+    .pack_uv_u16 = pack_uv_u16_neon,
+};
+#endif
+
+static kernels_t kernels;
+static once_flag kernels_once = ONCE_FLAG_INIT;
+
+static void init_kernels() {
+  kernels = scalar_kernels;
+#ifdef SVE2_YUV_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse4.1")) {
+    kernels = sse4_kernels;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c")) {
+    kernels = avx2_kernels;
+  }
+#endif
+#ifdef SVE2_YUV_KERNELS_NEON
+  kernels = neon_kernels;
+#endif
+  log_info("using %s RGBA to YUV kernels", kernels.name);
+}
+
+static const kernels_t *get_kernels() {
+  call_once(&kernels_once, init_kernels);
+  return &kernels;
+}
+
+bool rgba_to_yuv_supports(enum AVPixelFormat dst_fmt) {
+  return dst_fmt == AV_PIX_FMT_NV12 || dst_fmt == AV_PIX_FMT_YUV420P ||
+         dst_fmt == AV_PIX_FMT_P010;
+}
+
+void rgba_to_yuv_init(rgba_to_yuv_t *cv, enum AVPixelFormat src_fmt,
+                      enum AVPixelFormat dst_fmt, i32 width, i32 height,
+                      enum AVColorSpace color_space,
+                      enum AVColorRange color_range) {
+  if ((src_fmt != AV_PIX_FMT_RGBA && src_fmt != AV_PIX_FMT_RGBAF16) ||
+      !rgba_to_yuv_supports(dst_fmt)) {
+    log_error("conversion from %s to %s is not supported by the CPU color "
+              "converter",
+              av_get_pix_fmt_name(src_fmt), av_get_pix_fmt_name(dst_fmt));
+    panic();
+  }
+  nassert(width % 2 == 0 && height % 2 == 0 &&
+          "4:2:0 subsampling requires even dimensions");
+
+  i32 bit_depth = dst_fmt == AV_PIX_FMT_P010 ? 10 : 8;
+  f32 m[16];
+  yuv_matrix_from_rgb(m, color_space, color_range, bit_depth);
+
+  *cv = (rgba_to_yuv_t){
+      .src_fmt = src_fmt,
+      .dst_fmt = dst_fmt,
+      .width = width,
+      .height = height,
+      .max_value = (f32)((1 << bit_depth) - 1),
+      .post_scale = dst_fmt == AV_PIX_FMT_P010 ? 64.0f : 1.0f,
+  };
+  // the matrix is scaled so the kernels directly produce code values:
+  // unpacked RGBA8 samples are in [0, 255] (not normalized), and chroma is
+  // computed from the sum of 4 samples
+  f32 in_scale = src_fmt == AV_PIX_FMT_RGBA ? 1.0f / 255.0f : 1.0f;
+  for (i32 i = 0; i < 3; ++i) {
+    cv->luma[i] = m[i] * in_scale * cv->max_value;
+    cv->chroma[0][i] = m[4 + i] * in_scale * cv->max_value * 0.25f;
+    cv->chroma[1][i] = m[8 + i] * in_scale * cv->max_value * 0.25f;
+  }
+  cv->luma[3] = m[3] * cv->max_value;
+  cv->chroma[0][3] = m[7] * cv->max_value;
+  cv->chroma[1][3] = m[11] * cv->max_value;
+}
+
+// convert the rows [y0, y1) of a frame, y0 and y1 must be even
+static void convert_rows(const rgba_to_yuv_t *cv, const u8 *src,
+                         i64 src_linesize, AVFrame *dst, i32 y0, i32 y1) {
+  const kernels_t *k = get_kernels();
+  // unpacked chunk of a row pair, its 2x2 sums and the converted samples
+  _Alignas(32) f32 rgb[2][3][CHUNK_SIZE];
+  _Alignas(32) f32 sums[3][CHUNK_SIZE / 2];
+  _Alignas(32) f32 out[CHUNK_SIZE], uv[2][CHUNK_SIZE / 2];
+  bool p010 = cv->dst_fmt == AV_PIX_FMT_P010;
+
+  for (i32 y = y0; y < y1; y += 2) {
+    for (i32 x = 0; x < cv->width; x += CHUNK_SIZE) {
+      i32 n = sve2_min_i32(CHUNK_SIZE, cv->width - x);
+      for (i32 row = 0; row < 2; ++row) {
+        const u8 *s = src + (y + row) * src_linesize;
+        f32 *r = rgb[row][0], *g = rgb[row][1], *b = rgb[row][2];
+        if (cv->src_fmt == AV_PIX_FMT_RGBA) {
+          k->unpack_rgba8(s + x * 4, n, r, g, b);
+        } else {
+          k->unpack_rgba16f((const u16 *)s + x * 4, n, r, g, b);
+        }
+
+        k->transform(r, g, b, n, cv->luma, cv->max_value, cv->post_scale, out);
+        u8 *d = dst->data[0] + (y + row) * dst->linesize[0];
+        if (p010) {
+          k->pack_u16(out, n, (u16 *)d + x);
+        } else {
+          k->pack_u8(out, n, d + x);
+        }
+      }
+
+      i32 cn = n / 2, cx = x / 2, cy = y / 2;
+      for (i32 c = 0; c < 3; ++c) {
+        k->sum_2x2(rgb[0][c], rgb[1][c], cn, sums[c]);
+      }
+      for (i32 c = 0; c < 2; ++c) {
+        k->transform(sums[0], sums[1], sums[2], cn, cv->chroma[c],
+                     cv->max_value, cv->post_scale, uv[c]);
+      }
+      switch (cv->dst_fmt) {
+      case AV_PIX_FMT_NV12:
+        k->pack_uv_u8(uv[0], uv[1], cn,
+                      dst->data[1] + cy * dst->linesize[1] + cx * 2);
+        break;
+      case AV_PIX_FMT_P010:
+        k->pack_uv_u16(uv[0], uv[1], cn,
+                       (u16 *)(dst->data[1] + cy * dst->linesize[1]) + cx * 2);
+        break;
+      default:
+        k->pack_u8(uv[0], cn, dst->data[1] + cy * dst->linesize[1] + cx);
+        k->pack_u8(uv[1], cn, dst->data[2] + cy * dst->linesize[2] + cx);
+        break;
+      }
+    }
+  }
+}
+
+typedef struct {
+  const rgba_to_yuv_t *cv;
+  const u8 *src;
+  i64 src_linesize;
+  AVFrame *dst;
+} convert_job_t;
+
+static void convert_band(void *userdata, i32 band) {
+  const convert_job_t *job = userdata;
+  i32 y0 = band * BAND_HEIGHT;
+  convert_rows(job->cv, job->src, job->src_linesize, job->dst, y0,
+               sve2_min_i32(y0 + BAND_HEIGHT, job->cv->height));
+}
+
+void rgba_to_yuv_convert(const rgba_to_yuv_t *cv, thread_pool_t *pool,
+                         const u8 *src, i64 src_linesize, AVFrame *dst) {
+  if (!pool) {
+    convert_rows(cv, src, src_linesize, dst, 0, cv->height);
+    return;
+  }
+  convert_job_t job = {
+      .cv = cv, .src = src, .src_linesize = src_linesize, .dst = dst};
+  thread_pool_run(pool, (cv->height + BAND_HEIGHT - 1) / BAND_HEIGHT,
+                  convert_band, &job);
+}
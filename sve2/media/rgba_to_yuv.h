@@ -0,0 +1,77 @@
+#pragma once
+
+#include <libavutil/frame.h>
+#include <libavutil/pixfmt.h>
+
+#include "sve2/utils/thread_pool.h"
+#include "sve2/utils/types.h"
+
+/**
+ * @brief RGBA to YUV converter, running on the CPU. This is the CPU
+ * counterpart of the GPU color converter (see sve2/gl/color_convert.h), for
+ * machines where compute shaders are slow (e.g. Mesa's software rasterizer).
+ *
+ * Row pairs are converted in chunks that fit in the L1 cache: pixels are
+ * unpacked to planar floats, chroma is downsampled 2x2, and the matrix is
+ * applied and quantized with vectorized kernels. The kernels are chosen at
+ * runtime: AVX2 (with F16C) or SSE4.1 on x86-64, NEON on AArch64, and a
+ * portable scalar fallback everywhere else (or if SVE2_NO_NONSTD is defined).
+ * Conversions can be split by bands of rows across a thread pool.
+ */
+typedef struct {
+  /**
+   * @brief Source format, AV_PIX_FMT_RGBA or AV_PIX_FMT_RGBAF16 (alpha is
+   * ignored)
+   */
+  enum AVPixelFormat src_fmt;
+  /**
+   * @brief Destination format, AV_PIX_FMT_NV12, AV_PIX_FMT_YUV420P or
+   * AV_PIX_FMT_P010
+   */
+  enum AVPixelFormat dst_fmt;
+  /**
+   * @brief Frame size, must be even
+   */
+  i32 width, height;
+  /**
+   * @brief Luma and chroma coefficients (R, G, B, offset), applied to the
+   * unpacked source samples and giving code values. The chroma coefficients
+   * take the sum of 2x2 blocks.
+   */
+  f32 luma[4], chroma[2][4];
+  /**
+   * @brief Maximum code value, and the scale applied after rounding (64 for
+   * P010, which stores 10 bits in the high bits of 16-bit samples)
+   */
+  f32 max_value, post_scale;
+} rgba_to_yuv_t;
+
+/**
+ * @brief Check whether a destination format is supported by the converter:
+ * NV12, YUV420P and P010 (fewer than the GPU color converter).
+ */
+bool rgba_to_yuv_supports(enum AVPixelFormat dst_fmt);
+
+/**
+ * @brief Initialize a converter, the matrix is the same as the GPU color
+ * converter's (see yuv_matrix_from_rgb()).
+ */
+void rgba_to_yuv_init(rgba_to_yuv_t *cv, enum AVPixelFormat src_fmt,
+                      enum AVPixelFormat dst_fmt, i32 width, i32 height,
+                      enum AVColorSpace color_space,
+                      enum AVColorRange color_range);
+
+/**
+ * @brief Convert a frame.
+ *
+ * @param cv The converter
+ * @param pool Thread pool the rows are split across, or NULL to convert on
+ * the calling thread only
+ * @param src First row of the source frame
+ * @param src_linesize Distance between rows of the source, in bytes. This may
+ * be negative, e.g. to flip frames read back from OpenGL.
+ * @param dst Destination frame, with allocated planes of the destination
+ * format and size
+ */
+void rgba_to_yuv_convert(const rgba_to_yuv_t *cv, thread_pool_t *pool,
+                         const u8 *src, i64 src_linesize, AVFrame *dst);
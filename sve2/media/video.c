@@ -1,10 +1,53 @@
 #include "video.h"
 
+#include <log.h>
+
+// switch to the proxy of v if it is ready, at time
+static void update_proxy(video_t *v, i64 time) {
+  proxy_state_t state = proxy_get_state(v->proxy, NULL);
+  if (state == PROXY_STATE_QUEUED || state == PROXY_STATE_TRANSCODING) {
+    return;
+  }
+
+  if (state == PROXY_STATE_READY) {
+    ffmpeg_video_stream_t proxy;
+    if (ffmpeg_video_stream_open(v->ffmpeg.base.ctx, &proxy,
+                                 v->proxy->proxy_path, SVE2_SI(VIDEO, 0),
+                                 true)) {
+      ffmpeg_video_stream_set_preview_size(&proxy, v->ffmpeg.preview_width,
+                                           v->ffmpeg.preview_height);
+      ffmpeg_video_stream_close(&v->ffmpeg);
+      v->ffmpeg = proxy;
+      v->using_proxy = true;
+      ffmpeg_video_stream_seek(&v->ffmpeg, time);
+      log_info("switched to proxy file '%s'", v->proxy->proxy_path);
+    } else {
+      log_warn("unable to open proxy file '%s'", v->proxy->proxy_path);
+    }
+  }
+  // nothing else to wait for
+  v->proxy = NULL;
+}
+
 bool video_open(context_t *ctx, video_t *v, const char *path,
                 stream_index_t index, video_format_t format) {
+  v->proxy = NULL;
+  v->using_proxy = false;
   switch (v->format = format) {
-  case VIDEO_FORMAT_FFMPEG_STREAM:
+  case VIDEO_FORMAT_FFMPEG_STREAM: {
+    proxy_manager_t *pm = context_get_proxy_manager(ctx);
+    if (pm) {
+      v->proxy = proxy_request(pm, path, index);
+      if (proxy_get_state(v->proxy, NULL) == PROXY_STATE_READY &&
+          ffmpeg_video_stream_open(ctx, &v->ffmpeg, v->proxy->proxy_path,
+                                   SVE2_SI(VIDEO, 0), true)) {
+        v->proxy = NULL;
+        v->using_proxy = true;
+        return true;
+      }
+    }
     return ffmpeg_video_stream_open(ctx, &v->ffmpeg, path, index, true);
+  }
   case VIDEO_FORMAT_TEXTURE_ARRAY:
     return video_texture_array_new(ctx, &v->tex_array, path, index);
   }
@@ -32,6 +75,9 @@ void video_seek(video_t *v, i64 time) {
 bool video_get_texture(video_t *v, i64 time, video_frame_t *tex) {
   switch (v->format) {
   case VIDEO_FORMAT_FFMPEG_STREAM:
+    if (v->proxy) {
+      update_proxy(v, time);
+    }
     return ffmpeg_video_stream_get_texture(&v->ffmpeg, time, tex);
   case VIDEO_FORMAT_TEXTURE_ARRAY:
     return video_texture_array_get_texture(&v->tex_array, time, tex);
@@ -39,3 +85,9 @@ bool video_get_texture(video_t *v, i64 time, video_frame_t *tex) {
 
   return false;
 }
+
+void video_set_preview_size(video_t *v, i32 width, i32 height) {
+  if (v->format == VIDEO_FORMAT_FFMPEG_STREAM) {
+    ffmpeg_video_stream_set_preview_size(&v->ffmpeg, width, height);
+  }
+}
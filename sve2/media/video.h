@@ -29,10 +29,18 @@ typedef struct {
     ffmpeg_video_stream_t ffmpeg;
     video_texture_array_t tex_array;
   };
+  /**
+   * @brief Proxy of the stream (see sve2/media/proxy.h), NULL if proxies are
+   * disabled or the stream is not streamed (VIDEO_FORMAT_FFMPEG_STREAM). Once
+   * the proxy is ready, it is decoded instead of the source (using_proxy).
+   */
+  proxy_t *proxy;
+  bool using_proxy;
 } video_t;
 
 /**
- * @brief Open a video stream
+ * @brief Open a video stream. If proxies are enabled in ctx, the proxy of the
+ * stream is requested, and used as soon as it is ready.
  *
  * @param v Destination video_t object
  * @param path Path to the video file
@@ -63,3 +71,17 @@ void video_seek(video_t *v, i64 time);
  * @param tex Output texture containing the video textures
  */
 bool video_get_texture(video_t *v, i64 time, video_frame_t *tex);
+/**
+ * @brief Decode a video stream at a quality adapted to its on-screen size, for
+ * previews. Where the codec supports it, frames are decoded at a resolution
+ * divided by a power of two (in software, then scaled down to the on-screen
+ * size on upload), and the loop filter is skipped once the video is halved on
+ * screen. This can be called every frame, the decoder is only reopened when
+ * the decoded resolution changes. This does nothing for texture arrays.
+ *
+ * @param v The video stream
+ * @param width On-screen width of the video, in pixels. 0 (or height being 0)
+ * means full quality, e.g. for rendering.
+ * @param height On-screen height of the video, in pixels
+ */
+void video_set_preview_size(video_t *v, i32 width, i32 height);
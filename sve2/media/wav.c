@@ -0,0 +1,77 @@
+#include "wav.h"
+
+#include <string.h>
+
+#include "sve2/utils/minmax.h"
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+// RIFF is little-endian
+static u32 read_u16(const u8 *p) { return (u32)p[0] | (u32)p[1] << 8; }
+static u32 read_u32(const u8 *p) { return read_u16(p) | read_u16(p + 2) << 16; }
+
+static enum AVSampleFormat get_sample_fmt(u32 format_tag, u32 bits) {
+  if (format_tag == WAVE_FORMAT_PCM) {
+    switch (bits) {
+    case 8:
+      return AV_SAMPLE_FMT_U8;
+    case 16:
+      return AV_SAMPLE_FMT_S16;
+    case 32:
+      return AV_SAMPLE_FMT_S32;
+    }
+  } else if (format_tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+    return AV_SAMPLE_FMT_FLT;
+  }
+
+  // 24-bit and 64-bit samples have no interleaved context equivalent
+  return AV_SAMPLE_FMT_NONE;
+}
+
+bool wav_parse(const u8 *data, i64 size, wav_info_t *info) {
+  if (size < 12 || memcmp(data, "RIFF", 4) != 0 ||
+      memcmp(data + 8, "WAVE", 4) != 0) {
+    return false;
+  }
+
+  bool has_fmt = false;
+  i64 offset = 12;
+  while (offset + 8 <= size) {
+    const u8 *chunk = data + offset;
+    i64 chunk_size = read_u32(chunk + 4);
+    offset += 8;
+
+    if (memcmp(chunk, "fmt ", 4) == 0 && chunk_size >= 16 &&
+        offset + chunk_size <= size) {
+      const u8 *fmt = data + offset;
+      u32 format_tag = read_u16(fmt);
+      info->nb_channels = (i32)read_u16(fmt + 2);
+      info->sample_rate = (i32)read_u32(fmt + 4);
+      info->block_align = (i32)read_u16(fmt + 12);
+      u32 bits = read_u16(fmt + 14);
+      info->channel_mask = 0;
+      if (format_tag == WAVE_FORMAT_EXTENSIBLE && chunk_size >= 40) {
+        info->channel_mask = read_u32(fmt + 20);
+        // the first two bytes of the subformat GUID are the format tag
+        format_tag = read_u16(fmt + 24);
+      }
+
+      info->sample_fmt = get_sample_fmt(format_tag, bits);
+      i32 expected_block_align = info->nb_channels * (i32)(bits / 8);
+      has_fmt = info->nb_channels > 0 &&
+                info->block_align == expected_block_align;
+    } else if (memcmp(chunk, "data", 4) == 0) {
+      // streamed WAV files might not have the data size filled in
+      info->data_offset = offset;
+      info->data_size = sve2_min_i64(chunk_size, size - offset);
+      return has_fmt;
+    }
+
+    // chunks are padded to an even size
+    offset += chunk_size + (chunk_size & 1);
+  }
+
+  return false;
+}
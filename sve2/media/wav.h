@@ -0,0 +1,40 @@
+#pragma once
+
+#include <libavutil/samplefmt.h>
+
+#include "sve2/utils/types.h"
+
+// minimal RIFF/WAVE parser, used to serve uncompressed WAV files directly from
+// a memory mapping
+
+typedef struct {
+  /**
+   * @brief Sample format of the data chunk (always interleaved), or
+   * AV_SAMPLE_FMT_NONE if it is not one of u8, s16, s32 or flt
+   */
+  enum AVSampleFormat sample_fmt;
+  i32 nb_channels, sample_rate;
+  /**
+   * @brief Speaker positions (WAVE_FORMAT_EXTENSIBLE only), 0 if unspecified
+   */
+  u32 channel_mask;
+  /**
+   * @brief Size (in bytes) of a sample (of all channels)
+   */
+  i32 block_align;
+  /**
+   * @brief Location of the sample data in the file
+   */
+  i64 data_offset, data_size;
+} wav_info_t;
+
+/**
+ * @brief Parse the header of a WAV file
+ *
+ * @param data The file content (or at least the part before the sample data)
+ * @param size Size of data
+ * @param info Destination wav_info_t object
+ * @return Whether data is a valid WAV file with PCM (integer or float) data.
+ * Other codecs (ADPCM, etc.) are not supported.
+ */
+bool wav_parse(const u8 *data, i64 size, wav_info_t *info);
@@ -0,0 +1,53 @@
+#include "yuv_matrix.h"
+
+#include <string.h>
+
+#include <libavutil/pixdesc.h>
+
+#include "sve2/log/logging.h"
+#include "sve2/utils/runtime.h"
+
+void yuv_matrix_from_rgb(f32 m[static 16], enum AVColorSpace color_space,
+                         enum AVColorRange color_range, i32 bit_depth) {
+  f32 kr, kb;
+  switch (color_space) {
+  case AVCOL_SPC_BT709:
+    kr = 0.2126f, kb = 0.0722f;
+    break;
+  case AVCOL_SPC_BT2020_NCL:
+    kr = 0.2627f, kb = 0.0593f;
+    break;
+  case AVCOL_SPC_UNSPECIFIED:
+  case AVCOL_SPC_BT470BG:
+  case AVCOL_SPC_SMPTE170M:
+    kr = 0.299f, kb = 0.114f;
+    break;
+  default:
+    log_error("unsupported color space %s", av_color_space_name(color_space));
+    panic();
+  }
+  f32 kg = 1.0f - kr - kb;
+
+  f32 max = (f32)((1 << bit_depth) - 1);
+  f32 depth_scale = (f32)(1 << (bit_depth - 8));
+  f32 y_scale = 1.0f, c_scale = 1.0f, y_offset = 0.0f;
+  f32 c_offset = (f32)(1 << (bit_depth - 1)) / max;
+  if (color_range != AVCOL_RANGE_JPEG) {
+    y_scale = 219.0f * depth_scale / max;
+    c_scale = 224.0f * depth_scale / max;
+    y_offset = 16.0f * depth_scale / max;
+  }
+
+  // U = (B - Y) / (2 * (1 - kb)), V = (R - Y) / (2 * (1 - kr))
+  f32 u_scale = c_scale / (2.0f * (1.0f - kb));
+  f32 v_scale = c_scale / (2.0f * (1.0f - kr));
+  f32 rows[16] = {
+      // clang-format off
+      kr * y_scale,          kg * y_scale,  kb * y_scale,          y_offset,
+      -kr * u_scale,         -kg * u_scale, (1.0f - kb) * u_scale, c_offset,
+      (1.0f - kr) * v_scale, -kg * v_scale, -kb * v_scale,         c_offset,
+      0.0f,                  0.0f,          0.0f,                  1.0f,
+      // clang-format on
+  };
+  memcpy(m, rows, sizeof rows);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <libavutil/pixfmt.h>
+
+#include "sve2/utils/types.h"
+
+/**
+ * @brief Get the RGB to YUV matrix of a color space and range, shared by the
+ * GPU and CPU color converters.
+ *
+ * The matrix is row-major, maps normalized RGB (in [0, 1]) to normalized YUV
+ * samples (e.g. 16/255 for black in limited range), and includes the range
+ * offsets in its last column (the last row is (0, 0, 0, 1)). The luma weights
+ * come from the respective ITU-R recommendations, and the limited range levels
+ * are scaled from their 8-bit definition (16-235 for luma, 16-240 for chroma).
+ *
+ * @param m The matrix
+ * @param color_space BT.601 (AVCOL_SPC_UNSPECIFIED, AVCOL_SPC_BT470BG or
+ * AVCOL_SPC_SMPTE170M), BT.709 or BT.2020 non-constant luminance. Other color
+ * spaces panic.
+ * @param color_range AVCOL_RANGE_JPEG for full range, anything else means
+ * limited range
+ * @param bit_depth Bit depth of the samples
+ */
+void yuv_matrix_from_rgb(f32 m[static 16], enum AVColorSpace color_space,
+                         enum AVColorRange color_range, i32 bit_depth);
@@ -0,0 +1,156 @@
+#include "cache.h"
+
+#include <stdlib.h>
+#include <threads.h>
+
+#include <log.h>
+
+#include "sve2/utils/asprintf.h"
+#include "sve2/utils/hash.h"
+#include "sve2/utils/threads.h"
+
+#ifndef SVE2_NO_NONSTD
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static once_flag cache_dir_once = ONCE_FLAG_INIT;
+static char *cache_dir = NULL;
+
+// mkdir -p
+static bool create_dirs(char *path) {
+  for (char *p = path + 1;; ++p) {
+    if (*p != '/' && *p != '\0') {
+      continue;
+    }
+
+    char c = *p;
+    *p = '\0';
+    bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+    *p = c;
+    if (!ok || c == '\0') {
+      return ok;
+    }
+  }
+}
+
+static void init_cache_dir() {
+  const char *env;
+  char *dir = NULL;
+  if ((env = getenv("SVE2_CACHE_DIR")) && *env) {
+    dir = sve2_strdup(env);
+  } else if ((env = getenv("XDG_CACHE_HOME")) && *env) {
+    dir = sve2_asprintf("%s/sve2", env);
+  } else if ((env = getenv("HOME")) && *env) {
+    dir = sve2_asprintf("%s/.cache/sve2", env);
+  }
+
+  if (!dir) {
+    log_warn("no cache directory available, caching is disabled");
+    return;
+  }
+
+  if (!create_dirs(dir)) {
+    char msg[100];
+    strerror_r(errno, msg, sizeof msg);
+    log_warn("unable to create cache directory '%s': %s, caching is disabled",
+             dir, msg);
+    free(dir);
+    return;
+  }
+
+  log_info("using cache directory '%s'", dir);
+  cache_dir = dir;
+}
+
+const char *cache_get_dir() {
+  call_once(&cache_dir_once, init_cache_dir);
+  return cache_dir;
+}
+
+bool cache_hash_source(u64 hash, const char *path, u64 key[static 1]) {
+  char real_path[PATH_MAX];
+  struct stat st;
+  if (!realpath(path, real_path) || stat(real_path, &st) < 0) {
+    return false;
+  }
+
+  i64 size = st.st_size;
+  i64 mtime = st.st_mtim.tv_sec * SVE2_NS_PER_SEC + st.st_mtim.tv_nsec;
+  hash = sve2_hash_str(hash, real_path);
+  hash = sve2_hash_value(hash, size);
+  hash = sve2_hash_value(hash, mtime);
+  *key = hash;
+  return true;
+}
+
+FILE *cache_file_create(const char *path, char *temp_path[static 1]) {
+  // the PID makes the name unique among concurrent writers
+  *temp_path = sve2_asprintf("%s.%ld.tmp", path, (long)getpid());
+  FILE *f = fopen(*temp_path, "wb");
+  if (!f) {
+    free(*temp_path);
+    *temp_path = NULL;
+  }
+
+  return f;
+}
+
+bool cache_file_commit(FILE *f, char *temp_path, const char *path) {
+  bool ok = fflush(f) == 0 && !ferror(f);
+  ok = fclose(f) == 0 && ok;
+  // rename() is atomic, so readers see either the old entry, or the new one
+  ok = ok && rename(temp_path, path) == 0;
+  if (!ok) {
+    log_warn("unable to write cache file '%s'", path);
+    remove(temp_path);
+  }
+
+  free(temp_path);
+  return ok;
+}
+
+void cache_file_abort(FILE *f, char *temp_path) {
+  fclose(f);
+  remove(temp_path);
+  free(temp_path);
+}
+#else
+const char *cache_get_dir() { return NULL; }
+
+bool cache_hash_source(u64 hash, const char *path, u64 key[static 1]) {
+  (void)hash;
+  (void)path;
+  (void)key;
+  return false;
+}
+
+FILE *cache_file_create(const char *path, char *temp_path[static 1]) {
+  (void)path;
+  *temp_path = NULL;
+  return NULL;
+}
+
+bool cache_file_commit(FILE *f, char *temp_path, const char *path) {
+  (void)f;
+  (void)temp_path;
+  (void)path;
+  return false;
+}
+
+void cache_file_abort(FILE *f, char *temp_path) {
+  (void)f;
+  (void)temp_path;
+}
+#endif
+
+char *cache_get_path(u64 key, const char *ext) {
+  const char *dir = cache_get_dir();
+  if (!dir) {
+    return NULL;
+  }
+
+  return sve2_asprintf("%s/%016" PRIx64 "%s", dir, key, ext);
+}
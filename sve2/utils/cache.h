@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "sve2/utils/types.h"
+
+// on-disk cache for data derived from media files (decoded audio, etc.)
+//
+// the cache directory is $SVE2_CACHE_DIR, $XDG_CACHE_HOME/sve2 or
+// ~/.cache/sve2 (whichever is set first). Cache files are named after a 64-bit
+// key, which should hash everything the cached data depends on, so stale
+// entries are never read (they are simply not cleaned up automatically).
+//
+// caching is disabled if no directory can be created, or if SVE2_NO_NONSTD is
+// defined. Users of this module must fall back to uncached operation then.
+
+/**
+ * @brief Get the cache directory
+ *
+ * @return The cache directory path (owned by this module), or NULL if caching
+ * is disabled
+ */
+const char *cache_get_dir();
+
+/**
+ * @brief Get the path of a cache file
+ *
+ * @param key Key of the cache entry
+ * @param ext Extension of the cache file (including the dot)
+ * @return The path (must be freed with free()), or NULL if caching is disabled
+ */
+char *cache_get_path(u64 key, const char *ext);
+
+/**
+ * @brief Hash the identity of a source file: its canonical path, size and
+ * modification time. This is much cheaper than hashing the file content, and
+ * it changes whenever the file is modified.
+ *
+ * @param hash Initial hash value (see hash.h)
+ * @param path Path to the source file
+ * @param key The resulting hash
+ * @return Whether the operation succeeded
+ */
+bool cache_hash_source(u64 hash, const char *path, u64 key[static 1]);
+
+/**
+ * @brief Create a temporary file for writing a cache entry. It must be closed
+ * via cache_file_commit() or cache_file_abort(). Readers never see partially
+ * written entries, even if multiple processes write the same entry at once.
+ *
+ * @param path Path of the cache entry (from cache_get_path())
+ * @param temp_path Path of the temporary file
+ * @return The opened file, or NULL on failure
+ */
+FILE *cache_file_create(const char *path, char *temp_path[static 1]);
+/**
+ * @brief Close the temporary file and atomically rename it to the cache entry
+ * path. temp_path is freed.
+ *
+ * @return Whether the operation succeeded
+ */
+bool cache_file_commit(FILE *f, char *temp_path, const char *path);
+/**
+ * @brief Close and delete the temporary file. temp_path is freed.
+ */
+void cache_file_abort(FILE *f, char *temp_path);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <string.h>
+
+#include "sve2/utils/types.h"
+
+// 64-bit FNV-1a hash, used to build cache keys. This is not cryptographically
+// secure, but collisions are unlikely enough for cache lookups.
+#define SVE2_HASH_INIT ((u64)0xcbf29ce484222325)
+
+static inline u64 sve2_hash_update(u64 hash, const void *data, i64 size) {
+  const u8 *bytes = data;
+  for (i64 i = 0; i < size; ++i) {
+    hash = (hash ^ bytes[i]) * (u64)0x100000001b3;
+  }
+  return hash;
+}
+
+static inline u64 sve2_hash_str(u64 hash, const char *str) {
+  // include the null-terminator, so that ("ab", "c") != ("a", "bc")
+  return sve2_hash_update(hash, str, (i64)strlen(str) + 1);
+}
+
+#define sve2_hash_value(hash, x) sve2_hash_update((hash), &(x), sizeof(x))
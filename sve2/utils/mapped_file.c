@@ -0,0 +1,78 @@
+#include "mapped_file.h"
+
+#include <stddef.h>
+
+#include <log.h>
+
+#include "sve2/utils/minmax.h"
+
+#ifndef SVE2_NO_NONSTD
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+bool mapped_file_open(mapped_file_t *m, const char *path) {
+  m->data = NULL;
+  m->size = 0;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return false;
+  }
+
+  void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // the mapping stays valid after closing the file descriptor
+  close(fd);
+  if (data == MAP_FAILED) {
+    char msg[100];
+    strerror_r(errno, msg, sizeof msg);
+    log_warn("unable to map file '%s': %s", path, msg);
+    return false;
+  }
+
+  m->data = data;
+  m->size = st.st_size;
+  return true;
+}
+
+void mapped_file_close(mapped_file_t *m) {
+  if (m->data) {
+    munmap(m->data, (size_t)m->size);
+  }
+  m->data = NULL;
+  m->size = 0;
+}
+
+void mapped_file_prefetch(mapped_file_t *m, i64 offset, i64 size) {
+  // madvise needs a page-aligned address
+  i64 page_size = sysconf(_SC_PAGESIZE);
+  i64 begin = offset / page_size * page_size;
+  i64 end = sve2_min_i64(offset + size, m->size);
+  if (end > begin) {
+    madvise(m->data + begin, (size_t)(end - begin), MADV_WILLNEED);
+  }
+}
+#else
+bool mapped_file_open(mapped_file_t *m, const char *path) {
+  (void)path;
+  m->data = NULL;
+  m->size = 0;
+  return false;
+}
+
+void mapped_file_close(mapped_file_t *m) { (void)m; }
+
+void mapped_file_prefetch(mapped_file_t *m, i64 offset, i64 size) {
+  (void)m;
+  (void)offset;
+  (void)size;
+}
+#endif
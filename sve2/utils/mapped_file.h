@@ -0,0 +1,31 @@
+#pragma once
+
+#include "sve2/utils/types.h"
+
+/**
+ * @brief A read-only memory mapping of a whole file. Pages are loaded lazily,
+ * shared between processes mapping the same file and can be evicted by the OS
+ * under memory pressure (unlike heap memory).
+ */
+typedef struct {
+  u8 *data;
+  i64 size;
+} mapped_file_t;
+
+/**
+ * @brief Map a file into memory
+ *
+ * @param m Destination mapped_file_t object
+ * @param path Path to the file
+ * @return Whether the operation succeeded. This always fails if SVE2_NO_NONSTD
+ * is defined.
+ */
+bool mapped_file_open(mapped_file_t *m, const char *path);
+/**
+ * @brief Unmap a file. This does nothing if m is zero-initialized.
+ */
+void mapped_file_close(mapped_file_t *m);
+/**
+ * @brief Hint the OS that the mapped range will be read sequentially soon
+ */
+void mapped_file_prefetch(mapped_file_t *m, i64 offset, i64 size);
@@ -4,7 +4,7 @@
 
 noreturn void panic() { exit(EXIT_FAILURE); }
 
-void *sve2_malloc(i32 size) {
+void *sve2_malloc(i64 size) {
   assert(size >= 0);
   if (size == 0) {
     return NULL;
@@ -14,7 +14,7 @@ void *sve2_malloc(i32 size) {
   return ptr;
 }
 
-void *sve2_calloc(i32 nmem, i32 size) {
+void *sve2_calloc(i64 nmem, i64 size) {
   assert(size >= 0 && nmem >= 0);
   if (size == 0 || nmem == 0) {
     return NULL;
@@ -24,7 +24,7 @@ void *sve2_calloc(i32 nmem, i32 size) {
   return ptr;
 }
 
-void *sve2_realloc(void *ptr, i32 new_size) {
+void *sve2_realloc(void *ptr, i64 new_size) {
   assert(new_size >= 0);
   if (new_size == 0) {
     free(ptr);
@@ -26,9 +26,9 @@ noreturn void panic();
 // operations that (almost) never fail
 
 // memory allocation (with signed arguments)
-void *sve2_malloc(i32 size);
-void *sve2_calloc(i32 nmem, i32 size);
-void *sve2_realloc(void *ptr, i32 new_size);
+void *sve2_malloc(i64 size);
+void *sve2_calloc(i64 nmem, i64 size);
+void *sve2_realloc(void *ptr, i64 new_size);
 
 // see av_freep
 void sve2_freep(void * /* should be T** */ ptr);
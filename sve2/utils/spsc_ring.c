@@ -0,0 +1,107 @@
+#include "spsc_ring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+
+void spsc_ring_init(spsc_ring_t *r, i32 elem_size, i32 capacity) {
+  assert(elem_size > 0 && capacity > 0);
+  r->data = sve2_malloc(elem_size * capacity);
+  r->elem_size = elem_size;
+  r->capacity = capacity;
+  atomic_init(&r->write_index, 0);
+  atomic_init(&r->read_index, 0);
+  atomic_init(&r->num_underruns, 0);
+  atomic_init(&r->num_overruns, 0);
+}
+
+void spsc_ring_free(spsc_ring_t *r) { sve2_freep(&r->data); }
+
+i32 spsc_ring_size(spsc_ring_t *r) {
+  // load the read index first, so the difference can never exceed capacity
+  i64 read = atomic_load_explicit(&r->read_index, memory_order_acquire);
+  i64 write = atomic_load_explicit(&r->write_index, memory_order_acquire);
+  return (i32)(write - read);
+}
+
+i32 spsc_ring_space(spsc_ring_t *r) {
+  i64 write = atomic_load_explicit(&r->write_index, memory_order_acquire);
+  i64 read = atomic_load_explicit(&r->read_index, memory_order_acquire);
+  return r->capacity - (i32)(write - read);
+}
+
+i32 spsc_ring_write_map(spsc_ring_t *r, i32 count, u8 *data[static 1]) {
+  // only the producer writes write_index, so a relaxed load is sufficient
+  i64 write = atomic_load_explicit(&r->write_index, memory_order_relaxed);
+  // acquire pairs with the release in spsc_ring_read(), so the consumer is
+  // done with the elements before we overwrite them
+  i64 read = atomic_load_explicit(&r->read_index, memory_order_acquire);
+  i32 space = r->capacity - (i32)(write - read);
+  if (space < count) {
+    atomic_fetch_add_explicit(&r->num_overruns, 1, memory_order_relaxed);
+  }
+  i32 offset = (i32)(write % r->capacity);
+  *data = r->data + (i64)offset * r->elem_size;
+  return sve2_min_i32(space, r->capacity - offset);
+}
+
+void spsc_ring_write_commit(spsc_ring_t *r, i32 count) {
+  i64 write = atomic_load_explicit(&r->write_index, memory_order_relaxed);
+  assert(count >= 0 && count <= spsc_ring_space(r));
+  // release makes the element data visible before the new index
+  atomic_store_explicit(&r->write_index, write + count, memory_order_release);
+}
+
+i32 spsc_ring_read(spsc_ring_t *r, u8 *dst, i32 count) {
+  i64 read = atomic_load_explicit(&r->read_index, memory_order_relaxed);
+  // acquire pairs with the release in spsc_ring_write_commit()
+  i64 write = atomic_load_explicit(&r->write_index, memory_order_acquire);
+  i32 num_read = sve2_min_i32(count, (i32)(write - read));
+  if (num_read < count) {
+    atomic_fetch_add_explicit(&r->num_underruns, 1, memory_order_relaxed);
+  }
+
+  i32 offset = (i32)(read % r->capacity);
+  i32 first = sve2_min_i32(num_read, r->capacity - offset);
+  memcpy(dst, r->data + (i64)offset * r->elem_size, (i64)first * r->elem_size);
+  memcpy(dst + (i64)first * r->elem_size, r->data,
+         (i64)(num_read - first) * r->elem_size);
+
+  atomic_store_explicit(&r->read_index, read + num_read, memory_order_release);
+  return num_read;
+}
+
+i32 spsc_ring_read_map(spsc_ring_t *r, u8 *data[static 1]) {
+  // only the consumer writes read_index, so a relaxed load is sufficient
+  i64 read = atomic_load_explicit(&r->read_index, memory_order_relaxed);
+  // acquire pairs with the release in spsc_ring_write_commit()
+  i64 write = atomic_load_explicit(&r->write_index, memory_order_acquire);
+  i32 offset = (i32)(read % r->capacity);
+  *data = r->data + (i64)offset * r->elem_size;
+  return sve2_min_i32((i32)(write - read), r->capacity - offset);
+}
+
+void spsc_ring_read_commit(spsc_ring_t *r, i32 count) {
+  i64 read = atomic_load_explicit(&r->read_index, memory_order_relaxed);
+  assert(count >= 0 && count <= spsc_ring_size(r));
+  // release makes sure we are done with the elements before the producer
+  // overwrites them
+  atomic_store_explicit(&r->read_index, read + count, memory_order_release);
+}
+
+void spsc_ring_clear(spsc_ring_t *r) {
+  atomic_store_explicit(&r->read_index,
+                        atomic_load_explicit(&r->write_index,
+                                             memory_order_relaxed),
+                        memory_order_relaxed);
+}
+
+i64 spsc_ring_num_underruns(spsc_ring_t *r) {
+  return atomic_load_explicit(&r->num_underruns, memory_order_relaxed);
+}
+
+i64 spsc_ring_num_overruns(spsc_ring_t *r) {
+  return atomic_load_explicit(&r->num_overruns, memory_order_relaxed);
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <stdalign.h>
+#include <stdatomic.h>
+
+#include "sve2/utils/types.h"
+
+#define SVE2_CACHE_LINE_SIZE 64
+
+/**
+ * @brief Wait-free single-producer/single-consumer ring buffer of fixed-size
+ * elements (e.g. interleaved audio samples, see audio_pcm.h for the definition
+ * of a sample).
+ *
+ * The producer and the consumer can be on different threads, but there must be
+ * at most one of each. Neither side ever blocks or takes a lock, so this is
+ * safe to use from real-time threads (e.g. the miniaudio data callback).
+ *
+ * The read and write indices are monotonically increasing element counters,
+ * positions in the buffer are obtained by taking them modulo capacity. Each
+ * index lives on its own cache line to avoid false sharing between the two
+ * threads.
+ */
+typedef struct {
+  u8 *data;
+  i32 elem_size;
+  i32 capacity;
+  /**
+   * @brief Written by the producer, read by the consumer. num_overruns is only
+   * ever touched by the producer.
+   */
+  alignas(SVE2_CACHE_LINE_SIZE) _Atomic(i64) write_index;
+  _Atomic(i64) num_overruns;
+  /**
+   * @brief Written by the consumer, read by the producer. num_underruns is only
+   * ever touched by the consumer.
+   */
+  alignas(SVE2_CACHE_LINE_SIZE) _Atomic(i64) read_index;
+  _Atomic(i64) num_underruns;
+} spsc_ring_t;
+
+void spsc_ring_init(spsc_ring_t *r, i32 elem_size, i32 capacity);
+void spsc_ring_free(spsc_ring_t *r);
+
+// number of readable elements. This is exact when called from the consumer
+// thread, and a lower bound (of the free space) when called from the producer
+// thread.
+i32 spsc_ring_size(spsc_ring_t *r);
+// number of writable elements, see spsc_ring_size()
+i32 spsc_ring_space(spsc_ring_t *r);
+
+// producer API
+
+/**
+ * @brief Get a contiguous writable region of the ring. The region might be
+ * smaller than spsc_ring_space() when it wraps around the end of the buffer,
+ * in which case the producer should map again after committing.
+ *
+ * @param r The ring buffer
+ * @param count Number of elements the producer wants to write. If they do not
+ * fit in the free space of the ring (wrapped around or not), this is counted
+ * as an overrun.
+ * @param data Pointer to return the start of the writable region
+ * @return Number of writable elements at *data (0 if the ring is full)
+ */
+i32 spsc_ring_write_map(spsc_ring_t *r, i32 count, u8 *data[static 1]);
+/**
+ * @brief Publish count elements written to the region returned by
+ * spsc_ring_write_map(). count must not exceed the mapped size.
+ */
+void spsc_ring_write_commit(spsc_ring_t *r, i32 count);
+// consumer API
+
+/**
+ * @brief Copy at most count elements out of the ring. Reading less than count
+ * elements is counted as an underrun.
+ *
+ * @return Number of elements actually read
+ */
+i32 spsc_ring_read(spsc_ring_t *r, u8 *dst, i32 count);
+
+/**
+ * @brief Get a contiguous readable region of the ring, the counterpart of
+ * spsc_ring_write_map(). Reading from a mapped region is not counted as an
+ * underrun.
+ *
+ * @param r The ring buffer
+ * @param data Pointer to return the start of the readable region
+ * @return Number of readable elements at *data (0 if the ring is empty)
+ */
+i32 spsc_ring_read_map(spsc_ring_t *r, u8 *data[static 1]);
+/**
+ * @brief Release count elements of the region returned by spsc_ring_read_map()
+ * to the producer. count must not exceed the mapped size.
+ */
+void spsc_ring_read_commit(spsc_ring_t *r, i32 count);
+
+// discard every element. Neither the producer nor the consumer may be using
+// the ring during this call.
+void spsc_ring_clear(spsc_ring_t *r);
+
+// statistics, can be queried from any thread
+i64 spsc_ring_num_underruns(spsc_ring_t *r);
+i64 spsc_ring_num_overruns(spsc_ring_t *r);
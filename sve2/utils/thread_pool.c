@@ -0,0 +1,93 @@
+#include "thread_pool.h"
+
+#include <stdlib.h>
+
+#include "sve2/utils/minmax.h"
+#include "sve2/utils/runtime.h"
+#include "sve2/utils/threads.h"
+
+// run jobs of the current batch until there is none left, the lock must be
+// held (it is released while a job runs)
+static void run_jobs(thread_pool_t *pool) {
+  while (pool->next_job < pool->num_jobs) {
+    i32 job = pool->next_job++;
+    thread_pool_fn_t fn = pool->fn;
+    void *userdata = pool->userdata;
+    sve2_mtx_unlock(&pool->lock);
+    fn(userdata, job);
+    sve2_mtx_lock(&pool->lock);
+    if (++pool->num_done == pool->num_jobs) {
+      sve2_cnd_signal(&pool->done_cond);
+    }
+  }
+}
+
+static int run_worker(void *arg) {
+  thread_pool_t *pool = arg;
+  u64 generation = 0;
+  sve2_mtx_lock(&pool->lock);
+  while (true) {
+    while (!pool->closing && pool->generation == generation) {
+      sve2_cnd_wait(&pool->work_cond, &pool->lock);
+    }
+    if (pool->closing) {
+      break;
+    }
+    // a worker waking up late might find the batch done already, or even
+    // join the next one, which is fine either way
+    generation = pool->generation;
+    run_jobs(pool);
+  }
+  sve2_mtx_unlock(&pool->lock);
+  return 0;
+}
+
+void thread_pool_init(thread_pool_t *pool, i32 num_threads) {
+  *pool = (thread_pool_t){0};
+  num_threads = num_threads > 0 ? num_threads : sve2_get_num_cpus();
+  sve2_mtx_init(&pool->lock, mtx_plain);
+  sve2_cnd_init(&pool->work_cond);
+  sve2_cnd_init(&pool->done_cond);
+  // the calling thread is one of the threads
+  pool->num_threads = num_threads - 1;
+  pool->threads = sve2_calloc(sve2_max_i32(pool->num_threads, 1),
+                              sizeof *pool->threads);
+  for (i32 i = 0; i < pool->num_threads; ++i) {
+    sve2_thrd_create(&pool->threads[i], run_worker, pool);
+  }
+}
+
+void thread_pool_free(thread_pool_t *pool) {
+  sve2_mtx_lock(&pool->lock);
+  pool->closing = true;
+  sve2_cnd_broadcast(&pool->work_cond);
+  sve2_mtx_unlock(&pool->lock);
+  for (i32 i = 0; i < pool->num_threads; ++i) {
+    thrd_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  cnd_destroy(&pool->done_cond);
+  cnd_destroy(&pool->work_cond);
+  mtx_destroy(&pool->lock);
+}
+
+void thread_pool_run(thread_pool_t *pool, i32 num_jobs, thread_pool_fn_t fn,
+                     void *userdata) {
+  if (num_jobs <= 0) {
+    return;
+  }
+  sve2_mtx_lock(&pool->lock);
+  pool->fn = fn;
+  pool->userdata = userdata;
+  pool->num_jobs = num_jobs;
+  pool->next_job = pool->num_done = 0;
+  ++pool->generation;
+  if (pool->num_threads > 0) {
+    sve2_cnd_broadcast(&pool->work_cond);
+  }
+  run_jobs(pool);
+  while (pool->num_done < pool->num_jobs) {
+    sve2_cnd_wait(&pool->done_cond, &pool->lock);
+  }
+  sve2_mtx_unlock(&pool->lock);
+}
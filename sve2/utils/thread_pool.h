@@ -0,0 +1,56 @@
+#pragma once
+
+#include <threads.h>
+
+#include "sve2/utils/types.h"
+
+/**
+ * @brief Job function, called once for every job index of a batch
+ */
+typedef void (*thread_pool_fn_t)(void *userdata, i32 job);
+
+/**
+ * @brief Fixed-size pool of worker threads running batches of independent
+ * jobs (a parallel for loop).
+ *
+ * Jobs are handed out one at a time, so they should be coarse (e.g. bands of
+ * rows of a frame) and preferably more numerous than the threads, so the load
+ * is balanced. The calling thread works on the batch too.
+ */
+typedef struct {
+  thrd_t *threads;
+  i32 num_threads;
+  mtx_t lock;
+  /**
+   * @brief Signalled when a batch starts (or the pool closes), and when the
+   * last job of a batch is done
+   */
+  cnd_t work_cond, done_cond;
+  /**
+   * @brief Current batch. generation is incremented every batch, so workers
+   * can tell whether they have seen it.
+   */
+  thread_pool_fn_t fn;
+  void *userdata;
+  i32 num_jobs, next_job, num_done;
+  u64 generation;
+  bool closing;
+} thread_pool_t;
+
+/**
+ * @brief Initialize a thread pool.
+ *
+ * @param pool The pool
+ * @param num_threads Number of threads working on a batch, including the
+ * calling thread. 0 means the number of CPUs.
+ */
+void thread_pool_init(thread_pool_t *pool, i32 num_threads);
+void thread_pool_free(thread_pool_t *pool);
+
+/**
+ * @brief Run fn(userdata, job) for every job in [0, num_jobs), and wait until
+ * they are all done. Jobs run concurrently, in no particular order. This must
+ * not be called from several threads at once.
+ */
+void thread_pool_run(thread_pool_t *pool, i32 num_jobs, thread_pool_fn_t fn,
+                     void *userdata);
@@ -1,15 +1,28 @@
 #include "threads.h"
 
 #include <threads.h>
+#include <time.h>
+
+#ifndef SVE2_NO_NONSTD
+#include <unistd.h>
+#endif
 
 #include "sve2/log/logging.h"
+#include "sve2/utils/minmax.h"
 #include "sve2/utils/runtime.h"
 
 static i64 timer = 0;
 
 i64 get_ts() {
   struct timespec ts;
+  // prefer a monotonic clock, the wall clock can jump (NTP adjustments, etc.)
+#if defined(TIME_MONOTONIC)
+  nassert(timespec_get(&ts, TIME_MONOTONIC) == TIME_MONOTONIC);
+#elif !defined(SVE2_NO_NONSTD)
+  nassert(clock_gettime(CLOCK_MONOTONIC, &ts) == 0);
+#else
   nassert(timespec_get(&ts, TIME_UTC) == TIME_UTC);
+#endif
   return (i64)ts.tv_sec * SVE2_NS_PER_SEC + ts.tv_nsec;
 }
 
@@ -37,6 +50,17 @@ struct timespec ts_from_ns(i64 ns) {
                            .tv_nsec = ns % SVE2_NS_PER_SEC};
 }
 
+// mtx_timedlock and cnd_timedwait take an absolute TIME_UTC time point, while
+// deadlines are relative to the (monotonic) threads timer. The wall clock is
+// only read here, so a jump of it only affects waits in progress.
+static struct timespec utc_from_deadline(i64 deadline) {
+  struct timespec now;
+  nassert(timespec_get(&now, TIME_UTC) == TIME_UTC);
+  i64 timeout = sve2_max_i64(deadline - threads_timer_now(), 0);
+  return ts_from_ns((i64)now.tv_sec * SVE2_NS_PER_SEC + now.tv_nsec +
+                    timeout);
+}
+
 // use mtx_lock/mtx_trylock if possible (deadline is special values)
 bool sve2_mtx_timedlock(mtx_t *mutex, i64 deadline) {
   int err;
@@ -48,7 +72,7 @@ bool sve2_mtx_timedlock(mtx_t *mutex, i64 deadline) {
     err = mtx_lock(mutex);
     break;
   default: {
-    struct timespec time_point = ts_from_ns(deadline);
+    struct timespec time_point = utc_from_deadline(deadline);
     err = mtx_timedlock(mutex, &time_point);
   }
   }
@@ -66,7 +90,7 @@ bool sve2_cnd_timedwait(cnd_t *cond, mtx_t *mutex, i64 deadline) {
     err = cnd_wait(cond, mutex);
     break;
   default: {
-    struct timespec time_point = ts_from_ns(deadline);
+    struct timespec time_point = utc_from_deadline(deadline);
     err = cnd_timedwait(cond, mutex, &time_point);
   }
   }
@@ -91,3 +115,12 @@ void sve2_sleep_for(i64 time) {
 void sve2_sleep_until(i64 deadline) {
   sve2_sleep_for(deadline - threads_timer_now());
 }
+
+i32 sve2_get_num_cpus() {
+#ifndef SVE2_NO_NONSTD
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  return num_cpus > 0 ? (i32)num_cpus : 1;
+#else
+  return 1;
+#endif
+}
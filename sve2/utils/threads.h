@@ -31,3 +31,6 @@ bool sve2_cnd_timedwait(cnd_t *cond, mtx_t *mutex, i64 deadline);
 // sleep functions
 void sve2_sleep_for(i64 time);
 void sve2_sleep_until(i64 deadline);
+
+// number of online CPUs (1 if unknown), used to size worker pools
+i32 sve2_get_num_cpus();